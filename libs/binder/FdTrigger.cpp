@@ -43,15 +43,18 @@ bool FdTrigger::isTriggered() {
     return mWrite == -1;
 }
 
-status_t FdTrigger::triggerablePoll(base::borrowed_fd fd, int16_t event) {
+status_t FdTrigger::triggerablePoll(base::borrowed_fd fd, int16_t event, int timeoutMs) {
     LOG_ALWAYS_FATAL_IF(event == 0, "triggerablePoll %d with event 0 is not allowed", fd.get());
     pollfd pfd[]{{.fd = fd.get(), .events = (uint16_t)event, .revents = 0},
                  {.fd = mRead.get(), .events = 0, .revents = 0}};
-    int ret = TEMP_FAILURE_RETRY(poll(pfd, arraysize(pfd), -1));
+    int ret = TEMP_FAILURE_RETRY(poll(pfd, arraysize(pfd), timeoutMs));
     if (ret < 0) {
         return -errno;
     }
-    LOG_ALWAYS_FATAL_IF(ret == 0, "poll(%d) returns 0 with infinite timeout", fd.get());
+    if (ret == 0) {
+        LOG_ALWAYS_FATAL_IF(timeoutMs < 0, "poll(%d) returns 0 with infinite timeout", fd.get());
+        return TIMED_OUT;
+    }
 
     // At least one FD has events. Check them.
 
@@ -47,12 +47,21 @@ public:
      * Poll for a read event.
      *
      * event - for pollfd
+     * timeoutMs - for poll, -1 to wait forever
      *
      * Return:
      *   true - time to read!
      *   false - trigger happened
+     *   TIMED_OUT - nothing happened within timeoutMs
      */
-    [[nodiscard]] status_t triggerablePoll(base::borrowed_fd fd, int16_t event);
+    [[nodiscard]] status_t triggerablePoll(base::borrowed_fd fd, int16_t event,
+                                           int timeoutMs = -1);
+
+    /**
+     * To poll for the trigger along with other FDs. POLLHUP is set on it once
+     * triggered.
+     */
+    base::borrowed_fd readFd() const { return mRead; }
 
 private:
     base::unique_fd mWrite;
@@ -23,6 +23,7 @@
 #include <binder/TextOutput.h>
 
 #include <android-base/macros.h>
+#include <android-base/stringprintf.h>
 #include <cutils/sched_policy.h>
 #if defined(__linux__)
 #include <utils/CallStack.h>
@@ -30,7 +31,9 @@
 #include <utils/Log.h>
 #include <utils/SystemClock.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <errno.h>
 #include <inttypes.h>
 #include <poll.h>
@@ -118,6 +121,12 @@ static const char *kCommandStrings[] = {
 
 static const int64_t kWorkSourcePropagatedBitIndex = 32;
 
+// the most the driver writes for a single BR_* command
+static constexpr size_t kMaxReturnCommandSize =
+        sizeof(int32_t) + sizeof(binder_transaction_data_secctx);
+// see ProcessState::setThreadBufferSizes
+static constexpr size_t kShrinkAfterSmallReads = 16;
+
 static const char* getReturnString(uint32_t cmd)
 {
     size_t idx = _IOC_NR(cmd);
@@ -127,6 +136,57 @@ static const char* getReturnString(uint32_t cmd)
         return "unknown";
 }
 
+static size_t driverStatsIndex(uint32_t cmd)
+{
+    return std::min<size_t>(_IOC_NR(cmd), ProcessState::DriverStats::kNumCommands - 1);
+}
+
+static uint64_t driverStatsNowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+// Counters are only written by their own thread, so this doesn't need an
+// atomic read-modify-write.
+static void addDriverCounter(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+std::string ProcessState::DriverStats::toString() const
+{
+    using android::base::StringAppendF;
+
+    std::string ret;
+    StringAppendF(&ret, "ioctls %" PRIu64 " written %" PRIu64 " bytes read %" PRIu64 " bytes\n",
+                  ioctls, bytesWritten, bytesRead);
+    StringAppendF(&ret, "in driver %" PRIu64 "us in transact %" PRIu64 "us\n", driverUs,
+                  transactUs);
+    StringAppendF(&ret, "starved %" PRIu64 " times for %" PRIu64 "ms\n", starvations,
+                  starvationMs);
+    StringAppendF(&ret, "ref counts deferred %" PRIu64 " cancelled %" PRIu64 "\n",
+                  deferredRefCounts, cancelledRefCounts);
+    StringAppendF(&ret, "buffers %" PRIu64 " bytes grown %" PRIu64 " shrunk %" PRIu64 "\n",
+                  bufferBytes, bufferGrows, bufferShrinks);
+
+    auto appendCommands = [&](const std::array<uint64_t, kNumCommands>& counts,
+                              const char* const* names, size_t numNames, const char* prefix) {
+        for (size_t i = 0; i < kNumCommands; i++) {
+            if (counts[i] == 0) continue;
+            if (i < numNames) {
+                StringAppendF(&ret, "%s: %" PRIu64 "\n", names[i], counts[i]);
+            } else {
+                StringAppendF(&ret, "%s_%zu: %" PRIu64 "\n", prefix, i, counts[i]);
+            }
+        }
+    };
+    appendCommands(returnCommands, kReturnStrings, arraysize(kReturnStrings), "BR");
+    appendCommands(commands, kCommandStrings, arraysize(kCommandStrings), "BC");
+    return ret;
+}
+
 static const void* printBinderTransactionData(TextOutput& out, const void* data)
 {
     const binder_transaction_data* btd =
@@ -469,6 +529,134 @@ void IPCThreadState::clearCaller()
     mCallingUid = getuid();
 }
 
+void IPCThreadState::writeCommand(uint32_t cmd)
+{
+    if (!mDeferredRefCounts.empty()) writeDeferredRefCounts();
+    addDriverCounter(mDriverCounters.commands[driverStatsIndex(cmd)], 1);
+    mOut.writeInt32(cmd);
+}
+
+bool IPCThreadState::writeRefCountCommand(uint32_t cmd, int32_t handle)
+{
+    const size_t maxDeferred = mProcess->getMaxDeferredRefCounts();
+    if (maxDeferred == 0 || mIsLooper || mServingStackPointer != nullptr) {
+        // these flush soon anyway, see flushIfNeeded
+        writeCommand(cmd);
+        mOut.writeInt32(handle);
+        return flushIfNeeded();
+    }
+
+    uint32_t undoes;
+    switch (cmd) {
+        case BC_ACQUIRE: undoes = BC_RELEASE; break;
+        case BC_RELEASE: undoes = BC_ACQUIRE; break;
+        case BC_INCREFS: undoes = BC_DECREFS; break;
+        case BC_DECREFS: undoes = BC_INCREFS; break;
+        default: LOG_ALWAYS_FATAL("Not a ref count command: %" PRIu32, cmd);
+    }
+
+    // Only the latest held command on the same handle can be cancelled, so
+    // that the strong and weak counts of the handle still change in the same
+    // order (e.g. the weak count isn't dropped before a strong count which
+    // was held is).
+    for (auto it = mDeferredRefCounts.rbegin(); it != mDeferredRefCounts.rend(); ++it) {
+        if (it->handle != handle) continue;
+        if (it->cmd != undoes) break;
+        mDeferredRefCounts.erase(std::next(it).base());
+        addDriverCounter(mDriverCounters.cancelledRefCounts, 2);
+        return false;
+    }
+
+    mDeferredRefCounts.push_back({cmd, handle});
+    addDriverCounter(mDriverCounters.deferredRefCounts, 1);
+    if (mDeferredRefCounts.size() < maxDeferred) return false;
+
+    writeDeferredRefCounts();
+    return flushIfNeeded();
+}
+
+void IPCThreadState::writeDeferredRefCounts()
+{
+    for (const DeferredRefCount& ref : mDeferredRefCounts) {
+        addDriverCounter(mDriverCounters.commands[driverStatsIndex(ref.cmd)], 1);
+        mOut.writeInt32(ref.cmd);
+        mOut.writeInt32(ref.handle);
+    }
+    mDeferredRefCounts.clear();
+}
+
+uint32_t IPCThreadState::readCommand()
+{
+    uint32_t cmd = (uint32_t)mIn.readInt32();
+    addDriverCounter(mDriverCounters.returnCommands[driverStatsIndex(cmd)], 1);
+    return cmd;
+}
+
+IPCThreadState::DriverStats IPCThreadState::getDriverStats() const
+{
+    DriverStats stats;
+    addDriverStats(&stats);
+    return stats;
+}
+
+void IPCThreadState::addDriverStats(DriverStats* stats) const
+{
+    auto load = [](const std::atomic<uint64_t>& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    stats->ioctls += load(mDriverCounters.ioctls);
+    stats->bytesWritten += load(mDriverCounters.bytesWritten);
+    stats->bytesRead += load(mDriverCounters.bytesRead);
+    for (size_t i = 0; i < DriverStats::kNumCommands; i++) {
+        stats->returnCommands[i] += load(mDriverCounters.returnCommands[i]);
+        stats->commands[i] += load(mDriverCounters.commands[i]);
+    }
+    stats->driverUs += load(mDriverCounters.driverUs);
+    stats->transactUs += load(mDriverCounters.transactUs);
+    stats->deferredRefCounts += load(mDriverCounters.deferredRefCounts);
+    stats->cancelledRefCounts += load(mDriverCounters.cancelledRefCounts);
+    stats->bufferGrows += load(mDriverCounters.bufferGrows);
+    stats->bufferShrinks += load(mDriverCounters.bufferShrinks);
+    stats->bufferBytes += load(mDriverCounters.bufferBytes);
+}
+
+void IPCThreadState::resizeInBeforeRead()
+{
+    if (mSmallReads < kShrinkAfterSmallReads) return;
+    mSmallReads = 0;
+
+    const size_t capacity = std::max(mProcess->getThreadBufferMinSize(), mIn.dataCapacity() / 2);
+    if (capacity >= mIn.dataCapacity()) return;
+    mIn.freeData();
+    mIn.setDataCapacity(capacity);
+    addDriverCounter(mDriverCounters.bufferShrinks, 1);
+}
+
+void IPCThreadState::resizeInAfterRead(size_t size, size_t consumed)
+{
+    if (size - consumed >= kMaxReturnCommandSize) {
+        // the driver had no more commands for this thread
+        mSmallReads = consumed <= size / 4 ? mSmallReads + 1 : 0;
+        return;
+    }
+    mSmallReads = 0;
+
+    const size_t capacity = std::min(mProcess->getThreadBufferMaxSize(), mIn.dataCapacity() * 2);
+    if (capacity <= mIn.dataCapacity()) return;
+    if (mIn.setDataCapacity(capacity) == NO_ERROR) {
+        addDriverCounter(mDriverCounters.bufferGrows, 1);
+    }
+}
+
+void IPCThreadState::resizeOutAfterWrite()
+{
+    const size_t minSize = mProcess->getThreadBufferMinSize();
+    if (mOut.dataCapacity() <= std::max(minSize, mProcess->getThreadBufferMaxSize())) return;
+    mOut.freeData();
+    mOut.setDataCapacity(minSize);
+    addDriverCounter(mDriverCounters.bufferShrinks, 1);
+}
+
 void IPCThreadState::flushCommands()
 {
     if (mProcess->mDriverFD < 0)
@@ -476,11 +664,12 @@ void IPCThreadState::flushCommands()
     talkWithDriver(false);
     // The flush could have caused post-write refcount decrements to have
     // been executed, which in turn could result in BC_RELEASE/BC_DECREFS
-    // being queued in mOut. So flush again, if we need to.
-    if (mOut.dataSize() > 0) {
+    // being queued in mOut (or mDeferredRefCounts). So flush again, if we
+    // need to.
+    if (mOut.dataSize() > 0 || !mDeferredRefCounts.empty()) {
         talkWithDriver(false);
     }
-    if (mOut.dataSize() > 0) {
+    if (mOut.dataSize() > 0 || !mDeferredRefCounts.empty()) {
         ALOGW("mOut.dataSize() > 0 after flushCommands()");
     }
 }
@@ -514,16 +703,24 @@ void IPCThreadState::blockUntilThreadAvailable()
     pthread_mutex_unlock(&mProcess->mThreadCountLock);
 }
 
-status_t IPCThreadState::getAndExecuteCommand()
+status_t IPCThreadState::getAndExecuteCommand(uint64_t* waitedUs)
 {
     status_t result;
     int32_t cmd;
 
+    const bool needRead = mIn.dataPosition() >= mIn.dataSize();
     result = talkWithDriver();
     if (result >= NO_ERROR) {
         size_t IN = mIn.dataAvail();
         if (IN < sizeof(int32_t)) return result;
-        cmd = mIn.readInt32();
+        cmd = readCommand();
+        // The wait belongs to every command of the read. A BR_SPAWN_LOOPER
+        // means no other thread was waiting, so this one is needed however
+        // long it waited.
+        if (waitedUs != nullptr) {
+            if (needRead) *waitedUs = mLastReadWaitUs;
+            if (cmd == BR_SPAWN_LOOPER) *waitedUs = 0;
+        }
         IF_LOG_COMMANDS() {
             alog << "Processing top-level Command: "
                  << getReturnString(cmd) << endl;
@@ -535,8 +732,16 @@ status_t IPCThreadState::getAndExecuteCommand()
                 mProcess->mStarvationStartTimeMs == 0) {
             mProcess->mStarvationStartTimeMs = uptimeMillis();
         }
+        if (mProcess->mExecutingThreadsCount > mProcess->mPeakExecutingThreads) {
+            mProcess->mPeakExecutingThreads = mProcess->mExecutingThreadsCount;
+        }
+        const bool respawn = mProcess->respawnPooledThreadLocked();
         pthread_mutex_unlock(&mProcess->mThreadCountLock);
 
+        if (respawn) {
+            mProcess->startPooledThread(false /*isMain*/, false /*requested*/);
+        }
+
         result = executeCommand(cmd);
 
         pthread_mutex_lock(&mProcess->mThreadCountLock);
@@ -548,6 +753,8 @@ status_t IPCThreadState::getAndExecuteCommand()
                 ALOGE("binder thread pool (%zu threads) starved for %" PRId64 " ms",
                       mProcess->mMaxThreads, starvationTimeMs);
             }
+            mProcess->mStarvations++;
+            mProcess->mStarvationMs += starvationTimeMs;
             mProcess->mStarvationStartTimeMs = 0;
         }
 
@@ -613,14 +820,27 @@ void IPCThreadState::processPostWriteDerefs()
 }
 
 void IPCThreadState::joinThreadPool(bool isMain)
+{
+    runThreadPool(isMain ? BC_ENTER_LOOPER : BC_REGISTER_LOOPER, false /*pooled*/);
+}
+
+void IPCThreadState::joinPooledThread(bool requested)
+{
+    runThreadPool(requested ? BC_REGISTER_LOOPER : BC_ENTER_LOOPER, true /*pooled*/);
+}
+
+void IPCThreadState::runThreadPool(uint32_t looperCmd, bool pooled)
 {
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS JOINING THE THREAD POOL\n", (void*)(intptr_t)pthread_self(), getpid());
     sp<ProcessState> proc(ProcessState::self());
     proc->registerThread(gettid());
+    proc->threadPoolEntered(pooled);
 
-    mOut.writeInt32(isMain ? BC_ENTER_LOOPER : BC_REGISTER_LOOPER);
+    writeCommand(looperCmd);
 
     mIsLooper = true;
+    bool reaped = false;
+    uint64_t waitedUs = 0;
     status_t result;
     do {
         processPendingDerefs();
@@ -630,8 +850,9 @@ void IPCThreadState::joinThreadPool(bool isMain)
             result = TIMED_OUT;
             break;
         }
+
         // now get the next command to be processed, waiting if necessary
-        result = getAndExecuteCommand();
+        result = getAndExecuteCommand(&waitedUs);
 
         if (result < NO_ERROR && result != TIMED_OUT && result != -ECONNREFUSED && result != -EBADF) {
             LOG_ALWAYS_FATAL("getAndExecuteCommand(fd=%d) returned unexpected error %" PRId32 ", aborting",
@@ -643,14 +864,31 @@ void IPCThreadState::joinThreadPool(bool isMain)
         if(result == TIMED_OUT) {
             break;
         }
+
+        // Leave the thread pool once the commands of a read are done, if
+        // this thread waited a whole idle period for them and the pool
+        // doesn't need it, see ProcessState::setThreadPoolIdleTimeout.
+        // Checking after a read rather than with a timeout keeps the other
+        // threads asleep in the driver.
+        if (pooled && result >= NO_ERROR && mIn.dataPosition() >= mIn.dataSize()) {
+            const uint64_t idleUs =
+                    static_cast<uint64_t>(proc->getThreadPoolIdleTimeout()) * 1000;
+            if (idleUs != 0 && waitedUs >= idleUs && proc->reapPooledThread()) {
+                reaped = true;
+                result = TIMED_OUT;
+                break;
+            }
+            waitedUs = 0;
+        }
     } while (result != -ECONNREFUSED && result != -EBADF);
 
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS LEAVING THE THREAD POOL err=%" PRId32 "\n",
         (void*)(intptr_t)pthread_self(), getpid(), result);
 
-    mOut.writeInt32(BC_EXIT_LOOPER);
+    writeCommand(BC_EXIT_LOOPER);
     mIsLooper = false;
     talkWithDriver(false);
+    if (!reaped) proc->threadPoolExited(pooled);
     proc->unregisterThread(gettid());
 }
 
@@ -660,7 +898,7 @@ status_t IPCThreadState::setupPolling(int* fd)
         return -EBADF;
     }
 
-    mOut.writeInt32(BC_ENTER_LOOPER);
+    writeCommand(BC_ENTER_LOOPER);
     flushCommands();
     *fd = mProcess->mDriverFD;
     return 0;
@@ -766,9 +1004,7 @@ status_t IPCThreadState::transact(int32_t handle,
 void IPCThreadState::incStrongHandle(int32_t handle, BpBinder *proxy)
 {
     LOG_REMOTEREFS("IPCThreadState::incStrongHandle(%" PRId32 ")\n", handle);
-    mOut.writeInt32(BC_ACQUIRE);
-    mOut.writeInt32(handle);
-    if (!flushIfNeeded()) {
+    if (!writeRefCountCommand(BC_ACQUIRE, handle)) {
         // Create a temp reference until the driver has handled this command.
         proxy->incStrong(mProcess.get());
         mPostWriteStrongDerefs.push(proxy);
@@ -778,17 +1014,13 @@ void IPCThreadState::incStrongHandle(int32_t handle, BpBinder *proxy)
 void IPCThreadState::decStrongHandle(int32_t handle)
 {
     LOG_REMOTEREFS("IPCThreadState::decStrongHandle(%" PRId32 ")\n", handle);
-    mOut.writeInt32(BC_RELEASE);
-    mOut.writeInt32(handle);
-    flushIfNeeded();
+    writeRefCountCommand(BC_RELEASE, handle);
 }
 
 void IPCThreadState::incWeakHandle(int32_t handle, BpBinder *proxy)
 {
     LOG_REMOTEREFS("IPCThreadState::incWeakHandle(%" PRId32 ")\n", handle);
-    mOut.writeInt32(BC_INCREFS);
-    mOut.writeInt32(handle);
-    if (!flushIfNeeded()) {
+    if (!writeRefCountCommand(BC_INCREFS, handle)) {
         // Create a temp reference until the driver has handled this command.
         proxy->getWeakRefs()->incWeak(mProcess.get());
         mPostWriteWeakDerefs.push(proxy->getWeakRefs());
@@ -798,16 +1030,14 @@ void IPCThreadState::incWeakHandle(int32_t handle, BpBinder *proxy)
 void IPCThreadState::decWeakHandle(int32_t handle)
 {
     LOG_REMOTEREFS("IPCThreadState::decWeakHandle(%" PRId32 ")\n", handle);
-    mOut.writeInt32(BC_DECREFS);
-    mOut.writeInt32(handle);
-    flushIfNeeded();
+    writeRefCountCommand(BC_DECREFS, handle);
 }
 
 status_t IPCThreadState::attemptIncStrongHandle(int32_t handle)
 {
 #if HAS_BC_ATTEMPT_ACQUIRE
     LOG_REMOTEREFS("IPCThreadState::attemptIncStrongHandle(%d)\n", handle);
-    mOut.writeInt32(BC_ATTEMPT_ACQUIRE);
+    writeCommand(BC_ATTEMPT_ACQUIRE);
     mOut.writeInt32(0); // xxx was thread priority
     mOut.writeInt32(handle);
     status_t result = UNKNOWN_ERROR;
@@ -837,7 +1067,7 @@ void IPCThreadState::expungeHandle(int32_t handle, IBinder* binder)
 
 status_t IPCThreadState::requestDeathNotification(int32_t handle, BpBinder* proxy)
 {
-    mOut.writeInt32(BC_REQUEST_DEATH_NOTIFICATION);
+    writeCommand(BC_REQUEST_DEATH_NOTIFICATION);
     mOut.writeInt32((int32_t)handle);
     mOut.writePointer((uintptr_t)proxy);
     return NO_ERROR;
@@ -845,7 +1075,7 @@ status_t IPCThreadState::requestDeathNotification(int32_t handle, BpBinder* prox
 
 status_t IPCThreadState::clearDeathNotification(int32_t handle, BpBinder* proxy)
 {
-    mOut.writeInt32(BC_CLEAR_DEATH_NOTIFICATION);
+    writeCommand(BC_CLEAR_DEATH_NOTIFICATION);
     mOut.writeInt32((int32_t)handle);
     mOut.writePointer((uintptr_t)proxy);
     return NO_ERROR;
@@ -861,15 +1091,26 @@ IPCThreadState::IPCThreadState()
         mIsFlushing(false),
         mStrictModePolicy(0),
         mLastTransactionBinderFlags(0),
-        mCallRestriction(mProcess->mCallRestriction) {
+        mCallRestriction(mProcess->mCallRestriction),
+        mSmallReads(0),
+        mLastReadWaitUs(0) {
     pthread_setspecific(mProcess->mTLS, this);
     clearCaller();
-    mIn.setDataCapacity(256);
-    mOut.setDataCapacity(256);
+    mIn.setDataCapacity(mProcess->getThreadBufferMinSize());
+    mOut.setDataCapacity(mProcess->getThreadBufferMinSize());
+    mDriverCounters.bufferBytes.store(mIn.dataCapacity() + mOut.dataCapacity(),
+                                      std::memory_order_relaxed);
+
+    AutoMutex _l(mProcess->mDriverStatsLock);
+    mProcess->mDriverStatsThreads.insert(this);
 }
 
 IPCThreadState::~IPCThreadState()
 {
+    AutoMutex _l(mProcess->mDriverStatsLock);
+    mDriverCounters.bufferBytes.store(0, std::memory_order_relaxed);
+    addDriverStats(&mProcess->mExitedDriverStats);
+    mProcess->mDriverStatsThreads.erase(this);
 }
 
 status_t IPCThreadState::sendReply(const Parcel& reply, uint32_t flags)
@@ -898,7 +1139,7 @@ again:
         if (err < NO_ERROR) break;
         if (mIn.dataAvail() == 0) continue;
 
-        cmd = (uint32_t)mIn.readInt32();
+        cmd = readCommand();
 
         IF_LOG_COMMANDS() {
             alog << "Processing waitForResponse Command: "
@@ -1008,6 +1249,8 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
         return -EBADF;
     }
 
+    if (!mDeferredRefCounts.empty()) writeDeferredRefCounts();
+
     binder_write_read bwr;
 
     // Is the read buffer empty?
@@ -1023,6 +1266,7 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
 
     // This is what we'll read.
     if (doReceive && needRead) {
+        resizeInBeforeRead();
         bwr.read_size = mIn.dataCapacity();
         bwr.read_buffer = (uintptr_t)mIn.data();
     } else {
@@ -1044,13 +1288,17 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
             << ", needRead: " << needRead << ", doReceive: " << doReceive << endl;
     }
 
+    mLastReadWaitUs = 0;
+
     // Return immediately if there is nothing to do.
     if ((bwr.write_size == 0) && (bwr.read_size == 0)) return NO_ERROR;
 
     bwr.write_consumed = 0;
     bwr.read_consumed = 0;
     status_t err;
+    const uint64_t startUs = driverStatsNowUs();
     do {
+        addDriverCounter(mDriverCounters.ioctls, 1);
         IF_LOG_COMMANDS() {
             alog << "About to read/write, write size = " << mOut.dataSize() << endl;
         }
@@ -1069,6 +1317,11 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
             alog << "Finished read/write, write size = " << mOut.dataSize() << endl;
         }
     } while (err == -EINTR);
+    const uint64_t driverUs = driverStatsNowUs() - startUs;
+    addDriverCounter(mDriverCounters.driverUs, driverUs);
+    if (bwr.read_size > 0) mLastReadWaitUs = driverUs;
+    addDriverCounter(mDriverCounters.bytesWritten, bwr.write_consumed);
+    addDriverCounter(mDriverCounters.bytesRead, bwr.read_consumed);
 
     IF_LOG_COMMANDS() {
         alog << "Our err: " << (void*)(intptr_t)err << ", write consumed: "
@@ -1086,6 +1339,7 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
                                  mOut.dataSize());
             else {
                 mOut.setDataSize(0);
+                resizeOutAfterWrite();
                 processPostWriteDerefs();
             }
         }
@@ -1093,6 +1347,11 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
             mIn.setDataSize(bwr.read_consumed);
             mIn.setDataPosition(0);
         }
+        if (bwr.read_size > 0) {
+            resizeInAfterRead(bwr.read_size, bwr.read_consumed);
+        }
+        mDriverCounters.bufferBytes.store(mIn.dataCapacity() + mOut.dataCapacity(),
+                                          std::memory_order_relaxed);
         IF_LOG_COMMANDS() {
             TextOutput::Bundle _b(alog);
             alog << "Remaining data size: " << mOut.dataSize() << endl;
@@ -1139,7 +1398,7 @@ status_t IPCThreadState::writeTransactionData(int32_t cmd, uint32_t binderFlags,
         return (mLastError = err);
     }
 
-    mOut.writeInt32(cmd);
+    writeCommand(cmd);
     mOut.write(&tr, sizeof(tr));
 
     return NO_ERROR;
@@ -1176,7 +1435,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
             LOG_REMOTEREFS("BR_ACQUIRE from driver on %p", obj);
             obj->printRefs();
         }
-        mOut.writeInt32(BC_ACQUIRE_DONE);
+        writeCommand(BC_ACQUIRE_DONE);
         mOut.writePointer((uintptr_t)refs);
         mOut.writePointer((uintptr_t)obj);
         break;
@@ -1198,7 +1457,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         refs = (RefBase::weakref_type*)mIn.readPointer();
         obj = (BBinder*)mIn.readPointer();
         refs->incWeak(mProcess.get());
-        mOut.writeInt32(BC_INCREFS_DONE);
+        writeCommand(BC_INCREFS_DONE);
         mOut.writePointer((uintptr_t)refs);
         mOut.writePointer((uintptr_t)obj);
         break;
@@ -1226,7 +1485,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                        "BR_ATTEMPT_ACQUIRE: object %p does not match cookie %p (expected %p)",
                        refs, obj, refs->refBase());
 
-            mOut.writeInt32(BC_ACQUIRE_RESULT);
+            writeCommand(BC_ACQUIRE_RESULT);
             mOut.writeInt32((int32_t)success);
         }
         break;
@@ -1292,6 +1551,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                     << ", offsets addr="
                     << reinterpret_cast<const size_t*>(tr.data.ptr.offsets) << endl;
             }
+            const uint64_t transactStartUs = driverStatsNowUs();
             if (tr.target.ptr) {
                 // We only have a weak reference on the target object, so we must first try to
                 // safely acquire a strong reference before doing anything else with it.
@@ -1307,6 +1567,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
             } else {
                 error = mProcess->mContextObject->transact(tr.code, buffer, &reply, tr.flags);
             }
+            addDriverCounter(mDriverCounters.transactUs, driverStatsNowUs() - transactStartUs);
 
             //ALOGI("<<<< TRANSACT from pid %d restore pid %d sid %s uid %d\n",
             //     mCallingPid, origPid, (origSid ? origSid : "<N/A>"), origUid);
@@ -1375,7 +1636,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         {
             BpBinder *proxy = (BpBinder*)mIn.readPointer();
             proxy->sendObituary();
-            mOut.writeInt32(BC_DEAD_BINDER_DONE);
+            writeCommand(BC_DEAD_BINDER_DONE);
             mOut.writePointer((uintptr_t)proxy);
         } break;
 
@@ -1477,7 +1738,7 @@ void IPCThreadState::freeBuffer(Parcel* parcel, const uint8_t* data,
     ALOG_ASSERT(data != NULL, "Called with NULL data");
     if (parcel != nullptr) parcel->closeFileDescriptors();
     IPCThreadState* state = self();
-    state->mOut.writeInt32(BC_FREE_BUFFER);
+    state->writeCommand(BC_FREE_BUFFER);
     state->mOut.writePointer((uintptr_t)data);
     state->flushIfNeeded();
 }
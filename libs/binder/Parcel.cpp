@@ -184,6 +184,7 @@ status_t Parcel::flattenBinder(const sp<IBinder>& binder) {
 
     if (isForRpc()) {
         if (binder) {
+            size_t position = mDataPos;
             status_t status = writeInt32(1); // non-null
             if (status != OK) return status;
             uint64_t address;
@@ -192,6 +193,7 @@ status_t Parcel::flattenBinder(const sp<IBinder>& binder) {
             if (status != OK) return status;
             status = writeUint64(address);
             if (status != OK) return status;
+            RpcState::onBinderWritten(this, position);
         } else {
             status_t status = writeInt32(0); // null
             if (status != OK) return status;
@@ -2275,6 +2277,31 @@ void Parcel::ipcSetDataReference(const uint8_t* data, size_t dataSize,
     scanForFds();
 }
 
+uint8_t* Parcel::rpcReplyBuffer(size_t size)
+{
+    if (mOwner != nullptr || mData == nullptr || mObjectsSize != 0) return nullptr;
+    if (mDataCapacity < size) return nullptr;
+    return mData;
+}
+
+void Parcel::rpcSetReplyData(const sp<RpcSession>& session, size_t size)
+{
+    LOG_ALWAYS_FATAL_IF(mOwner != nullptr || size > mDataCapacity,
+                        "Reply was not read into this Parcel's buffer");
+
+    mError = NO_ERROR;
+    mDataSize = size;
+    mDataPos = 0;
+    ALOGV("rpcSetReplyData Setting data size of %p to %zu", this, mDataSize);
+    mNextObjectHint = 0;
+    mObjectsSorted = false;
+    mHasFds = false;
+    mFdsKnown = true;
+    mWorkSourceRequestHeaderPosition = 0;
+    mRequestHeaderPresent = false;
+    mSession = session;
+}
+
 void Parcel::print(TextOutput& to, uint32_t /*flags*/) const
 {
     to << "Parcel(";
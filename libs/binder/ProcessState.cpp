@@ -19,6 +19,7 @@
 #include <binder/ProcessState.h>
 
 #include <android-base/result.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <binder/BpBinder.h>
 #include <binder/IPCThreadState.h>
@@ -28,14 +29,19 @@
 #include <utils/AndroidThreads.h>
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/SystemClock.h>
 #include <utils/Thread.h>
 
 #include "Static.h"
 #include "binder_module.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <mutex>
+#include <new>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -48,6 +54,24 @@
 #define DEFAULT_MAX_BINDER_THREADS 15
 #define DEFAULT_ENABLE_ONEWAY_SPAM_DETECTION 1
 
+#ifdef CONFIG_ANDROID_BINDER_THREAD_BUFFER_MIN_SIZE
+#define DEFAULT_THREAD_BUFFER_MIN_SIZE CONFIG_ANDROID_BINDER_THREAD_BUFFER_MIN_SIZE
+#else
+#define DEFAULT_THREAD_BUFFER_MIN_SIZE 256
+#endif
+
+#ifdef CONFIG_ANDROID_BINDER_THREAD_BUFFER_MAX_SIZE
+#define DEFAULT_THREAD_BUFFER_MAX_SIZE CONFIG_ANDROID_BINDER_THREAD_BUFFER_MAX_SIZE
+#else
+#define DEFAULT_THREAD_BUFFER_MAX_SIZE 2048
+#endif
+
+#ifdef CONFIG_ANDROID_BINDER_THREADPOOL_IDLE_TIMEOUT
+#define DEFAULT_THREADPOOL_IDLE_TIMEOUT CONFIG_ANDROID_BINDER_THREADPOOL_IDLE_TIMEOUT
+#else
+#define DEFAULT_THREADPOOL_IDLE_TIMEOUT 0
+#endif
+
 #ifdef __ANDROID_VNDK__
 const char* kDefaultDriver = "/dev/vndbinder";
 #else
@@ -61,19 +85,25 @@ namespace android {
 class PoolThread : public Thread
 {
 public:
-    explicit PoolThread(bool isMain)
-        : mIsMain(isMain)
+    PoolThread(bool isMain, bool requested)
+        : mIsMain(isMain), mRequested(requested)
     {
     }
 
 protected:
     virtual bool threadLoop()
     {
-        IPCThreadState::self()->joinThreadPool(mIsMain);
+        if (mIsMain) {
+            IPCThreadState::self()->joinThreadPool(true);
+        } else {
+            IPCThreadState::self()->joinPooledThread(mRequested);
+        }
         return false;
     }
 
     const bool mIsMain;
+    // whether the driver asked for it with BR_SPAWN_LOOPER
+    const bool mRequested;
 };
 
 sp<ProcessState> ProcessState::self()
@@ -105,6 +135,24 @@ void ProcessState::unregisterThread(pid_t thread)
     mThreadPoolSet.erase(thread);
 }
 
+ProcessState::DriverStats ProcessState::getDriverStats()
+{
+    DriverStats stats;
+    {
+        AutoMutex _l(mDriverStatsLock);
+        stats = mExitedDriverStats;
+        for (IPCThreadState* thread : mDriverStatsThreads) {
+            thread->addDriverStats(&stats);
+        }
+    }
+
+    pthread_mutex_lock(&mThreadCountLock);
+    stats.starvations = mStarvations;
+    stats.starvationMs = mStarvationMs;
+    pthread_mutex_unlock(&mThreadCountLock);
+    return stats;
+}
+
 void ProcessState::insertBBinder(IBinder *binder)
 {
     AutoMutex _l(mLock);
@@ -403,26 +451,71 @@ void ProcessState::setCallRestriction(CallRestriction restriction) {
     mCallRestriction = restriction;
 }
 
-ProcessState::handle_entry* ProcessState::lookupHandleLocked(int32_t handle)
+ProcessState::handle_entry* ProcessState::lookupHandle(int32_t handle, bool create)
 {
-    const size_t N=mHandleToObject.size();
-    if (N <= (size_t)handle) {
-        handle_entry e;
-        e.binder = nullptr;
-        e.refs = nullptr;
-        status_t err = mHandleToObject.insertAt(e, N, handle+1-N);
-        if (err < NO_ERROR) return nullptr;
+    if (handle < 0) return nullptr;
+
+    const uint32_t index = static_cast<uint32_t>(handle) + kFirstHandleSegmentSize;
+    const size_t shift = 31 - __builtin_clz(index);
+    const size_t segment = shift - kFirstHandleSegmentShift;
+    const size_t offset = index - (uint32_t(1) << shift);
+
+    handle_entry* entries = mHandleSegments[segment].load(std::memory_order_acquire);
+    if (entries == nullptr) {
+        if (!create) return nullptr;
+
+        handle_entry* newEntries = new (std::nothrow) handle_entry[size_t(1) << shift]();
+        if (newEntries == nullptr) return nullptr;
+        if (mHandleSegments[segment].compare_exchange_strong(entries, newEntries,
+                                                             std::memory_order_acq_rel)) {
+            entries = newEntries;
+        } else {
+            // another thread made it first
+            delete[] newEntries;
+        }
     }
-    return &mHandleToObject.editItemAt(handle);
+    return &entries[offset];
+}
+
+Mutex& ProcessState::handleLock(int32_t handle)
+{
+    return mHandleLocks[static_cast<uint32_t>(handle) % kNumHandleLocks];
+}
+
+Condition& ProcessState::handleReadersDone(int32_t handle)
+{
+    return mHandleReadersDone[static_cast<uint32_t>(handle) % kNumHandleLocks];
 }
 
 sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
 {
     sp<IBinder> result;
 
-    AutoMutex _l(mLock);
+    // Fast path, if there is a proxy which is still alive. While counted as a
+    // reader, expungeHandle waits, so the proxy's destructor can't finish and
+    // its weak refs can still be looked at. attemptIncWeak fails if the proxy
+    // is being destroyed, and the weak reference keeps it alive otherwise.
+    if (handle_entry* e = lookupHandle(handle, false /*create*/); e != nullptr) {
+        const uint32_t phase = e->phase.load() & 1;
+        e->readers[phase].fetch_add(1);
+        IBinder* b = e->binder.load();
+        const bool acquired = b != nullptr && b->getWeakRefs()->attemptIncWeak(this);
+        if (e->readers[phase].fetch_sub(1) == 1 && e->expunging.load()) {
+            AutoMutex _l(handleLock(handle));
+            handleReadersDone(handle).broadcast();
+        }
+
+        if (acquired) {
+            // see below
+            result.force_set(b);
+            b->getWeakRefs()->decWeak(this);
+            return result;
+        }
+    }
 
-    handle_entry* e = lookupHandleLocked(handle);
+    AutoMutex _l(handleLock(handle));
+
+    handle_entry* e = lookupHandle(handle, true /*create*/);
 
     if (e != nullptr) {
         // We need to create a new BpBinder if there isn't currently one, OR we
@@ -432,8 +525,8 @@ sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
         // We need to do this because there is a race condition between someone
         // releasing a reference on this BpBinder, and a new reference on its handle
         // arriving from the driver.
-        IBinder* b = e->binder;
-        if (b == nullptr || !e->refs->attemptIncWeak(this)) {
+        IBinder* b = e->binder.load();
+        if (b == nullptr || !b->getWeakRefs()->attemptIncWeak(this)) {
             if (handle == 0) {
                 // Special case for context manager...
                 // The context manager is the only object for which we create
@@ -465,15 +558,14 @@ sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
             }
 
             sp<BpBinder> b = BpBinder::PrivateAccessor::create(handle);
-            e->binder = b.get();
-            if (b) e->refs = b->getWeakRefs();
+            e->binder.store(b.get());
             result = b;
         } else {
             // This little bit of nastyness is to allow us to add a primary
             // reference to the remote proxy when this team doesn't have one
             // but another team is sending the handle to us.
             result.force_set(b);
-            e->refs->decWeak(this);
+            b->getWeakRefs()->decWeak(this);
         }
     }
 
@@ -482,14 +574,34 @@ sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
 
 void ProcessState::expungeHandle(int32_t handle, IBinder* binder)
 {
-    AutoMutex _l(mLock);
+    Mutex& lock = handleLock(handle);
+    Condition& readersDone = handleReadersDone(handle);
+    AutoMutex _l(lock);
 
-    handle_entry* e = lookupHandleLocked(handle);
+    handle_entry* e = lookupHandle(handle, false /*create*/);
+    if (e == nullptr) return;
 
     // This handle may have already been replaced with a new BpBinder
     // (if someone failed the AttemptIncWeak() above); we don't want
     // to overwrite it.
-    if (e && e->binder == binder) e->binder = nullptr;
+    IBinder* expected = binder;
+    e->binder.compare_exchange_strong(expected, nullptr);
+
+    // The caller is about to destroy |binder|, which getStrongProxyForHandle
+    // may still be looking at without the lock (even if it was replaced).
+    // Readers which start from now on can't see it anymore, so only the ones
+    // counted in the current phase are waited for. Another expungeHandle call
+    // for this handle may be waiting for its own readers first.
+    while (e->expunging.load()) {
+        readersDone.wait(lock);
+    }
+    e->expunging.store(true);
+    const uint32_t phase = e->phase.fetch_add(1) & 1;
+    while (e->readers[phase].load() != 0) {
+        readersDone.wait(lock);
+    }
+    e->expunging.store(false);
+    readersDone.broadcast();
 }
 
 String8 ProcessState::makeBinderThreadName() {
@@ -507,12 +619,124 @@ String8 ProcessState::makeBinderThreadName() {
 
 void ProcessState::spawnPooledThread(bool isMain)
 {
-    if (mThreadPoolStarted) {
-        String8 name = makeBinderThreadName();
-        ALOGV("Spawning new pooled thread, name=%s\n", name.string());
-        sp<Thread> t = sp<PoolThread>::make(isMain);
-        t->run(name.string(), 0, CONFIG_ANDROID_BINDER_THREADPOOL_STACKSIZE);
+    startPooledThread(isMain, true /*requested*/);
+}
+
+void ProcessState::startPooledThread(bool isMain, bool requested)
+{
+    if (!mThreadPoolStarted) {
+        if (!requested) {
+            // counted by respawnPooledThreadLocked
+            pthread_mutex_lock(&mThreadCountLock);
+            mStartingThreads--;
+            pthread_mutex_unlock(&mThreadCountLock);
+        }
+        return;
+    }
+
+    if (!isMain && requested) {
+        pthread_mutex_lock(&mThreadCountLock);
+        mStartingThreads++;
+        mSpawnedThreads++;
+        if (mUnreplacedThreads > 0) mUnreplacedThreads--;
+        pthread_mutex_unlock(&mThreadCountLock);
     }
+
+    String8 name = makeBinderThreadName();
+    ALOGV("Spawning new pooled thread, name=%s\n", name.string());
+    sp<Thread> t = sp<PoolThread>::make(isMain, requested);
+    status_t status = t->run(name.string(), 0, CONFIG_ANDROID_BINDER_THREADPOOL_STACKSIZE);
+    if (status != NO_ERROR) {
+        ALOGE("Failed to start binder thread %s: %s", name.string(),
+              statusToString(status).c_str());
+        if (!isMain) {
+            pthread_mutex_lock(&mThreadCountLock);
+            mStartingThreads--;
+            pthread_mutex_unlock(&mThreadCountLock);
+        }
+    }
+}
+
+void ProcessState::threadPoolEntered(bool pooled)
+{
+    pthread_mutex_lock(&mThreadCountLock);
+    mLooperThreads++;
+    if (pooled) {
+        mStartingThreads--;
+        mPooledThreads++;
+    }
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+void ProcessState::threadPoolExited(bool pooled)
+{
+    pthread_mutex_lock(&mThreadCountLock);
+    mLooperThreads--;
+    if (pooled) mPooledThreads--;
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+bool ProcessState::reapPooledThread()
+{
+    pthread_mutex_lock(&mThreadCountLock);
+    updateThreadPoolPeriodLocked();
+    const size_t target = threadPoolTargetLocked();
+    const bool reap = getThreadPoolIdleTimeout() != 0 && mLooperThreads > target;
+    if (reap) {
+        mLooperThreads--;
+        mPooledThreads--;
+        mUnreplacedThreads++;
+        mReapedThreads++;
+    }
+    const size_t threads = mLooperThreads;
+    pthread_mutex_unlock(&mThreadCountLock);
+
+    ALOGI_IF(reap, "binder thread pool: idle thread leaving, %zu threads left (keeping %zu)",
+             threads, target);
+    return reap;
+}
+
+bool ProcessState::respawnPooledThreadLocked()
+{
+    // Only replace threads which left, since the driver asks for the others.
+    // Once one is starting, it will take the next command.
+    if (mUnreplacedThreads == 0 || mStartingThreads != 0 ||
+        mExecutingThreadsCount < mLooperThreads || mPooledThreads >= mMaxThreads) {
+        return false;
+    }
+    mUnreplacedThreads--;
+    mStartingThreads++;
+    mRespawnedThreads++;
+    ALOGI("binder thread pool: all %zu threads busy, starting another", mLooperThreads);
+    return true;
+}
+
+void ProcessState::updateThreadPoolPeriodLocked()
+{
+    const int64_t idleMs = getThreadPoolIdleTimeout();
+    const int64_t now = uptimeMillis();
+    if (idleMs == 0 || now - mThreadPoolPeriodStartMs < idleMs) return;
+
+    // Threads are only reaped when they wake up, so this may not have been
+    // called for a while. Nothing happened in the periods skipped over.
+    const bool skipped = now - mThreadPoolPeriodStartMs >= 2 * idleMs;
+    mLastPeakExecutingThreads = skipped ? mExecutingThreadsCount : mPeakExecutingThreads;
+    mPeakExecutingThreads = mExecutingThreadsCount;
+    mLastThreadPoolPeriodStarvations = skipped ? mStarvations : mThreadPoolPeriodStarvations;
+    mThreadPoolPeriodStarvations = mStarvations;
+    mThreadPoolPeriodStartMs = now;
+}
+
+size_t ProcessState::threadPoolTargetLocked() const
+{
+    // Keep every thread while the pool is starved, or was in the last two
+    // periods.
+    if (mStarvationStartTimeMs != 0 || mStarvations != mLastThreadPoolPeriodStarvations) {
+        return std::max(mLooperThreads, mMaxThreads);
+    }
+    // Otherwise, enough for the busiest moment, and one waiting for the
+    // next command.
+    return std::max(mPeakExecutingThreads, mLastPeakExecutingThreads) + 1;
 }
 
 status_t ProcessState::setThreadPoolMaxThreadCount(size_t maxThreads) {
@@ -558,6 +782,61 @@ bool ProcessState::isDriverFeatureEnabled(const DriverFeature feature) {
     return on == '1';
 }
 
+void ProcessState::setMaxDeferredRefCounts(size_t count) {
+    mMaxDeferredRefCounts.store(count, std::memory_order_relaxed);
+}
+
+size_t ProcessState::getMaxDeferredRefCounts() const {
+    return mMaxDeferredRefCounts.load(std::memory_order_relaxed);
+}
+
+void ProcessState::setThreadBufferSizes(size_t minBytes, size_t maxBytes) {
+    LOG_ALWAYS_FATAL_IF(minBytes == 0 || maxBytes < minBytes,
+                        "Invalid thread buffer sizes %zu to %zu", minBytes, maxBytes);
+    mThreadBufferMinSize.store(minBytes, std::memory_order_relaxed);
+    mThreadBufferMaxSize.store(maxBytes, std::memory_order_relaxed);
+}
+
+size_t ProcessState::getThreadBufferMinSize() const {
+    return mThreadBufferMinSize.load(std::memory_order_relaxed);
+}
+
+size_t ProcessState::getThreadBufferMaxSize() const {
+    return mThreadBufferMaxSize.load(std::memory_order_relaxed);
+}
+
+void ProcessState::setThreadPoolIdleTimeout(uint32_t idleMs) {
+    mThreadPoolIdleTimeoutMs.store(idleMs, std::memory_order_relaxed);
+}
+
+uint32_t ProcessState::getThreadPoolIdleTimeout() const {
+    return mThreadPoolIdleTimeoutMs.load(std::memory_order_relaxed);
+}
+
+ProcessState::ThreadPoolStats ProcessState::getThreadPoolStats()
+{
+    ThreadPoolStats stats;
+    pthread_mutex_lock(&mThreadCountLock);
+    updateThreadPoolPeriodLocked();
+    stats.threads = mLooperThreads;
+    stats.startingThreads = mStartingThreads;
+    stats.targetThreads = threadPoolTargetLocked();
+    stats.peakExecutingThreads = std::max(mPeakExecutingThreads, mLastPeakExecutingThreads);
+    stats.spawnedThreads = mSpawnedThreads;
+    stats.respawnedThreads = mRespawnedThreads;
+    stats.reapedThreads = mReapedThreads;
+    pthread_mutex_unlock(&mThreadCountLock);
+    return stats;
+}
+
+std::string ProcessState::ThreadPoolStats::toString() const
+{
+    return base::StringPrintf("threads %zu starting %zu target %zu peak executing %zu\n"
+                              "spawned %" PRIu64 " respawned %" PRIu64 " reaped %" PRIu64 "\n",
+                              threads, startingThreads, targetThreads, peakExecutingThreads,
+                              spawnedThreads, respawnedThreads, reapedThreads);
+}
+
 status_t ProcessState::enableOnewaySpamDetection(bool enable) {
     uint32_t enableDetection = enable ? 1 : 0;
     if (ioctl(mDriverFD, BINDER_ENABLE_ONEWAY_SPAM_DETECTION, &enableDetection) == -1) {
@@ -618,11 +897,30 @@ ProcessState::ProcessState(const char* driver)
         mWaitingForThreads(0),
         mMaxThreads(DEFAULT_MAX_BINDER_THREADS),
         mStarvationStartTimeMs(0),
+        mStarvations(0),
+        mStarvationMs(0),
+        mLooperThreads(0),
+        mPooledThreads(0),
+        mStartingThreads(0),
+        mPeakExecutingThreads(0),
+        mLastPeakExecutingThreads(0),
+        mThreadPoolPeriodStartMs(0),
+        mThreadPoolPeriodStarvations(0),
+        mLastThreadPoolPeriodStarvations(0),
+        mUnreplacedThreads(0),
+        mSpawnedThreads(0),
+        mRespawnedThreads(0),
+        mReapedThreads(0),
+        mHandleSegments{},
         mForked(false),
         mExitRequested(false),
         mThreadPoolStarted(false),
         mThreadPoolSeq(1),
         mCallRestriction(CallRestriction::NONE),
+        mMaxDeferredRefCounts(0),
+        mThreadBufferMinSize(DEFAULT_THREAD_BUFFER_MIN_SIZE),
+        mThreadBufferMaxSize(DEFAULT_THREAD_BUFFER_MAX_SIZE),
+        mThreadPoolIdleTimeoutMs(DEFAULT_THREADPOOL_IDLE_TIMEOUT),
         mTLS(0),
         mShutdown(false),
         mDisableBackgroundScheduling(false) {
@@ -655,6 +953,9 @@ ProcessState::ProcessState(const char* driver)
 
 ProcessState::~ProcessState()
 {
+    for (std::atomic<handle_entry*>& segment : mHandleSegments) {
+        delete[] segment.load();
+    }
     pthread_key_delete(mTLS);
     if (mDriverFD >= 0) {
         if (mVMStart != MAP_FAILED) {
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RpcPriority"
+
+#include "RpcPriority.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <log/log.h>
+
+#include "RpcState.h"
+#include "RpcWireFormat.h"
+
+namespace android {
+
+uint32_t RpcPriority::current() {
+    int policy;
+    sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) return 0;
+
+    uint32_t wirePolicy;
+    int value = param.sched_priority;
+    if (policy == SCHED_FIFO) {
+        wirePolicy = RPC_WIRE_PRIORITY_POLICY_FIFO;
+    } else if (policy == SCHED_RR) {
+        wirePolicy = RPC_WIRE_PRIORITY_POLICY_RR;
+    } else {
+#ifdef __linux__
+        // normal threads only differ by their nice value
+        errno = 0;
+        value = getpriority(PRIO_PROCESS, gettid());
+        if (value == -1 && errno != 0) return 0;
+        wirePolicy = RPC_WIRE_PRIORITY_POLICY_NORMAL;
+#else
+        // e.g. SCHED_SPORADIC, which is still ordered by sched_priority
+        wirePolicy = RPC_WIRE_PRIORITY_POLICY_RR;
+#endif
+    }
+
+    return RPC_WIRE_PRIORITY_SET | (wirePolicy << RPC_WIRE_PRIORITY_POLICY_SHIFT) |
+            static_cast<uint8_t>(value);
+}
+
+int32_t RpcPriority::urgency(uint32_t priority) {
+    if (!(priority & RPC_WIRE_PRIORITY_SET)) return 0;
+
+    uint32_t wirePolicy = (priority >> RPC_WIRE_PRIORITY_POLICY_SHIFT) & 0xff;
+    if (wirePolicy == RPC_WIRE_PRIORITY_POLICY_NORMAL) {
+        // nice is -20 (most urgent) to 19
+        int8_t nice = static_cast<int8_t>(priority & 0xff);
+        return 21 - std::clamp<int8_t>(nice, -20, 19);
+    }
+    // sched_priority is up to 255 on some systems, larger is more urgent
+    return 100 + static_cast<int32_t>(priority & 0xff);
+}
+
+uint32_t RpcPriority::clamp(uint32_t priority, int maxRealtimePriority) {
+    if (!(priority & RPC_WIRE_PRIORITY_SET)) return 0;
+
+    uint32_t wirePolicy = (priority >> RPC_WIRE_PRIORITY_POLICY_SHIFT) & 0xff;
+    if (wirePolicy == RPC_WIRE_PRIORITY_POLICY_NORMAL) return priority;
+
+    int policy;
+    if (wirePolicy == RPC_WIRE_PRIORITY_POLICY_FIFO) {
+        policy = SCHED_FIFO;
+    } else if (wirePolicy == RPC_WIRE_PRIORITY_POLICY_RR) {
+        policy = SCHED_RR;
+    } else {
+        return 0;
+    }
+    int value = std::min({static_cast<int>(priority & 0xff), maxRealtimePriority,
+                          sched_get_priority_max(policy)});
+    if (value <= 0 || value < sched_get_priority_min(policy)) return 0;
+    return (priority & ~0xffu) | static_cast<uint8_t>(value);
+}
+
+bool RpcPriority::set(uint32_t priority) {
+    if (!(priority & RPC_WIRE_PRIORITY_SET)) return false;
+
+    uint32_t wirePolicy = (priority >> RPC_WIRE_PRIORITY_POLICY_SHIFT) & 0xff;
+    sched_param param{};
+    if (wirePolicy == RPC_WIRE_PRIORITY_POLICY_NORMAL) {
+#ifdef __linux__
+        if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) != 0) return false;
+        return setpriority(PRIO_PROCESS, gettid(), static_cast<int8_t>(priority & 0xff)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    int policy = wirePolicy == RPC_WIRE_PRIORITY_POLICY_FIFO ? SCHED_FIFO : SCHED_RR;
+    param.sched_priority = static_cast<int>(priority & 0xff);
+    return pthread_setschedparam(pthread_self(), policy, &param) == 0;
+}
+
+RpcPriority::Scoped::Scoped(uint32_t priority) {
+    if (!(priority & RPC_WIRE_PRIORITY_SET)) return;
+
+    // Only ever boosted, since a thread may not be allowed to go back to a
+    // more urgent priority after it has been lowered.
+    uint32_t previous = current();
+    if (previous == 0 || urgency(priority) <= urgency(previous)) return;
+    if (!set(priority)) {
+        LOG_RPC_DETAIL("Could not run at caller priority 0x%" PRIx32, priority);
+        return;
+    }
+    mPrevious = previous;
+}
+
+RpcPriority::Scoped::~Scoped() {
+    if (mPrevious.has_value() && !set(*mPrevious)) {
+        ALOGE("Could not go back to priority 0x%" PRIx32, *mPrevious);
+    }
+}
+
+} // namespace android
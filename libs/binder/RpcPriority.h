@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+
+namespace android {
+
+/**
+ * Scheduling priority of a thread, as sent in RpcWireTransaction::priority
+ * (see RpcSession::setPriorityInheritance).
+ */
+class RpcPriority {
+public:
+    /** Priority of the calling thread, or 0 if it can't be read. */
+    static uint32_t current();
+
+    /**
+     * For ordering, larger is more urgent. Real-time priorities come before
+     * any normal one, and 0 (no priority) comes last.
+     */
+    static int32_t urgency(uint32_t priority);
+
+    /**
+     * 'priority' with a real-time priority lowered to 'maxRealtimePriority'
+     * and to what the system supports, or 0 if a real-time priority isn't
+     * allowed at all. Normal priorities are unchanged.
+     */
+    static uint32_t clamp(uint32_t priority, int maxRealtimePriority);
+
+    /**
+     * While in scope, the calling thread runs at 'priority' if that is more
+     * urgent than its own, the way a thread of the binder driver runs at the
+     * priority of its caller. Nothing is changed for 0, or if the thread isn't
+     * allowed to take the priority.
+     */
+    class Scoped {
+    public:
+        explicit Scoped(uint32_t priority);
+        ~Scoped();
+
+    private:
+        std::optional<uint32_t> mPrevious;
+    };
+
+private:
+    static bool set(uint32_t priority);
+};
+
+} // namespace android
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RpcReactor"
+#include <log/log.h>
+
+#include "RpcReactor.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "FdTrigger.h"
+#include "RpcState.h"
+
+#ifdef __GLIBC__
+extern "C" pid_t gettid();
+#endif
+
+namespace android {
+
+std::shared_ptr<RpcReactor> RpcReactor::make(size_t workerThreads) {
+    LOG_ALWAYS_FATAL_IF(workerThreads == 0, "RpcReactor needs at least one worker thread");
+
+    auto reactor = std::make_shared<RpcReactor>();
+    if (!base::Pipe(&reactor->mWakeRead, &reactor->mWakeWrite, O_CLOEXEC | O_NONBLOCK)) {
+        ALOGE("Could not create pipe %s", strerror(errno));
+        return nullptr;
+    }
+
+    // threads keep the reactor alive, in case the last reference to it is
+    // dropped from one of them
+    std::lock_guard<std::mutex> _l(reactor->mMutex);
+    reactor->mThreads.emplace_back([reactor] { reactor->pollLoop(); });
+    for (size_t i = 0; i < workerThreads; i++) {
+        reactor->mThreads.emplace_back([reactor] { reactor->workerLoop(); });
+    }
+    return reactor;
+}
+
+void RpcReactor::add(sp<RpcSession>&& session, RpcSession::PreJoinSetupResult&& setupResult) {
+    sp<RpcSession::RpcConnection>& connection = setupResult.connection;
+
+    if (setupResult.status != OK) {
+        ALOGE("Connection failed to init, closing with status %s",
+              statusToString(setupResult.status).c_str());
+        removeConnection(std::move(session), connection);
+        return;
+    }
+    LOG_ALWAYS_FATAL_IF(!connection, "must have connection if setup succeeded");
+
+    {
+        // the connection is only assigned to a thread while it is processed
+        std::lock_guard<std::mutex> _l(session->mMutex);
+        connection->exclusiveTid = std::nullopt;
+    }
+
+    {
+        std::unique_lock<std::mutex> _l(mMutex);
+        // e.g. the session already ended while this connection was set up
+        if (mShutdown) {
+            _l.unlock();
+            removeConnection(std::move(session), connection);
+            return;
+        }
+        mConnections[connection] = Entry{.session = std::move(session)};
+    }
+    wake();
+}
+
+void RpcReactor::shutdown() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        mShutdown = true;
+        threads = std::move(mThreads);
+    }
+    mReadyCv.notify_all();
+    wake();
+
+    for (std::thread& thread : threads) {
+        // e.g. the server is destroyed by a worker, which dropped the last
+        // reference to it. This thread exits once it returns to its loop.
+        if (thread.get_id() == std::this_thread::get_id()) {
+            thread.detach();
+        } else {
+            thread.join();
+        }
+    }
+
+    std::lock_guard<std::mutex> _l(mMutex);
+    if (!mConnections.empty()) {
+        ALOGE("RpcReactor shut down with %zu connections left", mConnections.size());
+    }
+}
+
+size_t RpcReactor::numConnections() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    return mConnections.size();
+}
+
+void RpcReactor::wake() {
+    char c = 0;
+    // if the pipe is full, the poller is going to wake up anyway
+    (void)TEMP_FAILURE_RETRY(write(mWakeWrite.get(), &c, sizeof(c)));
+}
+
+void RpcReactor::pollLoop() {
+    std::vector<pollfd> pfds;
+    std::vector<sp<RpcSession::RpcConnection>> polled;
+
+    while (true) {
+        pfds.clear();
+        polled.clear();
+        pfds.push_back({.fd = mWakeRead.get(), .events = POLLIN, .revents = 0});
+        {
+            std::lock_guard<std::mutex> _l(mMutex);
+            if (mShutdown) return;
+
+            // for each connection, its socket, and the shutdown trigger of
+            // its session
+            for (const auto& [connection, entry] : mConnections) {
+                if (entry.busy) continue;
+                polled.push_back(connection);
+                pfds.push_back({.fd = connection->rpcTransport->pollFd().get(),
+                                .events = POLLIN,
+                                .revents = 0});
+                pfds.push_back({.fd = entry.session->mShutdownTrigger->readFd().get(),
+                                .events = 0,
+                                .revents = 0});
+            }
+        }
+
+        int ret = TEMP_FAILURE_RETRY(poll(pfds.data(), pfds.size(), -1));
+        if (ret < 0) {
+            ALOGE("RpcReactor poll on %zu connections failed: %s", polled.size(),
+                  strerror(errno));
+            usleep(10000);
+            continue;
+        }
+
+        if (pfds[0].revents != 0) {
+            char buf[16];
+            while (TEMP_FAILURE_RETRY(read(mWakeRead.get(), buf, sizeof(buf))) > 0) {
+            }
+        }
+
+        size_t numReady = 0;
+        {
+            std::lock_guard<std::mutex> _l(mMutex);
+            for (size_t i = 0; i < polled.size(); i++) {
+                if (pfds[1 + 2 * i].revents == 0 && pfds[2 + 2 * i].revents == 0) continue;
+
+                // Hangups and shutdown are handled by the worker too, since
+                // reading then fails.
+                auto it = mConnections.find(polled[i]);
+                LOG_ALWAYS_FATAL_IF(it == mConnections.end(), "Polled connection was removed");
+                it->second.busy = true;
+                mReady.push_back(polled[i]);
+                numReady++;
+            }
+        }
+        for (size_t i = 0; i < numReady; i++) {
+            mReadyCv.notify_one();
+        }
+    }
+}
+
+void RpcReactor::workerLoop() {
+    std::unique_lock<std::mutex> _l(mMutex);
+    while (true) {
+        mReadyCv.wait(_l, [&] { return mShutdown || !mReady.empty(); });
+        if (mShutdown) return;
+
+        sp<RpcSession::RpcConnection> connection = std::move(mReady.front());
+        mReady.pop_front();
+        auto it = mConnections.find(connection);
+        LOG_ALWAYS_FATAL_IF(it == mConnections.end(), "Ready connection was removed");
+        sp<RpcSession> session = it->second.session;
+        _l.unlock();
+
+        bool keep = process(session, connection);
+
+        _l.lock();
+        it = mConnections.find(connection);
+        LOG_ALWAYS_FATAL_IF(it == mConnections.end(), "Processed connection was removed");
+        if (keep) {
+            it->second.busy = false;
+            wake();
+            continue;
+        }
+        mConnections.erase(it);
+
+        _l.unlock();
+        removeConnection(std::move(session), connection);
+        connection = nullptr;
+        _l.lock();
+    }
+}
+
+bool RpcReactor::process(const sp<RpcSession>& session,
+                         const sp<RpcSession::RpcConnection>& connection) {
+    {
+        // so that nested calls made while processing use this connection
+        std::lock_guard<std::mutex> _l(session->mMutex);
+        connection->exclusiveTid = gettid();
+    }
+
+    // keep processing while there is more to read, which might be buffered
+    // by the transport where the poller can't see it
+    status_t status;
+    do {
+        status = session->state()->getAndExecuteCommand(connection, session,
+                                                        RpcState::CommandType::ANY);
+        if (status != OK) break;
+        status = connection->rpcTransport->waitForRead(session->mShutdownTrigger.get(),
+                                                       std::chrono::milliseconds(0));
+    } while (status == OK);
+
+    {
+        std::lock_guard<std::mutex> _l(session->mMutex);
+        connection->exclusiveTid = std::nullopt;
+    }
+
+    if (status == TIMED_OUT) return true;
+
+    LOG_RPC_DETAIL("Binder connection closing w/ status %s", statusToString(status).c_str());
+    return false;
+}
+
+void RpcReactor::removeConnection(sp<RpcSession>&& session,
+                                  const sp<RpcSession::RpcConnection>& connection) {
+    // same as the end of RpcSession::join
+    sp<RpcSession::EventListener> listener;
+    {
+        std::lock_guard<std::mutex> _l(session->mMutex);
+        listener = session->mEventListener.promote();
+    }
+
+    if (connection != nullptr) {
+        LOG_ALWAYS_FATAL_IF(!session->removeIncomingConnection(connection),
+                            "bad state: connection object guaranteed to be in list");
+    }
+
+    session = nullptr;
+
+    if (listener != nullptr) {
+        listener->onSessionIncomingThreadEnded();
+    }
+}
+
+} // namespace android
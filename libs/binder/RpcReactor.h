@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <binder/RpcSession.h>
+#include <utils/Errors.h>
+
+namespace android {
+
+/**
+ * Serves incoming connections with a fixed set of threads, instead of a
+ * thread per connection (see RpcServer::setReactorWorkerThreads).
+ *
+ * One thread polls all connections which are idle, and queues those with a
+ * command to read for a pool of worker threads. A worker owns the connection
+ * (like a joined thread would) until there is nothing left to read, and only
+ * then is it polled again. So, each connection is used by at most one thread
+ * at a time, and nested calls work as usual.
+ */
+class RpcReactor {
+public:
+    /** Returns nullptr for error case */
+    static std::shared_ptr<RpcReactor> make(size_t workerThreads);
+
+    /**
+     * Takes over an incoming connection after RpcSession::preJoinSetup, in
+     * place of RpcSession::join.
+     */
+    void add(sp<RpcSession>&& session, RpcSession::PreJoinSetupResult&& setupResult);
+
+    /**
+     * Stops and joins all threads. All sessions should be shut down before, so
+     * that no connections are left.
+     */
+    void shutdown();
+
+    size_t numConnections();
+
+private:
+    struct Entry {
+        sp<RpcSession> session;
+        // being processed by a worker, so not polled
+        bool busy = false;
+    };
+    using ConnectionMap = std::map<sp<RpcSession::RpcConnection>, Entry>;
+
+    void pollLoop();
+    void workerLoop();
+    void wake();
+    // returns whether the connection should be polled again
+    bool process(const sp<RpcSession>& session,
+                 const sp<RpcSession::RpcConnection>& connection);
+    static void removeConnection(sp<RpcSession>&& session,
+                                 const sp<RpcSession::RpcConnection>& connection);
+
+    // written to when there are new connections for the poller
+    base::unique_fd mWakeRead;
+    base::unique_fd mWakeWrite;
+
+    std::mutex mMutex; // for below
+    std::condition_variable mReadyCv;
+    bool mShutdown = false;
+    ConnectionMap mConnections;
+    // connections with data to read, which are waiting for a worker
+    std::deque<sp<RpcSession::RpcConnection>> mReady;
+    std::vector<std::thread> mThreads;
+};
+
+} // namespace android
@@ -21,11 +21,13 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <string>
 #include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/hex.h>
+#include <android-base/macros.h>
 #include <android-base/scopeguard.h>
 #include <binder/Parcel.h>
 #include <binder/RpcServer.h>
@@ -33,6 +35,7 @@
 #include <log/log.h>
 
 #include "FdTrigger.h"
+#include "RpcReactor.h"
 #include "RpcSocketAddress.h"
 #include "RpcState.h"
 #include "RpcWireFormat.h"
@@ -44,6 +47,44 @@ constexpr size_t kSessionIdBytes = 32;
 using base::ScopeGuard;
 using base::unique_fd;
 
+// see setMaxSessionsPerPeer, or nullopt if the peer can't be told apart from
+// others
+static std::optional<std::string> peerOf(int fd, const sockaddr_storage& addr) {
+    switch (addr.ss_family) {
+        case AF_UNIX: {
+#ifdef SO_PEERCRED
+            ucred cred;
+            socklen_t len = sizeof(cred);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+                return "pid " + std::to_string(cred.pid);
+            }
+#else
+            (void)fd;
+#endif
+            return std::nullopt;
+        }
+        case AF_RPMSG: {
+            const auto& rpmsg = reinterpret_cast<const sockaddr_rpmsg&>(addr);
+            return "cpu " + std::string(rpmsg.rp_cpu, strnlen(rpmsg.rp_cpu, sizeof(rpmsg.rp_cpu)));
+        }
+        case AF_VSOCK:
+            return "cid " + std::to_string(reinterpret_cast<const sockaddr_vm&>(addr).svm_cid);
+        case AF_INET: {
+            char ip[INET_ADDRSTRLEN] = {};
+            inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(addr).sin_addr, ip,
+                      sizeof(ip));
+            return std::string("inet ") + ip;
+        }
+        case AF_INET6: {
+            char ip[INET6_ADDRSTRLEN] = {};
+            inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr, ip,
+                      sizeof(ip));
+            return std::string("inet6 ") + ip;
+        }
+    }
+    return std::nullopt;
+}
+
 RpcServer::RpcServer(std::unique_ptr<RpcTransportCtx> ctx) : mCtx(std::move(ctx)) {}
 RpcServer::~RpcServer() {
     (void)shutdown();
@@ -125,6 +166,53 @@ size_t RpcServer::getMaxThreads() {
     return mMaxThreads;
 }
 
+void RpcServer::setReactorWorkerThreads(size_t workerThreads) {
+    LOG_ALWAYS_FATAL_IF(mJoinThreadRunning, "Cannot set reactor threads while running");
+    mReactorWorkerThreads = workerThreads;
+}
+
+size_t RpcServer::getReactorWorkerThreads() {
+    return mReactorWorkerThreads;
+}
+
+void RpcServer::setMaxSessionsPerPeer(size_t sessions) {
+    LOG_ALWAYS_FATAL_IF(mJoinThreadRunning, "Cannot set max sessions per peer while running");
+    mMaxSessionsPerPeer = sessions;
+}
+
+size_t RpcServer::getMaxSessionsPerPeer() {
+    return mMaxSessionsPerPeer;
+}
+
+void RpcServer::setMaxConnectionsPerSession(size_t connections) {
+    LOG_ALWAYS_FATAL_IF(mJoinThreadRunning, "Cannot set max connections per session while running");
+    mMaxConnectionsPerSession = connections;
+}
+
+size_t RpcServer::getMaxConnectionsPerSession() {
+    return mMaxConnectionsPerSession;
+}
+
+void RpcServer::setMaxQueuedOnewayBytesPerSession(size_t bytes) {
+    LOG_ALWAYS_FATAL_IF(mJoinThreadRunning, "Cannot set max queued oneway bytes while running");
+    mMaxQueuedOnewayBytesPerSession = bytes;
+}
+
+size_t RpcServer::getMaxQueuedOnewayBytesPerSession() {
+    return mMaxQueuedOnewayBytesPerSession;
+}
+
+void RpcServer::setPriorityInheritance(bool enabled, int maxRealtimePriority) {
+    LOG_ALWAYS_FATAL_IF(mJoinThreadRunning, "Cannot set priority inheritance while running");
+    mPriorityInheritance = enabled;
+    mMaxCallerRealtimePriority = maxRealtimePriority;
+}
+
+RpcServer::AdmissionStats RpcServer::getAdmissionStats() {
+    std::lock_guard<std::mutex> _l(mLock);
+    return mAdmissionStats;
+}
+
 void RpcServer::setProtocolVersion(uint32_t version) {
     mProtocolVersion = version;
 }
@@ -181,6 +269,10 @@ void RpcServer::join() {
         mJoinThreadRunning = true;
         mShutdownTrigger = FdTrigger::make();
         LOG_ALWAYS_FATAL_IF(mShutdownTrigger == nullptr, "Cannot create join signaler");
+        if (mReactorWorkerThreads > 0) {
+            mReactor = RpcReactor::make(mReactorWorkerThreads);
+            LOG_ALWAYS_FATAL_IF(mReactor == nullptr, "Cannot create reactor");
+        }
     }
 
     status_t status;
@@ -242,6 +334,15 @@ bool RpcServer::shutdown() {
         }
     }
 
+    // All sessions ended, so the reactor has no more connections. Its threads
+    // don't need this lock to finish.
+    if (mReactor != nullptr) {
+        std::shared_ptr<RpcReactor> reactor = std::move(mReactor);
+        _l.unlock();
+        reactor->shutdown();
+        _l.lock();
+    }
+
     // At this point, we know join() is about to exit, but the thread that calls
     // join() may not have exited yet.
     // If RpcServer owns the join thread (aka start() is called), make sure the thread exits;
@@ -284,6 +385,7 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
     status_t status = OK;
 
     int clientFdForLog = clientFd.get();
+    std::optional<std::string> peer = peerOf(clientFd.get(), addr);
     auto client = server->mCtx->newTransport(std::move(clientFd), server->mShutdownTrigger.get());
     if (client == nullptr) {
         ALOGE("Dropping accept4()-ed socket because sslAccept fails");
@@ -328,16 +430,70 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
     bool incoming = false;
     uint32_t protocolVersion = 0;
     bool requestingNewSession = false;
+    bool multiplexed = false;
+    bool fastConnect = false;
+    bool priority = false;
+    bool decStrongBatch = false;
+    bool replyBinders = false;
+    // RPC_NEW_SESSION_RESPONSE_* for the options which were accepted
+    uint8_t responseFlags = 0;
+    bool throttled = false;
+    // counted in mPeerSessions, but not yet in mSessionPeers
+    bool peerReserved = false;
+    // counted in mJoiningConnections
+    bool connectionReserved = false;
 
     if (status == OK) {
         incoming = header.options & RPC_CONNECTION_OPTION_INCOMING;
         protocolVersion = std::min(header.version,
                                    server->mProtocolVersion.value_or(RPC_WIRE_PROTOCOL_VERSION));
         requestingNewSession = sessionId.empty();
+        multiplexed = requestingNewSession && !incoming &&
+                (header.options & RPC_CONNECTION_OPTION_MULTIPLEXED) &&
+                server->mCtx->supportsConcurrentReadWrite();
+        fastConnect = requestingNewSession && !incoming &&
+                (header.options & RPC_CONNECTION_OPTION_FAST_CONNECT);
+        // both sides must opt in
+        priority = requestingNewSession && !incoming &&
+                (header.options & RPC_CONNECTION_OPTION_PRIORITY) && server->mPriorityInheritance;
+        decStrongBatch = requestingNewSession && !incoming &&
+                (header.options & RPC_CONNECTION_OPTION_DEC_STRONG_BATCH);
+        replyBinders = requestingNewSession && !incoming &&
+                (header.options & RPC_CONNECTION_OPTION_REPLY_BINDERS);
+        if (priority) responseFlags |= RPC_NEW_SESSION_RESPONSE_PRIORITY;
+        if (decStrongBatch) responseFlags |= RPC_NEW_SESSION_RESPONSE_DEC_STRONG_BATCH;
+        if (multiplexed) responseFlags |= RPC_NEW_SESSION_RESPONSE_MULTIPLEXED;
+        if (replyBinders) responseFlags |= RPC_NEW_SESSION_RESPONSE_REPLY_BINDERS;
+
+        // a session of a peer which can't be identified is only limited by
+        // the limits per session, rather than sharing a limit with all others
+        if (requestingNewSession && !incoming && peer.has_value()) {
+            std::lock_guard<std::mutex> _l(server->mLock);
+            size_t& peerSessions = server->mPeerSessions[*peer];
+            if (server->mMaxSessionsPerPeer != 0 && peerSessions >= server->mMaxSessionsPerPeer) {
+                ALOGE("Refusing new session from %s, which already has %zu", peer->c_str(),
+                      peerSessions);
+                server->mAdmissionStats.rejectedSessions++;
+                throttled = true;
+            } else {
+                peerSessions++;
+                peerReserved = true;
+            }
+        }
 
-        if (requestingNewSession) {
+        if (throttled) {
             RpcNewSessionResponse response{
                     .version = protocolVersion,
+                    .flags = RPC_NEW_SESSION_RESPONSE_THROTTLED,
+            };
+            iovec iov{&response, sizeof(response)};
+            (void)client->interruptableWriteFully(server->mShutdownTrigger.get(), &iov, 1, {});
+            status = WOULD_BLOCK;
+        } else if (requestingNewSession && !fastConnect) {
+            // with fast connect, this is sent once the session exists, see below
+            RpcNewSessionResponse response{
+                    .version = protocolVersion,
+                    .flags = responseFlags,
             };
 
             iovec iov{&response, sizeof(response)};
@@ -351,6 +507,7 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
 
     std::thread thisThread;
     sp<RpcSession> session;
+    std::shared_ptr<RpcReactor> reactor;
     {
         std::unique_lock<std::mutex> _l(server->mLock);
 
@@ -364,6 +521,9 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
             server->mShutdownCv.notify_all();
         };
         server->mConnectingThreads.erase(threadId);
+        ScopeGuard peerGuard = [&]() {
+            if (peerReserved) server->releasePeerLocked(*peer);
+        };
 
         if (status != OK || server->mShutdownTrigger->isTriggered()) {
             return;
@@ -398,6 +558,12 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
 
             session = RpcSession::make();
             session->setMaxIncomingThreads(server->mMaxThreads);
+            session->mMaxQueuedOnewayBytes = server->mMaxQueuedOnewayBytesPerSession;
+            session->mPriorityInheritance = priority;
+            session->mDecStrongBatch = decStrongBatch;
+            session->mReplyRequestIds = multiplexed;
+            session->mReplyBinderPositions = replyBinders;
+            session->mMaxCallerRealtimePriority = server->mMaxCallerRealtimePriority;
             if (!session->setProtocolVersion(protocolVersion)) return;
 
             // if null, falls back to server root
@@ -421,6 +587,8 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
             }
 
             server->mSessions[sessionId] = session;
+            if (peerReserved) server->mSessionPeers[sessionId] = *peer;
+            peerReserved = false;
         } else {
             auto it = server->mSessions.find(sessionId);
             if (it == server->mSessions.end()) {
@@ -429,26 +597,127 @@ void RpcServer::establishConnection(sp<RpcServer>&& server, base::unique_fd clie
                 return;
             }
             session = it->second;
+
+            if (server->mMaxConnectionsPerSession != 0) {
+                std::lock_guard<std::mutex> _sl(session->mMutex);
+                size_t connections = session->mConnections.mIncoming.size() +
+                        session->mConnections.mOutgoing.size();
+                if (auto joining = server->mJoiningConnections.find(sessionId);
+                    joining != server->mJoiningConnections.end()) {
+                    connections += joining->second;
+                }
+                if (connections >= server->mMaxConnectionsPerSession) {
+                    ALOGE("Refusing connection from %s, session %s already has %zu",
+                          peer.value_or("unidentified peer").c_str(),
+                          base::HexString(sessionId.data(), sessionId.size()).c_str(),
+                          connections);
+                    server->mAdmissionStats.rejectedConnections++;
+                    return;
+                }
+            }
         }
 
         if (incoming) {
-            LOG_ALWAYS_FATAL_IF(OK != session->addOutgoingConnection(std::move(client), true),
+            // the client started a thread on demand, which this side stops
+            // again once the connection isn't used for a while
+            std::chrono::milliseconds idleTimeout(0);
+            if (header.options & RPC_CONNECTION_OPTION_ON_DEMAND) {
+                idleTimeout = std::chrono::milliseconds(header.idleTimeoutMs);
+            }
+            // added with mLock held, so it is counted before any other
+            // connection is checked against setMaxConnectionsPerSession
+            LOG_ALWAYS_FATAL_IF(OK !=
+                                        session->addOutgoingConnection(std::move(client), true,
+                                                                       idleTimeout),
                                 "server state must already be initialized");
             return;
         }
 
-        detachGuard.Disable();
-        session->preJoinThreadOwnership(std::move(thisThread));
+        // preJoinSetup adds this connection to the session without mLock, so
+        // until then, it is counted here instead
+        if (server->mMaxConnectionsPerSession != 0) {
+            server->mJoiningConnections[sessionId]++;
+            connectionReserved = true;
+        }
+
+        // Multiplexed connections are read by a single thread anyway, which
+        // hands calls to workers of its own.
+        if (server->mReactor != nullptr && !multiplexed) {
+            // This thread ends after setup, so it isn't owned by the session.
+            reactor = server->mReactor;
+        } else {
+            detachGuard.Disable();
+            session->preJoinThreadOwnership(std::move(thisThread));
+        }
+    }
+
+    status_t fastConnectStatus = OK;
+    if (fastConnect) {
+        fastConnectStatus = sendFastConnectResponse(server, session, client.get(),
+                                                    protocolVersion, responseFlags);
     }
 
-    auto setupResult = session->preJoinSetup(std::move(client));
+    auto setupResult = session->preJoinSetup(std::move(client), multiplexed);
+    if (setupResult.status == OK) setupResult.status = fastConnectStatus;
+
+    if (connectionReserved) {
+        std::lock_guard<std::mutex> _l(server->mLock);
+        auto joining = server->mJoiningConnections.find(sessionId);
+        LOG_ALWAYS_FATAL_IF(joining == server->mJoiningConnections.end() || joining->second == 0,
+                            "Bad state, no joining connections counted");
+        if (--joining->second == 0) server->mJoiningConnections.erase(joining);
+    }
 
     // avoid strong cycle
     server = nullptr;
 
+    if (reactor != nullptr) {
+        reactor->add(std::move(session), std::move(setupResult));
+        return;
+    }
+
     RpcSession::join(std::move(session), std::move(setupResult));
 }
 
+status_t RpcServer::sendFastConnectResponse(const sp<RpcServer>& server,
+                                            const sp<RpcSession>& session, RpcTransport* client,
+                                            uint32_t protocolVersion, uint8_t flags) {
+    RpcNewSessionResponse response{
+            .version = protocolVersion,
+            .flags = static_cast<uint8_t>(RPC_NEW_SESSION_RESPONSE_FAST_CONNECT | flags),
+    };
+    RpcFastConnectInfo info{
+            .maxThreads = static_cast<uint32_t>(session->getMaxIncomingThreads()),
+            .sessionIdSize = static_cast<uint16_t>(session->mId.size()),
+            .rootObject = RpcWireAddress::fromRaw(0),
+    };
+
+    // same as RPC_SPECIAL_TRANSACT_GET_ROOT, so the client doesn't need to ask
+    sp<IBinder> root = session->mSessionSpecificRootObject ?: server->getRootObject();
+    if (root != nullptr) {
+        uint64_t address;
+        if (status_t status = session->state()->onBinderLeaving(session, root, &address);
+            status != OK) {
+            ALOGE("Failed to send root object with fast connect: %s",
+                  statusToString(status).c_str());
+            return status;
+        }
+        info.rootObject = RpcWireAddress::fromRaw(address);
+    }
+
+    iovec iovs[]{
+            {&response, sizeof(response)},
+            {&info, sizeof(info)},
+            {session->mId.data(), session->mId.size()},
+    };
+    status_t status = client->interruptableWriteFully(server->mShutdownTrigger.get(), iovs,
+                                                      arraysize(iovs), {});
+    if (status != OK) {
+        ALOGE("Failed to send new session response: %s", statusToString(status).c_str());
+    }
+    return status;
+}
+
 status_t RpcServer::setupSocketServer(const RpcSocketAddress& addr) {
     LOG_RPC_DETAIL("Setting up socket server %s", addr.toString().c_str());
     LOG_ALWAYS_FATAL_IF(hasServer(), "Each RpcServer can only have one server.");
@@ -499,12 +768,29 @@ void RpcServer::onSessionAllIncomingThreadsEnded(const sp<RpcSession>& session)
     LOG_ALWAYS_FATAL_IF(it->second != session, "Bad state, session has id mismatch %s",
                         base::HexString(id.data(), id.size()).c_str());
     (void)mSessions.erase(it);
+
+    if (auto peer = mSessionPeers.find(id); peer != mSessionPeers.end()) {
+        releasePeerLocked(peer->second);
+        mSessionPeers.erase(peer);
+    }
 }
 
 void RpcServer::onSessionIncomingThreadEnded() {
     mShutdownCv.notify_all();
 }
 
+void RpcServer::onSessionOnewayThrottled() {
+    std::lock_guard<std::mutex> _l(mLock);
+    mAdmissionStats.throttledSessions++;
+}
+
+void RpcServer::releasePeerLocked(const std::string& peer) {
+    auto it = mPeerSessions.find(peer);
+    LOG_ALWAYS_FATAL_IF(it == mPeerSessions.end() || it->second == 0,
+                        "Bad state, no sessions counted for %s", peer.c_str());
+    if (--it->second == 0) mPeerSessions.erase(it);
+}
+
 bool RpcServer::hasServer() {
     std::lock_guard<std::mutex> _l(mLock);
     return mServer.ok();
@@ -24,11 +24,15 @@
 #include <pthread.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <limits>
 #include <string_view>
+#include <thread>
 
 #include <android-base/hex.h>
 #include <android-base/macros.h>
 #include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
 #include <binder/BpBinder.h>
 #include <binder/Parcel.h>
 #include <binder/ProcessState.h>
@@ -38,6 +42,7 @@
 #include <utils/String8.h>
 
 #include "FdTrigger.h"
+#include "RpcPriority.h"
 #include "RpcSocketAddress.h"
 #include "RpcState.h"
 #include "RpcWireFormat.h"
@@ -64,6 +69,8 @@ RpcSession::RpcSession(std::unique_ptr<RpcTransportCtx> ctx) : mCtx(std::move(ct
 RpcSession::~RpcSession() {
     LOG_RPC_DETAIL("RpcSession destroyed %p", this);
 
+    stopWorker(true /*join*/);
+
     std::lock_guard<std::mutex> _l(mMutex);
     LOG_ALWAYS_FATAL_IF(mConnections.mIncoming.size() != 0,
                         "Should not be able to destroy a session with servers in use.");
@@ -108,6 +115,265 @@ size_t RpcSession::getMaxOutgoingThreads() {
     return mMaxOutgoingThreads;
 }
 
+void RpcSession::setMaxPendingDecStrongs(size_t count, std::chrono::milliseconds maxDelay) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set max pending dec strongs before setting up connections, but has "
+                        "%zu client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    mMaxPendingDecStrongs = count;
+    mDecStrongFlushDelay = maxDelay;
+}
+
+size_t RpcSession::getMaxPendingDecStrongs() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    return mMaxPendingDecStrongs;
+}
+
+void RpcSession::setMaxPendingOnewayBytes(size_t maxBytes, std::chrono::milliseconds maxDelay) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set max pending oneway bytes before setting up connections, but has "
+                        "%zu client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    mMaxPendingOnewayBytes = maxBytes;
+    mOnewayFlushDelay = maxDelay;
+}
+
+size_t RpcSession::getMaxPendingOnewayBytes() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    return mMaxPendingOnewayBytes;
+}
+
+RpcSession::OnewayBatchStats RpcSession::getOnewayBatchStats() {
+    return state()->getOnewayBatchStats();
+}
+
+RpcSession::BufferPoolStats RpcSession::getBufferPoolStats() {
+    return state()->getBufferPoolStats();
+}
+
+RpcSession::TransactionStats RpcSession::getTransactionStats() {
+    return state()->getTransactionStats();
+}
+
+void RpcSession::setIncomingThreadsOnDemand(size_t minThreads,
+                                            std::chrono::milliseconds idleTimeout) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set incoming threads on demand before setting up connections, but "
+                        "has %zu client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    // otherwise, the server can't make any calls, which would start more
+    mMinIncomingThreads = std::max<size_t>(minThreads, 1);
+    mIncomingIdleTimeout = idleTimeout;
+}
+
+RpcSession::IncomingThreadStats RpcSession::getIncomingThreadStats() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    IncomingThreadStats stats = mIncomingThreadStats;
+    stats.threads = mConnections.mIncoming.size();
+    return stats;
+}
+
+bool RpcSession::beginIncomingCall(const sp<RpcConnection>& connection) {
+    if (!mConnectOnDemand) return false;
+
+    std::lock_guard<std::mutex> _l(mMutex);
+    // e.g. a nested call on an outgoing connection, which needs no thread
+    if (std::find(mConnections.mIncoming.begin(), mConnections.mIncoming.end(), connection) ==
+        mConnections.mIncoming.end()) {
+        return false;
+    }
+
+    // a nested call on a connection which is already busy
+    if (connection->incomingCalls++ > 0) return true;
+
+    mBusyIncoming++;
+    mIncomingThreadStats.maxBusy = std::max(mIncomingThreadStats.maxBusy, mBusyIncoming);
+
+    size_t threads = mConnections.mIncoming.size() + mStartingIncoming;
+    if (mBusyIncoming < threads || threads >= mMaxIncomingThreads) return true;
+    if (mShutdownTrigger->isTriggered()) return true;
+
+    // all threads are busy, so the next call from the server would have to
+    // wait for one
+    std::lock_guard<std::mutex> _lw(mWorker->mutex);
+    if (!startWorkerLocked()) return true;
+    mStartingIncoming++;
+    mWorker->connects++;
+    mWorker->cv.notify_one();
+    return true;
+}
+
+void RpcSession::endIncomingCall(const sp<RpcConnection>& connection) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    if (--connection->incomingCalls == 0) mBusyIncoming--;
+}
+
+void RpcSession::connectIncomingOnDemand() {
+    status_t status = mConnectOnDemand();
+
+    std::lock_guard<std::mutex> _l(mMutex);
+    mStartingIncoming--;
+    if (status != OK) {
+        ALOGE("Could not start incoming thread on demand: %s", statusToString(status).c_str());
+        return;
+    }
+    mIncomingThreadStats.started++;
+}
+
+bool RpcSession::onDemandConnectionClosed(const sp<RpcConnection>& connection) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    if (!mConnectOnDemand ||
+        std::find(mConnections.mIncoming.begin(), mConnections.mIncoming.end(), connection) ==
+                mConnections.mIncoming.end()) {
+        return false;
+    }
+
+    // this doesn't mean that the session is shutting down, so new connections
+    // are still accepted (see assignIncomingConnectionToThisThread)
+    mConnections.mMaxIncoming--;
+    mIncomingThreadStats.stopped++;
+    return true;
+}
+
+void RpcSession::scheduleIdleConnectionReaping() {
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> _l(mWorker->mutex);
+    if (mWorker->reapTime.has_value() && *mWorker->reapTime <= now) return;
+    if (!startWorkerLocked()) return;
+    mWorker->reapTime = now;
+    mWorker->cv.notify_one();
+}
+
+std::optional<std::chrono::steady_clock::time_point> RpcSession::reapIdleConnections() {
+    sp<RpcSession> thiz = sp<RpcSession>::fromExisting(this);
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> next;
+        sp<RpcConnection> idle;
+        {
+            std::lock_guard<std::mutex> _l(mMutex);
+            if (mShutdownTrigger->isTriggered()) return std::nullopt;
+            for (const sp<RpcConnection>& connection : mConnections.mOutgoing) {
+                if (connection->idleTimeout.count() == 0) continue;
+
+                auto deadline = connection->exclusiveTid.has_value()
+                        ? now + connection->idleTimeout
+                        : connection->lastUsed + connection->idleTimeout;
+                if (deadline <= now && idle == nullptr) {
+                    // no other thread may use it from now on
+                    idle = connection;
+                    idle->exclusiveTid = gettid();
+                    continue;
+                }
+                next = next.has_value() ? std::min(*next, deadline) : deadline;
+            }
+            if (idle == nullptr) return next;
+        }
+
+        if (status_t status = state()->sendCloseConnection(idle, thiz); status != OK) {
+            LOG_RPC_DETAIL("Failed to close idle connection: %s", statusToString(status).c_str());
+        }
+        std::lock_guard<std::mutex> _l(mMutex);
+        auto& outgoing = mConnections.mOutgoing;
+        outgoing.erase(std::remove(outgoing.begin(), outgoing.end(), idle), outgoing.end());
+    }
+}
+
+std::optional<std::chrono::steady_clock::time_point>& RpcSession::callDeadline() {
+    thread_local std::optional<std::chrono::steady_clock::time_point> deadline;
+    return deadline;
+}
+
+RpcSession::ScopedCallTimeout::ScopedCallTimeout(std::chrono::milliseconds timeout)
+      : mPrevious(callDeadline()) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    if (mPrevious == std::nullopt || deadline < *mPrevious) callDeadline() = deadline;
+}
+
+RpcSession::ScopedCallTimeout::~ScopedCallTimeout() {
+    callDeadline() = mPrevious;
+}
+
+std::optional<std::chrono::milliseconds> RpcSession::getCallTimeRemaining() {
+    const auto& deadline = callDeadline();
+    if (deadline == std::nullopt) return std::nullopt;
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            *deadline - std::chrono::steady_clock::now());
+    return std::max(remaining, std::chrono::milliseconds(0));
+}
+
+std::string RpcSession::TransactionStats::toString() const {
+    using android::base::StringAppendF;
+
+    std::string ret;
+    for (const CodeStats& c : codes) {
+        if (c.code == kNumCodes) {
+            ret += "other:";
+        } else {
+            StringAppendF(&ret, "code %" PRIu32 ":", c.code);
+        }
+        StringAppendF(&ret, " sent %" PRIu64 " (avg %" PRIu64 "us) received %" PRIu64
+                      " (avg %" PRIu64 "us)\n",
+                      c.sent, c.sent ? c.sentUs / c.sent : 0, c.received,
+                      c.received ? c.receivedUs / c.received : 0);
+    }
+
+    auto appendHistogram = [&](const char* name, const Histogram& histogram) {
+        ret += name;
+        ret += ":";
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            if (histogram[i] == 0) continue;
+            uint64_t bucketStart = i == 0 ? 0 : uint64_t(1) << (i - 1);
+            StringAppendF(&ret, " %s%" PRIu64 ":%" PRIu64, i + 1 == kNumBuckets ? ">=" : "",
+                          bucketStart, histogram[i]);
+        }
+        ret += "\n";
+    };
+    appendHistogram("request bytes", requestBytes);
+    appendHistogram("reply bytes", replyBytes);
+    appendHistogram("send us", sendUs);
+    appendHistogram("wait us", waitUs);
+    appendHistogram("received bytes", receivedBytes);
+    appendHistogram("dispatch us", dispatchUs);
+    return ret;
+}
+
+void RpcSession::setMultiplexed(bool multiplexed) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set multiplexing before setting up connections, but has %zu "
+                        "client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    mUseMultiplexing = multiplexed;
+}
+
+bool RpcSession::isMultiplexed() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    return mUseMultiplexing;
+}
+
+void RpcSession::setPriorityInheritance(bool enabled) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set priority inheritance before setting up connections, but has "
+                        "%zu client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    mPriorityInheritance = enabled;
+}
+
+void RpcSession::setFastConnect(bool fastConnect) {
+    std::lock_guard<std::mutex> _l(mMutex);
+    LOG_ALWAYS_FATAL_IF(!mConnections.mOutgoing.empty() || !mConnections.mIncoming.empty(),
+                        "Must set fast connect before setting up connections, but has %zu "
+                        "client(s) and %zu server(s)",
+                        mConnections.mOutgoing.size(), mConnections.mIncoming.size());
+    mUseFastConnect = fastConnect;
+}
+
 bool RpcSession::setProtocolVersion(uint32_t version) {
     if (version >= RPC_WIRE_PROTOCOL_VERSION_NEXT &&
         version != RPC_WIRE_PROTOCOL_VERSION_EXPERIMENTAL) {
@@ -197,6 +463,29 @@ status_t RpcSession::addNullDebuggingClient() {
 }
 
 sp<IBinder> RpcSession::getRootObject() {
+    std::optional<uint64_t> fastConnectRoot;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        fastConnectRoot = std::exchange(mFastConnectRootObject, std::nullopt);
+    }
+    if (fastConnectRoot.has_value()) {
+        // the server already sent it with the first connection, as if it were
+        // the reply to RPC_SPECIAL_TRANSACT_GET_ROOT
+        sp<RpcSession> thiz = sp<RpcSession>::fromExisting(this);
+        sp<IBinder> root;
+        if (status_t status = state()->onBinderEntering(thiz, *fastConnectRoot, &root);
+            status != OK) {
+            ALOGE("Error getting root object: %s", statusToString(status).c_str());
+            return nullptr;
+        }
+        if (status_t status = state()->flushExcessBinderRefs(thiz, *fastConnectRoot, root);
+            status != OK) {
+            ALOGE("Error getting root object: %s", statusToString(status).c_str());
+            return nullptr;
+        }
+        return root;
+    }
+
     ExclusiveConnection connection;
     status_t status = ExclusiveConnection::find(sp<RpcSession>::fromExisting(this),
                                                 ConnectionUse::CLIENT, &connection);
@@ -212,7 +501,35 @@ status_t RpcSession::getRemoteMaxThreads(size_t* maxThreads) {
     return state()->getMaxThreads(connection.get(), sp<RpcSession>::fromExisting(this), maxThreads);
 }
 
+void RpcSession::releaseFastConnectRootObject() {
+    std::optional<uint64_t> address;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        address = std::exchange(mFastConnectRootObject, std::nullopt);
+        if (mShutdownTrigger == nullptr || mShutdownTrigger->isTriggered()) return;
+    }
+    if (!address.has_value()) return;
+
+    // The server holds a ref for the root object it sent with the first
+    // connection, as if it were the reply to a getRootObject call. Since that
+    // call never happened, drop it as if the result had been dropped.
+    sp<IBinder> root;
+    if (status_t status = state()->onBinderEntering(sp<RpcSession>::fromExisting(this), *address,
+                                                    &root);
+        status != OK) {
+        return;
+    }
+    status_t status = sendDecStrongToTarget(*address, 0);
+    // it may be queued, and there is no later call to send it with
+    if (status == OK) status = flushPending();
+    if (status != OK) {
+        ALOGE("Failed to release unused root object: %s", statusToString(status).c_str());
+    }
+}
+
 bool RpcSession::shutdownAndWait(bool wait) {
+    releaseFastConnectRootObject();
+
     std::unique_lock<std::mutex> _l(mMutex);
     LOG_ALWAYS_FATAL_IF(mShutdownTrigger == nullptr, "Shutdown trigger not installed");
 
@@ -227,6 +544,10 @@ bool RpcSession::shutdownAndWait(bool wait) {
 
     _l.unlock();
 
+    stopWorker(wait);
+    // it fails the calls in flight, now that the connection is shut down
+    if (wait) state()->joinAsyncReader();
+
     if (status_t res = state()->sendObituaries(sp<RpcSession>::fromExisting(this)); res != OK) {
         ALOGE("Failed to send obituaries as the RpcSession is shutting down: %s",
               statusToString(res).c_str());
@@ -239,6 +560,28 @@ bool RpcSession::shutdownAndWait(bool wait) {
 
 status_t RpcSession::transact(const sp<IBinder>& binder, uint32_t code, const Parcel& data,
                               Parcel* reply, uint32_t flags) {
+    if (flags & IBinder::FLAG_ONEWAY) {
+        size_t maxBytes;
+        std::chrono::milliseconds delay;
+        {
+            std::lock_guard<std::mutex> _l(mMutex);
+            maxBytes = mMaxPendingOnewayBytes;
+            delay = mOnewayFlushDelay;
+        }
+
+        if (data.dataSize() < maxBytes) {
+            bool needsFlush;
+            if (status_t status = state()->queueOneway(binder, code, data,
+                                                       sp<RpcSession>::fromExisting(this),
+                                                       maxBytes, &needsFlush);
+                status != OK)
+                return status;
+            if (needsFlush) return flushPending();
+            schedulePendingFlush(delay);
+            return OK;
+        }
+    }
+
     ExclusiveConnection connection;
     status_t status =
             ExclusiveConnection::find(sp<RpcSession>::fromExisting(this),
@@ -250,12 +593,63 @@ status_t RpcSession::transact(const sp<IBinder>& binder, uint32_t code, const Pa
                              sp<RpcSession>::fromExisting(this), reply, flags);
 }
 
+status_t RpcSession::transactAsync(const sp<IBinder>& binder, uint32_t code, const Parcel& data,
+                                   TransactCallback&& callback, uint32_t flags) {
+    if (flags & IBinder::FLAG_ONEWAY) {
+        ALOGE("Oneway calls have no reply, use transact instead");
+        return BAD_VALUE;
+    }
+
+    sp<RpcConnection> multiplexed;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        if (mForServer == nullptr) multiplexed = mConnections.mMultiplexed;
+    }
+    if (multiplexed == nullptr) {
+        ALOGE("Asynchronous calls need a multiplexed session, see setMultiplexed");
+        return INVALID_OPERATION;
+    }
+    return state()->transactAsync(multiplexed, binder, code, data,
+                                  sp<RpcSession>::fromExisting(this), std::move(callback), flags);
+}
+
+std::future<RpcSession::AsyncReply> RpcSession::transactFuture(const sp<IBinder>& binder,
+                                                              uint32_t code, const Parcel& data,
+                                                              uint32_t flags) {
+    auto promise = std::make_shared<std::promise<AsyncReply>>();
+    std::future<AsyncReply> future = promise->get_future();
+    status_t status = transactAsync(
+            binder, code, data,
+            [promise](AsyncReply reply) { promise->set_value(std::move(reply)); }, flags);
+    if (status != OK) promise->set_value(AsyncReply{.status = status});
+    return future;
+}
+
 status_t RpcSession::sendDecStrong(const BpBinder* binder) {
     // target is 0 because this is used to free BpBinder objects
     return sendDecStrongToTarget(binder->getPrivateAccessor().rpcAddress(), 0 /*target*/);
 }
 
 status_t RpcSession::sendDecStrongToTarget(uint64_t address, size_t target) {
+    size_t maxPending;
+    std::chrono::milliseconds delay;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        maxPending = mDecStrongBatch ? mMaxPendingDecStrongs : 0;
+        delay = mDecStrongFlushDelay;
+    }
+
+    if (maxPending > 0) {
+        bool needsFlush;
+        if (status_t status = state()->queueDecStrongToTarget(address, target, maxPending,
+                                                              &needsFlush);
+            status != OK)
+            return status;
+        if (needsFlush) return flushPending();
+        schedulePendingFlush(delay);
+        return OK;
+    }
+
     ExclusiveConnection connection;
     status_t status = ExclusiveConnection::find(sp<RpcSession>::fromExisting(this),
                                                 ConnectionUse::CLIENT_REFCOUNT, &connection);
@@ -264,6 +658,158 @@ status_t RpcSession::sendDecStrongToTarget(uint64_t address, size_t target) {
                                           address, target);
 }
 
+status_t RpcSession::flushPending() {
+    ExclusiveConnection connection;
+    status_t status = ExclusiveConnection::find(sp<RpcSession>::fromExisting(this),
+                                                ConnectionUse::CLIENT_REFCOUNT, &connection);
+    if (status != OK) return status;
+    return state()->flushPending(connection.get(), sp<RpcSession>::fromExisting(this));
+}
+
+void RpcSession::schedulePendingFlush(std::chrono::milliseconds delay) {
+    auto flushTime = std::chrono::steady_clock::now() + delay;
+
+    std::lock_guard<std::mutex> _l(mWorker->mutex);
+    // an earlier flush will send this too
+    if (mWorker->flushTime.has_value() && *mWorker->flushTime <= flushTime) return;
+    if (!startWorkerLocked()) return;
+    mWorker->flushTime = flushTime;
+    mWorker->cv.notify_one();
+}
+
+bool RpcSession::startWorkerLocked() {
+    if (mWorker->stopped) return false;
+    if (!mWorker->thread.joinable()) {
+        mWorker->thread = std::thread(runWorker, mWorker, wp<RpcSession>::fromExisting(this));
+    }
+    return true;
+}
+
+void RpcSession::stopWorker(bool join) {
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> _l(mWorker->mutex);
+        mWorker->stopped = true;
+        mWorker->flushTime.reset();
+        mWorker->reapTime.reset();
+        mWorker->connects = 0;
+        if (join) thread = std::move(mWorker->thread);
+    }
+    mWorker->cv.notify_all();
+
+    if (join) {
+        // they stop once the connection is shut down, and they stop counting
+        // before they drop their reference to this session
+        std::unique_lock<std::mutex> _l(mWorker->mutex);
+        mWorker->cv.wait(_l, [&] { return mWorker->drains == 0; });
+    }
+
+    if (!thread.joinable()) return;
+    // e.g. the worker dropped the last reference to this session
+    if (thread.get_id() == std::this_thread::get_id()) {
+        thread.detach();
+        return;
+    }
+    thread.join();
+}
+
+void RpcSession::drainStaleReplies(const sp<RpcConnection>& connection) {
+    {
+        std::lock_guard<std::mutex> _l(mWorker->mutex);
+        // the session is shutting down, so the connection won't be used again
+        if (mWorker->stopped) return;
+        mWorker->drains++;
+    }
+
+    auto drain = [](std::shared_ptr<Worker> worker, sp<RpcSession> session,
+                    sp<RpcConnection> connection) {
+        status_t status = session->state()->drainStaleReplies(connection, session);
+        if (status != OK) {
+            // the session is shut down already
+            LOG_RPC_DETAIL("Failed to read stale replies: %s", statusToString(status).c_str());
+        } else {
+            std::unique_lock<std::mutex> _l(session->mMutex);
+            connection->draining = false;
+            connection->lastUsed = std::chrono::steady_clock::now();
+            if (session->mConnections.mWaitingThreads > 0) {
+                _l.unlock();
+                session->mAvailableConnectionCv.notify_all();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> _l(worker->mutex);
+            worker->drains--;
+        }
+        worker->cv.notify_all();
+        // may be the last reference, see stopWorker
+        session = nullptr;
+    };
+    std::thread(drain, mWorker, sp<RpcSession>::fromExisting(this), connection).detach();
+}
+
+void RpcSession::runWorker(const std::shared_ptr<Worker>& worker,
+                           const wp<RpcSession>& weakSession) {
+    std::unique_lock<std::mutex> _l(worker->mutex);
+    while (!worker->stopped) {
+        auto now = std::chrono::steady_clock::now();
+        enum { CONNECT, FLUSH, REAP } task;
+        if (worker->connects > 0) {
+            worker->connects--;
+            task = CONNECT;
+        } else {
+            std::optional<std::chrono::steady_clock::time_point> next = worker->flushTime;
+            if (worker->reapTime.has_value() && (!next.has_value() || *worker->reapTime < *next)) {
+                next = worker->reapTime;
+            }
+            if (!next.has_value()) {
+                worker->cv.wait(_l);
+                continue;
+            }
+            if (*next > now) {
+                worker->cv.wait_until(_l, *next);
+                continue;
+            }
+            if (worker->flushTime.has_value() && *worker->flushTime <= now) {
+                worker->flushTime.reset();
+                task = FLUSH;
+            } else {
+                worker->reapTime.reset();
+                task = REAP;
+            }
+        }
+        _l.unlock();
+
+        // This may drop the last reference to the session, so only 'worker'
+        // is used afterwards.
+        std::optional<std::chrono::steady_clock::time_point> nextReapTime;
+        if (sp<RpcSession> session = weakSession.promote(); session != nullptr) {
+            switch (task) {
+                case CONNECT:
+                    session->connectIncomingOnDemand();
+                    break;
+                case FLUSH:
+                    // If the queue was already flushed with a transaction,
+                    // this does nothing.
+                    if (status_t status = session->flushPending(); status != OK) {
+                        LOG_RPC_DETAIL("Failed to flush pending commands: %s",
+                                       statusToString(status).c_str());
+                    }
+                    break;
+                case REAP:
+                    nextReapTime = session->reapIdleConnections();
+                    break;
+            }
+        }
+
+        _l.lock();
+        if (nextReapTime.has_value() && !worker->stopped &&
+            (!worker->reapTime.has_value() || *nextReapTime < *worker->reapTime)) {
+            worker->reapTime = nextReapTime;
+        }
+    }
+}
+
 status_t RpcSession::readId() {
     {
         std::lock_guard<std::mutex> _l(mMutex);
@@ -313,10 +859,11 @@ void RpcSession::preJoinThreadOwnership(std::thread thread) {
 }
 
 RpcSession::PreJoinSetupResult RpcSession::preJoinSetup(
-        std::unique_ptr<RpcTransport> rpcTransport) {
+        std::unique_ptr<RpcTransport> rpcTransport, bool multiplexed) {
     // must be registered to allow arbitrary client code executing commands to
     // be able to do nested calls (we can't only read from it)
-    sp<RpcConnection> connection = assignIncomingConnectionToThisThread(std::move(rpcTransport));
+    sp<RpcConnection> connection =
+            assignIncomingConnectionToThisThread(std::move(rpcTransport), multiplexed);
 
     status_t status;
 
@@ -407,6 +954,7 @@ void RpcSession::join(sp<RpcSession>&& session, PreJoinSetupResult&& setupResult
                 break;
             }
         }
+        if (connection->multiplexed) session->state()->joinMultiplexedWorkers();
     } else {
         ALOGE("Connection failed to init, closing with status %s",
               statusToString(setupResult.status).c_str());
@@ -446,7 +994,8 @@ sp<RpcServer> RpcSession::server() {
 }
 
 status_t RpcSession::setupClient(const std::function<status_t(const std::vector<uint8_t>& sessionId,
-                                                              bool incoming)>& connectAndInit) {
+                                                              bool incoming)>& connectAndInit,
+                                 bool concurrent) {
     {
         std::lock_guard<std::mutex> _l(mMutex);
         LOG_ALWAYS_FATAL_IF(mConnections.mOutgoing.size() != 0,
@@ -456,6 +1005,9 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
 
     if (auto status = initShutdownTrigger(); status != OK) return status;
 
+    // this object may be reused to connect to another server
+    mCtx->onNewSession();
+
     auto oldProtocolVersion = mProtocolVersion;
     auto cleanup = base::ScopeGuard([&] {
         // if any threads are started, shut them down
@@ -475,10 +1027,16 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
         mProtocolVersion = oldProtocolVersion;
 
         mConnections = {};
+        mConnectOnDemand = nullptr;
+        mDecStrongBatch = false;
+        mReplyRequestIds = false;
+        mReplyBinderPositions = false;
+        mFastConnectRootObject.reset();
     });
 
     if (status_t status = connectAndInit({}, false /*incoming*/); status != OK) return status;
 
+    std::optional<RpcState::FastConnectInfo> fastConnect;
     {
         ExclusiveConnection connection;
         if (status_t status = ExclusiveConnection::find(sp<RpcSession>::fromExisting(this),
@@ -487,27 +1045,57 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
             return status;
 
         uint32_t version;
+        uint8_t flags;
         if (status_t status =
                     state()->readNewSessionResponse(connection.get(),
-                                                    sp<RpcSession>::fromExisting(this), &version);
+                                                    sp<RpcSession>::fromExisting(this), &version,
+                                                    &fastConnect, &flags);
             status != OK)
             return status;
         if (!setProtocolVersion(version)) return BAD_VALUE;
+
+        // no other thread uses the session yet
+        bool priority = flags & RPC_NEW_SESSION_RESPONSE_PRIORITY;
+        ALOGI_IF(mUseMultiplexing && !mCtx->supportsConcurrentReadWrite(),
+                 "Transport doesn't allow concurrent reads and writes, not multiplexing");
+        ALOGI_IF(mPriorityInheritance && !priority,
+                 "Server doesn't run calls at the priority of their callers");
+        mPriorityInheritance = mPriorityInheritance && priority;
+
+        std::lock_guard<std::mutex> _l(mMutex);
+        mDecStrongBatch = flags & RPC_NEW_SESSION_RESPONSE_DEC_STRONG_BATCH;
+        mReplyRequestIds = mUseMultiplexing && mCtx->supportsConcurrentReadWrite() &&
+                (flags & RPC_NEW_SESSION_RESPONSE_MULTIPLEXED);
+        mReplyBinderPositions = flags & RPC_NEW_SESSION_RESPONSE_REPLY_BINDERS;
+        if (mReplyRequestIds) {
+            connection.get()->multiplexed = true;
+            mConnections.mMultiplexed = connection.get();
+        }
     }
 
     // TODO(b/189955605): we should add additional sessions dynamically
     // instead of all at once.
     size_t numThreadsAvailable;
-    if (status_t status = getRemoteMaxThreads(&numThreadsAvailable); status != OK) {
-        ALOGE("Could not get max threads after initial session setup: %s",
-              statusToString(status).c_str());
-        return status;
-    }
+    if (fastConnect.has_value()) {
+        numThreadsAvailable = fastConnect->maxThreads;
+        mId = std::move(fastConnect->sessionId);
+        LOG_RPC_DETAIL("RpcSession %p has id %s", this,
+                       base::HexString(mId.data(), mId.size()).c_str());
 
-    if (status_t status = readId(); status != OK) {
-        ALOGE("Could not get session id after initial session setup: %s",
-              statusToString(status).c_str());
-        return status;
+        std::lock_guard<std::mutex> _l(mMutex);
+        if (fastConnect->rootObject != 0) mFastConnectRootObject = fastConnect->rootObject;
+    } else {
+        if (status_t status = getRemoteMaxThreads(&numThreadsAvailable); status != OK) {
+            ALOGE("Could not get max threads after initial session setup: %s",
+                  statusToString(status).c_str());
+            return status;
+        }
+
+        if (status_t status = readId(); status != OK) {
+            ALOGE("Could not get session id after initial session setup: %s",
+                  statusToString(status).c_str());
+            return status;
+        }
     }
 
     size_t outgoingThreads = std::min(numThreadsAvailable, mMaxOutgoingThreads);
@@ -516,6 +1104,12 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
              "because it is preconfigured to start at most %zu outgoing threads.",
              numThreadsAvailable, outgoingThreads, mMaxOutgoingThreads);
 
+    {
+        // all calls share the connection we already have
+        std::lock_guard<std::mutex> _l(mMutex);
+        if (mConnections.mMultiplexed != nullptr) outgoingThreads = 1;
+    }
+
     // TODO(b/189955605): we should add additional sessions dynamically
     // instead of all at once - the other side should be responsible for setting
     // up additional connections. We need to create at least one (unless 0 are
@@ -526,12 +1120,40 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
     LOG_RPC_DETAIL("RpcSession::setupClient() instantiating %zu outgoing (server max: %zu) and %zu "
                    "incoming threads",
                    outgoingThreads, numThreadsAvailable, mMaxIncomingThreads);
-    for (size_t i = 0; i + 1 < outgoingThreads; i++) {
-        if (status_t status = connectAndInit(mId, false /*incoming*/); status != OK) return status;
-    }
+    // the rest is started by beginIncomingCall
+    size_t incomingThreads = mMaxIncomingThreads;
+    if (mConnectOnDemand) incomingThreads = std::min(incomingThreads, *mMinIncomingThreads);
+
+    if (concurrent && fastConnect.has_value()) {
+        // the server has already created the session, so none of these
+        // depend on each other
+        std::mutex statusMutex;
+        status_t firstError = OK;
+        std::vector<std::thread> threads;
+        auto connect = [&](bool incoming) {
+            status_t status = connectAndInit(mId, incoming);
+            if (status == OK) return;
+            std::lock_guard<std::mutex> _l(statusMutex);
+            if (firstError == OK) firstError = status;
+        };
+        for (size_t i = 0; i + 1 < outgoingThreads; i++) {
+            threads.emplace_back(connect, false /*incoming*/);
+        }
+        for (size_t i = 0; i < incomingThreads; i++) {
+            threads.emplace_back(connect, true /*incoming*/);
+        }
+        for (auto& thread : threads) thread.join();
+        if (firstError != OK) return firstError;
+    } else {
+        for (size_t i = 0; i + 1 < outgoingThreads; i++) {
+            if (status_t status = connectAndInit(mId, false /*incoming*/); status != OK)
+                return status;
+        }
 
-    for (size_t i = 0; i < mMaxIncomingThreads; i++) {
-        if (status_t status = connectAndInit(mId, true /*incoming*/); status != OK) return status;
+        for (size_t i = 0; i < incomingThreads; i++) {
+            if (status_t status = connectAndInit(mId, true /*incoming*/); status != OK)
+                return status;
+        }
     }
 
     cleanup.Disable();
@@ -540,14 +1162,22 @@ status_t RpcSession::setupClient(const std::function<status_t(const std::vector<
 }
 
 status_t RpcSession::setupSocketClient(const RpcSocketAddress& addr) {
-    return setupClient([&](const std::vector<uint8_t>& sessionId, bool incoming) {
-        return setupOneSocketConnection(addr, sessionId, incoming);
-    });
+    if (mMinIncomingThreads.has_value()) {
+        mConnectOnDemand = [this, addr = CopiedSocketAddress(addr)]() {
+            return setupOneSocketConnection(addr, mId, true /*incoming*/, true /*onDemand*/);
+        };
+    }
+
+    return setupClient(
+            [&](const std::vector<uint8_t>& sessionId, bool incoming) {
+                return setupOneSocketConnection(addr, sessionId, incoming);
+            },
+            true /*concurrent*/);
 }
 
 status_t RpcSession::setupOneSocketConnection(const RpcSocketAddress& addr,
                                               const std::vector<uint8_t>& sessionId,
-                                              bool incoming) {
+                                              bool incoming, bool onDemand) {
     for (size_t tries = 0; tries < 5; tries++) {
         if (tries > 0) usleep(10000);
 
@@ -598,7 +1228,7 @@ status_t RpcSession::setupOneSocketConnection(const RpcSocketAddress& addr,
         }
         LOG_RPC_DETAIL("Socket at %s client with fd %d", addr.toString().c_str(), serverFd.get());
 
-        return initAndAddConnection(std::move(serverFd), sessionId, incoming);
+        return initAndAddConnection(std::move(serverFd), sessionId, incoming, onDemand);
     }
 
     ALOGE("Ran out of retries to connect to %s", addr.toString().c_str());
@@ -606,7 +1236,7 @@ status_t RpcSession::setupOneSocketConnection(const RpcSocketAddress& addr,
 }
 
 status_t RpcSession::initAndAddConnection(unique_fd fd, const std::vector<uint8_t>& sessionId,
-                                          bool incoming) {
+                                          bool incoming, bool onDemand) {
     LOG_ALWAYS_FATAL_IF(mShutdownTrigger == nullptr);
     auto server = mCtx->newTransport(std::move(fd), mShutdownTrigger.get());
     if (server == nullptr) {
@@ -629,6 +1259,20 @@ status_t RpcSession::initAndAddConnection(unique_fd fd, const std::vector<uint8_
 
     if (incoming) {
         header.options |= RPC_CONNECTION_OPTION_INCOMING;
+        if (onDemand) {
+            header.options |= RPC_CONNECTION_OPTION_ON_DEMAND;
+            header.idleTimeoutMs = static_cast<uint32_t>(
+                    std::clamp<int64_t>(mIncomingIdleTimeout.count(), 1,
+                                        std::numeric_limits<uint32_t>::max()));
+        }
+    } else if (sessionId.empty()) {
+        if (mUseMultiplexing && mCtx->supportsConcurrentReadWrite()) {
+            header.options |= RPC_CONNECTION_OPTION_MULTIPLEXED;
+        }
+        if (mUseFastConnect) header.options |= RPC_CONNECTION_OPTION_FAST_CONNECT;
+        if (mPriorityInheritance) header.options |= RPC_CONNECTION_OPTION_PRIORITY;
+        header.options |= RPC_CONNECTION_OPTION_DEC_STRONG_BATCH;
+        header.options |= RPC_CONNECTION_OPTION_REPLY_BINDERS;
     }
 
     iovec headerIov{&header, sizeof(header)};
@@ -680,7 +1324,7 @@ status_t RpcSession::addIncomingConnection(std::unique_ptr<RpcTransport> rpcTran
         session->preJoinThreadOwnership(std::move(thread));
 
         // only continue once we have a response or the connection fails
-        auto setupResult = session->preJoinSetup(std::move(movedRpcTransport));
+        auto setupResult = session->preJoinSetup(std::move(movedRpcTransport), false);
 
         ownershipTransferred = true;
         threadLock.unlock();
@@ -705,14 +1349,18 @@ status_t RpcSession::initShutdownTrigger() {
     return OK;
 }
 
-status_t RpcSession::addOutgoingConnection(std::unique_ptr<RpcTransport> rpcTransport, bool init) {
+status_t RpcSession::addOutgoingConnection(std::unique_ptr<RpcTransport> rpcTransport, bool init,
+                                           std::chrono::milliseconds idleTimeout) {
     sp<RpcConnection> connection = sp<RpcConnection>::make();
     {
         std::lock_guard<std::mutex> _l(mMutex);
         connection->rpcTransport = std::move(rpcTransport);
         connection->exclusiveTid = gettid();
+        connection->idleTimeout = idleTimeout;
+        connection->lastUsed = std::chrono::steady_clock::now();
         mConnections.mOutgoing.push_back(connection);
     }
+    if (idleTimeout.count() != 0) scheduleIdleConnectionReaping();
 
     status_t status = OK;
     if (init) {
@@ -748,7 +1396,7 @@ bool RpcSession::setForServer(const wp<RpcServer>& server, const wp<EventListene
 }
 
 sp<RpcSession::RpcConnection> RpcSession::assignIncomingConnectionToThisThread(
-        std::unique_ptr<RpcTransport> rpcTransport) {
+        std::unique_ptr<RpcTransport> rpcTransport, bool multiplexed) {
     std::lock_guard<std::mutex> _l(mMutex);
 
     if (mConnections.mIncoming.size() >= mMaxIncomingThreads) {
@@ -768,9 +1416,15 @@ sp<RpcSession::RpcConnection> RpcSession::assignIncomingConnectionToThisThread(
     sp<RpcConnection> session = sp<RpcConnection>::make();
     session->rpcTransport = std::move(rpcTransport);
     session->exclusiveTid = gettid();
+    session->multiplexed = multiplexed;
 
     mConnections.mIncoming.push_back(session);
-    mConnections.mMaxIncoming = mConnections.mIncoming.size();
+    if (multiplexed) mConnections.mMultiplexed = session;
+    // not the size, since it still counts connections closed on demand which
+    // are not removed yet
+    mConnections.mMaxIncoming++;
+    mIncomingThreadStats.maxThreads =
+            std::max(mIncomingThreadStats.maxThreads, mConnections.mIncoming.size());
 
     return session;
 }
@@ -781,6 +1435,7 @@ bool RpcSession::removeIncomingConnection(const sp<RpcConnection>& connection) {
                 std::find(mConnections.mIncoming.begin(), mConnections.mIncoming.end(), connection);
         it != mConnections.mIncoming.end()) {
         mConnections.mIncoming.erase(it);
+        if (mConnections.mMultiplexed == connection) mConnections.mMultiplexed = nullptr;
         if (mConnections.mIncoming.size() == 0) {
             sp<EventListener> listener = mEventListener.promote();
             if (listener) {
@@ -804,6 +1459,17 @@ status_t RpcSession::ExclusiveConnection::find(const sp<RpcSession>& session, Co
     connection->mReentrant = false;
 
     pid_t tid = gettid();
+    // only read when other threads are waiting too, see setPriorityInheritance
+    std::optional<int32_t> urgency;
+    auto getUrgency = [&]() {
+        if (!urgency.has_value()) {
+            urgency = session->mPriorityInheritance
+                    ? RpcPriority::urgency(RpcPriority::current())
+                    : 0;
+        }
+        return *urgency;
+    };
+
     std::unique_lock<std::mutex> _l(session->mMutex);
 
     session->mConnections.mWaitingThreads++;
@@ -855,15 +1521,30 @@ status_t RpcSession::ExclusiveConnection::find(const sp<RpcSession>& session, Co
             }
         }
 
+        // A multiplexed connection is never owned by a single thread. A client
+        // sends everything over it. A server only sends refcounts over it, since
+        // the client doesn't process nested transactions on it.
+        sp<RpcConnection>& multiplexed = session->mConnections.mMultiplexed;
+        if (exclusive == nullptr && available == nullptr && multiplexed != nullptr &&
+            (session->mForServer == nullptr || use == ConnectionUse::CLIENT_REFCOUNT)) {
+            connection->mConnection = multiplexed;
+            connection->mReentrant = true; // nothing to give up
+            break;
+        }
+
         // if our thread is already using a connection, prioritize using that
         if (exclusive != nullptr) {
             connection->mConnection = exclusive;
             connection->mReentrant = true;
             break;
         } else if (available != nullptr) {
-            connection->mConnection = available;
-            connection->mConnection->exclusiveTid = tid;
-            break;
+            // leave it to a more urgent thread which is waiting already
+            const std::multiset<int32_t>& waiting = session->mConnections.mWaitingUrgencies;
+            if (waiting.empty() || *waiting.rbegin() <= getUrgency()) {
+                connection->mConnection = available;
+                connection->mConnection->exclusiveTid = tid;
+                break;
+            }
         }
 
         if (session->mConnections.mOutgoing.size() == 0) {
@@ -883,7 +1564,9 @@ status_t RpcSession::ExclusiveConnection::find(const sp<RpcSession>& session, Co
         LOG_RPC_DETAIL("No available connections (have %zu clients and %zu servers). Waiting...",
                        session->mConnections.mOutgoing.size(),
                        session->mConnections.mIncoming.size());
+        auto waiting = session->mConnections.mWaitingUrgencies.insert(getUrgency());
         session->mAvailableConnectionCv.wait(_l);
+        session->mConnections.mWaitingUrgencies.erase(waiting);
     }
     session->mConnections.mWaitingThreads--;
 
@@ -902,6 +1585,12 @@ void RpcSession::ExclusiveConnection::findConnection(pid_t tid, sp<RpcConnection
     for (size_t i = 0; i < sockets.size(); i++) {
         sp<RpcConnection>& socket = sockets[(i + socketsIndexHint) % sockets.size()];
 
+        // shared, see ExclusiveConnection::find
+        if (socket->multiplexed) continue;
+
+        // still reading the replies to calls which timed out
+        if (socket->draining) continue;
+
         // take first available connection (intuition = caching)
         if (available && *available == nullptr && socket->exclusiveTid == std::nullopt) {
             *available = socket;
@@ -924,9 +1613,24 @@ RpcSession::ExclusiveConnection::~ExclusiveConnection() {
     if (!mReentrant && mConnection != nullptr) {
         std::unique_lock<std::mutex> _l(mSession->mMutex);
         mConnection->exclusiveTid = std::nullopt;
+        // Replies to calls which timed out are read on another thread, rather
+        // than by the next call, which would then also get the calls nested
+        // in those. This is only ever read by the thread holding it.
+        if (mConnection->staleReplies > 0) {
+            mConnection->draining = true;
+            _l.unlock();
+            mSession->drainStaleReplies(mConnection);
+            return;
+        }
+        mConnection->lastUsed = std::chrono::steady_clock::now();
         if (mSession->mConnections.mWaitingThreads > 0) {
             _l.unlock();
-            mSession->mAvailableConnectionCv.notify_one();
+            // each waiting thread checks whether it is the most urgent one
+            if (mSession->mPriorityInheritance) {
+                mSession->mAvailableConnectionCv.notify_all();
+            } else {
+                mSession->mAvailableConnectionCv.notify_one();
+            }
         }
     }
 }
@@ -102,6 +102,25 @@ private:
     sockaddr_vm mAddr;
 };
 
+// Copy of any other address, e.g. to use it after that goes out of scope.
+class CopiedSocketAddress : public RpcSocketAddress {
+public:
+    explicit CopiedSocketAddress(const RpcSocketAddress& other)
+          : mSize(other.addrSize()), mString(other.toString()) {
+        LOG_ALWAYS_FATAL_IF(mSize > sizeof(mAddr), "Socket address is too long: %zu", mSize);
+        memcpy(&mAddr, other.addr(), mSize);
+    }
+    virtual ~CopiedSocketAddress() {}
+    std::string toString() const override { return mString; }
+    const sockaddr* addr() const override { return reinterpret_cast<const sockaddr*>(&mAddr); }
+    size_t addrSize() const override { return mSize; }
+
+private:
+    sockaddr_storage mAddr;
+    size_t mSize;
+    std::string mString;
+};
+
 class InetSocketAddress : public RpcSocketAddress {
 public:
     InetSocketAddress(const sockaddr* sockAddr, size_t size, const char* addr, unsigned int port)
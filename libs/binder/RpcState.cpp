@@ -21,17 +21,25 @@
 #include <android-base/hex.h>
 #include <android-base/macros.h>
 #include <android-base/scopeguard.h>
+#include <android-base/strings.h>
 #include <binder/BpBinder.h>
 #include <binder/IPCThreadState.h>
 #include <binder/RpcServer.h>
 
 #include "Debug.h"
+#include "RpcPriority.h"
 #include "RpcWireFormat.h"
 
+#include <algorithm>
 #include <random>
+#include <thread>
 
 #include <inttypes.h>
 
+#ifdef __GLIBC__
+extern "C" pid_t gettid();
+#endif
+
 namespace android {
 
 using base::ScopeGuard;
@@ -49,8 +57,73 @@ void rpcMaybeWaitToFlake() {
 }
 #endif
 
-RpcState::RpcState() {}
-RpcState::~RpcState() {}
+static uint64_t microsBetween(std::chrono::steady_clock::time_point start,
+                              std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+// Binders dropped by commands which this thread reads while it holds the
+// writeMutex of a multiplexed connection (see rpcSend). Their destructors may
+// send on the same connection, so they are only released once it is unlocked.
+static thread_local std::vector<sp<IBinder>>* tDeferredReleases = nullptr;
+
+// Where binders were written to the reply which this thread is building in
+// processTransactInternal, see RPC_CONNECTION_OPTION_REPLY_BINDERS. This is
+// kept here rather than in the Parcel, which only RPC replies need it for.
+// Nested transactions on the same thread record their own replies.
+class ReplyBinderPositions {
+public:
+    explicit ReplyBinderPositions(const Parcel* reply) : mReply(reply), mPrevious(sCurrent) {
+        sCurrent = this;
+    }
+    ~ReplyBinderPositions() { sCurrent = mPrevious; }
+
+    static void record(const Parcel* parcel, size_t position) {
+        if (sCurrent == nullptr || sCurrent->mReply != parcel) return;
+        sCurrent->mPositions.push_back(static_cast<uint32_t>(position));
+    }
+
+    // A position is recorded again if a binder overwrites another one, and
+    // binders may be cut off by Parcel::setDataSize, so these are cleaned up
+    // once, when the reply is sent.
+    const std::vector<uint32_t>& positions(size_t dataSize) {
+        std::sort(mPositions.begin(), mPositions.end());
+        mPositions.erase(std::unique(mPositions.begin(), mPositions.end()), mPositions.end());
+        // each is a non-null marker and an address, see Parcel::flattenBinder
+        constexpr size_t kBinderSize = sizeof(int32_t) + sizeof(uint64_t);
+        while (!mPositions.empty() && mPositions.back() + kBinderSize > dataSize) {
+            mPositions.pop_back();
+        }
+        return mPositions;
+    }
+
+private:
+    static thread_local ReplyBinderPositions* sCurrent;
+
+    const Parcel* mReply;
+    ReplyBinderPositions* mPrevious;
+    std::vector<uint32_t> mPositions;
+};
+
+thread_local ReplyBinderPositions* ReplyBinderPositions::sCurrent = nullptr;
+
+static void releaseBinder(sp<IBinder>&& binder) {
+    if (tDeferredReleases != nullptr && binder != nullptr) {
+        tDeferredReleases->push_back(std::move(binder));
+        return;
+    }
+    binder = nullptr;
+}
+
+RpcState::RpcState() : mCommandDataPool(sp<CommandDataPool>::make()) {}
+RpcState::~RpcState() {
+    // the reader holds a reference to the session, so this is usually it
+    joinAsyncReader();
+}
+
+void RpcState::onBinderWritten(const Parcel* parcel, size_t position) {
+    ReplyBinderPositions::record(parcel, position);
+}
 
 status_t RpcState::onBinderLeaving(const sp<RpcSession>& session, const sp<IBinder>& binder,
                                    uint64_t* outAddress) {
@@ -77,58 +150,75 @@ status_t RpcState::onBinderLeaving(const sp<RpcSession>& session, const sp<IBind
         return INVALID_OPERATION;
     }
 
-    std::lock_guard<std::mutex> _l(mNodeMutex);
+    if (isRpc) {
+        uint64_t addr = binder->remoteBinder()->getPrivateAccessor().rpcAddress();
+        NodeShard& shard = shardForAddress(addr);
+        std::lock_guard<std::mutex> _l(shard.mutex);
+        if (mTerminated) return DEAD_OBJECT;
+
+        auto it = shard.nodes.find(addr);
+        LOG_ALWAYS_FATAL_IF(it == shard.nodes.end(),
+                            "RPC binder must have known address at this point");
+        // check integrity of data structure
+        LOG_ALWAYS_FATAL_IF(binder != it->second.binder, "Address mismatch %" PRIu64, addr);
+
+        it->second.timesSent++;
+        it->second.sentRef = binder; // might already be set
+        *outAddress = addr;
+        return OK;
+    }
+
+    size_t shardIndex = shardIndexForBinder(binder.get());
+    NodeShard& shard = mNodeShards[shardIndex];
+    std::lock_guard<std::mutex> _l(shard.mutex);
     if (mTerminated) return DEAD_OBJECT;
 
-    // TODO(b/182939933): maybe move address out of BpBinder, and keep binder->address map
-    // in RpcState
-    for (auto& [addr, node] : mNodeForAddress) {
-        if (binder == node.binder) {
-            if (isRpc) {
-                // check integrity of data structure
-                uint64_t actualAddr = binder->remoteBinder()->getPrivateAccessor().rpcAddress();
-                LOG_ALWAYS_FATAL_IF(addr != actualAddr, "Address mismatch %" PRIu64 " vs %" PRIu64,
-                                    addr, actualAddr);
-            }
-            node.timesSent++;
-            node.sentRef = binder; // might already be set
-            *outAddress = addr;
-            return OK;
-        }
+    if (auto local = shard.localAddresses.find(binder.get());
+        local != shard.localAddresses.end()) {
+        auto it = shard.nodes.find(local->second);
+        LOG_ALWAYS_FATAL_IF(it == shard.nodes.end() || binder != it->second.binder,
+                            "Local binder index out of date for %" PRIu64, local->second);
+        it->second.timesSent++;
+        it->second.sentRef = binder; // might already be set
+        *outAddress = it->first;
+        return OK;
     }
-    LOG_ALWAYS_FATAL_IF(isRpc, "RPC binder must have known address at this point");
 
     bool forServer = session->server() != nullptr;
 
     // arbitrary limit for maximum number of nodes in a process (otherwise we
     // might run out of addresses)
-    if (mNodeForAddress.size() > 100000) {
+    if (mNumNodes > 100000) {
         return NO_MEMORY;
     }
 
+    // ids in this shard are congruent to shardIndex, see shardForAddress
+    constexpr uint32_t kMaxShardId = std::numeric_limits<uint32_t>::max() / kNumNodeShards;
     while (true) {
         RpcWireAddress address{
                 .options = RPC_WIRE_ADDRESS_OPTION_CREATED,
-                .address = mNextId,
+                .address = static_cast<uint32_t>(shard.nextId * kNumNodeShards + shardIndex),
         };
         if (forServer) {
             address.options |= RPC_WIRE_ADDRESS_OPTION_FOR_SERVER;
         }
 
         // avoid ubsan abort
-        if (mNextId >= std::numeric_limits<uint32_t>::max()) {
-            mNextId = 0;
+        if (shard.nextId >= kMaxShardId) {
+            shard.nextId = 0;
         } else {
-            mNextId++;
+            shard.nextId++;
         }
 
-        auto&& [it, inserted] = mNodeForAddress.insert({RpcWireAddress::toRaw(address),
-                                                        BinderNode{
-                                                                .binder = binder,
-                                                                .sentRef = binder,
-                                                                .timesSent = 1,
-                                                        }});
+        auto&& [it, inserted] = shard.nodes.insert({RpcWireAddress::toRaw(address),
+                                                    BinderNode{
+                                                            .binder = binder,
+                                                            .sentRef = binder,
+                                                            .timesSent = 1,
+                                                    }});
         if (inserted) {
+            mNumNodes++;
+            shard.localAddresses[binder.get()] = it->first;
             *outAddress = it->first;
             return OK;
         }
@@ -153,10 +243,11 @@ status_t RpcState::onBinderEntering(const sp<RpcSession>& session, uint64_t addr
         return BAD_VALUE;
     }
 
-    std::lock_guard<std::mutex> _l(mNodeMutex);
+    NodeShard& shard = shardForAddress(address);
+    std::lock_guard<std::mutex> _l(shard.mutex);
     if (mTerminated) return DEAD_OBJECT;
 
-    if (auto it = mNodeForAddress.find(address); it != mNodeForAddress.end()) {
+    if (auto it = shard.nodes.find(address); it != shard.nodes.end()) {
         *out = it->second.binder.promote();
 
         // implicitly have strong RPC refcount, since we received this binder
@@ -172,8 +263,9 @@ status_t RpcState::onBinderEntering(const sp<RpcSession>& session, uint64_t addr
         return BAD_VALUE;
     }
 
-    auto&& [it, inserted] = mNodeForAddress.insert({address, BinderNode{}});
+    auto&& [it, inserted] = shard.nodes.insert({address, BinderNode{}});
     LOG_ALWAYS_FATAL_IF(!inserted, "Failed to insert binder when creating proxy");
+    mNumNodes++;
 
     // Currently, all binders are assumed to be part of the same session (no
     // device global binders in the RPC world).
@@ -183,17 +275,18 @@ status_t RpcState::onBinderEntering(const sp<RpcSession>& session, uint64_t addr
 }
 
 status_t RpcState::flushExcessBinderRefs(const sp<RpcSession>& session, uint64_t address,
-                                         const sp<IBinder>& binder) {
+                                         const sp<IBinder>& binder, RpcDecStrong* replyDecStrong) {
     // We can flush all references when the binder is destroyed. No need to send
     // extra reference counting packets now.
     if (binder->remoteBinder()) return OK;
 
-    std::unique_lock<std::mutex> _l(mNodeMutex);
+    NodeShard& shard = shardForAddress(address);
+    std::unique_lock<std::mutex> _l(shard.mutex);
     if (mTerminated) return DEAD_OBJECT;
 
-    auto it = mNodeForAddress.find(address);
+    auto it = shard.nodes.find(address);
 
-    LOG_ALWAYS_FATAL_IF(it == mNodeForAddress.end(), "Can't be deleted while we hold sp<>");
+    LOG_ALWAYS_FATAL_IF(it == shard.nodes.end(), "Can't be deleted while we hold sp<>");
     LOG_ALWAYS_FATAL_IF(it->second.binder != binder,
                         "Caller of flushExcessBinderRefs using inconsistent arguments");
 
@@ -207,6 +300,14 @@ status_t RpcState::flushExcessBinderRefs(const sp<RpcSession>& session, uint64_t
     // received it. Once (or if) it has no other refcounts, it would reply with
     // its own decStrong so that it could be removed from this session.
     if (it->second.timesRecd != 0) {
+        if (replyDecStrong != nullptr) {
+            replyDecStrong->address = RpcWireAddress::fromRaw(address);
+            if (!takeDecStrongToTargetLocked(shard, address, 0, &replyDecStrong->amount)) {
+                replyDecStrong->amount = 0;
+            }
+            return OK;
+        }
+
         _l.unlock();
 
         return session->sendDecStrongToTarget(address, 0);
@@ -216,19 +317,19 @@ status_t RpcState::flushExcessBinderRefs(const sp<RpcSession>& session, uint64_t
 }
 
 status_t RpcState::sendObituaries(const sp<RpcSession>& session) {
-    std::unique_lock _l(mNodeMutex);
-
     // Gather strong pointers to all of the remote binders for this session so
     // we hold the strong references. remoteBinder() returns a raw pointer.
     // Send the obituaries and drop the strong pointers outside of the lock so
     // the destructors and the onBinderDied calls are not done while locked.
     std::vector<sp<IBinder>> remoteBinders;
-    for (const auto& [_, binderNode] : mNodeForAddress) {
-        if (auto binder = binderNode.binder.promote()) {
-            remoteBinders.push_back(std::move(binder));
+    for (NodeShard& shard : mNodeShards) {
+        std::lock_guard<std::mutex> _l(shard.mutex);
+        for (const auto& [_, binderNode] : shard.nodes) {
+            if (auto binder = binderNode.binder.promote()) {
+                remoteBinders.push_back(std::move(binder));
+            }
         }
     }
-    _l.unlock();
 
     for (const auto& binder : remoteBinders) {
         if (binder->remoteBinder() &&
@@ -240,21 +341,37 @@ status_t RpcState::sendObituaries(const sp<RpcSession>& session) {
 }
 
 size_t RpcState::countBinders() {
-    std::lock_guard<std::mutex> _l(mNodeMutex);
-    return mNodeForAddress.size();
+    return mNumNodes;
 }
 
 void RpcState::dump() {
-    std::lock_guard<std::mutex> _l(mNodeMutex);
+    auto locks = lockAllShards();
     dumpLocked();
 }
 
+RpcState::NodeShard& RpcState::shardForAddress(uint64_t address) {
+    return mNodeShards[RpcWireAddress::fromRaw(address).address % kNumNodeShards];
+}
+
+size_t RpcState::shardIndexForBinder(const IBinder* binder) {
+    // pointers are aligned, so the low bits are not used directly
+    uint64_t hash = reinterpret_cast<uintptr_t>(binder) * 0x9E3779B97F4A7C15ull;
+    return (hash >> 32) % kNumNodeShards;
+}
+
+std::array<std::unique_lock<std::mutex>, RpcState::kNumNodeShards> RpcState::lockAllShards() {
+    std::array<std::unique_lock<std::mutex>, kNumNodeShards> locks;
+    for (size_t i = 0; i < kNumNodeShards; i++) {
+        locks[i] = std::unique_lock<std::mutex>(mNodeShards[i].mutex);
+    }
+    return locks;
+}
+
 void RpcState::clear() {
-    std::unique_lock<std::mutex> _l(mNodeMutex);
+    auto locks = lockAllShards();
 
     if (mTerminated) {
-        LOG_ALWAYS_FATAL_IF(!mNodeForAddress.empty(),
-                            "New state should be impossible after terminating!");
+        LOG_ALWAYS_FATAL_IF(mNumNodes != 0, "New state should be impossible after terminating!");
         return;
     }
 
@@ -265,54 +382,224 @@ void RpcState::clear() {
 
     // if the destructor of a binder object makes another RPC call, then calling
     // decStrong could deadlock. So, we must hold onto these binders until
-    // mNodeMutex is no longer taken.
+    // the shard locks are no longer taken.
     std::vector<sp<IBinder>> tempHoldBinder;
 
     mTerminated = true;
-    for (auto& [address, node] : mNodeForAddress) {
-        sp<IBinder> binder = node.binder.promote();
-        LOG_ALWAYS_FATAL_IF(binder == nullptr, "Binder %p expected to be owned.", binder.get());
-
-        if (node.sentRef != nullptr) {
-            tempHoldBinder.push_back(node.sentRef);
+    for (NodeShard& shard : mNodeShards) {
+        for (auto& [address, node] : shard.nodes) {
+            sp<IBinder> binder = node.binder.promote();
+            LOG_ALWAYS_FATAL_IF(binder == nullptr, "Binder %p expected to be owned.",
+                                binder.get());
+
+            if (node.sentRef != nullptr) {
+                tempHoldBinder.push_back(node.sentRef);
+            }
         }
+
+        shard.nodes.clear();
+        shard.localAddresses.clear();
     }
+    mNumNodes = 0;
+    mAsyncTodoBytes = 0;
 
-    mNodeForAddress.clear();
+    {
+        std::lock_guard<std::mutex> _lp(mPendingMutex);
+        mPendingDecStrongs.clear();
+        mPendingOneways.clear();
+    }
 
-    _l.unlock();
+    for (auto& lock : locks) lock.unlock();
     tempHoldBinder.clear(); // explicit
+
+    {
+        std::lock_guard<std::mutex> _lm(mMultiplexed.mutex);
+        mMultiplexed.terminated = true;
+        // dropped, like transactions which haven't been read yet
+        mMultiplexed.todo.clear();
+    }
+    mMultiplexed.todoCv.notify_all();
 }
 
 void RpcState::dumpLocked() {
     ALOGE("DUMP OF RpcState %p", this);
-    ALOGE("DUMP OF RpcState (%zu nodes)", mNodeForAddress.size());
-    for (const auto& [address, node] : mNodeForAddress) {
-        sp<IBinder> binder = node.binder.promote();
-
-        const char* desc;
-        if (binder) {
-            if (binder->remoteBinder()) {
-                if (binder->remoteBinder()->isRpcBinder()) {
-                    desc = "(rpc binder proxy)";
+    {
+        std::lock_guard<std::mutex> _l(mPendingMutex);
+        ALOGE("DUMP OF RpcState (%zu nodes, %zu pending dec strongs, %zu pending oneway bytes)",
+              mNumNodes.load(), mPendingDecStrongs.size(), mPendingOneways.size());
+        ALOGE("DUMP OF RpcState oneway batching: %" PRIu64 " queued, %" PRIu64 " flushes",
+              mNumQueuedOneways.load(), mNumOnewayFlushes.load());
+    }
+    for (const NodeShard& shard : mNodeShards) {
+        for (const auto& [address, node] : shard.nodes) {
+            sp<IBinder> binder = node.binder.promote();
+
+            const char* desc;
+            if (binder) {
+                if (binder->remoteBinder()) {
+                    if (binder->remoteBinder()->isRpcBinder()) {
+                        desc = "(rpc binder proxy)";
+                    } else {
+                        desc = "(binder proxy)";
+                    }
                 } else {
-                    desc = "(binder proxy)";
+                    desc = "(local binder)";
                 }
             } else {
-                desc = "(local binder)";
+                desc = "(null)";
+            }
+
+            ALOGE("- BINDER NODE: %p times sent:%zu times recd: %zu a: %" PRIu64 " type: %s",
+                  node.binder.unsafe_get(), node.timesSent, node.timesRecd, address, desc);
+            if (node.asyncTodoTotal != 0) {
+                ALOGE("  oneway backlog: %zu pending (span %zu), max %zu, %" PRIu64
+                      " out of order",
+                      node.asyncTodo.size(), node.asyncTodo.span(), node.asyncTodoMax,
+                      node.asyncTodoTotal);
+            }
+        }
+    }
+    mCommandDataPool->dump();
+    for (const std::string& line : base::Split(getTransactionStats().toString(), "\n")) {
+        if (!line.empty()) ALOGE("Transactions: %s", line.c_str());
+    }
+    {
+        std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+        ALOGE("Multiplexed: %zu calls in flight (%zu async), %zu queued, %zu workers (%zu idle)",
+              mMultiplexed.inFlight.size() + mMultiplexed.asyncInFlight.size(),
+              mMultiplexed.asyncInFlight.size(), mMultiplexed.todo.size(),
+              mMultiplexed.numWorkers, mMultiplexed.numIdleWorkers);
+    }
+    ALOGE("END DUMP OF RpcState");
+}
+
+#ifdef CONFIG_ANDROID_BINDER_RPC_BUFFER_POOL_SIZE
+constexpr size_t kCommandDataPoolMaxCachedBytes = CONFIG_ANDROID_BINDER_RPC_BUFFER_POOL_SIZE;
+#else
+constexpr size_t kCommandDataPoolMaxCachedBytes = 64 * 1024;
+#endif
+
+// Prefix of every buffer handed out by CommandDataPool. Sized so that the data
+// which follows keeps the alignment of the underlying allocation.
+struct alignas(alignof(std::max_align_t)) RpcState::CommandDataPool::Header {
+    CommandDataPool* pool;
+    uint32_t sizeClass;
+};
+
+RpcState::CommandDataPool::~CommandDataPool() {
+    LOG_ALWAYS_FATAL_IF(mOutstanding != 0, "Pool destroyed with %zu outstanding buffers",
+                        mOutstanding);
+    for (auto& sizeClass : mClasses) {
+        for (size_t i = 0; i < sizeClass.numCached; i++) {
+            delete[] (sizeClass.cached[i] - sizeof(Header));
+        }
+    }
+}
+
+uint8_t* RpcState::CommandDataPool::acquire(size_t size) {
+    uint32_t sizeClass = kNoSizeClass;
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        if (size <= kSizeClasses[i]) {
+            sizeClass = i;
+            break;
+        }
+    }
+
+    uint8_t* data = nullptr;
+    {
+        std::lock_guard<std::mutex> _l(mMutex);
+        if (sizeClass != kNoSizeClass) {
+            SizeClass& cls = mClasses[sizeClass];
+            if (cls.numCached > 0) {
+                data = cls.cached[--cls.numCached];
+                mCachedBytes -= kSizeClasses[sizeClass];
+                cls.hits++;
+            } else {
+                cls.misses++;
             }
         } else {
-            desc = "(null)";
+            mOversized++;
         }
+        mOutstanding++;
+    }
 
-        ALOGE("- BINDER NODE: %p times sent:%zu times recd: %zu a: %" PRIu64 " type: %s",
-              node.binder.unsafe_get(), node.timesSent, node.timesRecd, address, desc);
+    if (data == nullptr) {
+        size_t allocSize = sizeClass == kNoSizeClass ? size : kSizeClasses[sizeClass];
+        uint8_t* buffer = new (std::nothrow) uint8_t[sizeof(Header) + allocSize];
+        if (buffer == nullptr) {
+            std::lock_guard<std::mutex> _l(mMutex);
+            mOutstanding--;
+            return nullptr;
+        }
+        new (buffer) Header{
+                .pool = this,
+                .sizeClass = sizeClass,
+        };
+        data = buffer + sizeof(Header);
     }
-    ALOGE("END DUMP OF RpcState");
+
+    // released in recycle
+    incStrong(data);
+    return data;
 }
 
+void RpcState::CommandDataPool::recycle(uint8_t* data) {
+    if (data == nullptr) return;
 
-RpcState::CommandData::CommandData(size_t size) : mSize(size) {
+    Header* header = reinterpret_cast<Header*>(data - sizeof(Header));
+    CommandDataPool* pool = header->pool;
+    pool->put(header);
+    pool->decStrong(data); // may delete pool
+}
+
+void RpcState::CommandDataPool::put(Header* header) {
+    uint8_t* data = reinterpret_cast<uint8_t*>(header) + sizeof(Header);
+
+    std::unique_lock<std::mutex> _l(mMutex);
+    mOutstanding--;
+
+    if (header->sizeClass != kNoSizeClass) {
+        SizeClass& cls = mClasses[header->sizeClass];
+        size_t classSize = kSizeClasses[header->sizeClass];
+        if (cls.numCached < kMaxCachedPerClass &&
+            mCachedBytes + classSize <= kCommandDataPoolMaxCachedBytes) {
+            cls.cached[cls.numCached++] = data;
+            mCachedBytes += classSize;
+            return;
+        }
+        cls.dropped++;
+    }
+    _l.unlock();
+
+    delete[] reinterpret_cast<uint8_t*>(header);
+}
+
+void RpcState::CommandDataPool::dump() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    ALOGE("- COMMAND DATA POOL: cached %zu/%zu bytes, %zu outstanding, %zu oversized", mCachedBytes,
+          kCommandDataPoolMaxCachedBytes, mOutstanding, mOversized);
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        const SizeClass& cls = mClasses[i];
+        ALOGE("  - size <= %zu: cached %zu/%zu hits %zu misses %zu dropped %zu", kSizeClasses[i],
+              cls.numCached, kMaxCachedPerClass, cls.hits, cls.misses, cls.dropped);
+    }
+}
+
+RpcSession::BufferPoolStats RpcState::CommandDataPool::getStats() {
+    std::lock_guard<std::mutex> _l(mMutex);
+    RpcSession::BufferPoolStats stats;
+    for (const SizeClass& cls : mClasses) {
+        stats.hits += cls.hits;
+        stats.misses += cls.misses;
+        stats.dropped += cls.dropped;
+    }
+    stats.oversized = mOversized;
+    stats.cachedBytes = mCachedBytes;
+    stats.outstanding = mOutstanding;
+    return stats;
+}
+
+RpcState::CommandData::CommandData(const sp<CommandDataPool>& pool, size_t size) : mSize(size) {
     // The maximum size for regular binder is 1MB for all concurrent
     // transactions. A very small proportion of transactions are even
     // larger than a page, but we need to avoid allocating too much
@@ -330,12 +617,26 @@ RpcState::CommandData::CommandData(size_t size) : mSize(size) {
         ALOGW("Transaction requested too much data allocation %zu", size);
         return;
     }
-    mData.reset(new (std::nothrow) uint8_t[size]);
+    mData.reset(pool->acquire(size));
 }
 
 status_t RpcState::rpcSend(const sp<RpcSession::RpcConnection>& connection,
                            const sp<RpcSession>& session, const char* what, iovec* iovs, int niovs,
                            const std::function<status_t()>& altPoll) {
+    // declared first, so that these are released after the lock
+    std::vector<sp<IBinder>> deferredReleases;
+    std::unique_lock<std::mutex> writeLock(connection->writeMutex, std::defer_lock);
+    std::vector<sp<IBinder>>* origDeferredReleases = tDeferredReleases;
+    if (connection->multiplexed) {
+        writeLock.lock();
+        tDeferredReleases = &deferredReleases;
+    }
+    ScopeGuard guardDeferredReleases = [&]() { tDeferredReleases = origDeferredReleases; };
+
+    // parts of batched writes may be empty, and their base may be null
+    niovs = std::remove_if(iovs, iovs + niovs, [](const iovec& iov) { return iov.iov_len == 0; }) -
+            iovs;
+
     for (int i = 0; i < niovs; i++) {
         LOG_RPC_DETAIL("Sending %s (part %d of %d) on RpcTransport %p: %s",
                        what, i + 1, niovs, connection->rpcTransport.get(),
@@ -348,6 +649,7 @@ status_t RpcState::rpcSend(const sp<RpcSession::RpcConnection>& connection,
         status != OK) {
         LOG_RPC_DETAIL("Failed to write %s (%d iovs) on RpcTransport %p, error: %s", what, niovs,
                        connection->rpcTransport.get(), statusToString(status).c_str());
+        if (writeLock.owns_lock()) writeLock.unlock();
         (void)session->shutdownAndWait(false);
         return status;
     }
@@ -376,14 +678,52 @@ status_t RpcState::rpcRec(const sp<RpcSession::RpcConnection>& connection,
 }
 
 status_t RpcState::readNewSessionResponse(const sp<RpcSession::RpcConnection>& connection,
-                                          const sp<RpcSession>& session, uint32_t* version) {
+                                          const sp<RpcSession>& session, uint32_t* version,
+                                          std::optional<FastConnectInfo>* fastConnect,
+                                          uint8_t* flags) {
     RpcNewSessionResponse response;
     iovec iov{&response, sizeof(response)};
     if (status_t status = rpcRec(connection, session, "new session response", &iov, 1);
         status != OK) {
         return status;
     }
+    if (response.flags & RPC_NEW_SESSION_RESPONSE_THROTTLED) {
+        ALOGE("Server refused new session, too many sessions from this client");
+        return WOULD_BLOCK;
+    }
     *version = response.version;
+    *flags = response.flags;
+
+    fastConnect->reset();
+    if (!(response.flags & RPC_NEW_SESSION_RESPONSE_FAST_CONNECT)) return OK;
+
+    RpcFastConnectInfo info;
+    iovec infoIov{&info, sizeof(info)};
+    if (status_t status = rpcRec(connection, session, "fast connect info", &infoIov, 1);
+        status != OK) {
+        return status;
+    }
+    if (info.maxThreads == 0) {
+        ALOGE("Error invalid max maxThreads: %" PRIu32, info.maxThreads);
+        return BAD_VALUE;
+    }
+    if (info.sessionIdSize == 0) {
+        ALOGE("Server sent empty session ID with fast connect info");
+        return BAD_VALUE;
+    }
+
+    std::vector<uint8_t> sessionId(info.sessionIdSize);
+    iovec sessionIdIov{sessionId.data(), sessionId.size()};
+    if (status_t status = rpcRec(connection, session, "fast connect session ID", &sessionIdIov, 1);
+        status != OK) {
+        return status;
+    }
+
+    *fastConnect = FastConnectInfo{
+            .maxThreads = info.maxThreads,
+            .sessionId = std::move(sessionId),
+            .rootObject = RpcWireAddress::toRaw(info.rootObject),
+    };
     return OK;
 }
 
@@ -469,9 +809,9 @@ status_t RpcState::getSessionId(const sp<RpcSession::RpcConnection>& connection,
     return reply.readByteVector(sessionIdOut);
 }
 
-status_t RpcState::transact(const sp<RpcSession::RpcConnection>& connection,
-                            const sp<IBinder>& binder, uint32_t code, const Parcel& data,
-                            const sp<RpcSession>& session, Parcel* reply, uint32_t flags) {
+status_t RpcState::prepareTransaction(const sp<IBinder>& binder, uint32_t code,
+                                      const Parcel& data, const sp<RpcSession>& session,
+                                      uint64_t* address) {
     if (!data.isForRpc()) {
         ALOGE("Refusing to send RPC with parcel not crafted for RPC call on binder %p code "
               "%" PRIu32,
@@ -486,25 +826,182 @@ status_t RpcState::transact(const sp<RpcSession::RpcConnection>& connection,
         return BAD_TYPE;
     }
 
+    return onBinderLeaving(session, binder, address);
+}
+
+status_t RpcState::transact(const sp<RpcSession::RpcConnection>& connection,
+                            const sp<IBinder>& binder, uint32_t code, const Parcel& data,
+                            const sp<RpcSession>& session, Parcel* reply, uint32_t flags) {
     uint64_t address;
-    if (status_t status = onBinderLeaving(session, binder, &address); status != OK) return status;
+    if (status_t status = prepareTransaction(binder, code, data, session, &address);
+        status != OK) {
+        return status;
+    }
 
     return transactAddress(connection, address, code, data, session, reply, flags);
 }
 
+status_t RpcState::transactAsync(const sp<RpcSession::RpcConnection>& connection,
+                                 const sp<IBinder>& binder, uint32_t code, const Parcel& data,
+                                 const sp<RpcSession>& session,
+                                 RpcSession::TransactCallback&& callback, uint32_t flags) {
+    LOG_ALWAYS_FATAL_IF(!connection->multiplexed, "Asynchronous calls need a multiplexed connection");
+    LOG_ALWAYS_FATAL_IF(callback == nullptr, "Asynchronous calls need a callback");
+
+    uint64_t address;
+    if (status_t status = prepareTransaction(binder, code, data, session, &address);
+        status != OK) {
+        return status;
+    }
+
+    return transactAddress(connection, address, code, data, session, nullptr, flags,
+                           std::move(callback));
+}
+
+status_t RpcState::queueOneway(const sp<IBinder>& binder, uint32_t code, const Parcel& data,
+                               const sp<RpcSession>& session, size_t maxBytes, bool* needsFlush) {
+    uint64_t address;
+    if (status_t status = prepareTransaction(binder, code, data, session, &address);
+        status != OK) {
+        return status;
+    }
+
+    LOG_ALWAYS_FATAL_IF(std::numeric_limits<int32_t>::max() - sizeof(RpcWireHeader) -
+                                        sizeof(RpcWireTransaction) <
+                                data.dataSize(),
+                        "Too much data %zu", data.dataSize());
+
+    RpcWireHeader command{
+            .command = RPC_COMMAND_TRANSACT,
+            .bodySize = static_cast<uint32_t>(sizeof(RpcWireTransaction) + data.dataSize()),
+    };
+
+    NodeShard& shard = shardForAddress(address);
+    std::unique_lock<std::mutex> _l(shard.mutex);
+    if (mTerminated) return DEAD_OBJECT; // avoid fatal only, otherwise races
+    auto it = shard.nodes.find(address);
+    LOG_ALWAYS_FATAL_IF(it == shard.nodes.end(), "Sending transact on unknown address %" PRIu64,
+                        address);
+
+    RpcWireTransaction transaction{
+            .address = RpcWireAddress::fromRaw(address),
+            .code = code,
+            .flags = IBinder::FLAG_ONEWAY,
+            .asyncNumber = it->second.asyncNumber,
+    };
+    if (!nodeProgressAsyncNumber(&it->second)) {
+        _l.unlock();
+        (void)session->shutdownAndWait(false);
+        return DEAD_OBJECT;
+    }
+
+    // queued with the node lock still held, so that calls to each binder are
+    // queued in asyncNumber order
+    std::lock_guard<std::mutex> _lp(mPendingMutex);
+    auto append = [&](const void* buf, size_t size) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buf);
+        mPendingOneways.insert(mPendingOneways.end(), bytes, bytes + size);
+    };
+    append(&command, sizeof(command));
+    append(&transaction, sizeof(transaction));
+    append(data.data(), data.dataSize());
+    mNumQueuedOneways++;
+
+    Stats::add(mStats.forCode(address, code).sent, 1);
+    Stats::record(mStats.requestBytes, data.dataSize());
+
+    *needsFlush = mPendingOneways.size() >= maxBytes;
+    return OK;
+}
+
+RpcState::Stats::Code& RpcState::Stats::forCode(uint64_t address, uint32_t code) {
+    // special transactions reuse small codes, so they are counted with 'other'
+    if (address == 0 || code >= TransactionStats::kNumCodes) {
+        return codes[TransactionStats::kNumCodes];
+    }
+    return codes[code];
+}
+
+void RpcState::Stats::add(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+void RpcState::Stats::record(Histogram& histogram, uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    add(histogram[std::min(bucket, histogram.size() - 1)], 1);
+}
+
+void RpcState::Stats::read(const Histogram& histogram, TransactionStats::Histogram* out) {
+    for (size_t i = 0; i < histogram.size(); i++) {
+        (*out)[i] = histogram[i].load(std::memory_order_relaxed);
+    }
+}
+
+RpcSession::TransactionStats RpcState::getTransactionStats() {
+    RpcSession::TransactionStats stats;
+    for (uint32_t code = 0; code < mStats.codes.size(); code++) {
+        const Stats::Code& c = mStats.codes[code];
+        RpcSession::TransactionStats::CodeStats codeStats{
+                .code = code,
+                .sent = c.sent.load(std::memory_order_relaxed),
+                .sentUs = c.sentUs.load(std::memory_order_relaxed),
+                .received = c.received.load(std::memory_order_relaxed),
+                .receivedUs = c.receivedUs.load(std::memory_order_relaxed),
+        };
+        if (codeStats.sent == 0 && codeStats.received == 0) continue;
+        stats.codes.push_back(codeStats);
+    }
+    Stats::read(mStats.requestBytes, &stats.requestBytes);
+    Stats::read(mStats.replyBytes, &stats.replyBytes);
+    Stats::read(mStats.sendUs, &stats.sendUs);
+    Stats::read(mStats.waitUs, &stats.waitUs);
+    Stats::read(mStats.receivedBytes, &stats.receivedBytes);
+    Stats::read(mStats.dispatchUs, &stats.dispatchUs);
+    return stats;
+}
+
+RpcSession::BufferPoolStats RpcState::getBufferPoolStats() {
+    return mCommandDataPool->getStats();
+}
+
+RpcSession::OnewayBatchStats RpcState::getOnewayBatchStats() {
+    return RpcSession::OnewayBatchStats{
+            .queuedCalls = mNumQueuedOneways,
+            .flushes = mNumOnewayFlushes,
+    };
+}
+
 status_t RpcState::transactAddress(const sp<RpcSession::RpcConnection>& connection,
                                    uint64_t address, uint32_t code, const Parcel& data,
-                                   const sp<RpcSession>& session, Parcel* reply, uint32_t flags) {
+                                   const sp<RpcSession>& session, Parcel* reply, uint32_t flags,
+                                   RpcSession::TransactCallback&& asyncCallback) {
     LOG_ALWAYS_FATAL_IF(!data.isForRpc());
     LOG_ALWAYS_FATAL_IF(data.objectsCount() != 0);
 
+    // checked before anything is sent, and in particular before asyncNumber
+    // progresses, so that giving up here leaves no trace
+    std::optional<std::chrono::steady_clock::time_point> deadline = RpcSession::callDeadline();
+    uint32_t timeoutMs = 0;
+    if (deadline) {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                *deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) return TIMED_OUT;
+        timeoutMs = static_cast<uint32_t>(
+                std::min<int64_t>(remaining.count(), std::numeric_limits<uint32_t>::max()));
+    }
+
     uint64_t asyncNumber = 0;
+    // queued oneways and dec strongs are sent in the same write as this
+    // transaction
+    std::vector<uint8_t> oneways;
+    std::vector<RpcDecStrong> decStrongs;
 
     if (address != 0) {
-        std::unique_lock<std::mutex> _l(mNodeMutex);
+        NodeShard& shard = shardForAddress(address);
+        std::unique_lock<std::mutex> _l(shard.mutex);
         if (mTerminated) return DEAD_OBJECT; // avoid fatal only, otherwise races
-        auto it = mNodeForAddress.find(address);
-        LOG_ALWAYS_FATAL_IF(it == mNodeForAddress.end(),
+        auto it = shard.nodes.find(address);
+        LOG_ALWAYS_FATAL_IF(it == shard.nodes.end(),
                             "Sending transact on unknown address %" PRIu64, address);
 
         if (flags & IBinder::FLAG_ONEWAY) {
@@ -517,6 +1014,8 @@ status_t RpcState::transactAddress(const sp<RpcSession::RpcConnection>& connecti
         }
     }
 
+    takePending(&oneways, &decStrongs);
+
     LOG_ALWAYS_FATAL_IF(std::numeric_limits<int32_t>::max() - sizeof(RpcWireHeader) -
                                         sizeof(RpcWireTransaction) <
                                 data.dataSize(),
@@ -532,7 +1031,17 @@ status_t RpcState::transactAddress(const sp<RpcSession::RpcConnection>& connecti
             .code = code,
             .flags = flags,
             .asyncNumber = asyncNumber,
+            .timeoutMs = timeoutMs,
     };
+    if (session->mPriorityInheritance && !(flags & IBinder::FLAG_ONEWAY)) {
+        transaction.priority = RpcPriority::current();
+    }
+
+    // replies on a multiplexed connection may be read by any waiting thread
+    bool multiplexed = connection->multiplexed && !(flags & IBinder::FLAG_ONEWAY);
+    bool async = asyncCallback != nullptr;
+    LOG_ALWAYS_FATAL_IF(async && !multiplexed, "Asynchronous calls need a multiplexed connection");
+    if (multiplexed) transaction.requestId = beginMultiplexedRequest(std::move(asyncCallback));
 
     constexpr size_t kWaitMaxUs = 1000000;
     constexpr size_t kWaitLogUs = 10000;
@@ -555,85 +1064,619 @@ status_t RpcState::transactAddress(const sp<RpcSession::RpcConnection>& connecti
             waitUs = 1;
         }
 
+        if (connection->multiplexed) return drainMultiplexed(connection, session);
         return drainCommands(connection, session, CommandType::CONTROL_ONLY);
     };
 
+    RpcWireHeader decStrongCommand{
+            .command = RPC_COMMAND_DEC_STRONG_BATCH,
+            .bodySize = static_cast<uint32_t>(decStrongs.size() * sizeof(RpcDecStrong)),
+    };
+
     iovec iovs[]{
+            {oneways.data(), oneways.size()},
+            {&decStrongCommand, sizeof(RpcWireHeader)},
+            {decStrongs.data(), decStrongs.size() * sizeof(RpcDecStrong)},
             {&command, sizeof(RpcWireHeader)},
             {&transaction, sizeof(RpcWireTransaction)},
             {const_cast<uint8_t*>(data.data()), data.dataSize()},
     };
-    if (status_t status =
-                rpcSend(connection, session, "transaction", iovs, arraysize(iovs), drainRefs);
+    // skip the dec strong batch if nothing is queued, and keep any queued
+    // oneways right before the transaction
+    constexpr int kNumPendingIovs = 3;
+    int firstIov = decStrongs.empty() ? kNumPendingIovs : 0;
+    if (firstIov != 0 && !oneways.empty()) {
+        iovs[--firstIov] = iovs[0];
+    }
+    auto startTime = std::chrono::steady_clock::now();
+    if (status_t status = rpcSend(connection, session, "transaction", iovs + firstIov,
+                                  arraysize(iovs) - firstIov, drainRefs);
         status != OK) {
         // TODO(b/167966510): need to undo onBinderLeaving - we know the
         // refcount isn't successfully transferred.
+        restorePendingDecStrongs(std::move(decStrongs));
+        if (multiplexed) {
+            std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+            mMultiplexed.inFlight.erase(transaction.requestId);
+            mMultiplexed.asyncInFlight.erase(transaction.requestId);
+        }
         return status;
     }
+    auto sentTime = std::chrono::steady_clock::now();
+    if (!oneways.empty()) mNumOnewayFlushes++;
+
+    Stats::Code& codeStats = mStats.forCode(address, code);
+    Stats::add(codeStats.sent, 1);
+    Stats::record(mStats.requestBytes, data.dataSize());
+    Stats::record(mStats.sendUs, microsBetween(startTime, sentTime));
 
     if (flags & IBinder::FLAG_ONEWAY) {
         LOG_RPC_DETAIL("Oneway command, so no longer waiting on RpcTransport %p",
                        connection->rpcTransport.get());
+        Stats::add(codeStats.sentUs, microsBetween(startTime, sentTime));
 
         // Do not wait on result.
         return OK;
     }
 
+    if (async) {
+        Stats::add(codeStats.sentUs, microsBetween(startTime, sentTime));
+        startAsyncReader(connection, session);
+        return OK;
+    }
+
     LOG_ALWAYS_FATAL_IF(reply == nullptr, "Reply parcel must be used for synchronous transaction.");
 
-    return waitForReply(connection, session, reply);
+    status_t status = multiplexed
+            ? waitForMultiplexedReply(connection, session, transaction.requestId, reply, deadline)
+            : waitForReply(connection, session, reply, deadline);
+
+    auto doneTime = std::chrono::steady_clock::now();
+    Stats::add(codeStats.sentUs, microsBetween(startTime, doneTime));
+    Stats::record(mStats.waitUs, microsBetween(sentTime, doneTime));
+    if (status == OK) Stats::record(mStats.replyBytes, reply->dataSize());
+
+    return status;
 }
 
-static void cleanup_reply_data(Parcel* p, const uint8_t* data, size_t dataSize,
-                               const binder_size_t* objects, size_t objectsCount) {
+void RpcState::cleanupReplyData(Parcel* p, const uint8_t* data, size_t dataSize,
+                                const binder_size_t* objects, size_t objectsCount) {
     (void)p;
-    delete[] const_cast<uint8_t*>(data - offsetof(RpcWireReply, data));
+    CommandDataPool::recycle(const_cast<uint8_t*>(data));
     (void)dataSize;
     LOG_ALWAYS_FATAL_IF(objects != nullptr);
     LOG_ALWAYS_FATAL_IF(objectsCount != 0, "%zu objects remaining", objectsCount);
 }
 
-status_t RpcState::waitForReply(const sp<RpcSession::RpcConnection>& connection,
-                                const sp<RpcSession>& session, Parcel* reply) {
+status_t RpcState::rpcWaitForRead(const sp<RpcSession::RpcConnection>& connection,
+                                  const sp<RpcSession>& session, const char* what,
+                                  std::chrono::steady_clock::time_point deadline) {
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+    status_t status =
+            connection->rpcTransport->waitForRead(session->mShutdownTrigger.get(),
+                                                  std::max(remaining,
+                                                           std::chrono::milliseconds(0)));
+    if (status == OK || status == TIMED_OUT) return status;
+
+    LOG_RPC_DETAIL("Failed to wait for %s on RpcTransport %p, error: %s", what,
+                   connection->rpcTransport.get(), statusToString(status).c_str());
+    (void)session->shutdownAndWait(false);
+    return status;
+}
+
+status_t RpcState::waitForReply(
+        const sp<RpcSession::RpcConnection>& connection, const sp<RpcSession>& session,
+        Parcel* reply, std::optional<std::chrono::steady_clock::time_point> deadline) {
     RpcWireHeader command;
     while (true) {
+        if (deadline) {
+            // The reply will still come. Commands are only ever read whole,
+            // so the connection is otherwise in a good state, and it is only
+            // used again once the reply arrived (see
+            // RpcSession::ExclusiveConnection), or by the call which this one
+            // is nested in.
+            if (status_t status =
+                        rpcWaitForRead(connection, session, "command header (for reply)",
+                                       *deadline);
+                status != OK) {
+                if (status == TIMED_OUT) connection->staleReplies++;
+                return status;
+            }
+        }
+
         iovec iov{&command, sizeof(command)};
         if (status_t status = rpcRec(connection, session, "command header (for reply)", &iov, 1);
             status != OK)
             return status;
 
-        if (command.command == RPC_COMMAND_REPLY) break;
+        if (command.command == RPC_COMMAND_REPLY && connection->staleReplies == 0) break;
 
         if (status_t status = processCommand(connection, session, command, CommandType::ANY);
             status != OK)
             return status;
     }
 
-    CommandData data(command.bodySize);
-    if (!data.valid()) return NO_MEMORY;
-
-    iovec iov{data.data(), command.bodySize};
-    if (status_t status = rpcRec(connection, session, "reply body", &iov, 1); status != OK)
+    RpcWireReply rpcReply;
+    std::optional<CommandData> data;
+    if (status_t status = readReply(connection, session, command, &rpcReply, &data, reply);
+        status != OK)
         return status;
 
-    if (command.bodySize < sizeof(RpcWireReply)) {
-        ALOGE("Expecting %zu but got %" PRId32 " bytes for RpcWireReply. Terminating!",
-              sizeof(RpcWireReply), command.bodySize);
+    // already read into the reply Parcel
+    if (!data.has_value()) return rpcReply.status;
+
+    return setReply(session, rpcReply.status, std::move(*data), reply);
+}
+
+size_t RpcState::wireReplySize(const sp<RpcSession>& session) {
+    return session->mReplyRequestIds ? sizeof(RpcWireReply) : sizeof(RpcWireReplyV0);
+}
+
+bool RpcState::replyHasBinderPositions(const sp<RpcSession>& session) {
+    return session->mReplyBinderPositions;
+}
+
+status_t RpcState::takeReplyBinderPositions(const uint8_t* data, size_t* dataSize,
+                                            std::vector<uint32_t>* positions) {
+    uint32_t numPositions;
+    if (*dataSize < sizeof(numPositions)) {
+        ALOGE("Reply of %zu bytes is too small for its binder positions", *dataSize);
+        return BAD_VALUE;
+    }
+    memcpy(&numPositions, data + *dataSize - sizeof(numPositions), sizeof(numPositions));
+    size_t available = (*dataSize - sizeof(numPositions)) / sizeof(uint32_t);
+    if (numPositions > available) {
+        ALOGE("Reply of %zu bytes can't hold %" PRIu32 " binder positions", *dataSize,
+              numPositions);
+        return BAD_VALUE;
+    }
+    *dataSize -= (numPositions + 1) * sizeof(uint32_t);
+
+    if (positions != nullptr) {
+        positions->resize(numPositions);
+        memcpy(positions->data(), data + *dataSize, numPositions * sizeof(uint32_t));
+    }
+    return OK;
+}
+
+status_t RpcState::readReply(const sp<RpcSession::RpcConnection>& connection,
+                             const sp<RpcSession>& session, const RpcWireHeader& command,
+                             RpcWireReply* rpcReply, std::optional<CommandData>* data,
+                             Parcel* inPlaceReply, std::vector<uint32_t>* binderPositions) {
+    size_t replySize = wireReplySize(session);
+    if (command.bodySize < replySize) {
+        ALOGE("Expecting %zu but got %" PRId32 " bytes for RpcWireReply. Terminating!", replySize,
+              command.bodySize);
         (void)session->shutdownAndWait(false);
         return BAD_VALUE;
     }
-    RpcWireReply* rpcReply = reinterpret_cast<RpcWireReply*>(data.data());
-    if (rpcReply->status != OK) return rpcReply->status;
+    size_t dataSize = command.bodySize - replySize;
+
+    // The caller made room for the reply, so the payload is read straight into
+    // the Parcel, and there is no intermediate buffer.
+    if (uint8_t* buffer = inPlaceReply ? inPlaceReply->rpcReplyBuffer(dataSize) : nullptr;
+        buffer != nullptr) {
+        *rpcReply = {};
+        iovec iovs[]{
+                {rpcReply, replySize},
+                {buffer, dataSize},
+        };
+        if (status_t status = rpcRec(connection, session, "reply body", iovs, arraysize(iovs));
+            status != OK)
+            return status;
+        if (replyHasBinderPositions(session)) {
+            if (status_t status = takeReplyBinderPositions(buffer, &dataSize, binderPositions);
+                status != OK) {
+                (void)session->shutdownAndWait(false);
+                return status;
+            }
+        }
+        if (rpcReply->status == OK) inPlaceReply->rpcSetReplyData(session, dataSize);
+        return OK;
+    }
 
-    data.release();
-    reply->ipcSetDataReference(rpcReply->data, command.bodySize - offsetof(RpcWireReply, data),
-                               nullptr, 0, cleanup_reply_data);
+    data->emplace(mCommandDataPool, dataSize);
+    if (!(*data)->valid()) return NO_MEMORY;
 
+    // reply data goes to the start of the buffer, so the Parcel owns it directly
+    *rpcReply = {};
+    iovec iovs[]{
+            {rpcReply, replySize},
+            {(*data)->data(), (*data)->size()},
+    };
+    if (status_t status = rpcRec(connection, session, "reply body", iovs, arraysize(iovs));
+        status != OK)
+        return status;
+    if (replyHasBinderPositions(session)) {
+        if (status_t status = takeReplyBinderPositions((*data)->data(), &dataSize, binderPositions);
+            status != OK) {
+            (void)session->shutdownAndWait(false);
+            return status;
+        }
+        (*data)->shrink(dataSize);
+    }
+    return OK;
+}
+
+status_t RpcState::processStaleReply(const sp<RpcSession::RpcConnection>& connection,
+                                     const sp<RpcSession>& session, const RpcWireHeader& command) {
+    LOG_ALWAYS_FATAL_IF(connection->staleReplies == 0, "Unexpected stale reply");
+
+    RpcWireReply rpcReply;
+    std::optional<CommandData> data;
+    std::vector<uint32_t> binderPositions;
+    if (status_t status = readReply(connection, session, command, &rpcReply, &data, nullptr,
+                                    &binderPositions);
+        status != OK)
+        return status;
+    connection->staleReplies--;
+    LOG_RPC_DETAIL("Dropping reply to a call which timed out, status %" PRId32, rpcReply.status);
+    return releaseReplyBinders(session, rpcReply.status, std::move(*data), binderPositions);
+}
+
+status_t RpcState::releaseReplyBinders(const sp<RpcSession>& session, int32_t replyStatus,
+                                       CommandData data,
+                                       const std::vector<uint32_t>& binderPositions) {
+    if (replyStatus != OK || binderPositions.empty()) return OK;
+
+    // The other side counted a reference for each binder it sent, so they
+    // are read like the caller would have, and then dropped.
+    std::vector<sp<IBinder>> binders;
+    {
+        Parcel reply;
+        if (status_t status = setReply(session, OK, std::move(data), &reply); status != OK)
+            return status;
+        for (uint32_t position : binderPositions) {
+            reply.setDataPosition(position);
+            sp<IBinder> binder;
+            if (status_t status = reply.readNullableStrongBinder(&binder); status != OK) {
+                ALOGE("Could not read binder at %" PRIu32 " of a stale reply: %s", position,
+                      statusToString(status).c_str());
+                continue;
+            }
+            binders.push_back(std::move(binder));
+        }
+    }
+    for (sp<IBinder>& binder : binders) {
+        // destructor may make binder calls on this session
+        releaseBinder(std::move(binder));
+    }
+    return OK;
+}
+
+status_t RpcState::setReply(const sp<RpcSession>& session, int32_t status, CommandData data,
+                            Parcel* reply) {
+    if (status != OK) return status;
+
+    size_t size = data.size();
+    reply->ipcSetDataReference(data.release(), size, nullptr, 0, cleanupReplyData);
     reply->markForRpc(session);
 
     return OK;
 }
 
+uint32_t RpcState::beginMultiplexedRequest(RpcSession::TransactCallback&& asyncCallback) {
+    std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+    uint32_t requestId;
+    do {
+        requestId = mMultiplexed.nextRequestId++;
+    } while (requestId == 0 || mMultiplexed.inFlight.count(requestId) != 0 ||
+             mMultiplexed.asyncInFlight.count(requestId) != 0);
+    if (asyncCallback != nullptr) {
+        mMultiplexed.asyncInFlight.emplace(requestId, std::move(asyncCallback));
+    } else {
+        mMultiplexed.inFlight.emplace(requestId, std::nullopt);
+    }
+    return requestId;
+}
+
+void RpcState::startAsyncReader(const sp<RpcSession::RpcConnection>& connection,
+                                const sp<RpcSession>& session) {
+    std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+    if (mMultiplexed.asyncReaderRunning) return;
+    mMultiplexed.asyncReaderRunning = true;
+    // The last one is done, and doesn't take the lock again. It can't be this
+    // thread, since callbacks run while it is still running.
+    if (mMultiplexed.asyncReader.joinable()) mMultiplexed.asyncReader.join();
+    mMultiplexed.asyncReader = std::thread([connection, session]() {
+        session->state()->runAsyncReader(connection, session);
+    });
+}
+
+void RpcState::joinAsyncReader() {
+    std::thread reader;
+    {
+        std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+        reader.swap(mMultiplexed.asyncReader);
+    }
+    if (!reader.joinable()) return;
+    // e.g. a callback shut the session down, or dropped the last reference
+    if (reader.get_id() == std::this_thread::get_id()) {
+        reader.detach();
+        return;
+    }
+    reader.join();
+}
+
+void RpcState::runAsyncReader(const sp<RpcSession::RpcConnection>& connection,
+                              const sp<RpcSession>& session) {
+    pid_t tid = gettid();
+    std::unique_lock<std::mutex> _l(mMultiplexed.mutex);
+    while (!mMultiplexed.asyncInFlight.empty() || !mMultiplexed.asyncReplies.empty()) {
+        if (!mMultiplexed.asyncReplies.empty()) {
+            Multiplexed::AsyncReply asyncReply = std::move(mMultiplexed.asyncReplies.front());
+            mMultiplexed.asyncReplies.pop();
+            _l.unlock();
+
+            RpcSession::AsyncReply reply{.status = asyncReply.status};
+            if (asyncReply.data.has_value()) {
+                reply.parcel = std::make_unique<Parcel>();
+                reply.status = setReply(session, asyncReply.status, std::move(*asyncReply.data),
+                                        reply.parcel.get());
+                if (reply.status == OK) {
+                    Stats::record(mStats.replyBytes, reply.parcel->dataSize());
+                } else {
+                    reply.parcel = nullptr;
+                }
+            }
+            asyncReply.callback(std::move(reply));
+
+            _l.lock();
+            continue;
+        }
+
+        // a thread waiting on a synchronous call is reading, and it queues
+        // the replies for this thread
+        if (mMultiplexed.readerTid != std::nullopt) {
+            mMultiplexed.replyCv.wait(_l);
+            continue;
+        }
+
+        mMultiplexed.readerTid = tid;
+        _l.unlock();
+        status_t status = readMultiplexedCommand(connection, session);
+        _l.lock();
+        mMultiplexed.readerTid = std::nullopt;
+        // wake waiters, either for their reply or to take over reading
+        mMultiplexed.replyCv.notify_all();
+
+        if (status != OK) {
+            LOG_RPC_DETAIL("Failing %zu asynchronous calls: %s",
+                           mMultiplexed.asyncInFlight.size(), statusToString(status).c_str());
+            for (auto& [requestId, callback] : mMultiplexed.asyncInFlight) {
+                mMultiplexed.asyncReplies.push(Multiplexed::AsyncReply{
+                        .callback = std::move(callback),
+                        .status = status,
+                });
+            }
+            mMultiplexed.asyncInFlight.clear();
+        }
+    }
+    mMultiplexed.asyncReaderRunning = false;
+}
+
+status_t RpcState::waitForMultiplexedReply(
+        const sp<RpcSession::RpcConnection>& connection, const sp<RpcSession>& session,
+        uint32_t requestId, Parcel* reply,
+        std::optional<std::chrono::steady_clock::time_point> deadline) {
+    pid_t tid = gettid();
+    std::unique_lock<std::mutex> _l(mMultiplexed.mutex);
+    while (true) {
+        auto it = mMultiplexed.inFlight.find(requestId);
+        LOG_ALWAYS_FATAL_IF(it == mMultiplexed.inFlight.end(), "Lost request %" PRIu32, requestId);
+
+        if (it->second.has_value()) {
+            MultiplexedReply rpcReply = std::move(*it->second);
+            mMultiplexed.inFlight.erase(it);
+            _l.unlock();
+            return setReply(session, rpcReply.status, std::move(rpcReply.data), reply);
+        }
+
+        // If this thread is already the reader, this call is made while it is
+        // processing a command (e.g. from a binder destructor), and it isn't
+        // in the middle of reading a message.
+        if (mMultiplexed.readerTid == std::nullopt || *mMultiplexed.readerTid == tid) {
+            std::optional<pid_t> origReaderTid = mMultiplexed.readerTid;
+            mMultiplexed.readerTid = tid;
+            _l.unlock();
+
+            // a late reply is dropped as unknown by whichever thread reads it
+            status_t status = OK;
+            if (deadline) {
+                status = rpcWaitForRead(connection, session, "command header (multiplexed)",
+                                        *deadline);
+            }
+            if (status == OK) status = readMultiplexedCommand(connection, session);
+
+            _l.lock();
+            mMultiplexed.readerTid = origReaderTid;
+            // wake waiters, either for their reply or to take over reading
+            mMultiplexed.replyCv.notify_all();
+            if (status != OK) {
+                mMultiplexed.inFlight.erase(requestId);
+                return status;
+            }
+            continue;
+        }
+
+        if (!deadline) {
+            mMultiplexed.replyCv.wait(_l);
+        } else if (mMultiplexed.replyCv.wait_until(_l, *deadline) == std::cv_status::timeout) {
+            // the reply may have come in just now
+            it = mMultiplexed.inFlight.find(requestId);
+            if (it != mMultiplexed.inFlight.end() && it->second.has_value()) continue;
+            mMultiplexed.inFlight.erase(requestId);
+            return TIMED_OUT;
+        }
+    }
+}
+
+status_t RpcState::readMultiplexedCommand(const sp<RpcSession::RpcConnection>& connection,
+                                          const sp<RpcSession>& session) {
+    RpcWireHeader command;
+    iovec iov{&command, sizeof(command)};
+    if (status_t status = rpcRec(connection, session, "command header (multiplexed)", &iov, 1);
+        status != OK)
+        return status;
+
+    if (command.command == RPC_COMMAND_TRANSACT) {
+        ALOGE("Nested transactions are not supported on multiplexed connections. Terminating!");
+        (void)session->shutdownAndWait(false);
+        return BAD_TYPE;
+    }
+    if (command.command != RPC_COMMAND_REPLY) {
+        return processCommand(connection, session, command, CommandType::CONTROL_ONLY);
+    }
+
+    RpcWireReply rpcReply;
+    std::optional<CommandData> data;
+    std::vector<uint32_t> binderPositions;
+    if (status_t status = readReply(connection, session, command, &rpcReply, &data, nullptr,
+                                    &binderPositions);
+        status != OK)
+        return status;
+
+    std::unique_lock<std::mutex> _l(mMultiplexed.mutex);
+    if (auto asyncIt = mMultiplexed.asyncInFlight.find(rpcReply.requestId);
+        asyncIt != mMultiplexed.asyncInFlight.end()) {
+        // the async reader is woken up once this thread is done reading
+        mMultiplexed.asyncReplies.push(Multiplexed::AsyncReply{
+                .callback = std::move(asyncIt->second),
+                .status = rpcReply.status,
+                .data = std::move(*data),
+        });
+        mMultiplexed.asyncInFlight.erase(asyncIt);
+        return OK;
+    }
+
+    auto it = mMultiplexed.inFlight.find(rpcReply.requestId);
+    if (it == mMultiplexed.inFlight.end() || it->second.has_value()) {
+        // typically, the caller timed out
+        LOG_RPC_DETAIL("Dropping reply for unknown request %" PRIu32, rpcReply.requestId);
+        _l.unlock();
+        return releaseReplyBinders(session, rpcReply.status, std::move(*data), binderPositions);
+    }
+    it->second = MultiplexedReply{
+            .status = rpcReply.status,
+            .data = std::move(*data),
+    };
+    return OK;
+}
+
+status_t RpcState::drainMultiplexed(const sp<RpcSession::RpcConnection>& connection,
+                                    const sp<RpcSession>& session) {
+    pid_t tid = gettid();
+    std::optional<pid_t> origReaderTid;
+    {
+        std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+        // another thread is already reading, so it is draining the connection
+        if (mMultiplexed.readerTid != std::nullopt && *mMultiplexed.readerTid != tid) return OK;
+        origReaderTid = mMultiplexed.readerTid;
+        mMultiplexed.readerTid = tid;
+    }
+
+    status_t status = OK;
+    uint8_t buf;
+    while (true) {
+        size_t num_bytes;
+        status = connection->rpcTransport->peek(&buf, sizeof(buf), &num_bytes);
+        if (status == WOULD_BLOCK) {
+            status = OK;
+            break;
+        }
+        if (status != OK || !num_bytes) break;
+
+        status = readMultiplexedCommand(connection, session);
+        if (status != OK) break;
+    }
+
+    {
+        std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+        mMultiplexed.readerTid = origReaderTid;
+    }
+    mMultiplexed.replyCv.notify_all();
+    return status;
+}
+
+status_t RpcState::dispatchMultiplexed(const sp<RpcSession::RpcConnection>& connection,
+                                       const sp<RpcSession>& session,
+                                       CommandData transactionData) {
+    // the thread reading from the connection counts as one of the threads
+    size_t maxWorkers = std::max<size_t>(session->getMaxIncomingThreads(), 1) - 1;
+
+    std::unique_lock<std::mutex> _l(mMultiplexed.mutex);
+    if (mMultiplexed.terminated) return DEAD_OBJECT;
+
+    // the size is checked once the transaction is processed
+    int32_t urgency = 0;
+    if (session->mPriorityInheritance && transactionData.size() >= sizeof(RpcWireTransaction)) {
+        urgency = RpcPriority::urgency(RpcPriority::clamp(
+                reinterpret_cast<RpcWireTransaction*>(transactionData.data())->priority,
+                session->mMaxCallerRealtimePriority));
+    }
+
+    bool haveIdleWorker = mMultiplexed.numIdleWorkers > mMultiplexed.todo.size();
+    if (haveIdleWorker || mMultiplexed.numWorkers < maxWorkers) {
+        mMultiplexed.todo.emplace(urgency, std::move(transactionData));
+        if (haveIdleWorker) {
+            mMultiplexed.todoCv.notify_one();
+        } else {
+            mMultiplexed.numWorkers++;
+            mMultiplexed.workers.emplace_back([connection, session] {
+                session->state()->runMultiplexedWorker(connection, session);
+            });
+        }
+        return OK;
+    }
+    _l.unlock();
+
+    // all workers are busy, so this also stops reading until one is done
+    return processTransactInternal(connection, session, std::move(transactionData));
+}
+
+void RpcState::joinMultiplexedWorkers() {
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> _l(mMultiplexed.mutex);
+        mMultiplexed.terminated = true;
+        // dropped, like transactions which haven't been read yet
+        mMultiplexed.todo.clear();
+        workers.swap(mMultiplexed.workers);
+    }
+    mMultiplexed.todoCv.notify_all();
+
+    for (std::thread& worker : workers) worker.join();
+}
+
+void RpcState::runMultiplexedWorker(const sp<RpcSession::RpcConnection>& connection,
+                                    const sp<RpcSession>& session) {
+    std::unique_lock<std::mutex> _l(mMultiplexed.mutex);
+    while (true) {
+        mMultiplexed.numIdleWorkers++;
+        mMultiplexed.todoCv.wait(_l, [&] {
+            return mMultiplexed.terminated || !mMultiplexed.todo.empty();
+        });
+        mMultiplexed.numIdleWorkers--;
+        if (mMultiplexed.terminated) break;
+
+        // most urgent first, and in order of arrival otherwise
+        auto next = mMultiplexed.todo.begin();
+        CommandData transactionData = std::move(next->second);
+        mMultiplexed.todo.erase(next);
+        _l.unlock();
+
+        if (status_t status =
+                    processTransactInternal(connection, session, std::move(transactionData));
+            status != OK) {
+            LOG_RPC_DETAIL("Multiplexed transaction failed: %s", statusToString(status).c_str());
+        }
+
+        _l.lock();
+    }
+    mMultiplexed.numWorkers--;
+}
+
 status_t RpcState::sendDecStrongToTarget(const sp<RpcSession::RpcConnection>& connection,
                                          const sp<RpcSession>& session, uint64_t addr,
                                          size_t target) {
@@ -642,24 +1685,10 @@ status_t RpcState::sendDecStrongToTarget(const sp<RpcSession::RpcConnection>& co
     };
 
     {
-        std::lock_guard<std::mutex> _l(mNodeMutex);
+        NodeShard& shard = shardForAddress(addr);
+        std::lock_guard<std::mutex> _l(shard.mutex);
         if (mTerminated) return DEAD_OBJECT; // avoid fatal only, otherwise races
-        auto it = mNodeForAddress.find(addr);
-        LOG_ALWAYS_FATAL_IF(it == mNodeForAddress.end(),
-                            "Sending dec strong on unknown address %" PRIu64, addr);
-
-        LOG_ALWAYS_FATAL_IF(it->second.timesRecd < target, "Can't dec count of %zu to %zu.",
-                            it->second.timesRecd, target);
-
-        // typically this happens when multiple threads send dec refs at the
-        // same time - the transactions will get combined automatically
-        if (it->second.timesRecd == target) return OK;
-
-        body.amount = it->second.timesRecd - target;
-        it->second.timesRecd = target;
-
-        LOG_ALWAYS_FATAL_IF(nullptr != tryEraseNode(it),
-                            "Bad state. RpcState shouldn't own received binder");
+        if (!takeDecStrongToTargetLocked(shard, addr, target, &body.amount)) return OK;
     }
 
     RpcWireHeader cmd = {
@@ -670,6 +1699,123 @@ status_t RpcState::sendDecStrongToTarget(const sp<RpcSession::RpcConnection>& co
     return rpcSend(connection, session, "dec ref", iovs, arraysize(iovs));
 }
 
+status_t RpcState::sendCloseConnection(const sp<RpcSession::RpcConnection>& connection,
+                                       const sp<RpcSession>& session) {
+    RpcWireHeader cmd = {
+            .command = RPC_COMMAND_CLOSE_CONNECTION,
+            .bodySize = 0,
+    };
+    iovec iov{&cmd, sizeof(cmd)};
+    return rpcSend(connection, session, "close connection", &iov, 1);
+}
+
+status_t RpcState::queueDecStrongToTarget(uint64_t addr, size_t target, size_t maxPending,
+                                          bool* needsFlush) {
+    NodeShard& shard = shardForAddress(addr);
+    std::lock_guard<std::mutex> _l(shard.mutex);
+    if (mTerminated) return DEAD_OBJECT; // avoid fatal only, otherwise races
+
+    std::lock_guard<std::mutex> _lp(mPendingMutex);
+    uint32_t amount;
+    if (takeDecStrongToTargetLocked(shard, addr, target, &amount)) {
+        auto it = std::find_if(mPendingDecStrongs.begin(), mPendingDecStrongs.end(),
+                               [&](const RpcDecStrong& pending) {
+                                   return RpcWireAddress::toRaw(pending.address) == addr;
+                               });
+        if (it != mPendingDecStrongs.end()) {
+            it->amount += amount;
+        } else {
+            mPendingDecStrongs.push_back(RpcDecStrong{
+                    .address = RpcWireAddress::fromRaw(addr),
+                    .amount = amount,
+            });
+        }
+    }
+
+    *needsFlush = mPendingDecStrongs.size() >= maxPending;
+    return OK;
+}
+
+status_t RpcState::flushPending(const sp<RpcSession::RpcConnection>& connection,
+                                const sp<RpcSession>& session) {
+    if (mTerminated) return DEAD_OBJECT; // avoid fatal only, otherwise races
+
+    std::vector<uint8_t> oneways;
+    std::vector<RpcDecStrong> decStrongs;
+    takePending(&oneways, &decStrongs);
+    if (oneways.empty() && decStrongs.empty()) return OK;
+
+    LOG_RPC_DETAIL("Flushing %zu oneway bytes and %zu dec strongs", oneways.size(),
+                   decStrongs.size());
+
+    RpcWireHeader cmd = {
+            .command = RPC_COMMAND_DEC_STRONG_BATCH,
+            .bodySize = static_cast<uint32_t>(decStrongs.size() * sizeof(RpcDecStrong)),
+    };
+    iovec iovs[]{
+            {oneways.data(), oneways.size()},
+            {&cmd, sizeof(cmd)},
+            {decStrongs.data(), decStrongs.size() * sizeof(RpcDecStrong)},
+    };
+    // skip the dec strong batch if there is nothing queued
+    int niovs = decStrongs.empty() ? 1 : arraysize(iovs);
+    if (status_t status = rpcSend(connection, session, "pending batch", iovs, niovs);
+        status != OK) {
+        restorePendingDecStrongs(std::move(decStrongs));
+        return status;
+    }
+    if (!oneways.empty()) mNumOnewayFlushes++;
+    return OK;
+}
+
+void RpcState::takePending(std::vector<uint8_t>* oneways, std::vector<RpcDecStrong>* decStrongs) {
+    std::lock_guard<std::mutex> _l(mPendingMutex);
+    oneways->swap(mPendingOneways);
+    decStrongs->swap(mPendingDecStrongs);
+}
+
+void RpcState::restorePendingDecStrongs(std::vector<RpcDecStrong>&& decStrongs) {
+    if (decStrongs.empty()) return;
+
+    std::lock_guard<std::mutex> _l(mPendingMutex);
+    // the session is gone, and the other side drops the refcounts itself
+    if (mTerminated) return;
+
+    // ahead of any queued since, which may have been merged with these
+    for (const RpcDecStrong& pending : mPendingDecStrongs) {
+        auto it = std::find_if(decStrongs.begin(), decStrongs.end(), [&](const RpcDecStrong& d) {
+            return RpcWireAddress::toRaw(d.address) == RpcWireAddress::toRaw(pending.address);
+        });
+        if (it != decStrongs.end()) {
+            it->amount += pending.amount;
+        } else {
+            decStrongs.push_back(pending);
+        }
+    }
+    mPendingDecStrongs = std::move(decStrongs);
+}
+
+bool RpcState::takeDecStrongToTargetLocked(NodeShard& shard, uint64_t addr, size_t target,
+                                           uint32_t* amount) {
+    auto it = shard.nodes.find(addr);
+    LOG_ALWAYS_FATAL_IF(it == shard.nodes.end(),
+                        "Sending dec strong on unknown address %" PRIu64, addr);
+
+    LOG_ALWAYS_FATAL_IF(it->second.timesRecd < target, "Can't dec count of %zu to %zu.",
+                        it->second.timesRecd, target);
+
+    // typically this happens when multiple threads send dec refs at the
+    // same time - the transactions will get combined automatically
+    if (it->second.timesRecd == target) return false;
+
+    *amount = it->second.timesRecd - target;
+    it->second.timesRecd = target;
+
+    LOG_ALWAYS_FATAL_IF(nullptr != tryEraseNode(shard, it),
+                        "Bad state. RpcState shouldn't own received binder");
+    return true;
+}
+
 status_t RpcState::getAndExecuteCommand(const sp<RpcSession::RpcConnection>& connection,
                                         const sp<RpcSession>& session, CommandType type) {
     LOG_RPC_DETAIL("getAndExecuteCommand on RpcTransport %p", connection->rpcTransport.get());
@@ -683,6 +1829,18 @@ status_t RpcState::getAndExecuteCommand(const sp<RpcSession::RpcConnection>& con
     return processCommand(connection, session, command, type);
 }
 
+status_t RpcState::drainStaleReplies(const sp<RpcSession::RpcConnection>& connection,
+                                     const sp<RpcSession>& session) {
+    while (connection->staleReplies > 0) {
+        // calls nested in the ones which timed out are refused, see
+        // processTransactInternal
+        if (status_t status = getAndExecuteCommand(connection, session, CommandType::ANY);
+            status != OK)
+            return status;
+    }
+    return OK;
+}
+
 status_t RpcState::drainCommands(const sp<RpcSession::RpcConnection>& connection,
                                  const sp<RpcSession>& session, CommandType type) {
     uint8_t buf;
@@ -722,7 +1880,14 @@ status_t RpcState::processCommand(const sp<RpcSession::RpcConnection>& connectio
             if (type != CommandType::ANY) return BAD_TYPE;
             return processTransact(connection, session, command);
         case RPC_COMMAND_DEC_STRONG:
+        case RPC_COMMAND_DEC_STRONG_BATCH:
             return processDecStrong(connection, session, command);
+        case RPC_COMMAND_REPLY:
+            // only expected for calls which timed out, see waitForReply
+            if (connection->staleReplies == 0) break;
+            return processStaleReply(connection, session, command);
+        case RPC_COMMAND_CLOSE_CONNECTION:
+            return processCloseConnection(connection, session, command, type);
     }
 
     // We should always know the version of the opposing side, and since the
@@ -738,7 +1903,7 @@ status_t RpcState::processTransact(const sp<RpcSession::RpcConnection>& connecti
                                    const sp<RpcSession>& session, const RpcWireHeader& command) {
     LOG_ALWAYS_FATAL_IF(command.command != RPC_COMMAND_TRANSACT, "command: %" PRIu32, command.command);
 
-    CommandData transactionData(command.bodySize);
+    CommandData transactionData(mCommandDataPool, command.bodySize);
     if (!transactionData.valid()) {
         return NO_MEMORY;
     }
@@ -746,6 +1911,15 @@ status_t RpcState::processTransact(const sp<RpcSession::RpcConnection>& connecti
     if (status_t status = rpcRec(connection, session, "transaction body", &iov, 1); status != OK)
         return status;
 
+    if (connection->multiplexed) {
+        return dispatchMultiplexed(connection, session, std::move(transactionData));
+    }
+
+    // so that another thread is started if this was the last idle one
+    bool counted = session->beginIncomingCall(connection);
+    ScopeGuard guardEnd = [&]() {
+        if (counted) session->endIncomingCall(connection);
+    };
     return processTransactInternal(connection, session, std::move(transactionData));
 }
 
@@ -804,28 +1978,66 @@ processTransactInternalTailCall:
             (void)session->shutdownAndWait(false);
             replyStatus = BAD_VALUE;
         } else if (oneway) {
-            std::unique_lock<std::mutex> _l(mNodeMutex);
-            auto it = mNodeForAddress.find(addr);
-            if (it->second.binder.promote() != target) {
+            NodeShard& shard = shardForAddress(addr);
+            std::unique_lock<std::mutex> _l(shard.mutex);
+            auto it = shard.nodes.find(addr);
+            if (it == shard.nodes.end() || it->second.binder.promote() != target) {
                 ALOGE("Binder became invalid during transaction. Bad client? %" PRIu64, addr);
                 replyStatus = BAD_VALUE;
             } else if (transaction->asyncNumber != it->second.asyncNumber) {
                 // we need to process some other asynchronous transaction
                 // first
-                it->second.asyncTodo.push(BinderNode::AsyncTodo{
-                        .ref = target,
-                        .data = std::move(transactionData),
-                        .asyncNumber = transaction->asyncNumber,
-                });
-
-                size_t numPending = it->second.asyncTodo.size();
-                LOG_RPC_DETAIL("Enqueuing %" PRIu64 " on %" PRIu64 " (%zu pending)",
-                               transaction->asyncNumber, addr, numPending);
-
                 constexpr size_t kArbitraryOnewayCallTerminateLevel = 10000;
                 constexpr size_t kArbitraryOnewayCallWarnLevel = 1000;
                 constexpr size_t kArbitraryOnewayCallWarnPer = 1000;
 
+                uint64_t asyncNumber = transaction->asyncNumber;
+                if (asyncNumber < it->second.asyncNumber ||
+                    asyncNumber - it->second.asyncNumber >= kArbitraryOnewayCallTerminateLevel) {
+                    ALOGE("Oneway transaction %" PRIu64 " on %" PRIu64
+                          " is out of range, expecting %" PRIu64 ". Terminating!",
+                          asyncNumber, addr, it->second.asyncNumber);
+                    _l.unlock();
+                    (void)session->shutdownAndWait(false);
+                    return BAD_VALUE;
+                }
+                size_t queuedBytes = transactionData.size();
+                if (size_t maxBytes = session->mMaxQueuedOnewayBytes;
+                    maxBytes != 0 && mAsyncTodoBytes + queuedBytes > maxBytes) {
+                    ALOGE("WARNING: more than %zu bytes of oneway transactions pending. "
+                          "Terminating!",
+                          maxBytes);
+                    _l.unlock();
+                    sp<RpcSession::EventListener> listener;
+                    {
+                        std::lock_guard<std::mutex> _sl(session->mMutex);
+                        listener = session->mEventListener.promote();
+                    }
+                    if (listener != nullptr) listener->onSessionOnewayThrottled();
+                    (void)session->shutdownAndWait(false);
+                    return FAILED_TRANSACTION;
+                }
+                if (!it->second.asyncTodo.insert(asyncNumber - it->second.asyncNumber,
+                                                 AsyncTodo{
+                                                         .ref = target,
+                                                         .data = std::move(transactionData),
+                                                 })) {
+                    ALOGE("Duplicate oneway transaction %" PRIu64 " on %" PRIu64
+                          ". Terminating!",
+                          asyncNumber, addr);
+                    _l.unlock();
+                    (void)session->shutdownAndWait(false);
+                    return BAD_VALUE;
+                }
+
+                mAsyncTodoBytes += queuedBytes;
+
+                size_t numPending = it->second.asyncTodo.size();
+                it->second.asyncTodoMax = std::max(it->second.asyncTodoMax, numPending);
+                it->second.asyncTodoTotal++;
+                LOG_RPC_DETAIL("Enqueuing %" PRIu64 " on %" PRIu64 " (%zu pending)", asyncNumber,
+                               addr, numPending);
+
                 if (numPending >= kArbitraryOnewayCallWarnLevel) {
                     if (numPending >= kArbitraryOnewayCallTerminateLevel) {
                         ALOGE("WARNING: %zu pending oneway transactions. Terminating!", numPending);
@@ -844,8 +2056,17 @@ processTransactInternalTailCall:
         }
     }
 
+    // A call which arrives before the reply to one which timed out is nested in
+    // that one, and nothing waits for what it does anymore. It would otherwise
+    // run on whichever thread reads the stale reply.
+    if (replyStatus == OK && !oneway && connection->staleReplies > 0) {
+        ALOGW("Refusing transaction on %" PRIu64 " nested in a call which timed out", addr);
+        replyStatus = DEAD_OBJECT;
+    }
+
     Parcel reply;
     reply.markForRpc(session);
+    ReplyBinderPositions replyBinders(replyHasBinderPositions(session) ? &reply : nullptr);
 
     if (replyStatus == OK) {
         Parcel data;
@@ -859,12 +2080,43 @@ processTransactInternalTailCall:
         data.markForRpc(session);
 
         if (target) {
+            // other threads use a multiplexed connection at the same time, so
+            // nested calls are never made over it
+            bool multiplexed = connection->multiplexed;
             bool origAllowNested = connection->allowNested;
-            connection->allowNested = !oneway;
+            if (!multiplexed) connection->allowNested = !oneway;
+
+            // the caller's deadline applies to calls made from here
+            auto startTime = std::chrono::steady_clock::now();
+            std::optional<std::chrono::steady_clock::time_point>& callDeadline =
+                    RpcSession::callDeadline();
+            std::optional<std::chrono::steady_clock::time_point> origCallDeadline = callDeadline;
+            if (transaction->timeoutMs != 0) {
+                callDeadline = startTime + std::chrono::milliseconds(transaction->timeoutMs);
+            }
 
-            replyStatus = target->transact(transaction->code, data, &reply, transaction->flags);
+            // oneway calls have no caller waiting on them, and the priority
+            // of a caller is only taken if the server allowed it
+            uint32_t callerPriority = 0;
+            if (!oneway && session->mPriorityInheritance) {
+                callerPriority = RpcPriority::clamp(transaction->priority,
+                                                    session->mMaxCallerRealtimePriority);
+            }
+            {
+                RpcPriority::Scoped priority(callerPriority);
+                replyStatus =
+                        target->transact(transaction->code, data, &reply, transaction->flags);
+            }
+            uint64_t dispatchUs = microsBetween(startTime, std::chrono::steady_clock::now());
+
+            callDeadline = origCallDeadline;
+            if (!multiplexed) connection->allowNested = origAllowNested;
 
-            connection->allowNested = origAllowNested;
+            Stats::Code& codeStats = mStats.forCode(addr, transaction->code);
+            Stats::add(codeStats.received, 1);
+            Stats::add(codeStats.receivedUs, dispatchUs);
+            Stats::record(mStats.receivedBytes, data.dataSize());
+            Stats::record(mStats.dispatchUs, dispatchUs);
         } else {
             LOG_RPC_DETAIL("Got special transaction %" PRIu32, transaction->code);
 
@@ -921,10 +2173,11 @@ processTransactInternalTailCall:
         // downside: asynchronous transactions may drown out synchronous
         // transactions.
         {
-            std::unique_lock<std::mutex> _l(mNodeMutex);
-            auto it = mNodeForAddress.find(addr);
+            NodeShard& shard = shardForAddress(addr);
+            std::unique_lock<std::mutex> _l(shard.mutex);
+            auto it = shard.nodes.find(addr);
             // last refcount dropped after this transaction happened
-            if (it == mNodeForAddress.end()) return OK;
+            if (it == shard.nodes.end()) return OK;
 
             if (!nodeProgressAsyncNumber(&it->second)) {
                 _l.unlock();
@@ -932,22 +2185,17 @@ processTransactInternalTailCall:
                 return DEAD_OBJECT;
             }
 
-            if (it->second.asyncTodo.size() == 0) return OK;
-            if (it->second.asyncTodo.top().asyncNumber == it->second.asyncNumber) {
+            if (it->second.asyncTodo.empty()) return OK;
+            if (std::optional<AsyncTodo> todo = it->second.asyncTodo.advance(); todo) {
                 LOG_RPC_DETAIL("Found next async transaction %" PRIu64 " on %" PRIu64,
                                it->second.asyncNumber, addr);
 
-                // justification for const_cast (consider avoiding priority_queue):
-                // - AsyncTodo operator< doesn't depend on 'data' or 'ref' objects
-                // - gotta go fast
-                auto& todo = const_cast<BinderNode::AsyncTodo&>(it->second.asyncTodo.top());
-
                 // reset up arguments
-                transactionData = std::move(todo.data);
-                LOG_ALWAYS_FATAL_IF(target != todo.ref,
+                mAsyncTodoBytes -= todo->data.size();
+                transactionData = std::move(todo->data);
+                LOG_ALWAYS_FATAL_IF(target != todo->ref,
                                     "async list should be associated with a binder");
 
-                it->second.asyncTodo.pop();
                 goto processTransactInternalTailCall;
             }
         }
@@ -962,37 +2210,63 @@ processTransactInternalTailCall:
     }
 
     // Binder refs are flushed for oneway calls only after all calls which are
-    // built up are executed. Otherwise, they fill up the binder buffer.
+    // built up are executed. Otherwise, they fill up the binder buffer. Here,
+    // they go out in the same write as the reply.
+    RpcDecStrong decStrong{};
     if (addr != 0 && replyStatus == OK) {
-        replyStatus = flushExcessBinderRefs(session, addr, target);
+        replyStatus = flushExcessBinderRefs(session, addr, target, &decStrong);
     }
 
+    // see RpcWireReply
+    bool withBinderPositions = replyHasBinderPositions(session);
+    const std::vector<uint32_t>& binderPositions = replyBinders.positions(reply.dataSize());
+    uint32_t numBinderPositions = static_cast<uint32_t>(binderPositions.size());
+    size_t binderPositionsSize =
+            withBinderPositions ? (numBinderPositions + 1) * sizeof(uint32_t) : 0;
+
     LOG_ALWAYS_FATAL_IF(std::numeric_limits<int32_t>::max() - sizeof(RpcWireHeader) -
-                                        sizeof(RpcWireReply) <
+                                        sizeof(RpcWireReply) - binderPositionsSize <
                                 reply.dataSize(),
                         "Too much data for reply %zu", reply.dataSize());
 
+    size_t replySize = wireReplySize(session);
     RpcWireHeader cmdReply{
             .command = RPC_COMMAND_REPLY,
-            .bodySize = static_cast<uint32_t>(sizeof(RpcWireReply) + reply.dataSize()),
+            .bodySize = static_cast<uint32_t>(replySize + reply.dataSize() + binderPositionsSize),
     };
     RpcWireReply rpcReply{
             .status = replyStatus,
+            .requestId = transaction->requestId,
+    };
+
+    RpcWireHeader cmdDecStrong{
+            .command = RPC_COMMAND_DEC_STRONG,
+            .bodySize = sizeof(RpcDecStrong),
     };
 
     iovec iovs[]{
+            {&cmdDecStrong, sizeof(RpcWireHeader)},
+            {&decStrong, sizeof(RpcDecStrong)},
             {&cmdReply, sizeof(RpcWireHeader)},
-            {&rpcReply, sizeof(RpcWireReply)},
+            {&rpcReply, replySize},
             {const_cast<uint8_t*>(reply.data()), reply.dataSize()},
+            {withBinderPositions ? const_cast<uint32_t*>(binderPositions.data()) : nullptr,
+             withBinderPositions ? numBinderPositions * sizeof(uint32_t) : 0},
+            {&numBinderPositions, withBinderPositions ? sizeof(uint32_t) : 0},
     };
-    return rpcSend(connection, session, "reply", iovs, arraysize(iovs));
+    // skip the dec strong if there is none
+    constexpr int kNumDecStrongIovs = 2;
+    int firstIov = decStrong.amount == 0 ? kNumDecStrongIovs : 0;
+    return rpcSend(connection, session, "reply", iovs + firstIov, arraysize(iovs) - firstIov);
 }
 
 status_t RpcState::processDecStrong(const sp<RpcSession::RpcConnection>& connection,
                                     const sp<RpcSession>& session, const RpcWireHeader& command) {
-    LOG_ALWAYS_FATAL_IF(command.command != RPC_COMMAND_DEC_STRONG, "command: %" PRIu32, command.command);
+    LOG_ALWAYS_FATAL_IF(command.command != RPC_COMMAND_DEC_STRONG &&
+                                command.command != RPC_COMMAND_DEC_STRONG_BATCH,
+                        "command: %" PRIu32, command.command);
 
-    CommandData commandData(command.bodySize);
+    CommandData commandData(mCommandDataPool, command.bodySize);
     if (!commandData.valid()) {
         return NO_MEMORY;
     }
@@ -1000,18 +2274,57 @@ status_t RpcState::processDecStrong(const sp<RpcSession::RpcConnection>& connect
     if (status_t status = rpcRec(connection, session, "dec ref body", &iov, 1); status != OK)
         return status;
 
-    if (command.bodySize != sizeof(RpcDecStrong)) {
-        ALOGE("Expecting %zu but got %" PRId32 " bytes for RpcDecStrong. Terminating!",
+    if (command.command == RPC_COMMAND_DEC_STRONG) {
+        if (command.bodySize != sizeof(RpcDecStrong)) {
+            ALOGE("Expecting %zu but got %" PRId32 " bytes for RpcDecStrong. Terminating!",
+                  sizeof(RpcDecStrong), command.bodySize);
+            (void)session->shutdownAndWait(false);
+            return BAD_VALUE;
+        }
+    } else if (command.bodySize == 0 || command.bodySize % sizeof(RpcDecStrong) != 0) {
+        ALOGE("Expecting a multiple of %zu but got %" PRId32
+              " bytes for RpcDecStrong batch. Terminating!",
               sizeof(RpcDecStrong), command.bodySize);
         (void)session->shutdownAndWait(false);
         return BAD_VALUE;
     }
-    RpcDecStrong* body = reinterpret_cast<RpcDecStrong*>(commandData.data());
 
-    uint64_t addr = RpcWireAddress::toRaw(body->address);
-    std::unique_lock<std::mutex> _l(mNodeMutex);
-    auto it = mNodeForAddress.find(addr);
-    if (it == mNodeForAddress.end()) {
+    RpcDecStrong* bodies = reinterpret_cast<RpcDecStrong*>(commandData.data());
+    for (size_t i = 0; i < command.bodySize / sizeof(RpcDecStrong); i++) {
+        if (status_t status = processDecStrongBody(session, bodies[i]); status != OK) {
+            return status;
+        }
+    }
+    return OK;
+}
+
+status_t RpcState::processCloseConnection(const sp<RpcSession::RpcConnection>& connection,
+                                          const sp<RpcSession>& session,
+                                          const RpcWireHeader& command, CommandType type) {
+    LOG_ALWAYS_FATAL_IF(command.command != RPC_COMMAND_CLOSE_CONNECTION, "command: %" PRIu32,
+                        command.command);
+
+    // only a thread which is idle may be stopped, and it can't be started on
+    // demand by a session which does not know about it
+    if (type != CommandType::ANY || command.bodySize != 0 ||
+        !session->onDemandConnectionClosed(connection)) {
+        ALOGE("Unexpected request to close connection (body size %" PRIu32
+              ") - terminating session",
+              command.bodySize);
+        (void)session->shutdownAndWait(false);
+        return BAD_VALUE;
+    }
+
+    // ends RpcSession::join for this connection
+    return DEAD_OBJECT;
+}
+
+status_t RpcState::processDecStrongBody(const sp<RpcSession>& session, const RpcDecStrong& body) {
+    uint64_t addr = RpcWireAddress::toRaw(body.address);
+    NodeShard& shard = shardForAddress(addr);
+    std::unique_lock<std::mutex> _l(shard.mutex);
+    auto it = shard.nodes.find(addr);
+    if (it == shard.nodes.end()) {
         ALOGE("Unknown binder address %" PRIu64 " for dec strong.", addr);
         return OK;
     }
@@ -1026,27 +2339,87 @@ status_t RpcState::processDecStrong(const sp<RpcSession::RpcConnection>& connect
         return BAD_VALUE;
     }
 
-    if (it->second.timesSent < body->amount) {
+    if (it->second.timesSent < body.amount) {
         ALOGE("Record of sending binder %zu times, but requested decStrong for %" PRIu64 " of %" PRIu32,
-              it->second.timesSent, addr, body->amount);
+              it->second.timesSent, addr, body.amount);
         return OK;
     }
 
     LOG_ALWAYS_FATAL_IF(it->second.sentRef == nullptr, "Inconsistent state, lost ref for %" PRIu64,
                         addr);
 
-    LOG_RPC_DETAIL("Processing dec strong of %" PRIu64 " by %" PRIu32 "from %zu", addr, body->amount,
+    LOG_RPC_DETAIL("Processing dec strong of %" PRIu64 " by %" PRIu32 "from %zu", addr, body.amount,
                    it->second.timesSent);
 
-    it->second.timesSent -= body->amount;
-    sp<IBinder> tempHold = tryEraseNode(it);
+    it->second.timesSent -= body.amount;
+    sp<IBinder> tempHold = tryEraseNode(shard, it);
     _l.unlock();
-    tempHold = nullptr; // destructor may make binder calls on this session
+    // destructor may make binder calls on this session
+    releaseBinder(std::move(tempHold));
 
     return OK;
 }
 
-sp<IBinder> RpcState::tryEraseNode(std::map<uint64_t, BinderNode>::iterator& it) {
+bool RpcState::AsyncTodoRing::insert(size_t offset, AsyncTodo&& todo) {
+    LOG_ALWAYS_FATAL_IF(offset == 0, "The expected transaction is never queued");
+    if (offset >= kMaxSlots) {
+        if (!mFarAhead.emplace(mPosition + offset, std::move(todo)).second) return false;
+    } else {
+        if (offset >= mSlots.size()) grow(offset + 1);
+
+        std::optional<AsyncTodo>& slot = mSlots[(mHead + offset) & (mSlots.size() - 1)];
+        if (slot.has_value()) return false;
+        slot = std::move(todo);
+    }
+    mCount++;
+    mSpan = std::max(mSpan, offset);
+    return true;
+}
+
+std::optional<RpcState::AsyncTodo> RpcState::AsyncTodoRing::advance() {
+    if (mCount == 0) return std::nullopt;
+    if (mSlots.empty()) grow(1);
+
+    mHead = (mHead + 1) & (mSlots.size() - 1);
+    mSpan--;
+    mPosition++;
+    std::optional<AsyncTodo> todo = std::move(mSlots[mHead]);
+    mSlots[mHead].reset();
+    if (todo.has_value()) mCount--;
+    takeFarAhead();
+
+    // give back memory used by a flood of out of order transactions
+    constexpr size_t kMaxRetainedSlots = 16;
+    if (mCount == 0 && mSlots.size() > kMaxRetainedSlots) {
+        std::vector<std::optional<AsyncTodo>>().swap(mSlots);
+        mHead = 0;
+        mSpan = 0;
+    }
+    return todo;
+}
+
+void RpcState::AsyncTodoRing::grow(size_t minSlots) {
+    size_t newSize = std::max<size_t>(mSlots.size(), 8);
+    while (newSize < minSlots) newSize *= 2;
+
+    std::vector<std::optional<AsyncTodo>> slots(newSize);
+    for (size_t i = 0; i < mSlots.size(); i++) {
+        slots[i] = std::move(mSlots[(mHead + i) & (mSlots.size() - 1)]);
+    }
+    mSlots = std::move(slots);
+    mHead = 0;
+    takeFarAhead();
+}
+
+void RpcState::AsyncTodoRing::takeFarAhead() {
+    while (!mFarAhead.empty() && mFarAhead.begin()->first < mPosition + mSlots.size()) {
+        auto it = mFarAhead.begin();
+        mSlots[(mHead + (it->first - mPosition)) & (mSlots.size() - 1)] = std::move(it->second);
+        mFarAhead.erase(it);
+    }
+}
+
+sp<IBinder> RpcState::tryEraseNode(NodeShard& shard, NodeMap::iterator& it) {
     sp<IBinder> ref;
 
     if (it->second.timesSent == 0) {
@@ -1055,7 +2428,12 @@ sp<IBinder> RpcState::tryEraseNode(std::map<uint64_t, BinderNode>::iterator& it)
         if (it->second.timesRecd == 0) {
             LOG_ALWAYS_FATAL_IF(!it->second.asyncTodo.empty(),
                                 "Can't delete binder w/ pending async transactions");
-            mNodeForAddress.erase(it);
+            if (auto local = shard.localAddresses.find(it->second.binder.unsafe_get());
+                local != shard.localAddresses.end() && local->second == it->first) {
+                shard.localAddresses.erase(local);
+            }
+            shard.nodes.erase(it);
+            mNumNodes--;
         }
     }
 
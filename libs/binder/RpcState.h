@@ -20,15 +20,23 @@
 #include <binder/Parcel.h>
 #include <binder/RpcSession.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
 #include <optional>
 #include <queue>
+#include <thread>
+#include <unordered_map>
 
 #include <sys/uio.h>
 
 namespace android {
 
+struct RpcDecStrong;
 struct RpcWireHeader;
+struct RpcWireReply;
 
 /**
  * Log a lot more information about RPC calls, when debugging issues. Usually,
@@ -62,8 +70,19 @@ public:
     RpcState();
     ~RpcState();
 
+    // see RpcFastConnectInfo
+    struct FastConnectInfo {
+        size_t maxThreads;
+        std::vector<uint8_t> sessionId;
+        uint64_t rootObject; // zero if none
+    };
+
+    // |fastConnect| is only set if the server replied with RpcFastConnectInfo,
+    // and |flags| are the RPC_NEW_SESSION_RESPONSE_* which it set
     [[nodiscard]] status_t readNewSessionResponse(const sp<RpcSession::RpcConnection>& connection,
-                                                  const sp<RpcSession>& session, uint32_t* version);
+                                                  const sp<RpcSession>& session, uint32_t* version,
+                                                  std::optional<FastConnectInfo>* fastConnect,
+                                                  uint8_t* flags);
     [[nodiscard]] status_t sendConnectionInit(const sp<RpcSession::RpcConnection>& connection,
                                               const sp<RpcSession>& session);
     [[nodiscard]] status_t readConnectionInit(const sp<RpcSession::RpcConnection>& connection,
@@ -81,10 +100,29 @@ public:
     [[nodiscard]] status_t transact(const sp<RpcSession::RpcConnection>& connection,
                                     const sp<IBinder>& address, uint32_t code, const Parcel& data,
                                     const sp<RpcSession>& session, Parcel* reply, uint32_t flags);
+    // only on a multiplexed connection, see RpcSession::transactAsync
+    [[nodiscard]] status_t transactAsync(const sp<RpcSession::RpcConnection>& connection,
+                                         const sp<IBinder>& address, uint32_t code,
+                                         const Parcel& data, const sp<RpcSession>& session,
+                                         RpcSession::TransactCallback&& callback, uint32_t flags);
+    // if 'asyncCallback' is set, it gets the reply instead of 'reply'
     [[nodiscard]] status_t transactAddress(const sp<RpcSession::RpcConnection>& connection,
                                            uint64_t address, uint32_t code, const Parcel& data,
                                            const sp<RpcSession>& session, Parcel* reply,
-                                           uint32_t flags);
+                                           uint32_t flags,
+                                           RpcSession::TransactCallback&& asyncCallback = nullptr);
+    /**
+     * Same as transact with FLAG_ONEWAY, except the transaction is queued
+     * instead of being sent right away. Queued transactions are written
+     * together by flushPending or along with the next transaction, in the order
+     * they were queued. 'needsFlush' is set once 'maxBytes' are queued.
+     */
+    [[nodiscard]] status_t queueOneway(const sp<IBinder>& binder, uint32_t code,
+                                       const Parcel& data, const sp<RpcSession>& session,
+                                       size_t maxBytes, bool* needsFlush);
+    RpcSession::OnewayBatchStats getOnewayBatchStats();
+    RpcSession::BufferPoolStats getBufferPoolStats();
+    RpcSession::TransactionStats getTransactionStats();
 
     /**
      * The ownership model here carries an implicit strong refcount whenever a
@@ -108,6 +146,24 @@ public:
     [[nodiscard]] status_t sendDecStrongToTarget(const sp<RpcSession::RpcConnection>& connection,
                                                  const sp<RpcSession>& session, uint64_t address,
                                                  size_t target);
+    /**
+     * Same as sendDecStrongToTarget, except the dec strong is queued instead of
+     * being sent right away. Queued dec strongs are sent as a single
+     * RPC_COMMAND_DEC_STRONG_BATCH by flushPending or along with the next
+     * transaction. 'needsFlush' is set once 'maxPending' dec strongs are queued.
+     */
+    [[nodiscard]] status_t queueDecStrongToTarget(uint64_t address, size_t target,
+                                                  size_t maxPending, bool* needsFlush);
+    /**
+     * Asks the other side to stop the thread serving this incoming (for the
+     * other side) connection, which was started on demand. The connection must
+     * not be used after this (see RpcSession::setIncomingThreadsOnDemand).
+     */
+    [[nodiscard]] status_t sendCloseConnection(const sp<RpcSession::RpcConnection>& connection,
+                                               const sp<RpcSession>& session);
+    // sends any queued oneway transactions and dec strongs
+    [[nodiscard]] status_t flushPending(const sp<RpcSession::RpcConnection>& connection,
+                                        const sp<RpcSession>& session);
 
     enum class CommandType {
         ANY,
@@ -117,6 +173,17 @@ public:
                                                 const sp<RpcSession>& session, CommandType type);
     [[nodiscard]] status_t drainCommands(const sp<RpcSession::RpcConnection>& connection,
                                          const sp<RpcSession>& session, CommandType type);
+    // client - reads from a connection until the replies to all calls which
+    // timed out on it arrived, see RpcConnection::staleReplies
+    [[nodiscard]] status_t drainStaleReplies(const sp<RpcSession::RpcConnection>& connection,
+                                             const sp<RpcSession>& session);
+    // server - once the multiplexed connection is closed, stops the threads
+    // which process its transactions, and waits for them
+    void joinMultiplexedWorkers();
+    // client - once the multiplexed connection is shut down, waits for the
+    // thread which reads replies to asynchronous calls to fail them, unless
+    // called from that thread
+    void joinAsyncReader();
 
     /**
      * Called by Parcel for outgoing binders. This implies one refcount of
@@ -124,6 +191,12 @@ public:
      */
     [[nodiscard]] status_t onBinderLeaving(const sp<RpcSession>& session, const sp<IBinder>& binder,
                                            uint64_t* outAddress);
+    /**
+     * Called by Parcel once it has written a non-null binder at |position|.
+     * Only recorded for the reply which this thread is building for an
+     * incoming transaction, see RPC_CONNECTION_OPTION_REPLY_BINDERS.
+     */
+    static void onBinderWritten(const Parcel* parcel, size_t position);
 
     /**
      * Called by Parcel for incoming binders. This either returns the refcount
@@ -135,10 +208,13 @@ public:
     /**
      * Called on incoming binders to update refcounting information. This should
      * only be called when it is done as part of making progress on a
-     * transaction.
+     * transaction. If 'replyDecStrong' is set, a dec strong which needs to be
+     * sent is stored there (or left with an 'amount' of 0), so that it can be
+     * sent along with the reply, instead of being sent right away.
      */
     [[nodiscard]] status_t flushExcessBinderRefs(const sp<RpcSession>& session, uint64_t address,
-                                                 const sp<IBinder>& binder);
+                                                 const sp<IBinder>& binder,
+                                                 RpcDecStrong* replyDecStrong = nullptr);
     /**
      * Called when the RpcSession is shutdown.
      * Send obituaries for each known remote binder with this session.
@@ -169,20 +245,89 @@ public:
 private:
     void dumpLocked();
 
+    // Checks that 'data' can be sent in a transaction on 'binder', and gets
+    // the address to send it to. For transact, transactAsync and queueOneway.
+    [[nodiscard]] status_t prepareTransaction(const sp<IBinder>& binder, uint32_t code,
+                                              const Parcel& data, const sp<RpcSession>& session,
+                                              uint64_t* address);
+
+    // Cache of receive buffers shared by all connections of a session, so that
+    // steady-state traffic doesn't go to the heap for every incoming command.
+    // Buffers are handed out in a few size classes, and returned buffers are
+    // kept on a per-class free list, up to a limit on the number of bytes
+    // cached. Each buffer which is handed out holds a strong reference to the
+    // pool, so a buffer may outlive the RpcState which allocated it (e.g. when
+    // it backs a reply Parcel).
+    class CommandDataPool : public virtual RefBase {
+    public:
+        ~CommandDataPool();
+
+        // nullptr on allocation failure
+        uint8_t* acquire(size_t size);
+        // return a buffer from 'acquire' to the pool which it came from
+        static void recycle(uint8_t* data);
+
+        void dump();
+        RpcSession::BufferPoolStats getStats();
+
+    private:
+        struct Header;
+
+        static constexpr size_t kSizeClasses[] = {64, 256, 1024, 4096, 16384};
+        static constexpr size_t kNumSizeClasses = sizeof(kSizeClasses) / sizeof(kSizeClasses[0]);
+        static constexpr size_t kMaxCachedPerClass = 8;
+        static constexpr uint32_t kNoSizeClass = std::numeric_limits<uint32_t>::max();
+
+        void put(Header* header);
+
+        struct SizeClass {
+            uint8_t* cached[kMaxCachedPerClass];
+            size_t numCached = 0;
+
+            size_t hits = 0;
+            size_t misses = 0;
+            size_t dropped = 0;
+        };
+
+        std::mutex mMutex; // for below
+        SizeClass mClasses[kNumSizeClasses];
+        size_t mCachedBytes = 0;
+        size_t mOutstanding = 0;
+        size_t mOversized = 0;
+    };
+
     // Alternative to std::vector<uint8_t> that doesn't abort on allocation failure and caps
     // large allocations to avoid being requested from allocating too much data.
     struct CommandData {
-        explicit CommandData(size_t size);
+        CommandData(const sp<CommandDataPool>& pool, size_t size);
         bool valid() { return mSize == 0 || mData != nullptr; }
         size_t size() { return mSize; }
         uint8_t* data() { return mData.get(); }
+        // drops the end of the data, the buffer is kept
+        void shrink(size_t size) { mSize = std::min(mSize, size); }
+        // caller takes ownership, and must give it back with CommandDataPool::recycle
         uint8_t* release() { return mData.release(); }
 
     private:
-        std::unique_ptr<uint8_t[]> mData;
+        struct Recycler {
+            void operator()(uint8_t* data) { CommandDataPool::recycle(data); }
+        };
+        std::unique_ptr<uint8_t, Recycler> mData;
         size_t mSize;
     };
 
+    static void cleanupReplyData(Parcel* p, const uint8_t* data, size_t dataSize,
+                                 const binder_size_t* objects, size_t objectsCount);
+
+    // size of RpcWireReply as negotiated for 'session'
+    static size_t wireReplySize(const sp<RpcSession>& session);
+    // whether replies end with the positions of their binders, see RpcWireReply
+    static bool replyHasBinderPositions(const sp<RpcSession>& session);
+    // removes the binder positions from the end of the reply 'data', and
+    // returns them in 'positions' (if not null)
+    [[nodiscard]] static status_t takeReplyBinderPositions(const uint8_t* data, size_t* dataSize,
+                                                           std::vector<uint32_t>* positions);
+
     [[nodiscard]] status_t rpcSend(const sp<RpcSession::RpcConnection>& connection,
                                    const sp<RpcSession>& session, const char* what, iovec* iovs,
                                    int niovs, const std::function<status_t()>& altPoll = nullptr);
@@ -190,8 +335,62 @@ private:
                                   const sp<RpcSession>& session, const char* what, iovec* iovs,
                                   int niovs);
 
-    [[nodiscard]] status_t waitForReply(const sp<RpcSession::RpcConnection>& connection,
-                                        const sp<RpcSession>& session, Parcel* reply);
+    // Waits until something can be read, or until 'deadline'. On TIMED_OUT,
+    // the session stays up, unlike for other errors.
+    [[nodiscard]] status_t rpcWaitForRead(const sp<RpcSession::RpcConnection>& connection,
+                                          const sp<RpcSession>& session, const char* what,
+                                          std::chrono::steady_clock::time_point deadline);
+
+    [[nodiscard]] status_t waitForReply(
+            const sp<RpcSession::RpcConnection>& connection, const sp<RpcSession>& session,
+            Parcel* reply, std::optional<std::chrono::steady_clock::time_point> deadline);
+    // reads the body of RPC_COMMAND_REPLY, 'data' is the reply parcel data, unless
+    // it fits in 'inPlaceReply', which then gets the reply directly. The
+    // positions of the binders in 'data' are returned in 'binderPositions'.
+    [[nodiscard]] status_t readReply(const sp<RpcSession::RpcConnection>& connection,
+                                     const sp<RpcSession>& session, const RpcWireHeader& command,
+                                     RpcWireReply* rpcReply, std::optional<CommandData>* data,
+                                     Parcel* inPlaceReply = nullptr,
+                                     std::vector<uint32_t>* binderPositions = nullptr);
+    // reads the reply to a call which timed out, and releases its binders
+    [[nodiscard]] status_t processStaleReply(const sp<RpcSession::RpcConnection>& connection,
+                                             const sp<RpcSession>& session,
+                                             const RpcWireHeader& command);
+    [[nodiscard]] status_t setReply(const sp<RpcSession>& session, int32_t status,
+                                    CommandData data, Parcel* reply);
+    // drops a reply which no caller is waiting for, releasing its binders
+    [[nodiscard]] status_t releaseReplyBinders(const sp<RpcSession>& session, int32_t replyStatus,
+                                               CommandData data,
+                                               const std::vector<uint32_t>& binderPositions);
+
+    // Multiplexed connections, see RpcSession::setMultiplexed.
+    //
+    // client - register a call, so that its reply is kept for the thread
+    // waiting on it, or for 'asyncCallback' if it is set
+    uint32_t beginMultiplexedRequest(RpcSession::TransactCallback&& asyncCallback);
+    // client - make sure a thread reads replies while asynchronous calls are
+    // in flight, and calls their callbacks
+    void startAsyncReader(const sp<RpcSession::RpcConnection>& connection,
+                          const sp<RpcSession>& session);
+    void runAsyncReader(const sp<RpcSession::RpcConnection>& connection,
+                        const sp<RpcSession>& session);
+    [[nodiscard]] status_t waitForMultiplexedReply(
+            const sp<RpcSession::RpcConnection>& connection, const sp<RpcSession>& session,
+            uint32_t requestId, Parcel* reply,
+            std::optional<std::chrono::steady_clock::time_point> deadline);
+    // client - read and process one command, from the thread which is reading
+    [[nodiscard]] status_t readMultiplexedCommand(const sp<RpcSession::RpcConnection>& connection,
+                                                  const sp<RpcSession>& session);
+    // client - like drainCommands, keeping replies for the threads waiting on them
+    [[nodiscard]] status_t drainMultiplexed(const sp<RpcSession::RpcConnection>& connection,
+                                            const sp<RpcSession>& session);
+    // server - hand a transaction to a worker thread, or process it here if all
+    // of them are busy
+    [[nodiscard]] status_t dispatchMultiplexed(const sp<RpcSession::RpcConnection>& connection,
+                                               const sp<RpcSession>& session,
+                                               CommandData transactionData);
+    void runMultiplexedWorker(const sp<RpcSession::RpcConnection>& connection,
+                              const sp<RpcSession>& session);
     [[nodiscard]] status_t processCommand(const sp<RpcSession::RpcConnection>& connection,
                                           const sp<RpcSession>& session,
                                           const RpcWireHeader& command, CommandType type);
@@ -204,6 +403,53 @@ private:
     [[nodiscard]] status_t processDecStrong(const sp<RpcSession::RpcConnection>& connection,
                                             const sp<RpcSession>& session,
                                             const RpcWireHeader& command);
+    [[nodiscard]] status_t processDecStrongBody(const sp<RpcSession>& session,
+                                                const RpcDecStrong& body);
+    [[nodiscard]] status_t processCloseConnection(const sp<RpcSession::RpcConnection>& connection,
+                                                  const sp<RpcSession>& session,
+                                                  const RpcWireHeader& command, CommandType type);
+
+    // a oneway transaction which arrived before the ones it must run after
+    struct AsyncTodo {
+        sp<IBinder> ref;
+        CommandData data;
+    };
+    // Reorder buffer for the oneway transactions of a local binder. Slot 'i'
+    // holds the transaction whose asyncNumber is 'i' past the one expected
+    // next. Async numbers are dense, so this is a ring which only grows as
+    // far as the client gets ahead, and insert and advance are O(1). The ring
+    // has at most kMaxSlots, and transactions further ahead than that are kept
+    // in a map until they come within reach of it.
+    class AsyncTodoRing {
+    public:
+        bool empty() const { return mCount == 0; }
+        // number of transactions held
+        size_t size() const { return mCount; }
+        // distance from the expected asyncNumber to the furthest one held
+        size_t span() const { return mSpan; }
+
+        // holds the transaction 'offset' (> 0) past the expected one. Returns
+        // false if there already is one.
+        [[nodiscard]] bool insert(size_t offset, AsyncTodo&& todo);
+        // moves on to the next asyncNumber, and returns its transaction if it
+        // was already received
+        std::optional<AsyncTodo> advance();
+
+    private:
+        static constexpr size_t kMaxSlots = 64; // a power of 2
+        void grow(size_t minSlots);
+        // moves transactions from mFarAhead which are now within the ring
+        void takeFarAhead();
+
+        std::vector<std::optional<AsyncTodo>> mSlots; // size is 0 or a power of 2
+        size_t mHead = 0; // slot of the expected asyncNumber
+        size_t mSpan = 0;
+        size_t mCount = 0;
+        // number of times advance() moved on, so that mPosition + offset
+        // identifies a transaction in mFarAhead
+        uint64_t mPosition = 0;
+        std::map<uint64_t, AsyncTodo> mFarAhead;
+    };
 
     struct BinderNode {
         // Two cases:
@@ -235,16 +481,10 @@ private:
         //
 
         // async transaction queue, _only_ for local binder
-        struct AsyncTodo {
-            sp<IBinder> ref;
-            CommandData data;
-            uint64_t asyncNumber = 0;
-
-            bool operator<(const AsyncTodo& o) const {
-                return asyncNumber > /* !!! */ o.asyncNumber;
-            }
-        };
-        std::priority_queue<AsyncTodo> asyncTodo;
+        AsyncTodoRing asyncTodo;
+        // backlog statistics for asyncTodo, reported by dump()
+        size_t asyncTodoMax = 0;
+        uint64_t asyncTodoTotal = 0;
 
         //
         // CASE B - remote binder, we are sending transactions to
@@ -253,20 +493,128 @@ private:
         // (no additional data specific to remote binders)
     };
 
+    using NodeMap = std::unordered_map<uint64_t, BinderNode>;
+
+    // Binders known by both sides of a session are split into shards by
+    // address, each with its own lock, so that threads working on different
+    // binders don't serialize on one lock. Addresses allocated by this process
+    // are picked so that the node for a local binder is in the shard given by
+    // the binder's pointer, so onBinderLeaving can find it without a search.
+    static constexpr size_t kNumNodeShards = 16;
+    struct NodeShard {
+        std::mutex mutex; // for below
+        NodeMap nodes;
+        // the local binders in 'nodes', by identity
+        std::unordered_map<const IBinder*, uint64_t> localAddresses;
+        uint32_t nextId = 0;
+    };
+    NodeShard& shardForAddress(uint64_t address);
+    static size_t shardIndexForBinder(const IBinder* binder);
+    // locks all shards, in order
+    std::array<std::unique_lock<std::mutex>, kNumNodeShards> lockAllShards();
+
     // checks if there is any reference left to a node and erases it. If erase
     // happens, and there is a strong reference to the binder kept by
     // binderNode, this returns that strong reference, so that it can be
     // dropped after any locks are removed.
-    sp<IBinder> tryEraseNode(std::map<uint64_t, BinderNode>::iterator& it);
+    sp<IBinder> tryEraseNode(NodeShard& shard, NodeMap::iterator& it);
     // true - success
     // false - session shutdown, halt
     [[nodiscard]] bool nodeProgressAsyncNumber(BinderNode* node);
+    // lowers the number of refcounts held on 'address' to 'target'. Returns
+    // false if there is no dec strong to send.
+    [[nodiscard]] bool takeDecStrongToTargetLocked(NodeShard& shard, uint64_t address,
+                                                   size_t target, uint32_t* amount);
+    // takes everything queued by queueOneway and queueDecStrongToTarget, so
+    // that it can be sent in the caller's next write
+    void takePending(std::vector<uint8_t>* oneways, std::vector<RpcDecStrong>* decStrongs);
+    // queues dec strongs from takePending again, if they could not be sent
+    void restorePendingDecStrongs(std::vector<RpcDecStrong>&& decStrongs);
+
+    const sp<CommandDataPool> mCommandDataPool;
+
+    NodeShard mNodeShards[kNumNodeShards];
+    // only set with all shards locked, so it is consistent with any one shard
+    std::atomic<bool> mTerminated = false;
+    std::atomic<size_t> mNumNodes = 0;
+    // data of the oneway transactions in all asyncTodo, see
+    // RpcServer::setMaxQueuedOnewayBytesPerSession
+    std::atomic<size_t> mAsyncTodoBytes = 0;
+
+    std::mutex mPendingMutex; // for below, after a shard lock if both are taken
+    // dec strongs which haven't been sent yet, see queueDecStrongToTarget
+    std::vector<RpcDecStrong> mPendingDecStrongs;
+    // serialized oneway transactions which haven't been sent yet, see
+    // queueOneway. These are always written before mPendingDecStrongs, since
+    // they might hold the last references to some binders.
+    std::vector<uint8_t> mPendingOneways;
+    std::atomic<uint64_t> mNumQueuedOneways = 0;
+    std::atomic<uint64_t> mNumOnewayFlushes = 0;
+
+    // see RpcSession::TransactionStats, updated with relaxed atomics
+    struct Stats {
+        using TransactionStats = RpcSession::TransactionStats;
+        using Histogram = std::array<std::atomic<uint64_t>, TransactionStats::kNumBuckets>;
+        struct Code {
+            std::atomic<uint64_t> sent = 0;
+            std::atomic<uint64_t> sentUs = 0;
+            std::atomic<uint64_t> received = 0;
+            std::atomic<uint64_t> receivedUs = 0;
+        };
+        // the last one is for all other codes
+        std::array<Code, TransactionStats::kNumCodes + 1> codes;
+
+        Histogram requestBytes{};
+        Histogram replyBytes{};
+        Histogram sendUs{};
+        Histogram waitUs{};
+        Histogram receivedBytes{};
+        Histogram dispatchUs{};
+
+        Code& forCode(uint64_t address, uint32_t code);
+        static void add(std::atomic<uint64_t>& counter, uint64_t value);
+        static void record(Histogram& histogram, uint64_t value);
+        static void read(const Histogram& histogram, TransactionStats::Histogram* out);
+    };
+    Stats mStats;
 
-    std::mutex mNodeMutex;
-    bool mTerminated = false;
-    uint32_t mNextId = 0;
-    // binders known by both sides of a session
-    std::map<uint64_t, BinderNode> mNodeForAddress;
+    struct MultiplexedReply {
+        int32_t status;
+        CommandData data;
+    };
+    struct Multiplexed {
+        std::mutex mutex; // for below, after shard locks if both are taken
+
+        // client - synchronous calls waiting for a reply, by request ID.
+        // Whichever waiting thread takes 'readerTid' reads from the connection
+        // until the reply it is waiting on is read.
+        std::condition_variable replyCv;
+        uint32_t nextRequestId = 1;
+        std::optional<pid_t> readerTid;
+        std::map<uint32_t, std::optional<MultiplexedReply>> inFlight;
+
+        // client - asynchronous calls, see RpcSession::transactAsync. Their
+        // replies are queued by whichever thread reads them, and the callbacks
+        // are only called by the async reader, which runs while there are any.
+        struct AsyncReply {
+            RpcSession::TransactCallback callback;
+            int32_t status;
+            std::optional<CommandData> data; // unless the call failed locally
+        };
+        std::map<uint32_t, RpcSession::TransactCallback> asyncInFlight;
+        std::queue<AsyncReply> asyncReplies;
+        bool asyncReaderRunning = false;
+        std::thread asyncReader;
+
+        // server - transactions waiting for a worker thread, by urgency (see
+        // RpcPriority)
+        std::condition_variable todoCv;
+        std::multimap<int32_t, CommandData, std::greater<int32_t>> todo;
+        std::vector<std::thread> workers;
+        size_t numWorkers = 0;
+        size_t numIdleWorkers = 0;
+        bool terminated = false;
+    } mMultiplexed;
 };
 
 } // namespace android
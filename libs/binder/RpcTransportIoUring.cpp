@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RpcIoUringTransport"
+#include <log/log.h>
+
+#include <binder/RpcTransportIoUring.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BINDER_RPC_HAVE_IO_URING
+#endif
+
+#ifdef BINDER_RPC_HAVE_IO_URING
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+
+#include "FdTrigger.h"
+#include "RpcState.h"
+#endif
+
+namespace android {
+
+#ifdef BINDER_RPC_HAVE_IO_URING
+
+using base::unique_fd;
+
+namespace {
+
+// Only limits how many entries may wait to be submitted, which are those of
+// the thread about to wait in the kernel, and of one more. Any number of
+// operations can be in flight.
+constexpr unsigned kRingEntries = 32;
+
+// Minimal io_uring, since liburing isn't available everywhere.
+class IoUring {
+public:
+    static std::unique_ptr<IoUring> make() {
+        io_uring_params params{};
+        unique_fd fd(static_cast<int>(syscall(__NR_io_uring_setup, kRingEntries, &params)));
+        if (!fd.ok()) {
+            LOG_RPC_DETAIL("io_uring_setup(): %s", strerror(errno));
+            return nullptr;
+        }
+
+        std::unique_ptr<IoUring> ring(new IoUring);
+        ring->mFd = std::move(fd);
+
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) sqSize = cqSize = std::max(sqSize, cqSize);
+
+        if (!ring->mSqRing.map(ring->mFd, sqSize, IORING_OFF_SQ_RING) ||
+            (!singleMmap && !ring->mCqRing.map(ring->mFd, cqSize, IORING_OFF_CQ_RING)) ||
+            !ring->mSqes.map(ring->mFd, params.sq_entries * sizeof(io_uring_sqe),
+                             IORING_OFF_SQES)) {
+            ALOGE("Could not map io_uring: %s", strerror(errno));
+            return nullptr;
+        }
+
+        uint8_t* sq = reinterpret_cast<uint8_t*>(ring->mSqRing.addr);
+        uint8_t* cq = reinterpret_cast<uint8_t*>(singleMmap ? ring->mSqRing.addr
+                                                            : ring->mCqRing.addr);
+        ring->mSqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        ring->mSqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->mSqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->mSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->mSqEntries = params.sq_entries;
+        ring->mCqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->mCqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->mCqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->mCqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        ring->mSqTailLocal = *ring->mSqTail;
+        ring->mPublished = ring->mSqTailLocal;
+        return ring;
+    }
+
+    // The entry is zeroed. Returns nullptr when all are used.
+    io_uring_sqe* nextSqe() {
+        unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        if (mSqTailLocal - head >= mSqEntries) return nullptr;
+
+        unsigned index = mSqTailLocal & mSqMask;
+        io_uring_sqe* sqe = &reinterpret_cast<io_uring_sqe*>(mSqes.addr)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        mSqArray[index] = index;
+        mSqTailLocal++;
+        return sqe;
+    }
+
+    // Lets the kernel see the new entries. Returns false if there are none.
+    bool publish() {
+        if (mSqTailLocal == mPublished) return false;
+        __atomic_store_n(mSqTail, mSqTailLocal, __ATOMIC_RELEASE);
+        mPublished = mSqTailLocal;
+        return true;
+    }
+
+    // Submits all published entries, and if |wait|, waits for a completion.
+    // Only uses the fd, so it may be called while other threads add entries.
+    status_t enter(bool wait) const {
+        while (true) {
+            // the kernel submits no more than were published
+            long ret = syscall(__NR_io_uring_enter, mFd.get(), mSqEntries, wait ? 1 : 0,
+                               wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0) return OK;
+            int savedErrno = errno;
+            if (savedErrno == EINTR) continue;
+            LOG_RPC_DETAIL("io_uring_enter(): %s", strerror(savedErrno));
+            return -savedErrno;
+        }
+    }
+
+    bool popCqe(io_uring_cqe* cqe) {
+        unsigned head = *mCqHead;
+        if (head == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) return false;
+        *cqe = mCqes[head & mCqMask];
+        __atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    IoUring() = default;
+
+    struct Mapping {
+        void* addr = MAP_FAILED;
+        size_t size = 0;
+
+        bool map(const unique_fd& fd, size_t mapSize, off_t offset) {
+            addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd.get(), offset);
+            size = mapSize;
+            return addr != MAP_FAILED;
+        }
+        ~Mapping() {
+            if (addr != MAP_FAILED) munmap(addr, size);
+        }
+    };
+
+    // mappings are unmapped before the ring is closed
+    unique_fd mFd;
+    Mapping mSqRing;
+    Mapping mCqRing;
+    Mapping mSqes;
+
+    unsigned* mSqHead = nullptr;
+    unsigned* mSqTail = nullptr;
+    unsigned mSqMask = 0;
+    unsigned* mSqArray = nullptr;
+    unsigned mSqEntries = 0;
+    unsigned* mCqHead = nullptr;
+    unsigned* mCqTail = nullptr;
+    unsigned mCqMask = 0;
+    io_uring_cqe* mCqes = nullptr;
+
+    // entries which were filled in, and which the kernel was told about
+    unsigned mSqTailLocal = 0;
+    unsigned mPublished = 0;
+};
+
+// Where the result of an entry goes. Its address is the user_data of the
+// entry, and it must outlive the entry. Only accessed with the lock of the
+// IoUringReactor held.
+struct IoUringCompletion {
+    bool done = false;
+    int32_t res = 0;
+};
+
+// One ring for all transports of a RpcTransportCtx, i.e. of a session on
+// the client side, and of a server on the server side.
+//
+// Any thread may add entries. Only one at a time waits in io_uring_enter, and
+// hands out the completions it gets to the others, which wait on a condition
+// variable until theirs are done, or until it is their turn to wait in the
+// kernel. A thread which is alone submits and waits with a single syscall.
+class IoUringReactor {
+public:
+    static std::shared_ptr<IoUringReactor> make() {
+        auto ring = IoUring::make();
+        if (ring == nullptr) return nullptr;
+        return std::shared_ptr<IoUringReactor>(new IoUringReactor(std::move(ring)));
+    }
+
+    // Calls |fill| to add entries, and returns once |done| returns true. Both
+    // are called with the lock held. Entries without a completion should set
+    // user_data to 0.
+    status_t run(const std::function<void(IoUring&)>& fill, const std::function<bool()>& done) {
+        std::unique_lock<std::mutex> _l(mMutex);
+        fill(*mRing);
+        bool unsubmitted = mRing->publish();
+        while (true) {
+            reapLocked();
+            if (done()) break;
+
+            if (mEntering) {
+                if (!unsubmitted) {
+                    mCv.wait(_l);
+                    continue;
+                }
+                // The thread in the kernel won't see these until it returns.
+                // This doesn't block, and keeps the lock so that entries
+                // don't pile up unsubmitted.
+                unsubmitted = false;
+                if (status_t status = mRing->enter(false); status != OK) return status;
+                continue;
+            }
+
+            mEntering = true;
+            unsubmitted = false;
+            _l.unlock();
+            status_t status = mRing->enter(true);
+            _l.lock();
+            mEntering = false;
+            // someone else may have to wait in the kernel now
+            mCv.notify_all();
+            if (status != OK) return status;
+        }
+
+        // entries added by |fill| which didn't need waiting for
+        if (unsubmitted) return mRing->enter(false);
+        return OK;
+    }
+
+private:
+    explicit IoUringReactor(std::unique_ptr<IoUring> ring) : mRing(std::move(ring)) {}
+
+    void reapLocked() {
+        bool any = false;
+        io_uring_cqe cqe;
+        while (mRing->popCqe(&cqe)) {
+            if (cqe.user_data == 0) continue;
+            auto* completion = reinterpret_cast<IoUringCompletion*>(cqe.user_data);
+            completion->done = true;
+            completion->res = cqe.res;
+            any = true;
+        }
+        if (any) mCv.notify_all();
+    }
+
+    std::mutex mMutex; // for everything below
+    std::condition_variable mCv;
+    std::unique_ptr<IoUring> mRing;
+    bool mEntering = false;
+};
+
+// RpcTransport with TLS disabled, driven by io_uring.
+class RpcTransportIoUring : public RpcTransport {
+public:
+    RpcTransportIoUring(unique_fd socket, std::shared_ptr<IoUringReactor> reactor)
+          : mSocket(std::move(socket)), mReactor(std::move(reactor)) {}
+    ~RpcTransportIoUring() {
+        // the kernel still refers to these until they are cancelled
+        disarmTrigger(mRead);
+        disarmTrigger(mWrite);
+    }
+
+    status_t peek(void* buf, size_t size, size_t* out_size) override {
+        ssize_t ret = TEMP_FAILURE_RETRY(::recv(mSocket.get(), buf, size, MSG_PEEK));
+        if (ret < 0) {
+            int savedErrno = errno;
+            if (savedErrno == EAGAIN || savedErrno == EWOULDBLOCK) {
+                return WOULD_BLOCK;
+            }
+
+            LOG_RPC_DETAIL("RpcTransport peek(): %s", strerror(savedErrno));
+            return -savedErrno;
+        }
+
+        *out_size = static_cast<size_t>(ret);
+        return OK;
+    }
+
+    status_t interruptableWriteFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
+                                     const std::function<status_t()>& altPoll) override {
+        return interruptableReadOrWrite(mWrite, fdTrigger, iovs, niovs, IORING_OP_SENDMSG,
+                                        "sendmsg", POLLOUT, altPoll);
+    }
+
+    status_t interruptableReadFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
+                                    const std::function<status_t()>& altPoll) override {
+        return interruptableReadOrWrite(mRead, fdTrigger, iovs, niovs, IORING_OP_RECVMSG,
+                                        "recvmsg", POLLIN, altPoll);
+    }
+
+    status_t waitForRead(FdTrigger* fdTrigger, std::chrono::milliseconds timeout) override {
+        return fdTrigger->triggerablePoll(mSocket.get(), POLLIN,
+                                          std::clamp<int64_t>(timeout.count(), 0,
+                                                              std::numeric_limits<int>::max()));
+    }
+
+    base::borrowed_fd pollFd() const override { return mSocket; }
+
+private:
+    // A multiplexed connection is read and written by different threads at
+    // once, so each direction keeps its own poll on the trigger.
+    struct Direction {
+        // the trigger which is polled for, if any
+        FdTrigger* armedTrigger = nullptr;
+        IoUringCompletion trigger;
+    };
+
+    status_t interruptableReadOrWrite(Direction& direction, FdTrigger* fdTrigger, iovec* iovs,
+                                      int niovs, uint8_t opcode, const char* funName,
+                                      int16_t event, const std::function<status_t()>& altPoll) {
+        MAYBE_WAIT_IN_FLAKE_MODE;
+
+        if (niovs < 0) {
+            return BAD_VALUE;
+        }
+
+        // Since we didn't poll, we need to manually check to see if it was triggered. Otherwise, we
+        // may never know we should be shutting down.
+        if (fdTrigger->isTriggered()) {
+            return DEAD_OBJECT;
+        }
+
+        // see RpcTransportRaw, an empty last iovec would look like a hangup
+        while (niovs > 0 && iovs[niovs - 1].iov_len == 0) {
+            niovs--;
+        }
+        if (niovs == 0) {
+            return OK;
+        }
+
+        while (true) {
+            msghdr msg{
+                    .msg_iov = iovs,
+                    .msg_iovlen = static_cast<decltype(msg.msg_iovlen)>(niovs),
+            };
+            // With altPoll, that is called instead of waiting for the socket.
+            int64_t processSize;
+            if (status_t status = submitAndWait(direction, fdTrigger, opcode, &msg,
+                                                altPoll ? 0 : event, &processSize);
+                status != OK) {
+                return status;
+            }
+
+            if (processSize < 0) {
+                if (processSize != -EAGAIN && processSize != -EWOULDBLOCK) {
+                    LOG_RPC_DETAIL("RpcTransport %s(): %s", funName,
+                                   strerror(static_cast<int>(-processSize)));
+                    return static_cast<status_t>(processSize);
+                }
+            } else if (processSize == 0) {
+                return DEAD_OBJECT;
+            } else {
+                while (processSize > 0 && niovs > 0) {
+                    auto& iov = iovs[0];
+                    if (static_cast<size_t>(processSize) < iov.iov_len) {
+                        // Advance the base of the current iovec
+                        iov.iov_base = reinterpret_cast<char*>(iov.iov_base) + processSize;
+                        iov.iov_len -= processSize;
+                        break;
+                    }
+
+                    // The current iovec was fully processed
+                    processSize -= iov.iov_len;
+                    iovs++;
+                    niovs--;
+                }
+                if (niovs == 0) {
+                    LOG_ALWAYS_FATAL_IF(processSize > 0,
+                                        "Reached the end of iovecs "
+                                        "with %" PRId64 " bytes remaining",
+                                        processSize);
+                    return OK;
+                }
+                // the rest is usually ready already
+                continue;
+            }
+
+            if (altPoll) {
+                if (status_t status = altPoll(); status != OK) return status;
+                if (fdTrigger->isTriggered()) {
+                    return DEAD_OBJECT;
+                }
+            }
+        }
+    }
+
+    // Runs |opcode| on the socket. If |event| is set, it runs once the socket
+    // is ready for that, otherwise it doesn't wait. Either way, this usually
+    // takes a single io_uring_enter, unless the trigger interrupts it.
+    status_t submitAndWait(Direction& direction, FdTrigger* fdTrigger, uint8_t opcode,
+                           msghdr* msg, int16_t event, int64_t* result) {
+        // e.g. the server reads the connection header with its own trigger,
+        // and everything else with the one of the session
+        if (direction.armedTrigger != fdTrigger) {
+            if (status_t status = disarmTrigger(direction); status != OK) return status;
+        }
+
+        IoUringCompletion socketPoll{.done = event == 0};
+        IoUringCompletion op;
+        auto fill = [&](IoUring& ring) {
+            if (direction.armedTrigger == nullptr) {
+                // stays armed until triggered, which happens once only
+                io_uring_sqe* poll = nextSqe(ring);
+                poll->opcode = IORING_OP_POLL_ADD;
+                poll->fd = fdTrigger->readFd().get();
+                poll->poll32_events = POLLIN;
+                poll->user_data = reinterpret_cast<uint64_t>(&direction.trigger);
+                direction.armedTrigger = fdTrigger;
+            }
+
+            if (event != 0) {
+                io_uring_sqe* poll = nextSqe(ring);
+                poll->opcode = IORING_OP_POLL_ADD;
+                poll->flags = IOSQE_IO_LINK;
+                poll->fd = mSocket.get();
+                poll->poll32_events = event;
+                poll->user_data = reinterpret_cast<uint64_t>(&socketPoll);
+            }
+
+            io_uring_sqe* sqe = nextSqe(ring);
+            sqe->opcode = opcode;
+            sqe->fd = mSocket.get();
+            sqe->addr = reinterpret_cast<uint64_t>(msg);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | (event != 0 ? 0 : MSG_DONTWAIT);
+            sqe->user_data = reinterpret_cast<uint64_t>(&op);
+        };
+        bool triggered = false;
+        if (status_t status = mReactor->run(fill,
+                                            [&] {
+                                                triggered = direction.trigger.done;
+                                                return (op.done && socketPoll.done) || triggered;
+                                            });
+            status != OK) {
+            return status;
+        }
+
+        if (triggered) {
+            // The kernel may still use |msg| and the completions until the
+            // operation completes, so wait for that.
+            auto cancel = [&](IoUring& ring) {
+                for (IoUringCompletion* c : {&socketPoll, &op}) {
+                    if (c->done) continue;
+                    io_uring_sqe* sqe = nextSqe(ring);
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->fd = -1;
+                    sqe->addr = reinterpret_cast<uint64_t>(c);
+                }
+            };
+            if (status_t status =
+                        mReactor->run(cancel, [&] { return op.done && socketPoll.done; });
+                status != OK) {
+                // can't return while the kernel might still write to the stack
+                LOG_ALWAYS_FATAL("Could not cancel io_uring operation: %s",
+                                 statusToString(status).c_str());
+            }
+            direction.armedTrigger = nullptr;
+            direction.trigger = {};
+            return DEAD_OBJECT;
+        }
+
+        *result = op.res;
+        return OK;
+    }
+
+    // Cancels the poll on the trigger of |direction|, if any, and waits for it
+    // to complete, so that it can be armed again.
+    status_t disarmTrigger(Direction& direction) {
+        if (direction.armedTrigger == nullptr) return OK;
+        auto cancel = [&](IoUring& ring) {
+            if (direction.trigger.done) return;
+            io_uring_sqe* sqe = nextSqe(ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<uint64_t>(&direction.trigger);
+        };
+        if (status_t status = mReactor->run(cancel, [&] { return direction.trigger.done; });
+            status != OK) {
+            LOG_ALWAYS_FATAL("Could not cancel io_uring poll: %s", statusToString(status).c_str());
+        }
+        direction.armedTrigger = nullptr;
+        direction.trigger = {};
+        return OK;
+    }
+
+    static io_uring_sqe* nextSqe(IoUring& ring) {
+        io_uring_sqe* sqe = ring.nextSqe();
+        LOG_ALWAYS_FATAL_IF(sqe == nullptr, "io_uring has more than %u entries to submit",
+                            kRingEntries);
+        return sqe;
+    }
+
+    unique_fd mSocket;
+    std::shared_ptr<IoUringReactor> mReactor;
+    Direction mRead;
+    Direction mWrite;
+};
+
+// RpcTransportCtx with TLS disabled, driven by io_uring.
+class RpcTransportCtxIoUring : public RpcTransportCtx {
+public:
+    std::unique_ptr<RpcTransport> newTransport(unique_fd fd, FdTrigger*) const override {
+        if (mReactor == nullptr) return nullptr;
+        return std::make_unique<RpcTransportIoUring>(std::move(fd), mReactor);
+    }
+    std::vector<uint8_t> getCertificate(RpcCertificateFormat) const override { return {}; }
+    bool supportsConcurrentReadWrite() const override { return true; }
+    void onNewSession() override {}
+
+private:
+    // shared by all transports, see IoUringReactor
+    const std::shared_ptr<IoUringReactor> mReactor = IoUringReactor::make();
+};
+
+} // namespace
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryIoUring::newServerCtx() const {
+    return std::make_unique<RpcTransportCtxIoUring>();
+}
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryIoUring::newClientCtx() const {
+    return std::make_unique<RpcTransportCtxIoUring>();
+}
+
+std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryIoUring::make() {
+    // e.g. disabled with sysctl or seccomp
+    if (IoUring::make() == nullptr) return nullptr;
+    return std::unique_ptr<RpcTransportCtxFactoryIoUring>(new RpcTransportCtxFactoryIoUring());
+}
+
+#else // BINDER_RPC_HAVE_IO_URING
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryIoUring::newServerCtx() const {
+    return nullptr;
+}
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryIoUring::newClientCtx() const {
+    return nullptr;
+}
+
+std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryIoUring::make() {
+    return nullptr;
+}
+
+#endif // BINDER_RPC_HAVE_IO_URING
+
+const char* RpcTransportCtxFactoryIoUring::toCString() const {
+    return "io_uring";
+}
+
+} // namespace android
@@ -18,6 +18,12 @@
 #include <log/log.h>
 
 #include <poll.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
 
 #include <android-base/macros.h>
 #include <binder/RpcTransportRaw.h>
@@ -29,11 +35,42 @@ namespace android {
 
 namespace {
 
+std::atomic<bool> gCountSyscalls = false;
+std::atomic<uint64_t> gNumReads = 0;
+std::atomic<uint64_t> gNumWrites = 0;
+std::atomic<uint64_t> gNumPolls = 0;
+
+void countSyscall(std::atomic<uint64_t>& counter) {
+    // these are shared by all transports, so only written when asked for
+    if (!gCountSyscalls.load(std::memory_order_relaxed)) return;
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef CONFIG_ANDROID_BINDER_RPC_READ_AHEAD_SIZE
+constexpr size_t kDefaultReadAheadSize = CONFIG_ANDROID_BINDER_RPC_READ_AHEAD_SIZE;
+#else
+constexpr size_t kDefaultReadAheadSize = 0;
+#endif
+
+// Most messages are read as a header and then a body (see RpcState), so
+// the iovecs of one read never exceed this.
+constexpr int kMaxReadAheadIovs = 8;
+
 // RpcTransport with TLS disabled.
 class RpcTransportRaw : public RpcTransport {
 public:
-    explicit RpcTransportRaw(android::base::unique_fd socket) : mSocket(std::move(socket)) {}
+    RpcTransportRaw(android::base::unique_fd socket, size_t readAheadSize)
+          : mSocket(std::move(socket)), mReadAheadSize(readAheadSize) {
+        if (mReadAheadSize > 0) mReadAhead = std::make_unique<uint8_t[]>(mReadAheadSize);
+    }
     status_t peek(void* buf, size_t size, size_t* out_size) override {
+        if (mReadAheadStart < mReadAheadEnd) {
+            *out_size = std::min(size, mReadAheadEnd - mReadAheadStart);
+            memcpy(buf, mReadAhead.get() + mReadAheadStart, *out_size);
+            return OK;
+        }
+
+        countSyscall(gNumReads);
         ssize_t ret = TEMP_FAILURE_RETRY(::recv(mSocket.get(), buf, size, MSG_PEEK));
         if (ret < 0) {
             int savedErrno = errno;
@@ -49,10 +86,14 @@ public:
         return OK;
     }
 
+    // If 'lastIovOptional', this returns once all but the last iovec are
+    // processed, and the last one is filled with whatever else was ready.
     template <typename SendOrReceive>
     status_t interruptableReadOrWrite(FdTrigger* fdTrigger, iovec* iovs, int niovs,
                                       SendOrReceive sendOrReceiveFun, const char* funName,
-                                      int16_t event, const std::function<status_t()>& altPoll) {
+                                      int16_t event, std::atomic<uint64_t>& syscallCounter,
+                                      const std::function<status_t()>& altPoll,
+                                      bool lastIovOptional = false) {
         MAYBE_WAIT_IN_FLAKE_MODE;
 
         if (niovs < 0) {
@@ -88,6 +129,7 @@ public:
                     // non-negative int and can be cast to either.
                     .msg_iovlen = static_cast<decltype(msg.msg_iovlen)>(niovs),
             };
+            countSyscall(syscallCounter);
             ssize_t processSize =
                     TEMP_FAILURE_RETRY(sendOrReceiveFun(mSocket.get(), &msg, MSG_NOSIGNAL));
 
@@ -103,6 +145,7 @@ public:
             } else if (processSize == 0) {
                 return DEAD_OBJECT;
             } else {
+                int minIovs = lastIovOptional ? 1 : 0;
                 while (processSize > 0 && niovs > 0) {
                     auto& iov = iovs[0];
                     if (static_cast<size_t>(processSize) < iov.iov_len) {
@@ -117,7 +160,7 @@ public:
                     iovs++;
                     niovs--;
                 }
-                if (niovs == 0) {
+                if (niovs <= minIovs) {
                     LOG_ALWAYS_FATAL_IF(processSize > 0,
                                         "Reached the end of iovecs "
                                         "with %zd bytes remaining",
@@ -132,6 +175,7 @@ public:
                     return DEAD_OBJECT;
                 }
             } else {
+                countSyscall(gNumPolls);
                 if (status_t status = fdTrigger->triggerablePoll(mSocket.get(), event);
                     status != OK)
                     return status;
@@ -143,44 +187,127 @@ public:
     status_t interruptableWriteFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
                                      const std::function<status_t()>& altPoll) override {
         return interruptableReadOrWrite(fdTrigger, iovs, niovs, sendmsg, "sendmsg", POLLOUT,
-                                        altPoll);
+                                        gNumWrites, altPoll);
     }
 
     status_t interruptableReadFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
                                     const std::function<status_t()>& altPoll) override {
-        return interruptableReadOrWrite(fdTrigger, iovs, niovs, recvmsg, "recvmsg", POLLIN,
-                                        altPoll);
+        if (mReadAhead == nullptr) {
+            return interruptableReadOrWrite(fdTrigger, iovs, niovs, recvmsg, "recvmsg", POLLIN,
+                                            gNumReads, altPoll);
+        }
+
+        if (niovs < 0) return BAD_VALUE;
+        if (fdTrigger->isTriggered()) return DEAD_OBJECT;
+
+        // serve what was read ahead before
+        while (niovs > 0 && mReadAheadStart < mReadAheadEnd) {
+            size_t todo = std::min(iovs[0].iov_len, mReadAheadEnd - mReadAheadStart);
+            memcpy(iovs[0].iov_base, mReadAhead.get() + mReadAheadStart, todo);
+            mReadAheadStart += todo;
+            iovs[0].iov_base = reinterpret_cast<uint8_t*>(iovs[0].iov_base) + todo;
+            iovs[0].iov_len -= todo;
+            if (iovs[0].iov_len == 0) {
+                iovs++;
+                niovs--;
+            }
+        }
+        while (niovs > 0 && iovs[niovs - 1].iov_len == 0) {
+            niovs--;
+        }
+        if (niovs == 0) return OK;
+
+        if (niovs > kMaxReadAheadIovs) {
+            return interruptableReadOrWrite(fdTrigger, iovs, niovs, recvmsg, "recvmsg", POLLIN,
+                                            gNumReads, altPoll);
+        }
+
+        // The buffer is empty now. Anything which is already queued after the
+        // requested data (e.g. the body following a header) is read into it
+        // with the same recvmsg.
+        iovec iovsWithReadAhead[kMaxReadAheadIovs + 1];
+        std::copy(iovs, iovs + niovs, iovsWithReadAhead);
+        iovec& readAheadIov = iovsWithReadAhead[niovs];
+        readAheadIov = {mReadAhead.get(), mReadAheadSize};
+        mReadAheadStart = mReadAheadEnd = 0;
+
+        status_t status = interruptableReadOrWrite(fdTrigger, iovsWithReadAhead, niovs + 1,
+                                                   recvmsg, "recvmsg", POLLIN, gNumReads,
+                                                   altPoll, true /*lastIovOptional*/);
+        if (status != OK) return status;
+        mReadAheadEnd = reinterpret_cast<uint8_t*>(readAheadIov.iov_base) - mReadAhead.get();
+        return OK;
     }
 
+    status_t waitForRead(FdTrigger* fdTrigger, std::chrono::milliseconds timeout) override {
+        if (mReadAheadStart < mReadAheadEnd) return OK;
+
+        countSyscall(gNumPolls);
+        return fdTrigger->triggerablePoll(mSocket.get(), POLLIN,
+                                          std::clamp<int64_t>(timeout.count(), 0,
+                                                              std::numeric_limits<int>::max()));
+    }
+
+    base::borrowed_fd pollFd() const override { return mSocket; }
+
 private:
     base::unique_fd mSocket;
+
+    // data which was received, but not yet requested, is in
+    // [mReadAheadStart, mReadAheadEnd)
+    const size_t mReadAheadSize;
+    std::unique_ptr<uint8_t[]> mReadAhead;
+    size_t mReadAheadStart = 0;
+    size_t mReadAheadEnd = 0;
 };
 
 // RpcTransportCtx with TLS disabled.
 class RpcTransportCtxRaw : public RpcTransportCtx {
 public:
+    explicit RpcTransportCtxRaw(size_t readAheadSize) : mReadAheadSize(readAheadSize) {}
     std::unique_ptr<RpcTransport> newTransport(android::base::unique_fd fd, FdTrigger*) const {
-        return std::make_unique<RpcTransportRaw>(std::move(fd));
+        return std::make_unique<RpcTransportRaw>(std::move(fd), mReadAheadSize);
     }
     std::vector<uint8_t> getCertificate(RpcCertificateFormat) const override { return {}; }
+    bool supportsConcurrentReadWrite() const override { return true; }
+    void onNewSession() override {}
+
+private:
+    const size_t mReadAheadSize;
 };
 
 } // namespace
 
 std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryRaw::newServerCtx() const {
-    return std::make_unique<RpcTransportCtxRaw>();
+    return std::make_unique<RpcTransportCtxRaw>(mReadAheadSize);
 }
 
 std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryRaw::newClientCtx() const {
-    return std::make_unique<RpcTransportCtxRaw>();
+    return std::make_unique<RpcTransportCtxRaw>(mReadAheadSize);
 }
 
 const char *RpcTransportCtxFactoryRaw::toCString() const {
     return "raw";
 }
 
+void RpcTransportCtxFactoryRaw::setSyscallCountingEnabled(bool enabled) {
+    gCountSyscalls.store(enabled, std::memory_order_relaxed);
+}
+
+RpcTransportCtxFactoryRaw::SyscallCounts RpcTransportCtxFactoryRaw::getSyscallCounts() {
+    return SyscallCounts{
+            .reads = gNumReads.load(std::memory_order_relaxed),
+            .writes = gNumWrites.load(std::memory_order_relaxed),
+            .polls = gNumPolls.load(std::memory_order_relaxed),
+    };
+}
+
 std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryRaw::make() {
-    return std::unique_ptr<RpcTransportCtxFactoryRaw>(new RpcTransportCtxFactoryRaw());
+    return make(kDefaultReadAheadSize);
+}
+
+std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryRaw::make(size_t readAheadSize) {
+    return std::unique_ptr<RpcTransportCtxFactoryRaw>(new RpcTransportCtxFactoryRaw(readAheadSize));
 }
 
 } // namespace android
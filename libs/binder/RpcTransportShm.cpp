@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RpcShmTransport"
+#include <log/log.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include <binder/RpcTransportShm.h>
+
+#include "FdTrigger.h"
+#include "RpcState.h"
+
+namespace android {
+
+using base::borrowed_fd;
+using base::unique_fd;
+
+namespace {
+
+#ifdef CONFIG_ANDROID_BINDER_RPC_SHM_RING_SIZE
+constexpr size_t kDefaultRingSize = CONFIG_ANDROID_BINDER_RPC_SHM_RING_SIZE;
+#else
+constexpr size_t kDefaultRingSize = 64 * 1024;
+#endif
+
+// The client chooses the ring size, so this limits what a server maps.
+constexpr size_t kMinRingSize = 256;
+constexpr size_t kMaxRingSize = 16 * 1024 * 1024;
+
+constexpr uint32_t kShmHelloMagic = 0x4d485352; // "RSHM"
+
+// Sent by the client on the socket, along with the memfd, before anything else.
+struct ShmHello {
+    uint32_t magic;
+    uint32_t ringSize;
+};
+
+// Start of each ring in the shared memory, followed by its data. The indexes
+// count bytes in total, and wrap around. Each is only written by one side.
+struct ShmRingHeader {
+    // written by the producer
+    alignas(64) std::atomic<uint32_t> head;
+    // set by the producer when the ring is full, so that it is woken up
+    std::atomic<uint32_t> writerWaiting;
+
+    // written by the consumer
+    alignas(64) std::atomic<uint32_t> tail;
+    // set by the consumer when the ring is empty, so that it is woken up
+    std::atomic<uint32_t> readerWaiting;
+};
+// these are shared with another process
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+size_t mapSizeForRingSize(size_t ringSize) {
+    return 2 * (sizeof(ShmRingHeader) + ringSize);
+}
+
+size_t roundUpRingSize(size_t ringSize) {
+    size_t size = kMinRingSize;
+    while (size < ringSize && size < kMaxRingSize) size *= 2;
+    return size;
+}
+
+// Waits on a non-blocking socket which isn't ready yet, otherwise returns the
+// error.
+status_t waitOnSocket(borrowed_fd socket, FdTrigger* fdTrigger, int16_t event,
+                      const char* funName) {
+    int savedErrno = errno;
+    if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+        ALOGE("RpcTransportShm %s(): %s", funName, strerror(savedErrno));
+        return -savedErrno;
+    }
+    return fdTrigger->triggerablePoll(socket, event);
+}
+
+status_t sendHello(borrowed_fd socket, FdTrigger* fdTrigger, const ShmHello& hello,
+                   borrowed_fd memfd) {
+    iovec iov{const_cast<ShmHello*>(&hello), sizeof(hello)};
+    union {
+        cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control{};
+    msghdr msg{
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+    };
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int fd = memfd.get();
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    while (true) {
+        ssize_t ret = TEMP_FAILURE_RETRY(sendmsg(socket.get(), &msg, MSG_NOSIGNAL));
+        if (ret == static_cast<ssize_t>(sizeof(hello))) return OK;
+        if (ret >= 0) {
+            ALOGE("RpcTransportShm sent partial hello: %zd", ret);
+            return DEAD_OBJECT;
+        }
+        if (status_t status = waitOnSocket(socket, fdTrigger, POLLOUT, "sendmsg"); status != OK) {
+            return status;
+        }
+    }
+}
+
+status_t receiveHello(borrowed_fd socket, FdTrigger* fdTrigger, ShmHello* hello,
+                      unique_fd* memfd) {
+    iovec iov{hello, sizeof(*hello)};
+    union {
+        cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control{};
+    msghdr msg{
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+    };
+
+    while (true) {
+        ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(socket.get(), &msg, MSG_CMSG_CLOEXEC));
+        if (ret == 0) return DEAD_OBJECT;
+        if (ret > 0) {
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+                memfd->reset(fd);
+            }
+            if (ret != static_cast<ssize_t>(sizeof(*hello)) || !memfd->ok() ||
+                (msg.msg_flags & MSG_CTRUNC)) {
+                ALOGE("RpcTransportShm received bad hello of %zd bytes, with%s fd", ret,
+                      memfd->ok() ? "" : "out");
+                return BAD_VALUE;
+            }
+            return OK;
+        }
+        if (status_t status = waitOnSocket(socket, fdTrigger, POLLIN, "recvmsg"); status != OK) {
+            return status;
+        }
+    }
+}
+
+struct ShmRing {
+    ShmRingHeader* header;
+    uint8_t* data;
+};
+
+// RpcTransport over two ring buffers in shared memory.
+class RpcTransportShm : public RpcTransport {
+public:
+    RpcTransportShm(unique_fd socket, void* map, size_t ringSize, bool isClient)
+          : mSocket(std::move(socket)), mMap(map), mRingSize(ringSize) {
+        uint8_t* base = reinterpret_cast<uint8_t*>(map);
+        ShmRing rings[2];
+        for (ShmRing& ring : rings) {
+            ring.header = reinterpret_cast<ShmRingHeader*>(base);
+            ring.data = base + sizeof(ShmRingHeader);
+            base += sizeof(ShmRingHeader) + ringSize;
+        }
+        // the first one is from the client to the server
+        mTx = rings[isClient ? 0 : 1];
+        mRx = rings[isClient ? 1 : 0];
+    }
+    ~RpcTransportShm() { munmap(mMap, mapSizeForRingSize(mRingSize)); }
+
+    status_t peek(void* buf, size_t size, size_t* out_size) override {
+        uint32_t avail;
+        if (status_t status = readable(&avail); status != OK) return status;
+        if (avail == 0) {
+            if (status_t status = drainDoorbellsIfNotPolling(); status != OK) {
+                // same as recv(MSG_PEEK) when the other side is gone
+                if (status != DEAD_OBJECT) return status;
+                *out_size = 0;
+                return OK;
+            }
+            if (status_t status = armReader(&avail); status != OK) return status;
+            if (avail == 0) return WOULD_BLOCK;
+        }
+
+        *out_size = std::min<size_t>(size, avail);
+        copyFromRing(mRx, mRxTail, buf, *out_size);
+        return OK;
+    }
+
+    status_t interruptableWriteFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
+                                     const std::function<status_t()>& altPoll) override {
+        MAYBE_WAIT_IN_FLAKE_MODE;
+
+        if (niovs < 0) return BAD_VALUE;
+        if (fdTrigger->isTriggered()) return DEAD_OBJECT;
+
+        for (int i = 0; i < niovs; i++) {
+            const uint8_t* buf = reinterpret_cast<const uint8_t*>(iovs[i].iov_base);
+            size_t todo = iovs[i].iov_len;
+            while (todo > 0) {
+                uint32_t space;
+                if (status_t status = writable(&space); status != OK) return status;
+                if (space == 0) {
+                    // the other side must read before there is space
+                    if (status_t status = ringDoorbell(mTx.header->readerWaiting); status != OK) {
+                        return status;
+                    }
+                    if (status_t status = waitForSpace(fdTrigger, altPoll); status != OK) {
+                        return status;
+                    }
+                    continue;
+                }
+
+                size_t size = std::min<size_t>(todo, space);
+                copyToRing(mTx, mTxHead, buf, size);
+                mTxHead += size;
+                mTx.header->head.store(mTxHead);
+                buf += size;
+                todo -= size;
+            }
+        }
+        return ringDoorbell(mTx.header->readerWaiting);
+    }
+
+    status_t interruptableReadFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
+                                    const std::function<status_t()>& altPoll) override {
+        MAYBE_WAIT_IN_FLAKE_MODE;
+
+        if (niovs < 0) return BAD_VALUE;
+        if (fdTrigger->isTriggered()) return DEAD_OBJECT;
+
+        for (int i = 0; i < niovs; i++) {
+            uint8_t* buf = reinterpret_cast<uint8_t*>(iovs[i].iov_base);
+            size_t todo = iovs[i].iov_len;
+            while (todo > 0) {
+                uint32_t avail;
+                if (status_t status = readable(&avail); status != OK) return status;
+                if (avail == 0) {
+                    if (altPoll) {
+                        if (status_t status = altPoll(); status != OK) return status;
+                        if (fdTrigger->isTriggered()) return DEAD_OBJECT;
+                    } else if (status_t status = waitForData(fdTrigger, -1); status != OK) {
+                        return status;
+                    }
+                    continue;
+                }
+
+                size_t size = std::min<size_t>(todo, avail);
+                copyFromRing(mRx, mRxTail, buf, size);
+                mRxTail += size;
+                mRx.header->tail.store(mRxTail);
+                if (status_t status = ringDoorbell(mRx.header->writerWaiting); status != OK) {
+                    return status;
+                }
+                buf += size;
+                todo -= size;
+            }
+        }
+        return OK;
+    }
+
+    status_t waitForRead(FdTrigger* fdTrigger, std::chrono::milliseconds timeout) override {
+        return waitForData(fdTrigger,
+                           std::clamp<int64_t>(timeout.count(), 0,
+                                               std::numeric_limits<int>::max()));
+    }
+
+    // Readable once the other side rings the doorbell, which it only does
+    // after waitForRead found nothing to read.
+    base::borrowed_fd pollFd() const override { return mSocket; }
+
+private:
+    // The other side may write anything into the shared memory, so the
+    // indexes it writes are checked before they are used.
+    status_t readable(uint32_t* avail) {
+        *avail = mRx.header->head.load() - mRxTail;
+        if (*avail > mRingSize) {
+            ALOGE("RpcTransportShm: bad receive ring, %" PRIu32 " bytes in %zu", *avail,
+                  mRingSize);
+            return BAD_VALUE;
+        }
+        return OK;
+    }
+    status_t writable(uint32_t* space) {
+        uint32_t used = mTxHead - mTx.header->tail.load();
+        if (used > mRingSize) {
+            ALOGE("RpcTransportShm: bad send ring, %" PRIu32 " bytes in %zu", used, mRingSize);
+            return BAD_VALUE;
+        }
+        *space = mRingSize - used;
+        return OK;
+    }
+
+    // Asks for a doorbell once there is something to read, and checks again
+    // after, so that no data is missed.
+    status_t armReader(uint32_t* avail) {
+        mRx.header->readerWaiting.store(1);
+        return readable(avail);
+    }
+
+    // |timeoutMs| is for poll, see FdTrigger::triggerablePoll
+    status_t waitForData(FdTrigger* fdTrigger, int timeoutMs) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (true) {
+            uint64_t generation = doorbellGeneration();
+            uint32_t avail;
+            if (status_t status = readable(&avail); status != OK) return status;
+            if (avail > 0) return OK;
+            if (status_t status = armReader(&avail); status != OK) return status;
+            if (avail > 0) return OK;
+
+            int pollTimeoutMs = -1;
+            if (timeoutMs >= 0) {
+                pollTimeoutMs = std::max<int64_t>(0,
+                                                  std::chrono::ceil<std::chrono::milliseconds>(
+                                                          deadline -
+                                                          std::chrono::steady_clock::now())
+                                                          .count());
+            }
+            if (status_t status = waitForDoorbell(fdTrigger, pollTimeoutMs, generation);
+                status != OK) {
+                return status;
+            }
+        }
+    }
+
+    status_t waitForSpace(FdTrigger* fdTrigger, const std::function<status_t()>& altPoll) {
+        uint64_t generation = doorbellGeneration();
+        mTx.header->writerWaiting.store(1);
+        uint32_t space;
+        if (status_t status = writable(&space); status != OK) return status;
+        if (space > 0) return OK;
+
+        if (altPoll) {
+            if (status_t status = altPoll(); status != OK) return status;
+            if (fdTrigger->isTriggered()) return DEAD_OBJECT;
+            return OK;
+        }
+        return waitForDoorbell(fdTrigger, -1, generation);
+    }
+
+    uint64_t doorbellGeneration() {
+        std::lock_guard<std::mutex> _l(mWaitMutex);
+        return mDoorbellGeneration;
+    }
+
+    // A multiplexed connection is read and written by different threads at
+    // once, which wait for doorbells on the same socket. Only one of them
+    // polls, and tells the others whenever it got any, so that none is lost.
+    //
+    // |generation| is from doorbellGeneration() before the caller last checked
+    // the ring. If doorbells were drained since, one of them may have been for
+    // the caller, so it must check the ring again rather than wait.
+    status_t waitForDoorbell(FdTrigger* fdTrigger, int timeoutMs, uint64_t generation) {
+        std::unique_lock<std::mutex> _l(mWaitMutex);
+        if (mDoorbellGeneration != generation) return OK;
+        if (mPolling) {
+            auto done = [&] { return !mPolling || mDoorbellGeneration != generation; };
+            if (timeoutMs < 0) {
+                mWaitCv.wait(_l, done);
+            } else if (!mWaitCv.wait_for(_l, std::chrono::milliseconds(timeoutMs), done)) {
+                return TIMED_OUT;
+            }
+            // the caller checks the ring again, and waits again if needed
+            return OK;
+        }
+
+        mPolling = true;
+        _l.unlock();
+        status_t status = fdTrigger->triggerablePoll(mSocket, POLLIN, timeoutMs);
+        if (status == OK) status = drainDoorbells();
+        _l.lock();
+        mPolling = false;
+        mDoorbellGeneration++;
+        _l.unlock();
+        mWaitCv.notify_all();
+        return status;
+    }
+
+    // Draining while another thread polls might make it miss a doorbell, so
+    // that is left to the polling thread. Threads which are about to wait
+    // might also have needed the drained doorbells, so they are told as well.
+    status_t drainDoorbellsIfNotPolling() {
+        std::unique_lock<std::mutex> _l(mWaitMutex);
+        if (mPolling) return OK;
+        status_t status = drainDoorbells();
+        mDoorbellGeneration++;
+        _l.unlock();
+        mWaitCv.notify_all();
+        return status;
+    }
+
+    // Doorbells only mean that a ring changed, and were all seen once the
+    // ring is checked again after this.
+    status_t drainDoorbells() {
+        char buf[64];
+        while (true) {
+            ssize_t ret = TEMP_FAILURE_RETRY(recv(mSocket.get(), buf, sizeof(buf), MSG_DONTWAIT));
+            if (ret > 0) continue;
+            if (ret == 0) return DEAD_OBJECT;
+            int savedErrno = errno;
+            if (savedErrno == EAGAIN || savedErrno == EWOULDBLOCK) return OK;
+            LOG_RPC_DETAIL("RpcTransportShm recv(): %s", strerror(savedErrno));
+            return -savedErrno;
+        }
+    }
+
+    status_t ringDoorbell(std::atomic<uint32_t>& waiting) {
+        if (waiting.exchange(0) == 0) return OK;
+
+        char c = 0;
+        ssize_t ret =
+                TEMP_FAILURE_RETRY(send(mSocket.get(), &c, sizeof(c), MSG_DONTWAIT | MSG_NOSIGNAL));
+        if (ret < 0) {
+            int savedErrno = errno;
+            // full of doorbells, which the other side hasn't drained yet
+            if (savedErrno == EAGAIN || savedErrno == EWOULDBLOCK) return OK;
+            LOG_RPC_DETAIL("RpcTransportShm send(): %s", strerror(savedErrno));
+            return -savedErrno;
+        }
+        return OK;
+    }
+
+    void copyToRing(const ShmRing& ring, uint32_t pos, const uint8_t* buf, size_t size) {
+        size_t offset = pos & (mRingSize - 1);
+        size_t first = std::min(size, mRingSize - offset);
+        memcpy(ring.data + offset, buf, first);
+        memcpy(ring.data, buf + first, size - first);
+    }
+    void copyFromRing(const ShmRing& ring, uint32_t pos, void* buf, size_t size) {
+        size_t offset = pos & (mRingSize - 1);
+        size_t first = std::min(size, mRingSize - offset);
+        memcpy(buf, ring.data + offset, first);
+        memcpy(reinterpret_cast<uint8_t*>(buf) + first, ring.data, size - first);
+    }
+
+    unique_fd mSocket;
+    void* mMap;
+    const size_t mRingSize;
+
+    ShmRing mTx;
+    ShmRing mRx;
+    std::mutex mWaitMutex; // for below
+    std::condition_variable mWaitCv;
+    bool mPolling = false;
+    uint64_t mDoorbellGeneration = 0;
+
+    // only written by this side, so never read back from the shared memory
+    uint32_t mTxHead = 0;
+    uint32_t mRxTail = 0;
+};
+
+std::unique_ptr<RpcTransport> newClientTransport(unique_fd socket, FdTrigger* fdTrigger,
+                                                 size_t ringSize) {
+    size_t mapSize = mapSizeForRingSize(ringSize);
+    unique_fd memfd(memfd_create("binder_rpc_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (!memfd.ok()) {
+        ALOGE("Could not create memfd: %s", strerror(errno));
+        return nullptr;
+    }
+    if (ftruncate(memfd.get(), mapSize) != 0) {
+        ALOGE("Could not resize memfd to %zu: %s", mapSize, strerror(errno));
+        return nullptr;
+    }
+#ifdef F_ADD_SEALS
+    // so that the server can't be made to fault by shrinking it
+    if (fcntl(memfd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        ALOGE("Could not seal memfd: %s", strerror(errno));
+        return nullptr;
+    }
+#endif
+
+    void* map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd.get(), 0);
+    if (map == MAP_FAILED) {
+        ALOGE("Could not map %zu bytes: %s", mapSize, strerror(errno));
+        return nullptr;
+    }
+    auto transport = std::make_unique<RpcTransportShm>(std::move(socket), map, ringSize,
+                                                       true /*isClient*/);
+    uint8_t* base = reinterpret_cast<uint8_t*>(map);
+    new (base) ShmRingHeader{};
+    new (base + sizeof(ShmRingHeader) + ringSize) ShmRingHeader{};
+
+    ShmHello hello{
+            .magic = kShmHelloMagic,
+            .ringSize = static_cast<uint32_t>(ringSize),
+    };
+    if (status_t status = sendHello(transport->pollFd(), fdTrigger, hello, memfd);
+        status != OK) {
+        ALOGE("Could not send shared memory: %s", statusToString(status).c_str());
+        return nullptr;
+    }
+    return transport;
+}
+
+std::unique_ptr<RpcTransport> newServerTransport(unique_fd socket, FdTrigger* fdTrigger) {
+    ShmHello hello;
+    unique_fd memfd;
+    if (status_t status = receiveHello(socket, fdTrigger, &hello, &memfd); status != OK) {
+        ALOGE("Could not receive shared memory: %s", statusToString(status).c_str());
+        return nullptr;
+    }
+
+    size_t ringSize = hello.ringSize;
+    if (hello.magic != kShmHelloMagic || ringSize < kMinRingSize || ringSize > kMaxRingSize ||
+        (ringSize & (ringSize - 1)) != 0) {
+        ALOGE("Bad shared memory hello, magic 0x%" PRIx32 " and ring size %zu", hello.magic,
+              ringSize);
+        return nullptr;
+    }
+    size_t mapSize = mapSizeForRingSize(ringSize);
+
+    struct stat st;
+    if (fstat(memfd.get(), &st) != 0 || st.st_size < static_cast<off_t>(mapSize)) {
+        ALOGE("Shared memory is smaller than %zu bytes", mapSize);
+        return nullptr;
+    }
+#ifdef F_GET_SEALS
+    int seals = fcntl(memfd.get(), F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        ALOGE("Shared memory can shrink, seals: %d", seals);
+        return nullptr;
+    }
+#endif
+
+    void* map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd.get(), 0);
+    if (map == MAP_FAILED) {
+        ALOGE("Could not map %zu bytes: %s", mapSize, strerror(errno));
+        return nullptr;
+    }
+    return std::make_unique<RpcTransportShm>(std::move(socket), map, ringSize,
+                                             false /*isClient*/);
+}
+
+class RpcTransportCtxShm : public RpcTransportCtx {
+public:
+    RpcTransportCtxShm(bool isClient, size_t ringSize)
+          : mIsClient(isClient), mRingSize(ringSize) {}
+    std::unique_ptr<RpcTransport> newTransport(unique_fd fd, FdTrigger* fdTrigger) const override {
+        if (mIsClient) return newClientTransport(std::move(fd), fdTrigger, mRingSize);
+        return newServerTransport(std::move(fd), fdTrigger);
+    }
+    std::vector<uint8_t> getCertificate(RpcCertificateFormat) const override { return {}; }
+    bool supportsConcurrentReadWrite() const override { return true; }
+    void onNewSession() override {}
+
+private:
+    const bool mIsClient;
+    const size_t mRingSize;
+};
+
+} // namespace
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryShm::newServerCtx() const {
+    return std::make_unique<RpcTransportCtxShm>(false /*isClient*/, mRingSize);
+}
+
+std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryShm::newClientCtx() const {
+    return std::make_unique<RpcTransportCtxShm>(true /*isClient*/, mRingSize);
+}
+
+const char* RpcTransportCtxFactoryShm::toCString() const {
+    return "shm";
+}
+
+std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryShm::make() {
+    return make(kDefaultRingSize);
+}
+
+std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryShm::make(size_t ringSize) {
+    return std::unique_ptr<RpcTransportCtxFactoryShm>(
+            new RpcTransportCtxFactoryShm(roundUpRingSize(ringSize)));
+}
+
+} // namespace android
@@ -19,6 +19,9 @@
 
 #include <poll.h>
 
+#include <chrono>
+#include <mutex>
+
 #include <openssl/bn.h>
 #include <openssl/ssl.h>
 
@@ -40,6 +43,9 @@
 namespace android {
 namespace {
 
+// Must match between the client and the server for sessions to be resumed.
+constexpr char kSessionIdContext[] = "binder_rpc";
+
 // Implement BIO for socket that ignores SIGPIPE.
 int socketNew(BIO* bio) {
     BIO_set_data(bio, reinterpret_cast<void*>(-1));
@@ -282,10 +288,20 @@ public:
                                      const std::function<status_t()>& altPoll) override;
     status_t interruptableReadFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
                                     const std::function<status_t()>& altPoll) override;
+    status_t waitForRead(FdTrigger* fdTrigger, std::chrono::milliseconds timeout) override;
+    android::base::borrowed_fd pollFd() const override { return mSocket; }
 
 private:
+    status_t writeFully(FdTrigger* fdTrigger, const uint8_t* buffer, size_t size,
+                        const std::function<status_t()>& altPoll);
+
     android::base::unique_fd mSocket;
     Ssl mSsl;
+    // Messages made of several iovecs are gathered here, at most one TLS
+    // record at a time. So a message of up to SSL3_RT_MAX_PLAIN_LENGTH bytes
+    // is a single SSL_write and record, and a larger one is sent as full
+    // records rather than one per iovec.
+    std::vector<uint8_t> mWriteBuffer;
 };
 
 // Error code is errno.
@@ -319,37 +335,80 @@ status_t RpcTransportTls::interruptableWriteFully(FdTrigger* fdTrigger, iovec* i
     if (fdTrigger->isTriggered()) return DEAD_OBJECT;
 
     size_t size = 0;
+    int numNonEmpty = 0;
     for (int i = 0; i < niovs; i++) {
-        const iovec& iov = iovs[i];
-        if (iov.iov_len == 0) {
-            continue;
+        size += iovs[i].iov_len;
+        if (iovs[i].iov_len != 0) numNonEmpty++;
+    }
+
+    if (numNonEmpty <= 1) {
+        for (int i = 0; i < niovs; i++) {
+            if (iovs[i].iov_len == 0) continue;
+            if (status_t status = writeFully(fdTrigger,
+                                             reinterpret_cast<const uint8_t*>(iovs[i].iov_base),
+                                             iovs[i].iov_len, altPoll);
+                status != OK) {
+                return status;
+            }
         }
-        size += iov.iov_len;
+        LOG_TLS_DETAIL("TLS: Sent %zu bytes!", size);
+        return OK;
+    }
 
-        auto buffer = reinterpret_cast<const uint8_t*>(iov.iov_base);
-        const uint8_t* end = buffer + iov.iov_len;
-        while (buffer < end) {
-            size_t todo = std::min<size_t>(end - buffer, std::numeric_limits<int>::max());
-            auto [writeSize, errorQueue] = mSsl.call(SSL_write, buffer, todo);
-            if (writeSize > 0) {
-                buffer += writeSize;
-                errorQueue.clear();
-                continue;
+    mWriteBuffer.resize(std::min<size_t>(size, SSL3_RT_MAX_PLAIN_LENGTH));
+    size_t filled = 0;
+    for (int i = 0; i < niovs; i++) {
+        auto data = reinterpret_cast<const uint8_t*>(iovs[i].iov_base); // may be null if empty
+        size_t left = iovs[i].iov_len;
+        while (left > 0) {
+            size_t todo = std::min(left, mWriteBuffer.size() - filled);
+            memcpy(mWriteBuffer.data() + filled, data, todo);
+            filled += todo;
+            data += todo;
+            left -= todo;
+            if (filled < mWriteBuffer.size()) continue;
+
+            if (status_t status = writeFully(fdTrigger, mWriteBuffer.data(), filled, altPoll);
+                status != OK) {
+                return status;
             }
-            // SSL_write() should never return 0 unless BIO_write were to return 0.
-            int sslError = mSsl.getError(writeSize);
-            // TODO(b/195788248): BIO should contain the FdTrigger, and send(2) / recv(2) should be
-            //   triggerablePoll()-ed. Then additionalEvent is no longer necessary.
-            status_t pollStatus = errorQueue.pollForSslError(mSocket.get(), sslError, fdTrigger,
-                                                             "SSL_write", POLLIN, altPoll);
-            if (pollStatus != OK) return pollStatus;
-            // Do not advance buffer. Try SSL_write() again.
+            filled = 0;
+        }
+    }
+    // the last part of a message which is larger than a record
+    if (filled > 0) {
+        if (status_t status = writeFully(fdTrigger, mWriteBuffer.data(), filled, altPoll);
+            status != OK) {
+            return status;
         }
     }
     LOG_TLS_DETAIL("TLS: Sent %zu bytes!", size);
     return OK;
 }
 
+status_t RpcTransportTls::writeFully(FdTrigger* fdTrigger, const uint8_t* buffer, size_t size,
+                                     const std::function<status_t()>& altPoll) {
+    const uint8_t* end = buffer + size;
+    while (buffer < end) {
+        size_t todo = std::min<size_t>(end - buffer, std::numeric_limits<int>::max());
+        auto [writeSize, errorQueue] = mSsl.call(SSL_write, buffer, todo);
+        if (writeSize > 0) {
+            buffer += writeSize;
+            errorQueue.clear();
+            continue;
+        }
+        // SSL_write() should never return 0 unless BIO_write were to return 0.
+        int sslError = mSsl.getError(writeSize);
+        // TODO(b/195788248): BIO should contain the FdTrigger, and send(2) / recv(2) should be
+        //   triggerablePoll()-ed. Then additionalEvent is no longer necessary.
+        status_t pollStatus = errorQueue.pollForSslError(mSocket.get(), sslError, fdTrigger,
+                                                         "SSL_write", POLLIN, altPoll);
+        if (pollStatus != OK) return pollStatus;
+        // Do not advance buffer. Try SSL_write() again.
+    }
+    return OK;
+}
+
 status_t RpcTransportTls::interruptableReadFully(FdTrigger* fdTrigger, iovec* iovs, int niovs,
                                                  const std::function<status_t()>& altPoll) {
     MAYBE_WAIT_IN_FLAKE_MODE;
@@ -394,6 +453,19 @@ status_t RpcTransportTls::interruptableReadFully(FdTrigger* fdTrigger, iovec* io
     return OK;
 }
 
+status_t RpcTransportTls::waitForRead(FdTrigger* fdTrigger, std::chrono::milliseconds timeout) {
+    // A record which was already decrypted is readable without any I/O.
+    auto [pending, errorQueue] = mSsl.call(SSL_pending);
+    errorQueue.clear();
+    if (pending > 0) return OK;
+
+    // Note, only part of a record may have arrived, in which case the following
+    // read still blocks for the rest of it.
+    return fdTrigger->triggerablePoll(mSocket.get(), POLLIN,
+                                      std::clamp<int64_t>(timeout.count(), 0,
+                                                          std::numeric_limits<int>::max()));
+}
+
 // For |ssl|, set internal FD to |fd|, and do handshake. Handshake is triggerable by |fdTrigger|.
 bool setFdAndDoHandshake(Ssl* ssl, android::base::borrowed_fd fd, FdTrigger* fdTrigger) {
     bssl::UniquePtr<BIO> bio = newSocketBio(fd);
@@ -427,16 +499,23 @@ public:
     template <typename Impl,
               typename = std::enable_if_t<std::is_base_of_v<RpcTransportCtxTls, Impl>>>
     static std::unique_ptr<RpcTransportCtxTls> create(
-            std::shared_ptr<RpcCertificateVerifier> verifier, RpcAuth* auth);
+            std::shared_ptr<RpcCertificateVerifier> verifier, RpcAuth* auth,
+            std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> handshakeCounter);
     std::unique_ptr<RpcTransport> newTransport(android::base::unique_fd fd,
                                                FdTrigger* fdTrigger) const override;
     std::vector<uint8_t> getCertificate(RpcCertificateFormat) const override;
+    // SSL_read and SSL_write share the state of the SSL object
+    bool supportsConcurrentReadWrite() const override { return false; }
+    void onNewSession() override {}
 
 protected:
     static ssl_verify_result_t sslCustomVerify(SSL* ssl, uint8_t* outAlert);
+    // Sets up session resumption, which differs between server and client.
+    virtual bool configureResumption(SSL_CTX* ctx) = 0;
     virtual void preHandshake(Ssl* ssl) const = 0;
     bssl::UniquePtr<SSL_CTX> mCtx;
     std::shared_ptr<RpcCertificateVerifier> mCertVerifier;
+    std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> mHandshakeCounter; // may be null
 };
 
 std::vector<uint8_t> RpcTransportCtxTls::getCertificate(RpcCertificateFormat format) const {
@@ -469,7 +548,8 @@ ssl_verify_result_t RpcTransportCtxTls::sslCustomVerify(SSL* ssl, uint8_t* outAl
 // provided as a template argument so that this function can initialize an |Impl| object.
 template <typename Impl, typename>
 std::unique_ptr<RpcTransportCtxTls> RpcTransportCtxTls::create(
-        std::shared_ptr<RpcCertificateVerifier> verifier, RpcAuth* auth) {
+        std::shared_ptr<RpcCertificateVerifier> verifier, RpcAuth* auth,
+        std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> handshakeCounter) {
     bssl::UniquePtr<SSL_CTX> ctx(SSL_CTX_new(TLS_method()));
     TEST_AND_RETURN(nullptr, ctx != nullptr);
 
@@ -487,15 +567,25 @@ std::unique_ptr<RpcTransportCtxTls> RpcTransportCtxTls::create(
     // Require at least TLS 1.3
     TEST_AND_RETURN(nullptr, SSL_CTX_set_min_proto_version(ctx.get(), TLS1_3_VERSION));
 
+    // Only the first connection of a session does a full handshake, the
+    // others resume it with a ticket, see configureResumption.
+    TEST_AND_RETURN(nullptr,
+                    SSL_CTX_set_session_id_context(ctx.get(),
+                                                   reinterpret_cast<const uint8_t*>(
+                                                           kSessionIdContext),
+                                                   sizeof(kSessionIdContext) - 1));
+
     if constexpr (SHOULD_LOG_TLS_DETAIL) { // NOLINT
         SSL_CTX_set_info_callback(ctx.get(), sslDebugLog);
     }
 
-    auto ret = std::make_unique<Impl>();
+    std::unique_ptr<RpcTransportCtxTls> ret = std::make_unique<Impl>();
     // RpcTransportCtxTls* -> void*
     TEST_AND_RETURN(nullptr, SSL_CTX_set_app_data(ctx.get(), reinterpret_cast<void*>(ret.get())));
+    TEST_AND_RETURN(nullptr, ret->configureResumption(ctx.get()));
     ret->mCtx = std::move(ctx);
     ret->mCertVerifier = std::move(verifier);
+    ret->mHandshakeCounter = std::move(handshakeCounter);
     return ret;
 }
 
@@ -506,42 +596,122 @@ std::unique_ptr<RpcTransport> RpcTransportCtxTls::newTransport(android::base::un
     Ssl wrapped(std::move(ssl));
 
     preHandshake(&wrapped);
+    auto startTime = std::chrono::steady_clock::now();
     TEST_AND_RETURN(nullptr, setFdAndDoHandshake(&wrapped, fd, fdTrigger));
+    auto handshakeUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - startTime)
+                               .count();
+
+    if (mHandshakeCounter != nullptr) {
+        auto [resumed, errorQueue] = wrapped.call(SSL_session_reused);
+        errorQueue.clear();
+        mHandshakeCounter->add(resumed, handshakeUs);
+    }
+
     return std::make_unique<RpcTransportTls>(std::move(fd), std::move(wrapped));
 }
 
 class RpcTransportCtxTlsServer : public RpcTransportCtxTls {
 protected:
+    // Only issues tickets. The server keeps no cache of sessions, and it
+    // doesn't verify the certificate of a resumed session again.
+    bool configureResumption(SSL_CTX* ctx) override {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        return true;
+    }
     void preHandshake(Ssl* ssl) const override {
         ssl->call(SSL_set_accept_state).errorQueue.clear();
     }
 };
 
 class RpcTransportCtxTlsClient : public RpcTransportCtxTls {
+public:
+    void onNewSession() override {
+        std::lock_guard<std::mutex> _l(mResumeMutex);
+        mResumeSession = nullptr;
+    }
+
 protected:
+    // Keeps the tickets which the server sends, see sslNewSession.
+    bool configureResumption(SSL_CTX* ctx) override {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+        SSL_CTX_sess_set_new_cb(ctx, sslNewSession);
+        return true;
+    }
     void preHandshake(Ssl* ssl) const override {
         ssl->call(SSL_set_connect_state).errorQueue.clear();
+
+        bssl::UniquePtr<SSL_SESSION> session;
+        {
+            std::lock_guard<std::mutex> _l(mResumeMutex);
+            if (mResumeSession != nullptr) session = bssl::UpRef(mResumeSession);
+        }
+        // falls back to a full handshake if the server doesn't accept it
+        if (session != nullptr) ssl->call(SSL_set_session, session.get()).errorQueue.clear();
     }
+
+private:
+    static int sslNewSession(SSL* ssl, SSL_SESSION* session);
+
+    mutable std::mutex mResumeMutex; // for below
+    // The latest session ticket from the server, to resume from. Only set by
+    // connections of the current RPC session, see onNewSession.
+    bssl::UniquePtr<SSL_SESSION> mResumeSession;
 };
 
+// Keeps the session tickets which the server sends after each handshake.
+int RpcTransportCtxTlsClient::sslNewSession(SSL* ssl, SSL_SESSION* session) {
+    auto ctx = SSL_get_SSL_CTX(ssl); // Does not set error queue
+    LOG_ALWAYS_FATAL_IF(ctx == nullptr);
+    // void* -> RpcTransportCtxTls* -> RpcTransportCtxTlsClient*
+    auto rpcTransportCtxTls = static_cast<RpcTransportCtxTlsClient*>(
+            reinterpret_cast<RpcTransportCtxTls*>(SSL_CTX_get_app_data(ctx)));
+    LOG_ALWAYS_FATAL_IF(rpcTransportCtxTls == nullptr);
+
+    // Tickets are reused by all later connections, rather than once each.
+    // They are only for connections of the same session, and there is no
+    // early data which could be replayed.
+    std::lock_guard<std::mutex> _l(rpcTransportCtxTls->mResumeMutex);
+    rpcTransportCtxTls->mResumeSession.reset(session);
+    return 1; // takes ownership
+}
+
 } // namespace
 
 std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryTls::newServerCtx() const {
     return android::RpcTransportCtxTls::create<RpcTransportCtxTlsServer>(mCertVerifier,
-                                                                         mAuth.get());
+                                                                         mAuth.get(),
+                                                                         mHandshakeCounter);
 }
 
 std::unique_ptr<RpcTransportCtx> RpcTransportCtxFactoryTls::newClientCtx() const {
     return android::RpcTransportCtxTls::create<RpcTransportCtxTlsClient>(mCertVerifier,
-                                                                         mAuth.get());
+                                                                         mAuth.get(),
+                                                                         mHandshakeCounter);
 }
 
 const char* RpcTransportCtxFactoryTls::toCString() const {
     return "tls";
 }
 
+void RpcTransportCtxFactoryTls::HandshakeCounter::add(bool resumed, uint64_t handshakeUs) {
+    mHandshakes.fetch_add(1, std::memory_order_relaxed);
+    if (resumed) mResumed.fetch_add(1, std::memory_order_relaxed);
+    mHandshakeUs.fetch_add(handshakeUs, std::memory_order_relaxed);
+}
+
+RpcTransportCtxFactoryTls::HandshakeStats RpcTransportCtxFactoryTls::HandshakeCounter::get()
+        const {
+    return HandshakeStats{
+            .handshakes = mHandshakes.load(std::memory_order_relaxed),
+            .resumed = mResumed.load(std::memory_order_relaxed),
+            .handshakeUs = mHandshakeUs.load(std::memory_order_relaxed),
+    };
+}
+
 std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryTls::make(
-        std::shared_ptr<RpcCertificateVerifier> verifier, std::unique_ptr<RpcAuth> auth) {
+        std::shared_ptr<RpcCertificateVerifier> verifier, std::unique_ptr<RpcAuth> auth,
+        std::shared_ptr<HandshakeCounter> handshakeCounter) {
     if (verifier == nullptr) {
         ALOGE("%s: Must provide a certificate verifier", __PRETTY_FUNCTION__);
         return nullptr;
@@ -551,7 +721,8 @@ std::unique_ptr<RpcTransportCtxFactory> RpcTransportCtxFactoryTls::make(
         return nullptr;
     }
     return std::unique_ptr<RpcTransportCtxFactoryTls>(
-            new RpcTransportCtxFactoryTls(std::move(verifier), std::move(auth)));
+            new RpcTransportCtxFactoryTls(std::move(verifier), std::move(auth),
+                                          std::move(handshakeCounter)));
 }
 
 } // namespace android
@@ -23,6 +23,49 @@ namespace android {
 #endif
 
 constexpr uint8_t RPC_CONNECTION_OPTION_INCOMING = 0x1; // default is outgoing
+// Only for the first connection of a new session, see
+// RpcSession::setMultiplexed. The server sets
+// RPC_NEW_SESSION_RESPONSE_MULTIPLEXED if it serves the connection this way,
+// and then transactions and replies of the session carry a request ID. Older
+// servers ignore this, and the client uses a connection per call then.
+constexpr uint8_t RPC_CONNECTION_OPTION_MULTIPLEXED = 0x2;
+// Only for incoming connections, see RpcSession::setIncomingThreadsOnDemand.
+// The server may close the connection with RPC_COMMAND_CLOSE_CONNECTION after
+// it has been unused for RpcConnectionHeader::idleTimeoutMs. Older servers
+// ignore this, and keep the connection.
+constexpr uint8_t RPC_CONNECTION_OPTION_ON_DEMAND = 0x4;
+// Only for the first connection of a new session, see
+// RpcSession::setFastConnect. The server replies with RpcFastConnectInfo after
+// RpcNewSessionResponse, and sets RPC_NEW_SESSION_RESPONSE_FAST_CONNECT there.
+// Older servers ignore this, and the client asks for the same information with
+// separate transactions.
+constexpr uint8_t RPC_CONNECTION_OPTION_FAST_CONNECT = 0x8;
+// Only for the first connection of a new session, see
+// RpcSession::setPriorityInheritance. The server sets
+// RPC_NEW_SESSION_RESPONSE_PRIORITY if it runs calls at the priority of their
+// callers (see RpcServer::setPriorityInheritance). Older servers ignore this,
+// and the client doesn't send priorities then.
+constexpr uint8_t RPC_CONNECTION_OPTION_PRIORITY = 0x10;
+// Only for the first connection of a new session. The client can read
+// RPC_COMMAND_DEC_STRONG_BATCH, and will send it if the server sets
+// RPC_NEW_SESSION_RESPONSE_DEC_STRONG_BATCH. Older servers ignore this, and
+// neither side sends it then.
+constexpr uint8_t RPC_CONNECTION_OPTION_DEC_STRONG_BATCH = 0x20;
+// Only for the first connection of a new session. The server sets
+// RPC_NEW_SESSION_RESPONSE_REPLY_BINDERS, and then the data of its replies is
+// followed by the positions of their binders (see RpcWireReply), so that the
+// client can release the binders of a reply which arrives after its caller
+// gave up. Older servers ignore this, and such binders are leaked then.
+constexpr uint8_t RPC_CONNECTION_OPTION_REPLY_BINDERS = 0x40;
+
+// RpcWireTransaction::priority. Bits 0-7 hold the priority itself, which
+// is the nice value (signed) for RPC_WIRE_PRIORITY_POLICY_NORMAL, and the
+// sched_priority otherwise.
+constexpr uint32_t RPC_WIRE_PRIORITY_SET = 1u << 31;
+constexpr uint32_t RPC_WIRE_PRIORITY_POLICY_SHIFT = 8;
+constexpr uint32_t RPC_WIRE_PRIORITY_POLICY_NORMAL = 0;
+constexpr uint32_t RPC_WIRE_PRIORITY_POLICY_FIFO = 1;
+constexpr uint32_t RPC_WIRE_PRIORITY_POLICY_RR = 2;
 
 constexpr uint32_t RPC_WIRE_ADDRESS_OPTION_CREATED = 1 << 0; // distinguish from '0' address
 constexpr uint32_t RPC_WIRE_ADDRESS_OPTION_FOR_SERVER = 1 << 1;
@@ -47,7 +90,9 @@ static_assert(sizeof(RpcWireAddress) == sizeof(uint64_t));
 struct RpcConnectionHeader {
     uint32_t version; // maximum supported by caller
     uint8_t options;
-    uint8_t reservered[9];
+    uint8_t reserved0[3];
+    uint32_t idleTimeoutMs; // see RPC_CONNECTION_OPTION_ON_DEMAND
+    uint8_t reserved1[2];
     // Follows is sessionIdSize bytes.
     // if size is 0, this is requesting a new session.
     uint16_t sessionIdSize;
@@ -60,10 +105,41 @@ static_assert(sizeof(RpcConnectionHeader) == 16);
  */
 struct RpcNewSessionResponse {
     uint32_t version; // maximum supported by callee <= maximum supported by caller
-    uint8_t reserved[4];
+    uint8_t flags;    // RPC_NEW_SESSION_RESPONSE_*
+    uint8_t reserved[3];
 };
 static_assert(sizeof(RpcNewSessionResponse) == 8);
 
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_FAST_CONNECT = 0x1;
+// The server refuses the new session, see RpcServer::setMaxSessionsPerPeer, and
+// closes the connection after this response. Older clients ignore this, and see
+// the connection close instead.
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_THROTTLED = 0x2;
+// see RPC_CONNECTION_OPTION_PRIORITY
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_PRIORITY = 0x4;
+// see RPC_CONNECTION_OPTION_DEC_STRONG_BATCH
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_DEC_STRONG_BATCH = 0x8;
+// see RPC_CONNECTION_OPTION_MULTIPLEXED
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_MULTIPLEXED = 0x10;
+// see RPC_CONNECTION_OPTION_REPLY_BINDERS
+constexpr uint8_t RPC_NEW_SESSION_RESPONSE_REPLY_BINDERS = 0x20;
+
+/**
+ * Follows RpcNewSessionResponse if it has RPC_NEW_SESSION_RESPONSE_FAST_CONNECT,
+ * so that the client can open the rest of the connections of the session right
+ * away.
+ */
+struct RpcFastConnectInfo {
+    uint32_t maxThreads; // same as RPC_SPECIAL_TRANSACT_GET_MAX_THREADS
+    uint8_t reserved[2];
+    // Follows is sessionIdSize bytes, same as RPC_SPECIAL_TRANSACT_GET_SESSION_ID
+    uint16_t sessionIdSize;
+    // Same as a reply to RPC_SPECIAL_TRANSACT_GET_ROOT, which holds a strong
+    // reference for the client. Zero if there is no root object.
+    RpcWireAddress rootObject;
+};
+static_assert(sizeof(RpcFastConnectInfo) == 16);
+
 #define RPC_CONNECTION_INIT_OKAY "cci"
 
 /**
@@ -94,6 +170,20 @@ enum : uint32_t {
      * want to create a 'Parcel' object for every decref)
      */
     RPC_COMMAND_DEC_STRONG,
+    /**
+     * follows is one or more RpcDecStrong
+     *
+     * Only if RPC_NEW_SESSION_RESPONSE_DEC_STRONG_BATCH was negotiated. Used
+     * to send the dec strongs of many binders in a single message.
+     */
+    RPC_COMMAND_DEC_STRONG_BATCH,
+    /**
+     * no body
+     *
+     * Only sent on connections set up with RPC_CONNECTION_OPTION_ON_DEMAND,
+     * while they are unused. The sender closes the connection afterwards.
+     */
+    RPC_COMMAND_CLOSE_CONNECTION,
 };
 
 /**
@@ -133,17 +223,42 @@ struct RpcWireTransaction {
 
     uint64_t asyncNumber;
 
-    uint32_t reserved[4];
+    // Only if RPC_NEW_SESSION_RESPONSE_MULTIPLEXED was negotiated. Non-zero for
+    // synchronous transactions on the multiplexed connection, and echoed in
+    // the reply.
+    uint32_t requestId;
+
+    // Milliseconds left before the caller gives up on a synchronous
+    // transaction, 0 for no deadline. Older versions ignore it.
+    uint32_t timeoutMs;
+
+    // Scheduling priority of the thread making a synchronous transaction, for
+    // the remote thread to run at (see RpcSession::setPriorityInheritance), or
+    // 0. Only set if RPC_NEW_SESSION_RESPONSE_PRIORITY was negotiated, and
+    // ignored otherwise.
+    uint32_t priority;
+
+    uint32_t reserved[1];
 
     uint8_t data[];
 };
 static_assert(sizeof(RpcWireTransaction) == 40);
 
+// follows is the reply data
+// If RPC_NEW_SESSION_RESPONSE_REPLY_BINDERS was negotiated, the reply data is
+// followed by the position in it of each binder it holds (uint32_t each), and
+// then by the number of binders (uint32_t).
 struct RpcWireReply {
     int32_t status; // transact return
-    uint8_t data[];
+    uint32_t requestId; // RpcWireTransaction::requestId
+};
+static_assert(sizeof(RpcWireReply) == 8);
+
+// RpcWireReply unless RPC_NEW_SESSION_RESPONSE_MULTIPLEXED was negotiated
+struct RpcWireReplyV0 {
+    int32_t status; // transact return
 };
-static_assert(sizeof(RpcWireReply) == 4);
+static_assert(sizeof(RpcWireReplyV0) == 4);
 
 #ifdef __clang__
 #pragma clang diagnostic pop
@@ -21,6 +21,9 @@
 #include <binder/ProcessState.h>
 #include <utils/Vector.h>
 
+#include <atomic>
+#include <vector>
+
 #if defined(_WIN32)
 typedef  int  uid_t;
 #endif
@@ -178,6 +181,10 @@ public:
             // Service manager registration
             void                setTheContextObject(const sp<BBinder>& obj);
 
+            // Counters for this thread only, see ProcessState::getDriverStats
+            using DriverStats = ProcessState::DriverStats;
+            DriverStats         getDriverStats() const;
+
             // WARNING: DO NOT USE THIS API
             //
             // Returns a pointer to the stack from the last time a transaction
@@ -193,6 +200,7 @@ public:
             static const int32_t kUnsetWorkSource = -1;
 private:
             friend class ProcessState;
+            friend class PoolThread;
 
                                 IPCThreadState();
                                 ~IPCThreadState();
@@ -207,13 +215,36 @@ private:
                                                      uint32_t code,
                                                      const Parcel& data,
                                                      status_t* statusBuffer);
-            status_t            getAndExecuteCommand();
+            // waitedUs is set to how long this thread waited in the driver
+            // for the command, see ProcessState::setThreadPoolIdleTimeout
+            status_t            getAndExecuteCommand(uint64_t* waitedUs = nullptr);
             status_t            executeCommand(int32_t command);
             void                processPendingDerefs();
             void                processPostWriteDerefs();
+            // joinThreadPool for ProcessState's pooled threads, which enter
+            // with BC_ENTER_LOOPER if the driver didn't ask for them
+            void                joinPooledThread(bool requested);
+            void                runThreadPool(uint32_t looperCmd, bool pooled);
 
             void                clearCaller();
 
+            // mOut.writeInt32 and mIn.readInt32 for BC_* and BR_* commands,
+            // which also count them for getDriverStats
+            void                writeCommand(uint32_t cmd);
+            uint32_t            readCommand();
+            void                addDriverStats(DriverStats* stats) const;
+            // BC_ACQUIRE, BC_RELEASE, BC_INCREFS or BC_DECREFS, held back if
+            // ProcessState::setMaxDeferredRefCounts is set. Returns whether it
+            // was sent to the driver, like flushIfNeeded.
+            bool                writeRefCountCommand(uint32_t cmd, int32_t handle);
+            // writes mDeferredRefCounts to mOut
+            void                writeDeferredRefCounts();
+            // see ProcessState::setThreadBufferSizes, around a
+            // BINDER_WRITE_READ which read 'consumed' of 'size' bytes
+            void                resizeInBeforeRead();
+            void                resizeInAfterRead(size_t size, size_t consumed);
+            void                resizeOutAfterWrite();
+
     static  void                threadDestructor(void *st);
     static  void                freeBuffer(Parcel* parcel,
                                            const uint8_t* data, size_t dataSize,
@@ -242,6 +273,36 @@ private:
             int32_t             mStrictModePolicy;
             int32_t             mLastTransactionBinderFlags;
             CallRestriction     mCallRestriction;
+
+            // see writeRefCountCommand. These go in mOut before anything else
+            // which is written there.
+            struct DeferredRefCount {
+                uint32_t cmd;
+                int32_t handle;
+            };
+            std::vector<DeferredRefCount> mDeferredRefCounts;
+            // reads in a row which would have fit in a quarter of mIn
+            size_t              mSmallReads;
+            // microseconds the last BINDER_WRITE_READ which read took
+            uint64_t            mLastReadWaitUs;
+
+            // see getDriverStats. These are only written by this thread, but
+            // may be read by others in ProcessState::getDriverStats.
+            struct DriverCounters {
+                using Commands = std::array<std::atomic<uint64_t>, DriverStats::kNumCommands>;
+                std::atomic<uint64_t> ioctls = 0;
+                std::atomic<uint64_t> bytesWritten = 0;
+                std::atomic<uint64_t> bytesRead = 0;
+                Commands returnCommands{};
+                Commands commands{};
+                std::atomic<uint64_t> driverUs = 0;
+                std::atomic<uint64_t> transactUs = 0;
+                std::atomic<uint64_t> deferredRefCounts = 0;
+                std::atomic<uint64_t> cancelledRefCounts = 0;
+                std::atomic<uint64_t> bufferGrows = 0;
+                std::atomic<uint64_t> bufferShrinks = 0;
+                std::atomic<uint64_t> bufferBytes = 0;
+            } mDriverCounters;
 };
 
 } // namespace android
@@ -77,6 +77,8 @@ public:
 
     status_t            setDataSize(size_t size);
     void                setDataPosition(size_t pos) const;
+    // For RPC binders, a reply Parcel which already has enough capacity
+    // receives the reply data in place, without an intermediate buffer.
     status_t            setDataCapacity(size_t size);
 
     status_t            setData(const uint8_t* buffer, size_t len);
@@ -603,6 +605,11 @@ private:
     void                ipcSetDataReference(const uint8_t* data, size_t dataSize,
                                             const binder_size_t* objects, size_t objectsCount,
                                             release_func relFunc);
+    // For RpcState: returns this Parcel's own buffer if it can hold a reply of
+    // size bytes without reallocating (e.g. after setDataCapacity), so the
+    // reply can be read into it in place. Otherwise, returns nullptr.
+    uint8_t*            rpcReplyBuffer(size_t size);
+    void                rpcSetReplyData(const sp<RpcSession>& session, size_t size);
 
     status_t            finishWrite(size_t len);
     void                releaseObjects();
@@ -18,13 +18,16 @@
 
 #include <binder/IBinder.h>
 #include <binder/RpcServer.h>
+#include <utils/Condition.h>
 #include <utils/KeyedVector.h>
 #include <utils/Mutex.h>
 #include <utils/String16.h>
 #include <utils/String8.h>
 
+#include <array>
 #include <atomic>
 #include <pthread.h>
+#include <string>
 #include <unordered_set>
 #include <set>
 
@@ -110,6 +113,115 @@ public:
      */
     size_t getThreadPoolMaxThreadCount() const;
 
+    /**
+     * By default, a thread which isn't in the thread pool sends each
+     * reference count change on a remote binder to the driver right away.
+     * With this, each thread holds up to |count| of them, and sends them along
+     * with its next command (e.g. a transaction, or freeing a received
+     * buffer), or once |count| are held. A change which undoes a held one on
+     * the same handle (e.g. a release after an acquire) cancels it instead.
+     *
+     * By default, this is 0 (changes are not held).
+     */
+    void setMaxDeferredRefCounts(size_t count);
+    size_t getMaxDeferredRefCounts() const;
+
+    /**
+     * Each thread starts with |minBytes| for the commands it sends to and
+     * receives from the driver. Whenever the driver fills the receive buffer,
+     * it is doubled, up to |maxBytes|, so that bursts of incoming commands
+     * take fewer BINDER_WRITE_READ calls. It is halved again after a run of
+     * reads which would have fit in a quarter of it. The send buffer grows as
+     * needed, and goes back to |minBytes| after a write which needed more than
+     * |maxBytes|.
+     *
+     * By default, these are CONFIG_ANDROID_BINDER_THREAD_BUFFER_MIN_SIZE and
+     * CONFIG_ANDROID_BINDER_THREAD_BUFFER_MAX_SIZE. Threads which already
+     * exist keep their buffers until they next resize them.
+     */
+    void setThreadBufferSizes(size_t minBytes, size_t maxBytes);
+    size_t getThreadBufferMinSize() const;
+    size_t getThreadBufferMaxSize() const;
+
+    /**
+     * Counters for this process's use of the binder driver. These are always
+     * collected by each thread, without locks. See also
+     * IPCThreadState::getDriverStats for the calling thread only.
+     */
+    struct DriverStats {
+        // BR_* and BC_* commands are counted by _IOC_NR(cmd), and anything
+        // beyond this is counted as the last one
+        static constexpr size_t kNumCommands = 32;
+
+        // BINDER_WRITE_READ ioctls, and what the driver consumed in them
+        uint64_t ioctls = 0;
+        uint64_t bytesWritten = 0;
+        uint64_t bytesRead = 0;
+        std::array<uint64_t, kNumCommands> returnCommands{};
+        std::array<uint64_t, kNumCommands> commands{};
+        // time in BINDER_WRITE_READ, mostly waiting for commands
+        uint64_t driverUs = 0;
+        // time in BBinder::transact for incoming calls
+        uint64_t transactUs = 0;
+        // see setMaxDeferredRefCounts, commands which were held, and ones
+        // which were cancelled (two for each pair)
+        uint64_t deferredRefCounts = 0;
+        uint64_t cancelledRefCounts = 0;
+        // see setThreadBufferSizes, and the buffers of the threads which
+        // still exist
+        uint64_t bufferGrows = 0;
+        uint64_t bufferShrinks = 0;
+        uint64_t bufferBytes = 0;
+        // times all threads of the thread pool were busy, and for how long,
+        // only for the whole process
+        uint64_t starvations = 0;
+        uint64_t starvationMs = 0;
+
+        // e.g. to print from a service's dump()
+        std::string toString() const;
+    };
+    // for all threads, including ones which have exited
+    DriverStats getDriverStats();
+
+    /**
+     * By default, threads which the driver asks for (BR_SPAWN_LOOPER) stay in
+     * the thread pool until the process exits. With this, such a thread which
+     * waited |idleMs| or longer in the driver for its next command leaves the
+     * pool once it has run it, as long as the pool keeps one more thread than
+     * were busy at once during the last two periods of |idleMs|, and hasn't
+     * run out of threads in that time. Threads are only checked when they
+     * wake up, so a process which gets no commands keeps its threads until
+     * the next one, and no thread wakes up just to find it is idle. When all
+     * threads are busy again, another one is started, up to the maximum (see
+     * setThreadPoolMaxThreadCount). The main thread, and threads calling
+     * IPCThreadState::joinThreadPool themselves, never leave.
+     *
+     * By default, this is CONFIG_ANDROID_BINDER_THREADPOOL_IDLE_TIMEOUT, and 0
+     * means threads never leave.
+     */
+    void setThreadPoolIdleTimeout(uint32_t idleMs);
+    uint32_t getThreadPoolIdleTimeout() const;
+
+    // see setThreadPoolIdleTimeout
+    struct ThreadPoolStats {
+        // threads in the pool, and the ones started for it but not in it yet
+        size_t threads = 0;
+        size_t startingThreads = 0;
+        // how many the pool would keep right now, and the most which were
+        // busy at once during the last two idle periods
+        size_t targetThreads = 0;
+        size_t peakExecutingThreads = 0;
+        // threads started because the driver asked, started because the
+        // pool was busy after threads left it, and ones which left it
+        uint64_t spawnedThreads = 0;
+        uint64_t respawnedThreads = 0;
+        uint64_t reapedThreads = 0;
+
+        // e.g. to print from a service's dump()
+        std::string toString() const;
+    };
+    ThreadPoolStats getThreadPoolStats();
+
     enum class DriverFeature {
         ONEWAY_SPAM_DETECTION,
     };
@@ -133,12 +245,47 @@ private:
     ProcessState& operator=(const ProcessState& o);
     String8 makeBinderThreadName();
 
+    // see setThreadPoolIdleTimeout. Threads in joinThreadPool are counted by
+    // threadPoolEntered and threadPoolExited, and |pooled| is for ones
+    // started by startPooledThread.
+    void startPooledThread(bool isMain, bool requested);
+    void threadPoolEntered(bool pooled);
+    void threadPoolExited(bool pooled);
+    // called by a pooled thread which has been idle, returns whether it
+    // should leave the pool, in which case it has already been uncounted
+    bool reapPooledThread();
+    // called when a thread starts a command, returns whether it should start
+    // another pooled thread
+    bool respawnPooledThreadLocked();
+    void updateThreadPoolPeriodLocked();
+    size_t threadPoolTargetLocked() const;
+
     struct handle_entry {
-        IBinder* binder;
-        RefBase::weakref_type* refs;
+        // only set with the lock for the handle held, see mHandleLocks
+        std::atomic<IBinder*> binder;
+        // getStrongProxyForHandle calls looking at binder without the lock,
+        // counted by the parity of phase when they started. expungeHandle
+        // moves to the next phase, and waits only for the readers of the
+        // previous one, so that new readers can't hold it up.
+        std::atomic<uint32_t> readers[2];
+        std::atomic<uint32_t> phase;
+        // an expungeHandle call is waiting for readers
+        std::atomic<bool> expunging;
     };
 
-    handle_entry* lookupHandleLocked(int32_t handle);
+    // Handles are kept in segments which are never moved or freed, so that
+    // they can be looked up without a lock. Segment i holds
+    // kFirstHandleSegmentSize << i handles.
+    static constexpr size_t kFirstHandleSegmentShift = 5;
+    static constexpr size_t kFirstHandleSegmentSize = 1 << kFirstHandleSegmentShift;
+    static constexpr size_t kNumHandleSegments = 32 - kFirstHandleSegmentShift;
+    static constexpr size_t kNumHandleLocks = 8;
+
+    // Returns nullptr if the handle isn't valid, or if |create| is false and
+    // its segment doesn't exist yet.
+    handle_entry* lookupHandle(int32_t handle, bool create);
+    Mutex& handleLock(int32_t handle);
+    Condition& handleReadersDone(int32_t handle);
 
     String8 mDriverName;
     int mDriverFD;
@@ -156,11 +303,44 @@ private:
     size_t mMaxThreads;
     // Time when thread pool was emptied
     int64_t mStarvationStartTimeMs;
+    // see DriverStats
+    uint64_t mStarvations;
+    uint64_t mStarvationMs;
+    // see setThreadPoolIdleTimeout, all threads in joinThreadPool, the ones
+    // of those which were started by startPooledThread (not the main one),
+    // and the ones which were started but haven't joined yet
+    size_t mLooperThreads;
+    size_t mPooledThreads;
+    size_t mStartingThreads;
+    // the most threads executing at once in this idle period and the last,
+    // when this period started, and mStarvations when the last one started
+    size_t mPeakExecutingThreads;
+    size_t mLastPeakExecutingThreads;
+    int64_t mThreadPoolPeriodStartMs;
+    uint64_t mThreadPoolPeriodStarvations;
+    uint64_t mLastThreadPoolPeriodStarvations;
+    // threads which left the pool and haven't been replaced, since the
+    // driver may not ask for them again
+    size_t mUnreplacedThreads;
+    uint64_t mSpawnedThreads;
+    uint64_t mRespawnedThreads;
+    uint64_t mReapedThreads;
+
+    Mutex mDriverStatsLock; // for below
+    // IPCThreadState of each thread, which adds itself to
+    // mExitedDriverStats when it goes away
+    std::unordered_set<IPCThreadState*> mDriverStatsThreads;
+    DriverStats mExitedDriverStats;
+
+    std::atomic<handle_entry*> mHandleSegments[kNumHandleSegments];
+    // for creating and expunging proxies, by handle
+    Mutex mHandleLocks[kNumHandleLocks];
+    // broadcast with the lock for the handle held, when readers of a handle
+    // which expungeHandle waits for are done, or when it stops waiting
+    Condition mHandleReadersDone[kNumHandleLocks];
 
     mutable Mutex mLock; // protects everything below.
 
-    Vector<handle_entry> mHandleToObject;
-
     bool mForked;
     bool mExitRequested;
     bool mThreadPoolStarted;
@@ -172,6 +352,10 @@ private:
     std::unordered_set<sp<RpcSession>, RpcSessionHash> mSessions;
 
     CallRestriction mCallRestriction;
+    std::atomic<size_t> mMaxDeferredRefCounts;
+    std::atomic<size_t> mThreadBufferMinSize;
+    std::atomic<size_t> mThreadBufferMaxSize;
+    std::atomic<uint32_t> mThreadPoolIdleTimeoutMs;
 
     pthread_key_t mTLS;
     std::atomic<bool> mShutdown;
@@ -28,6 +28,7 @@
 namespace android {
 
 class FdTrigger;
+class RpcReactor;
 class RpcSocketAddress;
 
 /**
@@ -118,6 +119,71 @@ public:
     void setMaxThreads(size_t threads);
     size_t getMaxThreads();
 
+    /**
+     * By default, each connection is served by its own thread, which mostly
+     * sits idle. If |workerThreads| isn't 0, the connections of all sessions
+     * are instead watched by a single polling thread, and served by this many
+     * worker threads, so an idle connection costs no thread. The number of
+     * calls processed at the same time, including calls made back into this
+     * server while processing others, is then limited to |workerThreads|.
+     * Multiplexed connections (see RpcSession::setMultiplexed) already share
+     * threads, and are not affected.
+     *
+     * This must be called before join().
+     */
+    void setReactorWorkerThreads(size_t workerThreads);
+    size_t getReactorWorkerThreads();
+
+    /**
+     * Limits on what a single client can hold on this server, so that one
+     * client can't starve the others. For each, 0 (the default) means no
+     * limit, and these must be called before join().
+     *
+     * Sessions per peer: a peer is identified by the address of the socket,
+     * i.e. the process for unix domain sockets (with SO_PEERCRED), the remote
+     * cpu for rpmsg, the cid for vsock and the IP address for inet. Sessions
+     * of peers which can't be identified aren't limited by this. A new
+     * session beyond this is refused, and setting up the client session fails
+     * with WOULD_BLOCK.
+     *
+     * Connections per session: connections beyond this (in either direction)
+     * are closed when they are opened.
+     *
+     * Queued oneway bytes per session: oneway calls which arrive before
+     * earlier calls on the same binder are queued until those are processed.
+     * If more than this would be queued, the session is terminated. Oneway
+     * calls have no reply to report an error with, and dropping one would
+     * break the order of the calls after it.
+     */
+    void setMaxSessionsPerPeer(size_t sessions);
+    size_t getMaxSessionsPerPeer();
+    void setMaxConnectionsPerSession(size_t connections);
+    size_t getMaxConnectionsPerSession();
+    void setMaxQueuedOnewayBytesPerSession(size_t bytes);
+    size_t getMaxQueuedOnewayBytesPerSession();
+
+    struct AdmissionStats {
+        // see setMaxSessionsPerPeer
+        uint64_t rejectedSessions = 0;
+        // see setMaxConnectionsPerSession
+        uint64_t rejectedConnections = 0;
+        // sessions terminated, see setMaxQueuedOnewayBytesPerSession
+        uint64_t throttledSessions = 0;
+    };
+    AdmissionStats getAdmissionStats();
+
+    /**
+     * If enabled, a session which asks for it (see
+     * RpcSession::setPriorityInheritance) has its synchronous calls processed
+     * at least at the priority of the calling thread, as far as this process
+     * is allowed to. Real-time priorities are lowered to 'maxRealtimePriority',
+     * and aren't taken at all if that is 0. Disabled by default, since it lets
+     * clients raise the priority of threads of this process.
+     *
+     * This must be called before join().
+     */
+    void setPriorityInheritance(bool enabled, int maxRealtimePriority = 0);
+
     /**
      * By default, the latest protocol version which is supported by a client is
      * used. However, this can be used in order to prevent newer protocol
@@ -188,13 +254,29 @@ private:
 
     void onSessionAllIncomingThreadsEnded(const sp<RpcSession>& session) override;
     void onSessionIncomingThreadEnded() override;
+    void onSessionOnewayThrottled() override;
+    // see mPeerSessions
+    void releasePeerLocked(const std::string& peer);
 
     static void establishConnection(sp<RpcServer>&& server, base::unique_fd clientFd,
                                     const sockaddr_storage addr, socklen_t addrLen);
+    // RpcNewSessionResponse with RPC_NEW_SESSION_RESPONSE_FAST_CONNECT and
+    // |flags|, and RpcFastConnectInfo for a new session
+    [[nodiscard]] static status_t sendFastConnectResponse(const sp<RpcServer>& server,
+                                                          const sp<RpcSession>& session,
+                                                          RpcTransport* client,
+                                                          uint32_t protocolVersion,
+                                                          uint8_t flags);
     [[nodiscard]] status_t setupSocketServer(const RpcSocketAddress& address);
 
     const std::unique_ptr<RpcTransportCtx> mCtx;
     size_t mMaxThreads = 1;
+    size_t mReactorWorkerThreads = 0;
+    size_t mMaxSessionsPerPeer = 0;
+    size_t mMaxConnectionsPerSession = 0;
+    size_t mMaxQueuedOnewayBytesPerSession = 0;
+    bool mPriorityInheritance = false;
+    int mMaxCallerRealtimePriority = 0;
     std::optional<uint32_t> mProtocolVersion;
     base::unique_fd mServer; // socket we are accepting sessions on
 
@@ -206,8 +288,18 @@ private:
     wp<IBinder> mRootObjectWeak;
     std::function<sp<IBinder>(const sockaddr*, socklen_t)> mRootObjectFactory;
     std::map<std::vector<uint8_t>, sp<RpcSession>> mSessions;
+    // see setMaxSessionsPerPeer. Sessions are counted from when their new
+    // session response is sent, and the peer of each is kept by session ID.
+    std::map<std::string, size_t> mPeerSessions;
+    std::map<std::vector<uint8_t>, std::string> mSessionPeers;
+    // see setMaxConnectionsPerSession. Connections of each session which were
+    // admitted, but aren't added to the session yet.
+    std::map<std::vector<uint8_t>, size_t> mJoiningConnections;
+    AdmissionStats mAdmissionStats;
     std::unique_ptr<FdTrigger> mShutdownTrigger;
     std::condition_variable mShutdownCv;
+    // while joined, see setReactorWorkerThreads
+    std::shared_ptr<RpcReactor> mReactor;
 };
 
 } // namespace android
@@ -17,12 +17,20 @@
 
 #include <android-base/unique_fd.h>
 #include <binder/IBinder.h>
+#include <binder/Parcel.h>
 #include <binder/RpcTransport.h>
 #include <utils/Errors.h>
 #include <utils/RefBase.h>
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
 #include <optional>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -47,6 +55,8 @@ constexpr uint32_t RPC_WIRE_PROTOCOL_VERSION = 0;
 class RpcSession final : public virtual RefBase {
 public:
     static constexpr size_t kDefaultMaxOutgoingThreads = 10;
+    static constexpr std::chrono::milliseconds kDefaultDecStrongFlushDelay{10};
+    static constexpr std::chrono::milliseconds kDefaultOnewayFlushDelay{1};
 
     // Create an RpcSession with default configuration (raw sockets).
     static sp<RpcSession> make();
@@ -81,6 +91,209 @@ public:
     void setMaxOutgoingThreads(size_t threads);
     size_t getMaxOutgoingThreads();
 
+    /**
+     * Queue up to |count| dec strongs for remote binders which are released by
+     * this process, and send them together as a single command. Queued dec
+     * strongs are sent along with the next transaction on this session, once
+     * |count| are pending, or at most |maxDelay| after the first one was
+     * queued. This reduces the number of messages needed to tear down many
+     * proxies at once.
+     *
+     * By default, this is 0 (each dec strong is sent immediately). Batching is
+     * only used if the server supports it (RPC_CONNECTION_OPTION_DEC_STRONG_BATCH).
+     * This must be called before setting up this connection as a client.
+     */
+    void setMaxPendingDecStrongs(size_t count,
+                                 std::chrono::milliseconds maxDelay = kDefaultDecStrongFlushDelay);
+    size_t getMaxPendingDecStrongs();
+
+    /**
+     * Combine oneway transactions on this session into larger writes. Oneway
+     * calls are queued instead of being written right away, and queued calls
+     * are sent together once |maxBytes| are queued, at most |maxDelay| after
+     * the first one was queued, or along with the next synchronous (or large
+     * oneway) transaction on this session. Calls are sent in the order they
+     * were queued, so oneway calls to each binder stay in order.
+     *
+     * By default, this is 0 (each oneway call is sent immediately). Calls with
+     * at least |maxBytes| of data are never queued. This must be called before
+     * setting up this connection as a client.
+     */
+    void setMaxPendingOnewayBytes(size_t maxBytes,
+                                  std::chrono::milliseconds maxDelay = kDefaultOnewayFlushDelay);
+    size_t getMaxPendingOnewayBytes();
+
+    struct OnewayBatchStats {
+        // oneway calls which were queued, see setMaxPendingOnewayBytes
+        uint64_t queuedCalls = 0;
+        // writes which sent queued oneway calls
+        uint64_t flushes = 0;
+    };
+    OnewayBatchStats getOnewayBatchStats();
+
+    struct BufferPoolStats {
+        // receive buffers which were reused, newly allocated, and freed
+        // because the cache was full, see
+        // CONFIG_ANDROID_BINDER_RPC_BUFFER_POOL_SIZE
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t dropped = 0;
+        // buffers too large to be cached
+        uint64_t oversized = 0;
+        size_t cachedBytes = 0;
+        // buffers in use, e.g. by a reply Parcel
+        size_t outstanding = 0;
+    };
+    BufferPoolStats getBufferPoolStats();
+
+    /**
+     * Counters for the transactions sent and received on this session. These
+     * are always collected, without locks.
+     *
+     * Histogram bucket 0 counts zeros, and bucket i > 0 counts values in
+     * [2^(i-1), 2^i). The last bucket also counts anything larger. Sizes are
+     * in bytes, and times are in microseconds.
+     */
+    struct TransactionStats {
+        static constexpr size_t kNumBuckets = 24;
+        // Transaction codes below this are counted separately. All other codes
+        // (e.g. PING_TRANSACTION) and RPC session setup calls are counted
+        // together as code kNumCodes.
+        static constexpr uint32_t kNumCodes = 64;
+        using Histogram = std::array<uint64_t, kNumBuckets>;
+
+        struct CodeStats {
+            uint32_t code = 0;
+            // outgoing calls, and their total time until the reply is read
+            // (or until they are sent, for oneway calls)
+            uint64_t sent = 0;
+            uint64_t sentUs = 0;
+            // incoming calls, and their total time in IBinder::transact
+            uint64_t received = 0;
+            uint64_t receivedUs = 0;
+        };
+        // only codes which were used
+        std::vector<CodeStats> codes;
+
+        // outgoing calls
+        Histogram requestBytes{};
+        Histogram replyBytes{};
+        Histogram sendUs{};
+        Histogram waitUs{};
+        // incoming calls
+        Histogram receivedBytes{};
+        Histogram dispatchUs{};
+
+        // e.g. to print from a service's dump()
+        std::string toString() const;
+    };
+    TransactionStats getTransactionStats();
+
+    /**
+     * By default, all of setMaxIncomingThreads are started when this session
+     * is set up, and they are kept while it is. With this, only |minThreads|
+     * (at least one) are started then. Another one is started whenever all of
+     * them are busy processing calls from the server, and those started this
+     * way are stopped again once they have been unused for |idleTimeout| (if
+     * the server supports it).
+     *
+     * Only for sessions which are set up with a socket address (e.g.
+     * setupUnixDomainClient). This must be called before setting up this
+     * connection as a client.
+     */
+    void setIncomingThreadsOnDemand(size_t minThreads, std::chrono::milliseconds idleTimeout);
+
+    struct IncomingThreadStats {
+        size_t threads = 0;
+        // most threads at once
+        size_t maxThreads = 0;
+        // most threads processing calls at once
+        size_t maxBusy = 0;
+        // see setIncomingThreadsOnDemand
+        uint64_t started = 0;
+        uint64_t stopped = 0;
+    };
+    IncomingThreadStats getIncomingThreadStats();
+
+    /**
+     * While this is in scope, synchronous calls made by this thread on any
+     * session give up waiting for their reply after 'timeout', and return
+     * TIMED_OUT. The session can still be used afterwards. The connection of
+     * such a call is only used again once its late reply was read and
+     * dropped, and calls nested in it which arrive until then fail with
+     * DEAD_OBJECT. When these are nested, the earliest deadline applies.
+     *
+     * The time left is sent with each call, and the remote thread handling it
+     * gets the same deadline, so that nested calls it makes in turn are
+     * limited too, and it can check getCallTimeRemaining to stop early.
+     */
+    class ScopedCallTimeout {
+    public:
+        explicit ScopedCallTimeout(std::chrono::milliseconds timeout);
+        ~ScopedCallTimeout();
+
+    private:
+        std::optional<std::chrono::steady_clock::time_point> mPrevious;
+    };
+
+    /**
+     * Time left before the deadline of the calls made by this thread, if any,
+     * either from ScopedCallTimeout or from the call currently being handled.
+     * This is zero once the deadline has passed.
+     */
+    static std::optional<std::chrono::milliseconds> getCallTimeRemaining();
+
+    /**
+     * If enabled, this client session uses a single outgoing connection which
+     * is shared by all calling threads, instead of one connection per
+     * concurrent call (see setMaxOutgoingThreads). Each synchronous
+     * transaction is tagged with a request ID, and replies are handed to the
+     * thread which is waiting on them by whichever thread is reading from the
+     * connection at the time. The server processes up to
+     * RpcServer::setMaxThreads calls from the session concurrently.
+     *
+     * Only used if the server supports it (RPC_CONNECTION_OPTION_MULTIPLEXED),
+     * otherwise, this session falls back to one connection per call. The
+     * server can't make nested calls back into this process over the
+     * multiplexed connection, so clients hosting callbacks should also call
+     * setMaxIncomingThreads. Also ignored if the transport doesn't allow one
+     * thread to read while another writes (see
+     * RpcTransportCtx::supportsConcurrentReadWrite, e.g. TLS). This must be
+     * called before setting up this connection as a client.
+     */
+    void setMultiplexed(bool multiplexed);
+    bool isMultiplexed();
+
+    /**
+     * If enabled, the server replies to the first connection of this session
+     * with its max threads, the session ID and the root object all at once,
+     * instead of the client asking for each of them with a separate
+     * transaction. The rest of the connections are then opened concurrently,
+     * rather than one after the other, so that setting up a session takes
+     * about as long as setting up a single connection.
+     *
+     * Servers which don't support this are set up as usual. Connections are
+     * only opened concurrently for sessions which are set up with a socket
+     * address (e.g. setupUnixDomainClient). This must be called before setting
+     * up this connection as a client.
+     */
+    void setFastConnect(bool fastConnect);
+
+    /**
+     * If enabled, the scheduling priority of the calling thread is sent with
+     * each synchronous call, and the remote thread runs at least at that
+     * priority while processing it (as far as it is allowed to), like with the
+     * binder driver. Also, threads waiting for a free connection (see
+     * setMaxOutgoingThreads) get one in order of their priority, and a
+     * multiplexed server processes queued calls in that order.
+     *
+     * The server must allow this with RpcServer::setPriorityInheritance. If it
+     * doesn't, this is turned off again when the session is set up.
+     *
+     * This must be called before setting up this connection as a client.
+     */
+    void setPriorityInheritance(bool enabled);
+
     /**
      * By default, the minimum of the supported versions of the client and the
      * server will be used. Usually, this API should only be used for debugging.
@@ -168,6 +381,44 @@ public:
     [[nodiscard]] status_t transact(const sp<IBinder>& binder, uint32_t code, const Parcel& data,
                                     Parcel* reply, uint32_t flags);
 
+    struct AsyncReply {
+        status_t status;
+        // only holds the reply if status is OK
+        std::unique_ptr<Parcel> parcel;
+    };
+    using TransactCallback = std::function<void(AsyncReply reply)>;
+
+    /**
+     * Like transact for a synchronous call, except that this returns once the
+     * call is sent, and 'callback' gets the reply later. If this doesn't
+     * return OK, 'callback' is never called.
+     *
+     * The session must be multiplexed (see setMultiplexed), otherwise this
+     * returns INVALID_OPERATION. No thread waits for each call, so a single
+     * thread can have any number of calls in flight. The replies are read,
+     * and 'callback' is called, by a thread which the session starts while
+     * calls are in flight, so 'callback' should not block for long (e.g.
+     * post the reply to an event loop). If the session is shut down, the
+     * calls in flight get DEAD_OBJECT.
+     *
+     * The deadline of a ScopedCallTimeout is passed on to the remote thread,
+     * but this doesn't give up waiting for the reply.
+     */
+    [[nodiscard]] status_t transactAsync(const sp<IBinder>& binder, uint32_t code,
+                                         const Parcel& data, TransactCallback&& callback,
+                                         uint32_t flags = 0);
+
+    /**
+     * Same as transactAsync, with a future for the reply. If the call can't be
+     * sent, the future is ready right away with that error.
+     *
+     * For generated code, the request is written as for the blocking call,
+     * e.g. with Parcel::markForBinder and writeInterfaceToken, and the
+     * reply Parcel is read the same way as well.
+     */
+    std::future<AsyncReply> transactFuture(const sp<IBinder>& binder, uint32_t code,
+                                           const Parcel& data, uint32_t flags = 0);
+
     /**
      * Generally, you should not call this, unless you are testing error
      * conditions, as this is called automatically by BpBinders when they are
@@ -190,15 +441,56 @@ private:
     friend sp<RpcSession>;
     friend RpcServer;
     friend RpcState;
+    friend class RpcReactor;
     explicit RpcSession(std::unique_ptr<RpcTransportCtx> ctx);
 
     // for 'target', see RpcState::sendDecStrongToTarget
     [[nodiscard]] status_t sendDecStrongToTarget(uint64_t address, size_t target);
+    // send any dec strongs and oneway calls which are queued
+    [[nodiscard]] status_t flushPending();
+    // see mFastConnectRootObject
+    void releaseFastConnectRootObject();
+    // flush queued dec strongs and oneway calls after 'delay', unless this
+    // happens sooner for another reason
+    void schedulePendingFlush(std::chrono::milliseconds delay);
+
+    // Deferred work of this session (schedulePendingFlush, and setting up and
+    // closing on-demand connections) is done by a single thread, which is
+    // started the first time there is any, and which is stopped when the
+    // session is shut down or destroyed. It only holds a strong reference to
+    // the session while it is doing something, so it may drop the last one,
+    // and this state is shared with it.
+    struct Worker {
+        std::mutex mutex; // for below
+        std::condition_variable cv;
+        std::thread thread;
+        bool stopped = false;
+        // when the earliest scheduled flush happens, if one is scheduled
+        std::optional<std::chrono::steady_clock::time_point> flushTime;
+        // server, when on-demand connections are next checked for being idle
+        std::optional<std::chrono::steady_clock::time_point> reapTime;
+        // client, number of on-demand incoming connections to set up
+        size_t connects = 0;
+        // client, number of threads in drainStaleReplies, which aren't the
+        // worker, but are waited for like it
+        size_t drains = 0;
+    };
+    // with mWorker->mutex, returns false once the worker is stopped
+    [[nodiscard]] bool startWorkerLocked();
+    // if 'join', also waits for the worker thread to finish (unless this is it)
+    void stopWorker(bool join);
+    static void runWorker(const std::shared_ptr<Worker>& worker, const wp<RpcSession>& weakSession);
+
+    // deadline of the calls made by this thread, see ScopedCallTimeout
+    static std::optional<std::chrono::steady_clock::time_point>& callDeadline();
 
     class EventListener : public virtual RefBase {
     public:
         virtual void onSessionAllIncomingThreadsEnded(const sp<RpcSession>& session) = 0;
         virtual void onSessionIncomingThreadEnded() = 0;
+        // the session is being terminated, see
+        // RpcServer::setMaxQueuedOnewayBytesPerSession
+        virtual void onSessionOnewayThrottled() {}
     };
 
     class WaitForShutdownListener : public EventListener {
@@ -220,6 +512,30 @@ private:
         std::optional<pid_t> exclusiveTid;
 
         bool allowNested = false;
+
+        // Shared by all threads of the session, see setMultiplexed. Whole
+        // messages are written to it with 'writeMutex' held.
+        bool multiplexed = false;
+        std::mutex writeMutex;
+
+        // Replies still to come for calls which timed out, and which are
+        // dropped when they arrive. Calls which arrive before them are nested
+        // in the ones which timed out, and they are refused.
+        size_t staleReplies = 0;
+        // Client, set while another thread reads the stale replies of a
+        // connection which no call holds anymore (see drainStaleReplies). It
+        // isn't used for calls until then.
+        bool draining = false;
+
+        // Server, for an on-demand connection (see setIncomingThreadsOnDemand)
+        // which is closed once unused for this long, otherwise 0.
+        std::chrono::milliseconds idleTimeout{0};
+        std::chrono::steady_clock::time_point lastUsed;
+
+        // Client, for an on-demand incoming connection, the number of calls
+        // being processed on it, including nested ones. Guarded by the
+        // session's mMutex.
+        size_t incomingCalls = 0;
     };
 
     [[nodiscard]] status_t readId();
@@ -239,31 +555,54 @@ private:
         // Status of setup
         status_t status;
     };
-    PreJoinSetupResult preJoinSetup(std::unique_ptr<RpcTransport> rpcTransport);
+    PreJoinSetupResult preJoinSetup(std::unique_ptr<RpcTransport> rpcTransport,
+                                    bool multiplexed);
     // join on thread passed to preJoinThreadOwnership
     static void join(sp<RpcSession>&& session, PreJoinSetupResult&& result);
 
+    // If |concurrent|, connectAndInit may be called from several threads at
+    // once (see setFastConnect).
     [[nodiscard]] status_t setupClient(
             const std::function<status_t(const std::vector<uint8_t>& sessionId, bool incoming)>&
-                    connectAndInit);
+                    connectAndInit,
+            bool concurrent = false);
     [[nodiscard]] status_t setupSocketClient(const RpcSocketAddress& address);
     [[nodiscard]] status_t setupOneSocketConnection(const RpcSocketAddress& address,
                                                     const std::vector<uint8_t>& sessionId,
-                                                    bool incoming);
+                                                    bool incoming, bool onDemand = false);
     [[nodiscard]] status_t initAndAddConnection(base::unique_fd fd,
                                                 const std::vector<uint8_t>& sessionId,
-                                                bool incoming);
+                                                bool incoming, bool onDemand = false);
     [[nodiscard]] status_t addIncomingConnection(std::unique_ptr<RpcTransport> rpcTransport);
-    [[nodiscard]] status_t addOutgoingConnection(std::unique_ptr<RpcTransport> rpcTransport,
-                                                 bool init);
+    [[nodiscard]] status_t addOutgoingConnection(
+            std::unique_ptr<RpcTransport> rpcTransport, bool init,
+            std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(0));
     [[nodiscard]] bool setForServer(const wp<RpcServer>& server,
                                     const wp<RpcSession::EventListener>& eventListener,
                                     const std::vector<uint8_t>& sessionId,
                                     const sp<IBinder>& sessionSpecificRoot);
     sp<RpcConnection> assignIncomingConnectionToThisThread(
-            std::unique_ptr<RpcTransport> rpcTransport);
+            std::unique_ptr<RpcTransport> rpcTransport, bool multiplexed);
     [[nodiscard]] bool removeIncomingConnection(const sp<RpcConnection>& connection);
 
+    // Client, see setIncomingThreadsOnDemand. Returns whether the call is
+    // counted, and then must be followed by endIncomingCall.
+    [[nodiscard]] bool beginIncomingCall(const sp<RpcConnection>& connection);
+    void endIncomingCall(const sp<RpcConnection>& connection);
+    // client, run by the worker when all incoming connections are busy
+    void connectIncomingOnDemand();
+    // client, reads the replies to calls which timed out on a connection
+    // which no call holds anymore on a thread of its own, and then makes it
+    // available again
+    void drainStaleReplies(const sp<RpcConnection>& connection);
+    // client, the server closed an on-demand connection which was idle
+    [[nodiscard]] bool onDemandConnectionClosed(const sp<RpcConnection>& connection);
+    // server, has the worker close on-demand connections once idle
+    void scheduleIdleConnectionReaping();
+    // closes the connections which are idle, and returns when the next one
+    // may be, if there is any
+    std::optional<std::chrono::steady_clock::time_point> reapIdleConnections();
+
     [[nodiscard]] status_t initShutdownTrigger();
 
     enum class ConnectionUse {
@@ -326,21 +665,66 @@ private:
 
     std::unique_ptr<RpcState> mRpcBinderState;
 
+    const std::shared_ptr<Worker> mWorker = std::make_shared<Worker>();
+
+    // server, see RpcServer::setMaxQueuedOnewayBytesPerSession. Only set
+    // before the session is set up, so it is read without the lock.
+    size_t mMaxQueuedOnewayBytes = 0;
+
     std::mutex mMutex; // for all below
 
     size_t mMaxIncomingThreads = 0;
     size_t mMaxOutgoingThreads = kDefaultMaxOutgoingThreads;
     std::optional<uint32_t> mProtocolVersion;
 
+    bool mUseMultiplexing = false;
+    bool mUseFastConnect = false;
+    // only set before the session is set up, so it is read without the lock
+    bool mPriorityInheritance = false;
+    // replies carry RpcWireReply::requestId, see
+    // RPC_CONNECTION_OPTION_MULTIPLEXED. Same as above.
+    bool mReplyRequestIds = false;
+    // replies end with the positions of their binders, see
+    // RPC_CONNECTION_OPTION_REPLY_BINDERS. Same as above.
+    bool mReplyBinderPositions = false;
+    // for a server session, see RpcServer::setPriorityInheritance
+    int mMaxCallerRealtimePriority = 0;
+    // both sides can read RPC_COMMAND_DEC_STRONG_BATCH, see
+    // RPC_CONNECTION_OPTION_DEC_STRONG_BATCH
+    bool mDecStrongBatch = false;
+    // see RpcFastConnectInfo, handed out by the first getRootObject call, or
+    // released by shutdownAndWait if there is none
+    std::optional<uint64_t> mFastConnectRootObject;
+    size_t mMaxPendingDecStrongs = 0;
+    std::chrono::milliseconds mDecStrongFlushDelay = kDefaultDecStrongFlushDelay;
+    size_t mMaxPendingOnewayBytes = 0;
+    std::chrono::milliseconds mOnewayFlushDelay = kDefaultOnewayFlushDelay;
+
+    // see setIncomingThreadsOnDemand
+    std::optional<size_t> mMinIncomingThreads;
+    std::chrono::milliseconds mIncomingIdleTimeout{0};
+    // client, sets up an on-demand incoming connection. Only set before the
+    // session is set up, so it is read without the lock.
+    std::function<status_t()> mConnectOnDemand;
+    // incoming connections with calls in progress
+    size_t mBusyIncoming = 0;
+    size_t mStartingIncoming = 0;
+    IncomingThreadStats mIncomingThreadStats;
+
     std::condition_variable mAvailableConnectionCv; // for mWaitingThreads
 
     struct ThreadState {
         size_t mWaitingThreads = 0;
+        // of the threads waiting on mAvailableConnectionCv, see
+        // setPriorityInheritance
+        std::multiset<int32_t> mWaitingUrgencies;
         // hint index into clients, ++ when sending an async transaction
         size_t mOutgoingOffset = 0;
         std::vector<sp<RpcConnection>> mOutgoing;
         size_t mMaxIncoming = 0;
         std::vector<sp<RpcConnection>> mIncoming;
+        // also in mOutgoing (client) or mIncoming (server), see setMultiplexed
+        sp<RpcConnection> mMultiplexed;
         std::map<std::thread::id, std::thread> mThreads;
     } mConnections;
 };
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
@@ -63,6 +64,24 @@ public:
             FdTrigger *fdTrigger, iovec *iovs, int niovs,
             const std::function<status_t()> &altPoll) = 0;
 
+    /**
+     * Wait until there is data to read, but no longer than 'timeout', and
+     * allow to be interrupted by a trigger.
+     *
+     * Return:
+     *   OK - data can be read
+     *   TIMED_OUT - nothing arrived in time
+     *   error - interrupted (failure or trigger)
+     */
+    [[nodiscard]] virtual status_t waitForRead(FdTrigger *fdTrigger,
+                                               std::chrono::milliseconds timeout) = 0;
+
+    /**
+     * The underlying socket, to poll on many connections at once. Data which
+     * the transport already received is not visible there, see waitForRead.
+     */
+    [[nodiscard]] virtual base::borrowed_fd pollFd() const = 0;
+
 protected:
     RpcTransport() = default;
 };
@@ -88,6 +107,21 @@ public:
     [[nodiscard]] virtual std::vector<uint8_t> getCertificate(
             RpcCertificateFormat format) const = 0;
 
+    // Whether one thread may read from a transport of this context while
+    // another thread writes to it. Multiplexed sessions (see
+    // RpcSession::setMultiplexed) are only negotiated if this is true.
+    //
+    // Implementation details: false for TLS, since an SSL object can't be
+    // used from several threads at once.
+    [[nodiscard]] virtual bool supportsConcurrentReadWrite() const = 0;
+
+    // Called by a client RpcSession before it sets up a new session. Transports
+    // made after this don't share any state with those made before.
+    //
+    // Implementation details: for TLS, this forgets the session tickets of
+    // the previous RPC session, so that they are never resumed by another.
+    virtual void onNewSession() = 0;
+
 protected:
     RpcTransportCtx() = default;
 };
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Wraps the transport layer of RPC. Implementation uses plain sockets, driven
+// by io_uring.
+// Note: don't use directly. You probably want newServerRpcTransportCtx / newClientRpcTransportCtx.
+
+#pragma once
+
+#include <memory>
+
+#include <binder/RpcTransport.h>
+
+namespace android {
+
+// RpcTransportCtxFactory with TLS disabled, for Linux.
+//
+// The data on the wire is the same as with RpcTransportCtxFactoryRaw, so
+// either side may use the other. When a socket isn't ready, the transport
+// waits for it and then reads or writes with a single io_uring_enter, instead
+// of a failed recvmsg/sendmsg, a poll and another try. All connections of a
+// session, or of a server, share one ring.
+class RpcTransportCtxFactoryIoUring : public RpcTransportCtxFactory {
+public:
+    // Returns nullptr if io_uring isn't supported, e.g. when not on Linux, or
+    // when it is disabled in the kernel.
+    static std::unique_ptr<RpcTransportCtxFactory> make();
+
+    std::unique_ptr<RpcTransportCtx> newServerCtx() const override;
+    std::unique_ptr<RpcTransportCtx> newClientCtx() const override;
+    const char* toCString() const override;
+
+private:
+    RpcTransportCtxFactoryIoUring() = default;
+};
+
+} // namespace android
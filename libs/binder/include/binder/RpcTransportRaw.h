@@ -28,14 +28,32 @@ namespace android {
 // RpcTransportCtxFactory with TLS disabled.
 class RpcTransportCtxFactoryRaw : public RpcTransportCtxFactory {
 public:
+    // Uses CONFIG_ANDROID_BINDER_RPC_READ_AHEAD_SIZE, see below.
     static std::unique_ptr<RpcTransportCtxFactory> make();
+    // If |readAheadSize| isn't 0, each transport reads up to this many bytes
+    // more than requested, when they are already queued on the socket. A
+    // message header and body then usually take a single read.
+    static std::unique_ptr<RpcTransportCtxFactory> make(size_t readAheadSize);
 
     std::unique_ptr<RpcTransportCtx> newServerCtx() const override;
     std::unique_ptr<RpcTransportCtx> newClientCtx() const override;
     const char* toCString() const override;
 
+    // Number of system calls made by raw transports in this process, e.g. to
+    // measure how many each transaction needs in benchmarks. They are only
+    // counted while counting is enabled, which it isn't by default.
+    static void setSyscallCountingEnabled(bool enabled);
+    struct SyscallCounts {
+        uint64_t reads = 0; // including peeks
+        uint64_t writes = 0;
+        uint64_t polls = 0;
+    };
+    static SyscallCounts getSyscallCounts();
+
 private:
-    RpcTransportCtxFactoryRaw() = default;
+    explicit RpcTransportCtxFactoryRaw(size_t readAheadSize) : mReadAheadSize(readAheadSize) {}
+
+    const size_t mReadAheadSize;
 };
 
 } // namespace android
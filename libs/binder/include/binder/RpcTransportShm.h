@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Wraps the transport layer of RPC. Implementation uses shared memory, and a
+// unix domain socket for notifications only.
+// Note: don't use directly. You probably want newServerRpcTransportCtx / newClientRpcTransportCtx.
+
+#pragma once
+
+#include <memory>
+
+#include <binder/RpcTransport.h>
+
+namespace android {
+
+// RpcTransportCtxFactory for peers on the same machine.
+//
+// For each connection, the client creates a memfd with a ring buffer for each
+// direction, and passes it over the socket when connecting. Data is then only
+// copied into and out of the rings, and a byte is sent on the socket only to
+// wake up the other side when it waits for data or space. Both the client and
+// the server must use this, and the socket must be a unix domain socket.
+class RpcTransportCtxFactoryShm : public RpcTransportCtxFactory {
+public:
+    // Uses CONFIG_ANDROID_BINDER_RPC_SHM_RING_SIZE, see below.
+    static std::unique_ptr<RpcTransportCtxFactory> make();
+    // Each ring holds |ringSize| bytes, rounded up to a power of two. This is
+    // only used by clients, since the client chooses it for each connection.
+    static std::unique_ptr<RpcTransportCtxFactory> make(size_t ringSize);
+
+    std::unique_ptr<RpcTransportCtx> newServerCtx() const override;
+    std::unique_ptr<RpcTransportCtx> newClientCtx() const override;
+    const char* toCString() const override;
+
+private:
+    explicit RpcTransportCtxFactoryShm(size_t ringSize) : mRingSize(ringSize) {}
+
+    const size_t mRingSize;
+};
+
+} // namespace android
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include <binder/RpcAuth.h>
 #include <binder/RpcCertificateVerifier.h>
 #include <binder/RpcTransport.h>
@@ -27,8 +29,32 @@ namespace android {
 // RpcTransportCtxFactory with TLS enabled with self-signed certificate.
 class RpcTransportCtxFactoryTls : public RpcTransportCtxFactory {
 public:
-    static std::unique_ptr<RpcTransportCtxFactory> make(std::shared_ptr<RpcCertificateVerifier>,
-                                                        std::unique_ptr<RpcAuth>);
+    // Handshakes done by TLS transports, including those which resumed an
+    // earlier TLS session of the same RpcSession.
+    struct HandshakeStats {
+        uint64_t handshakes = 0;
+        uint64_t resumed = 0;
+        uint64_t handshakeUs = 0; // in total
+    };
+
+    // Counts the handshakes of the transports of all contexts made by the
+    // factories it is given to, see make. Thread-safe.
+    class HandshakeCounter {
+    public:
+        void add(bool resumed, uint64_t handshakeUs);
+        HandshakeStats get() const;
+
+    private:
+        std::atomic<uint64_t> mHandshakes = 0;
+        std::atomic<uint64_t> mResumed = 0;
+        std::atomic<uint64_t> mHandshakeUs = 0;
+    };
+
+    // |handshakeCounter| may be null, otherwise every handshake of the
+    // transports made by this factory's contexts is added to it.
+    static std::unique_ptr<RpcTransportCtxFactory> make(
+            std::shared_ptr<RpcCertificateVerifier>, std::unique_ptr<RpcAuth>,
+            std::shared_ptr<HandshakeCounter> handshakeCounter = nullptr);
 
     std::unique_ptr<RpcTransportCtx> newServerCtx() const override;
     std::unique_ptr<RpcTransportCtx> newClientCtx() const override;
@@ -36,11 +62,15 @@ public:
 
 private:
     RpcTransportCtxFactoryTls(std::shared_ptr<RpcCertificateVerifier> verifier,
-                              std::unique_ptr<RpcAuth> auth)
-          : mCertVerifier(std::move(verifier)), mAuth(std::move(auth)){};
+                              std::unique_ptr<RpcAuth> auth,
+                              std::shared_ptr<HandshakeCounter> handshakeCounter)
+          : mCertVerifier(std::move(verifier)),
+            mAuth(std::move(auth)),
+            mHandshakeCounter(std::move(handshakeCounter)){};
 
     std::shared_ptr<RpcCertificateVerifier> mCertVerifier;
     std::unique_ptr<RpcAuth> mAuth;
+    std::shared_ptr<HandshakeCounter> mHandshakeCounter;
 };
 
 } // namespace android
@@ -47,6 +47,17 @@ class MyBinderRpcBenchmark : public BnBinderRpcBenchmark {
         *out = bytes;
         return Status::ok();
     }
+    Status makeBinders(int32_t count, std::vector<sp<IBinder>>* out) override
+    {
+        for (int32_t i = 0; i < count; i++) {
+            out->push_back(sp<BBinder>::make());
+        }
+        return Status::ok();
+    }
+    Status sendBytes(const std::vector<uint8_t>& /*bytes*/) override
+    {
+        return Status::ok();
+    }
 };
 
 void defaultCpcServer(const sp<RpcServer>& server)
@@ -134,6 +134,7 @@ enum BinderLibTestTranscationCode {
     BINDER_LIB_TEST_ECHO_VECTOR,
     BINDER_LIB_TEST_REJECT_OBJECTS,
     BINDER_LIB_TEST_CAN_GET_SID,
+    BINDER_LIB_TEST_THREAD_POOL_STATS,
 };
 
 pid_t start_server_process(const char *binderservername, const char *binderserversuffix, int arg2, bool usePoll = false)
@@ -486,6 +487,200 @@ TEST_F(BinderLibTest, NopTransactionClear) {
                 StatusEq(NO_ERROR));
 }
 
+TEST_F(BinderLibTest, DriverStats) {
+    IPCThreadState* ipc = IPCThreadState::self();
+    IPCThreadState::DriverStats before = ipc->getDriverStats();
+    ProcessState::DriverStats processBefore = ProcessState::self()->getDriverStats();
+
+    constexpr size_t kNumCalls = 10;
+    Parcel data, reply;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        EXPECT_THAT(m_server->transact(BINDER_LIB_TEST_NOP_TRANSACTION, data, &reply),
+                    StatusEq(NO_ERROR));
+    }
+
+    // each call writes a BC_TRANSACTION and reads a BR_REPLY, in at least
+    // one BINDER_WRITE_READ
+    IPCThreadState::DriverStats after = ipc->getDriverStats();
+    EXPECT_GE(after.ioctls - before.ioctls, kNumCalls);
+    EXPECT_EQ(kNumCalls,
+              after.commands[_IOC_NR(BC_TRANSACTION)] - before.commands[_IOC_NR(BC_TRANSACTION)]);
+    EXPECT_EQ(kNumCalls,
+              after.returnCommands[_IOC_NR(BR_REPLY)] -
+                      before.returnCommands[_IOC_NR(BR_REPLY)]);
+    EXPECT_GE(after.bytesWritten - before.bytesWritten,
+              kNumCalls * (sizeof(uint32_t) + sizeof(binder_transaction_data)));
+    EXPECT_GE(after.bytesRead - before.bytesRead,
+              kNumCalls * (sizeof(uint32_t) + sizeof(binder_transaction_data)));
+    EXPECT_GT(after.driverUs, before.driverUs);
+
+    // the process adds up all threads, including this one
+    ProcessState::DriverStats processAfter = ProcessState::self()->getDriverStats();
+    EXPECT_GE(processAfter.ioctls - processBefore.ioctls, after.ioctls - before.ioctls);
+    EXPECT_GE(processAfter.commands[_IOC_NR(BC_TRANSACTION)] -
+                      processBefore.commands[_IOC_NR(BC_TRANSACTION)],
+              kNumCalls);
+}
+
+TEST_F(BinderLibTest, DeferredRefCounts) {
+    ProcessState::self()->setMaxDeferredRefCounts(4);
+
+    // on a thread of its own, so that nothing else is held
+    std::thread([&] {
+        IPCThreadState* ipc = IPCThreadState::self();
+        sp<IBinder> context = ProcessState::self()->getContextObject(nullptr);
+        ASSERT_NE(nullptr, context);
+        BpBinder* proxy = context->remoteBinder();
+        ASSERT_NE(nullptr, proxy);
+
+        // changes which undo each other never reach the driver
+        IPCThreadState::DriverStats before = ipc->getDriverStats();
+        for (size_t i = 0; i < 100; i++) {
+            ipc->incStrongHandle(0, proxy);
+            ipc->decStrongHandle(0);
+        }
+        IPCThreadState::DriverStats after = ipc->getDriverStats();
+        EXPECT_EQ(before.ioctls, after.ioctls);
+        EXPECT_EQ(before.cancelledRefCounts + 200, after.cancelledRefCounts);
+        EXPECT_EQ(before.commands[_IOC_NR(BC_ACQUIRE)], after.commands[_IOC_NR(BC_ACQUIRE)]);
+
+        // held changes go out with the next transaction
+        before = after;
+        ipc->incWeakHandle(0, proxy);
+        ipc->incStrongHandle(0, proxy);
+        after = ipc->getDriverStats();
+        EXPECT_EQ(before.ioctls, after.ioctls);
+        EXPECT_EQ(before.deferredRefCounts + 2, after.deferredRefCounts);
+
+        Parcel data, reply;
+        EXPECT_THAT(m_server->transact(BINDER_LIB_TEST_NOP_TRANSACTION, data, &reply),
+                    StatusEq(NO_ERROR));
+        after = ipc->getDriverStats();
+        EXPECT_EQ(before.commands[_IOC_NR(BC_INCREFS)] + 1, after.commands[_IOC_NR(BC_INCREFS)]);
+        EXPECT_EQ(before.commands[_IOC_NR(BC_ACQUIRE)] + 1, after.commands[_IOC_NR(BC_ACQUIRE)]);
+
+        // and once as many are held as allowed, on their own
+        before = after;
+        ipc->decStrongHandle(0);
+        ipc->decWeakHandle(0);
+        ipc->incWeakHandle(0, proxy);
+        EXPECT_EQ(before.ioctls, ipc->getDriverStats().ioctls);
+        ipc->decWeakHandle(0);
+        after = ipc->getDriverStats();
+        EXPECT_EQ(before.ioctls + 1, after.ioctls);
+        EXPECT_EQ(before.commands[_IOC_NR(BC_DECREFS)] + 2, after.commands[_IOC_NR(BC_DECREFS)]);
+    }).join();
+
+    ProcessState::self()->setMaxDeferredRefCounts(0);
+}
+
+TEST_F(BinderLibTest, ThreadBufferSizes) {
+    const size_t origMinSize = ProcessState::self()->getThreadBufferMinSize();
+    const size_t origMaxSize = ProcessState::self()->getThreadBufferMaxSize();
+    constexpr size_t kMinSize = 64;
+    constexpr size_t kMaxSize = 1024;
+    ProcessState::self()->setThreadBufferSizes(kMinSize, kMaxSize);
+
+    // a new thread, so that it starts with the small buffers
+    std::thread([&] {
+        IPCThreadState* ipc = IPCThreadState::self();
+        IPCThreadState::DriverStats before = ipc->getDriverStats();
+        EXPECT_EQ(2 * kMinSize, before.bufferBytes);
+
+        // a reply doesn't fit next to the other commands, so the receive
+        // buffer grows
+        Parcel data, reply;
+        for (size_t i = 0; i < 2; i++) {
+            EXPECT_THAT(m_server->transact(BINDER_LIB_TEST_NOP_TRANSACTION, data, &reply),
+                        StatusEq(NO_ERROR));
+        }
+        IPCThreadState::DriverStats grown = ipc->getDriverStats();
+        EXPECT_GT(grown.bufferGrows, before.bufferGrows);
+        EXPECT_GT(grown.bufferBytes, before.bufferBytes);
+        EXPECT_LE(grown.bufferBytes, kMinSize + kMaxSize);
+
+        // oneway calls only read a few bytes each, so it shrinks again
+        for (size_t i = 0; i < 64; i++) {
+            EXPECT_THAT(m_server->transact(BINDER_LIB_TEST_NOP_TRANSACTION, data, &reply,
+                                           TF_ONE_WAY),
+                        StatusEq(NO_ERROR));
+        }
+        IPCThreadState::DriverStats shrunk = ipc->getDriverStats();
+        EXPECT_GT(shrunk.bufferShrinks, grown.bufferShrinks);
+        EXPECT_LT(shrunk.bufferBytes, grown.bufferBytes);
+        EXPECT_GE(shrunk.bufferBytes, 2 * kMinSize);
+    }).join();
+
+    ProcessState::self()->setThreadBufferSizes(origMinSize, origMaxSize);
+}
+
+TEST_F(BinderLibTest, ThreadPoolShrinksWhenIdle) {
+    constexpr int32_t kIdleMs = 50;
+    constexpr size_t kCallers = 8;
+    // a server of its own, so that only this test uses its thread pool
+    sp<IBinder> server = addServer();
+    ASSERT_TRUE(server != nullptr);
+
+    struct Stats {
+        int32_t threads = 0;
+        int32_t targetThreads = 0;
+        uint64_t spawnedThreads = 0;
+        uint64_t respawnedThreads = 0;
+        uint64_t reapedThreads = 0;
+    };
+    auto getStats = [&](int32_t idleMs = -1) {
+        Parcel data, reply;
+        Stats stats;
+        data.writeInt32(idleMs);
+        EXPECT_THAT(server->transact(BINDER_LIB_TEST_THREAD_POOL_STATS, data, &reply),
+                    StatusEq(NO_ERROR));
+        stats.threads = reply.readInt32();
+        stats.targetThreads = reply.readInt32();
+        stats.spawnedThreads = reply.readUint64();
+        stats.respawnedThreads = reply.readUint64();
+        stats.reapedThreads = reply.readUint64();
+        return stats;
+    };
+    auto busy = [&] {
+        std::vector<std::thread> callers;
+        for (size_t i = 0; i < kCallers; i++) {
+            callers.emplace_back([&] {
+                Parcel data, reply;
+                for (size_t j = 0; j < 10; j++) {
+                    EXPECT_THAT(server->transact(BINDER_LIB_TEST_NOP_TRANSACTION_WAIT, data,
+                                                 &reply),
+                                StatusEq(NO_ERROR));
+                }
+            });
+        }
+        for (auto& caller : callers) caller.join();
+    };
+
+    getStats(kIdleMs);
+    busy();
+    Stats loaded = getStats();
+    EXPECT_GT(loaded.spawnedThreads, 0u);
+
+    // Threads are only reaped when they wake up for a command they waited
+    // the idle timeout for, so trickle calls in until the pool is down to
+    // what a single caller needs.
+    Stats idle = loaded;
+    for (size_t i = 0; i < 100 && idle.threads > idle.targetThreads; i++) {
+        usleep(2 * kIdleMs * 1000);
+        idle = getStats();
+    }
+    EXPECT_GT(idle.reapedThreads, loaded.reapedThreads);
+    EXPECT_LT(idle.threads, loaded.threads);
+    EXPECT_LE(idle.threads, idle.targetThreads);
+
+    // under load again, threads are started in place of the ones which left
+    busy();
+    Stats reloaded = getStats();
+    EXPECT_GT(reloaded.respawnedThreads, idle.respawnedThreads);
+
+    getStats(0);
+}
+
 TEST_F(BinderLibTest, Freeze) {
     Parcel data, reply, replypid;
     std::ifstream freezer_file("/sys/fs/cgroup/uid_0/cgroup.freeze");
@@ -913,6 +1108,39 @@ TEST_F(BinderLibTest, CheckHandleZeroBinderHighBitsZeroCookie) {
     EXPECT_EQ((uint64_t)0, (uint64_t)fb->binder >> 32);
 }
 
+TEST_F(BinderLibTest, ProxyDestroyedWhileLookedUp) {
+    constexpr size_t kNumThreads = 8;
+    constexpr size_t kNumLookups = 2000;
+
+    // The reply keeps a reference on the handle in the driver, so that its
+    // proxy can be destroyed and created again.
+    Parcel data, reply;
+    ASSERT_THAT(m_server->transact(BINDER_LIB_TEST_CREATE_BINDER_TRANSACTION, data, &reply),
+                StatusEq(NO_ERROR));
+    const flat_binder_object* fb = reply.readObject(false);
+    ASSERT_TRUE(fb != nullptr);
+    ASSERT_EQ(BINDER_TYPE_HANDLE, fb->hdr.type);
+    const int32_t handle = fb->handle;
+
+    // Each thread mostly drops the last reference to the proxy, and destroys
+    // it while others look it up without ProcessState's locks.
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumThreads; i++) {
+        threads.emplace_back([&] {
+            for (size_t j = 0; j < kNumLookups; j++) {
+                sp<IBinder> binder = ProcessState::self()->getStrongProxyForHandle(handle);
+                ASSERT_NE(nullptr, binder);
+                ASSERT_NE(nullptr, binder->remoteBinder());
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    sp<IBinder> binder = ProcessState::self()->getStrongProxyForHandle(handle);
+    ASSERT_NE(nullptr, binder);
+    EXPECT_THAT(binder->pingBinder(), StatusEq(NO_ERROR));
+}
+
 TEST_F(BinderLibTest, FreedBinder) {
     status_t ret;
 
@@ -1476,6 +1704,19 @@ public:
             case BINDER_LIB_TEST_GETPID:
                 reply->writeInt32(getpid());
                 return NO_ERROR;
+            case BINDER_LIB_TEST_THREAD_POOL_STATS: {
+                int32_t idleMs = data.readInt32();
+                if (idleMs >= 0) {
+                    ProcessState::self()->setThreadPoolIdleTimeout(idleMs);
+                }
+                ProcessState::ThreadPoolStats stats = ProcessState::self()->getThreadPoolStats();
+                reply->writeInt32(stats.threads);
+                reply->writeInt32(stats.targetThreads);
+                reply->writeUint64(stats.spawnedThreads);
+                reply->writeUint64(stats.respawnedThreads);
+                reply->writeUint64(stats.reapedThreads);
+                return NO_ERROR;
+            }
             case BINDER_LIB_TEST_NOP_TRANSACTION_WAIT:
                 usleep(5000);
                 [[fallthrough]];
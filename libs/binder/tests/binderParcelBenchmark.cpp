@@ -15,6 +15,7 @@
  */
 
 #include <binder/Parcel.h>
+#include <binder/ProcessState.h>
 #include <benchmark/benchmark.h>
 
 // Usage: atest binderParcelBenchmark
@@ -169,4 +170,30 @@ BENCHMARK(BM_CharVector)->Apply(VectorArgs);
 BENCHMARK(BM_Int32Vector)->Apply(VectorArgs);
 BENCHMARK(BM_Int64Vector)->Apply(VectorArgs);
 
+/*
+  Unparceling a proxy which already exists, from many threads at once, as when
+  many binder threads receive calls which carry the same binder. This looks
+  up the handle in ProcessState each time.
+*/
+static void BM_ReadStrongBinder(benchmark::State& state) {
+    // the context manager's proxy, which every process can get
+    android::sp<android::IBinder> binder = android::ProcessState::self()->getContextObject(nullptr);
+    if (binder == nullptr) {
+        state.SkipWithError("No context manager");
+        return;
+    }
+
+    android::Parcel p;
+    p.writeStrongBinder(binder);
+    while (state.KeepRunning()) {
+        p.setDataPosition(0);
+        android::sp<android::IBinder> read;
+        p.readStrongBinder(&read);
+
+        benchmark::DoNotOptimize(read);
+    }
+}
+
+BENCHMARK(BM_ReadStrongBinder)->ThreadRange(1, 16)->UseRealTime();
+
 BENCHMARK_MAIN();
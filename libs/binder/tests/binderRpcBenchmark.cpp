@@ -31,12 +31,15 @@
 #endif
 #include <binder/RpcServer.h>
 #include <binder/RpcSession.h>
+#include <binder/RpcTransportIoUring.h>
 #include <binder/RpcTransportRaw.h>
+#include <binder/RpcTransportShm.h>
 
 #include <thread>
 
 #include <signal.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <spawn.h>
@@ -47,6 +50,7 @@ using android::IBinder;
 using android::interface_cast;
 using android::IPCThreadState;
 using android::IServiceManager;
+using android::Parcel;
 using android::ProcessState;
 #if __has_include(<openssl/base.h>)
 using android::RpcAuthPreSigned;
@@ -54,11 +58,13 @@ using android::RpcCertificateFormat;
 using android::RpcCertificateVerifier;
 using android::RpcCertificateVerifierNoOp;
 using android::RpcTransportCtxFactory;
-using android::RpcTransportCtxFactoryRaw;
 using android::RpcTransportCtxFactoryTls;
 #endif
 using android::RpcServer;
 using android::RpcSession;
+using android::RpcTransportCtxFactoryIoUring;
+using android::RpcTransportCtxFactoryRaw;
+using android::RpcTransportCtxFactoryShm;
 using android::sp;
 using android::status_t;
 using android::statusToString;
@@ -67,6 +73,9 @@ using android::binder::Status;
 
 #define TLS_RPC_BENCH_MARK "/binderRpcTlsBenchmark"
 #define DEFAULT_RPC_BENCH_MARK "/binderRpcBenchmark"
+#define REACTOR_RPC_BENCH_MARK "/binderRpcReactorBenchmark"
+#define SHM_RPC_BENCH_MARK "/binderRpcShmBenchmark"
+#define IO_URING_RPC_BENCH_MARK "/binderRpcIoUringBenchmark"
 
 class MyBinderRpcBenchmark : public BnBinderRpcBenchmark {
     Status repeatString(const std::string& str, std::string* out) override {
@@ -81,12 +90,21 @@ class MyBinderRpcBenchmark : public BnBinderRpcBenchmark {
         *out = bytes;
         return Status::ok();
     }
+    Status makeBinders(int32_t count, std::vector<sp<IBinder>>* out) override {
+        for (int32_t i = 0; i < count; i++) {
+            out->push_back(sp<BBinder>::make());
+        }
+        return Status::ok();
+    }
+    Status sendBytes(const std::vector<uint8_t>& /*bytes*/) override { return Status::ok(); }
 };
 
 enum Transport {
     KERNEL,
     RPC,
     RPC_TLS,
+    RPC_SHM,
+    RPC_IO_URING,
 };
 
 static const std::initializer_list<int64_t> kTransportList = {
@@ -95,10 +113,13 @@ static const std::initializer_list<int64_t> kTransportList = {
 #endif
         Transport::RPC,
         Transport::RPC_TLS,
+        Transport::RPC_SHM,
+        Transport::RPC_IO_URING,
 };
 
 #if __has_include(<openssl/base.h>)
-std::unique_ptr<RpcTransportCtxFactory> makeFactoryTls() {
+std::unique_ptr<RpcTransportCtxFactory> makeFactoryTls(
+        std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> handshakeCounter = nullptr) {
     auto pkey = android::makeKeyPairForSelfSignedCert();
     CHECK_NE(pkey.get(), nullptr);
     auto cert = android::makeSelfSignedCert(pkey.get(), android::kCertValidSeconds);
@@ -106,15 +127,35 @@ std::unique_ptr<RpcTransportCtxFactory> makeFactoryTls() {
 
     auto verifier = std::make_shared<RpcCertificateVerifierNoOp>(OK);
     auto auth = std::make_unique<RpcAuthPreSigned>(std::move(pkey), std::move(cert));
-    return RpcTransportCtxFactoryTls::make(verifier, std::move(auth));
+    return RpcTransportCtxFactoryTls::make(verifier, std::move(auth), std::move(handshakeCounter));
 }
 #endif
 
 static sp<RpcSession> gSession = RpcSession::make();
+static sp<RpcSession> gSessionBatchedDecStrong = RpcSession::make();
+static sp<RpcSession> gSessionMultiplexed = RpcSession::make();
+static sp<RpcSession> gSessionBatchedOneway = RpcSession::make();
+// enough to read a page sized reply with its header at once
+static constexpr size_t kReadAheadSize = 16 * 1024;
+static sp<RpcSession> gSessionReadAhead =
+        RpcSession::make(RpcTransportCtxFactoryRaw::make(kReadAheadSize));
+// connected to a server with RpcServer::setReactorWorkerThreads
+static sp<RpcSession> gSessionReactor = RpcSession::make();
+static sp<RpcSession> gSessionShm = RpcSession::make(RpcTransportCtxFactoryShm::make());
+// only set up if io_uring is supported
+static sp<RpcSession> gSessionIoUring;
+// a single outgoing connection, so calls wait for each other
+static sp<RpcSession> gSessionOneConnection = RpcSession::make();
+static sp<RpcSession> gSessionOneConnectionPriority = RpcSession::make();
+// number of calls the server processes at once for each session
+static constexpr size_t kServerMaxThreads = 4;
+// address of the server for gSession
+static std::string gAddr;
 #if __has_include(<openssl/base.h>)
 // Certificate validation happens during handshake and does not affect the result of benchmarks.
 // Skip certificate validation to simplify the setup process.
 static sp<RpcSession> gSessionTls = RpcSession::make(makeFactoryTls());
+static std::string gTlsAddr;
 #endif
 #ifdef __BIONIC__
 static const String16 kKernelBinderInstance = String16(u"binderRpcBenchmark-control");
@@ -134,6 +175,14 @@ static sp<IBinder> getBinderForOptions(benchmark::State& state) {
         case RPC_TLS:
             return gSessionTls->getRootObject();
 #endif
+        case RPC_SHM:
+            return gSessionShm->getRootObject();
+        case RPC_IO_URING:
+            if (gSessionIoUring == nullptr) {
+                state.SkipWithError("io_uring is not supported");
+                return gSession->getRootObject();
+            }
+            return gSessionIoUring->getRootObject();
         default:
             LOG(FATAL) << "Unknown transport value: " << transport;
             return nullptr;
@@ -149,6 +198,39 @@ void BM_pingTransaction(benchmark::State& state) {
 }
 BENCHMARK(BM_pingTransaction)->ArgsProduct({kTransportList});
 
+void BM_syscallsPerTransaction(benchmark::State& state) {
+    bool withData = state.range(0);
+    bool readAhead = state.range(1);
+    sp<IBinder> binder = (readAhead ? gSessionReadAhead : gSession)->getRootObject();
+    CHECK(binder != nullptr);
+    sp<IBinderRpcBenchmark> iface = interface_cast<IBinderRpcBenchmark>(binder);
+    CHECK(iface != nullptr);
+
+    std::vector<uint8_t> bytes(getpagesize());
+    RpcTransportCtxFactoryRaw::setSyscallCountingEnabled(true);
+    auto before = RpcTransportCtxFactoryRaw::getSyscallCounts();
+    while (state.KeepRunning()) {
+        if (withData) {
+            std::vector<uint8_t> out;
+            Status ret = iface->repeatBytes(bytes, &out);
+            CHECK(ret.isOk()) << ret;
+        } else {
+            CHECK_EQ(OK, binder->pingBinder());
+        }
+    }
+    auto after = RpcTransportCtxFactoryRaw::getSyscallCounts();
+    RpcTransportCtxFactoryRaw::setSyscallCountingEnabled(false);
+
+    // client side only, the server is another process
+    state.counters["writes"] = benchmark::Counter(after.writes - before.writes,
+                                                  benchmark::Counter::kAvgIterations);
+    state.counters["reads"] = benchmark::Counter(after.reads - before.reads,
+                                                 benchmark::Counter::kAvgIterations);
+    state.counters["polls"] = benchmark::Counter(after.polls - before.polls,
+                                                 benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_syscallsPerTransaction)->ArgsProduct({{false, true}, {false, true}});
+
 void BM_repeatTwoPageString(benchmark::State& state) {
     sp<IBinder> binder = getBinderForOptions(state);
 
@@ -198,6 +280,35 @@ BENCHMARK(BM_throughputForTransportAndBytes)
         ->ArgsProduct({kTransportList,
                        {64, 1024, 2048, 4096, 8182, 16364, 32728, 65535, 65536, 65537}});
 
+void BM_repeatBytesReplyCapacity(benchmark::State& state) {
+    bool presized = state.range(0);
+    size_t size = state.range(1);
+    sp<IBinder> binder = gSession->getRootObject();
+    CHECK(binder != nullptr);
+
+    std::vector<uint8_t> bytes(size);
+    Parcel data;
+    data.markForBinder(binder);
+    CHECK_EQ(OK, data.writeInterfaceToken(binder->getInterfaceDescriptor()));
+    CHECK_EQ(OK, data.writeByteVector(bytes));
+
+    // reply is the exception code, the vector length and the padded bytes
+    size_t replySize = 2 * sizeof(int32_t) + ((size + 3) & ~3);
+
+    while (state.KeepRunning()) {
+        Parcel reply;
+        if (presized) CHECK_EQ(OK, reply.setDataCapacity(replySize));
+        CHECK_EQ(OK,
+                 binder->transact(BnBinderRpcBenchmark::TRANSACTION_repeatBytes, data, &reply));
+
+        std::vector<uint8_t> out;
+        CHECK_EQ(OK, reply.readExceptionCode());
+        CHECK_EQ(OK, reply.readByteVector(&out));
+    }
+}
+// reply read into a pool buffer vs into the caller's Parcel
+BENCHMARK(BM_repeatBytesReplyCapacity)->ArgsProduct({{false, true}, {64, 8192, 65536}});
+
 void BM_repeatBinder(benchmark::State& state) {
     sp<IBinder> binder = getBinderForOptions(state);
     CHECK(binder != nullptr);
@@ -215,8 +326,202 @@ void BM_repeatBinder(benchmark::State& state) {
 }
 BENCHMARK(BM_repeatBinder)->ArgsProduct({kTransportList});
 
-void defaultRpcServer(const char* addr, const sp<RpcServer>& server) {
+void BM_proxyTeardown(benchmark::State& state) {
+    bool batched = state.range(0);
+    int32_t count = state.range(1);
+    sp<RpcSession> session = batched ? gSessionBatchedDecStrong : gSession;
+    sp<IBinder> binder = session->getRootObject();
+    CHECK(binder != nullptr);
+    sp<IBinderRpcBenchmark> iface = interface_cast<IBinderRpcBenchmark>(binder);
+    CHECK(iface != nullptr);
+
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        std::vector<sp<IBinder>> binders;
+        Status ret = iface->makeBinders(count, &binders);
+        CHECK(ret.isOk()) << ret;
+        state.ResumeTiming();
+
+        // each proxy sends a dec strong as it is destroyed, and the ping makes
+        // sure any queued ones have reached the server
+        binders.clear();
+        CHECK_EQ(OK, binder->pingBinder());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_proxyTeardown)->ArgsProduct({{false, true}, {1, 100, 1000}});
+
+void BM_concurrentPing(benchmark::State& state) {
+    bool multiplexed = state.range(0);
+    sp<RpcSession> session = multiplexed ? gSessionMultiplexed : gSession;
+    sp<IBinder> binder = session->getRootObject();
+    CHECK(binder != nullptr);
+
+    while (state.KeepRunning()) {
+        CHECK_EQ(OK, binder->pingBinder());
+    }
+}
+// one connection per calling thread vs one connection shared by all of them
+BENCHMARK(BM_concurrentPing)->Arg(false)->Arg(true)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_asyncInFlight(benchmark::State& state) {
+    size_t inFlight = state.range(0);
+    sp<IBinder> binder = gSessionMultiplexed->getRootObject();
+    CHECK(binder != nullptr);
+
+    Parcel data;
+    data.markForBinder(binder);
+    CHECK_EQ(OK, data.writeInterfaceToken(binder->getInterfaceDescriptor()));
+    CHECK_EQ(OK, data.writeUtf8AsUtf16(std::string("a")));
+
+    std::vector<std::future<RpcSession::AsyncReply>> replies(inFlight);
+    while (state.KeepRunning()) {
+        // all calls are made from this thread, without waiting in between
+        for (auto& reply : replies) {
+            reply = gSessionMultiplexed
+                            ->transactFuture(binder, BnBinderRpcBenchmark::TRANSACTION_repeatString,
+                                             data);
+        }
+        for (auto& reply : replies) {
+            RpcSession::AsyncReply result = reply.get();
+            CHECK_EQ(OK, result.status);
+            CHECK_EQ(OK, result.parcel->readExceptionCode());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * inFlight);
+}
+// calls in flight from a single thread
+BENCHMARK(BM_asyncInFlight)->RangeMultiplier(8)->Range(1, 512)->UseRealTime();
+
+void BM_priorityPing(benchmark::State& state) {
+    bool priority = state.range(0);
+    sp<RpcSession> session = priority ? gSessionOneConnectionPriority : gSessionOneConnection;
+    sp<IBinder> binder = session->getRootObject();
+    CHECK(binder != nullptr);
+    sp<IBinderRpcBenchmark> iface = interface_cast<IBinderRpcBenchmark>(binder);
+    CHECK(iface != nullptr);
+
+    // bulk transfers from less important threads compete for the connection
+    std::atomic<bool> done = false;
+    std::vector<std::thread> bulk;
+    for (size_t i = 0; i < 2; i++) {
+        bulk.emplace_back([&]() {
+            CHECK_EQ(0, setpriority(PRIO_PROCESS, gettid(), 10));
+            std::vector<uint8_t> bytes(65536);
+            while (!done) {
+                std::vector<uint8_t> out;
+                Status ret = iface->repeatBytes(bytes, &out);
+                CHECK(ret.isOk()) << ret;
+            }
+        });
+    }
+
+    while (state.KeepRunning()) {
+        CHECK_EQ(OK, binder->pingBinder());
+    }
+
+    done = true;
+    for (auto& thread : bulk) thread.join();
+}
+// connection handed out in order of arrival vs by priority
+BENCHMARK(BM_priorityPing)->Arg(false)->Arg(true)->UseRealTime();
+
+void BM_onewayStream(benchmark::State& state) {
+    bool batched = state.range(0);
+    size_t size = state.range(1);
+    sp<RpcSession> session = batched ? gSessionBatchedOneway : gSession;
+    sp<IBinder> binder = session->getRootObject();
+    CHECK(binder != nullptr);
+    sp<IBinderRpcBenchmark> iface = interface_cast<IBinderRpcBenchmark>(binder);
+    CHECK(iface != nullptr);
+
+    std::vector<uint8_t> bytes(size);
+    RpcSession::OnewayBatchStats before = session->getOnewayBatchStats();
+    while (state.KeepRunning()) {
+        Status ret = iface->sendBytes(bytes);
+        CHECK(ret.isOk()) << ret;
+    }
+    // sync point, so everything queued has been sent
+    CHECK_EQ(OK, binder->pingBinder());
+    RpcSession::OnewayBatchStats after = session->getOnewayBatchStats();
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["flushes"] = after.flushes - before.flushes;
+}
+BENCHMARK(BM_onewayStream)->ArgsProduct({{false, true}, {16, 256}});
+
+void BM_reactorPing(benchmark::State& state) {
+    bool reactor = state.range(0);
+    sp<IBinder> binder = (reactor ? gSessionReactor : gSession)->getRootObject();
+    CHECK(binder != nullptr);
+
+    while (state.KeepRunning()) {
+        CHECK_EQ(OK, binder->pingBinder());
+    }
+}
+// thread per connection vs polling thread and worker pool on the server
+BENCHMARK(BM_reactorPing)->Arg(false)->Arg(true)->ThreadRange(1, 4)->UseRealTime();
+
+void BM_sessionSetup(benchmark::State& state) {
+    bool fastConnect = state.range(0);
+
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        sp<RpcSession> session = RpcSession::make();
+        session->setMaxIncomingThreads(1);
+        session->setFastConnect(fastConnect);
+        state.ResumeTiming();
+
+        CHECK_EQ(OK, session->setupUnixDomainClient(gAddr.c_str()));
+        CHECK_NE(nullptr, session->getRootObject());
+
+        state.PauseTiming();
+        CHECK(session->shutdownAndWait(true));
+        state.ResumeTiming();
+    }
+}
+// connections opened one after the other vs all at once
+BENCHMARK(BM_sessionSetup)->Arg(false)->Arg(true);
+
+#if __has_include(<openssl/base.h>)
+void BM_tlsSessionSetup(benchmark::State& state) {
+    size_t connections = state.range(0);
+
+    auto counter = std::make_shared<RpcTransportCtxFactoryTls::HandshakeCounter>();
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        // generates a key pair
+        sp<RpcSession> session = RpcSession::make(makeFactoryTls(counter));
+        session->setMaxOutgoingThreads(connections);
+        state.ResumeTiming();
+
+        CHECK_EQ(OK, session->setupUnixDomainClient(gTlsAddr.c_str()));
+
+        state.PauseTiming();
+        CHECK(session->shutdownAndWait(true));
+        state.ResumeTiming();
+    }
+    auto stats = counter->get();
+
+    // client side only, the server is another process
+    state.counters["handshakes"] =
+            benchmark::Counter(stats.handshakes, benchmark::Counter::kAvgIterations);
+    state.counters["resumed"] =
+            benchmark::Counter(stats.resumed, benchmark::Counter::kAvgIterations);
+    state.counters["handshakeUs"] =
+            stats.handshakes == 0 ? 0 : stats.handshakeUs / stats.handshakes;
+}
+// the first connection does a full handshake, the others resume it
+BENCHMARK(BM_tlsSessionSetup)->Arg(1)->Arg(kServerMaxThreads);
+#endif
+
+void defaultRpcServer(const char* addr, const sp<RpcServer>& server,
+                      size_t reactorWorkerThreads = 0) {
     server->setRootObject(sp<MyBinderRpcBenchmark>::make());
+    server->setMaxThreads(kServerMaxThreads);
+    server->setReactorWorkerThreads(reactorWorkerThreads);
+    // for gSessionOneConnectionPriority
+    server->setPriorityInheritance(true);
     CHECK_EQ(OK, server->setupUnixDomainServer(addr));
     server->join();
 }
@@ -257,6 +562,18 @@ extern "C" int main(int argc, char** argv) {
         defaultRpcServer(argv[2], RpcServer::make());
         return 0;
     }
+    if (argc == 3 && !strcmp(argv[1], REACTOR_RPC_BENCH_MARK)) {
+        defaultRpcServer(argv[2], RpcServer::make(), 2 /*reactorWorkerThreads*/);
+        return 0;
+    }
+    if (argc == 3 && !strcmp(argv[1], SHM_RPC_BENCH_MARK)) {
+        defaultRpcServer(argv[2], RpcServer::make(RpcTransportCtxFactoryShm::make()));
+        return 0;
+    }
+    if (argc == 3 && !strcmp(argv[1], IO_URING_RPC_BENCH_MARK)) {
+        defaultRpcServer(argv[2], RpcServer::make(RpcTransportCtxFactoryIoUring::make()));
+        return 0;
+    }
 #if __has_include(<openssl/base.h>)
     if (argc == 3 && !strcmp(argv[1], TLS_RPC_BENCH_MARK)) {
         defaultRpcServer(argv[2], RpcServer::make(makeFactoryTls()));
@@ -278,6 +595,8 @@ extern "C" int main(int argc, char** argv) {
     std::cerr << "\t.../" << Transport::KERNEL << " is KERNEL" << std::endl;
     std::cerr << "\t.../" << Transport::RPC << " is RPC" << std::endl;
     std::cerr << "\t.../" << Transport::RPC_TLS << " is RPC with TLS" << std::endl;
+    std::cerr << "\t.../" << Transport::RPC_SHM << " is RPC over shared memory" << std::endl;
+    std::cerr << "\t.../" << Transport::RPC_IO_URING << " is RPC with io_uring" << std::endl;
 
 #ifdef __BIONIC__
     spawnRpcServer(args[0], kKernelBinderInstance, NULL)
@@ -291,17 +610,48 @@ extern "C" int main(int argc, char** argv) {
 
     std::string tmp = getenv("TMPDIR") ?: "/tmp";
 
-    std::string addr = tmp + DEFAULT_RPC_BENCH_MARK;
+    gAddr = tmp + DEFAULT_RPC_BENCH_MARK;
+    const std::string& addr = gAddr;
     (void)unlink(addr.c_str());
 
-    spawnRpcServer(argv[0], (char *)addr.c_str(), DEFAULT_RPC_BENCH_MARK);
+    spawnRpcServer(argv[0], DEFAULT_RPC_BENCH_MARK, (char*)addr.c_str());
     setupClient(gSession, addr.c_str());
+    gSessionBatchedDecStrong->setMaxPendingDecStrongs(100);
+    setupClient(gSessionBatchedDecStrong, addr.c_str());
+    gSessionMultiplexed->setMultiplexed(true);
+    setupClient(gSessionMultiplexed, addr.c_str());
+    gSessionBatchedOneway->setMaxPendingOnewayBytes(4096);
+    setupClient(gSessionBatchedOneway, addr.c_str());
+    setupClient(gSessionReadAhead, addr.c_str());
+    gSessionOneConnection->setMaxOutgoingThreads(1);
+    setupClient(gSessionOneConnection, addr.c_str());
+    gSessionOneConnectionPriority->setMaxOutgoingThreads(1);
+    gSessionOneConnectionPriority->setPriorityInheritance(true);
+    setupClient(gSessionOneConnectionPriority, addr.c_str());
+
+    std::string reactorAddr = tmp + REACTOR_RPC_BENCH_MARK;
+    (void)unlink(reactorAddr.c_str());
+    spawnRpcServer(argv[0], REACTOR_RPC_BENCH_MARK, (char*)reactorAddr.c_str());
+    setupClient(gSessionReactor, reactorAddr.c_str());
+
+    std::string shmAddr = tmp + SHM_RPC_BENCH_MARK;
+    (void)unlink(shmAddr.c_str());
+    spawnRpcServer(argv[0], SHM_RPC_BENCH_MARK, (char*)shmAddr.c_str());
+    setupClient(gSessionShm, shmAddr.c_str());
+
+    if (auto factory = RpcTransportCtxFactoryIoUring::make(); factory != nullptr) {
+        gSessionIoUring = RpcSession::make(std::move(factory));
+        std::string ioUringAddr = tmp + IO_URING_RPC_BENCH_MARK;
+        (void)unlink(ioUringAddr.c_str());
+        spawnRpcServer(argv[0], IO_URING_RPC_BENCH_MARK, (char*)ioUringAddr.c_str());
+        setupClient(gSessionIoUring, ioUringAddr.c_str());
+    }
 
 #if __has_include(<openssl/base.h>)
-    std::string tlsAddr = tmp + TLS_RPC_BENCH_MARK;
-    (void)unlink(tlsAddr.c_str());
-    spawnRpcServer(argv[0], (char *)addr.c_str(), TLS_RPC_BENCH_MARK);
-    setupClient(gSessionTls, tlsAddr.c_str());
+    gTlsAddr = tmp + TLS_RPC_BENCH_MARK;
+    (void)unlink(gTlsAddr.c_str());
+    spawnRpcServer(argv[0], TLS_RPC_BENCH_MARK, (char*)gTlsAddr.c_str());
+    setupClient(gSessionTls, gTlsAddr.c_str());
 #endif
     ::benchmark::RunSpecifiedBenchmarks();
     return 0;
@@ -35,18 +35,23 @@
 #include <binder/RpcTlsTestUtils.h>
 #include <binder/RpcTlsUtils.h>
 #include <binder/RpcTransport.h>
+#include <binder/RpcTransportIoUring.h>
 #include <binder/RpcTransportRaw.h>
+#include <binder/RpcTransportShm.h>
 #include <binder/RpcTransportTls.h>
 #include <gtest/gtest.h>
 
 #include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <numeric>
 #include <thread>
 #include <type_traits>
 
 #include <poll.h>
+#include <sched.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "../FdTrigger.h"
@@ -66,7 +71,10 @@ static_assert(RPC_WIRE_PROTOCOL_VERSION + 1 == RPC_WIRE_PROTOCOL_VERSION_NEXT ||
               RPC_WIRE_PROTOCOL_VERSION == RPC_WIRE_PROTOCOL_VERSION_EXPERIMENTAL);
 const char* kLocalInetAddress = "127.0.0.1";
 
-enum class RpcSecurity { RAW, TLS };
+// SHM and IO_URING are not in RpcSecurityValues(), because they only work
+// over unix domain sockets, and on some kernels, respectively. See their
+// instantiations below.
+enum class RpcSecurity { RAW, TLS, SHM, IO_URING };
 
 static inline std::vector<RpcSecurity> RpcSecurityValues() {
     return {RpcSecurity::RAW, RpcSecurity::TLS};
@@ -74,7 +82,8 @@ static inline std::vector<RpcSecurity> RpcSecurityValues() {
 
 static inline std::unique_ptr<RpcTransportCtxFactory> newFactory(
         RpcSecurity rpcSecurity, std::shared_ptr<RpcCertificateVerifier> verifier = nullptr,
-        std::unique_ptr<RpcAuth> auth = nullptr) {
+        std::unique_ptr<RpcAuth> auth = nullptr,
+        std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> handshakeCounter = nullptr) {
     switch (rpcSecurity) {
         case RpcSecurity::RAW:
             return RpcTransportCtxFactoryRaw::make();
@@ -85,8 +94,13 @@ static inline std::unique_ptr<RpcTransportCtxFactory> newFactory(
             if (auth == nullptr) {
                 auth = std::make_unique<RpcAuthSelfSigned>();
             }
-            return RpcTransportCtxFactoryTls::make(std::move(verifier), std::move(auth));
+            return RpcTransportCtxFactoryTls::make(std::move(verifier), std::move(auth),
+                                                   std::move(handshakeCounter));
         }
+        case RpcSecurity::SHM:
+            return RpcTransportCtxFactoryShm::make();
+        case RpcSecurity::IO_URING:
+            return RpcTransportCtxFactoryIoUring::make();
         default:
             LOG_ALWAYS_FATAL("Unknown RpcSecurity %d", rpcSecurity);
     }
@@ -156,16 +170,16 @@ private:
 std::atomic<int32_t> MyBinderRpcSession::gNum;
 
 class MyBinderRpcCallback : public BnBinderRpcCallback {
-    Status sendCallback(const std::string& value) {
+public:
+    Status sendCallback(const std::string& value) override {
         std::unique_lock _l(mMutex);
         mValues.push_back(value);
         _l.unlock();
         mCv.notify_one();
         return Status::ok();
     }
-    Status sendOnewayCallback(const std::string& value) { return sendCallback(value); }
+    Status sendOnewayCallback(const std::string& value) override { return sendCallback(value); }
 
-public:
     std::mutex mMutex;
     std::condition_variable mCv;
     std::vector<std::string> mValues;
@@ -221,6 +235,13 @@ public:
         *held = mHeldBinder;
         return Status::ok();
     }
+    Status releaseHeldBinderInMs(int32_t ms) override {
+        std::thread([=] {
+            usleep(ms * 1000);
+            mHeldBinder = nullptr;
+        }).detach();
+        return Status::ok();
+    }
     Status nestMe(const sp<IBinderRpcTest>& binder, int count) override {
         if (count <= 0) return Status::ok();
         return binder->nestMe(this, count - 1);
@@ -230,6 +251,11 @@ public:
         *out = binder;
         return Status::ok();
     }
+    Status sleepMsThenGiveMeABinder(int32_t ms, sp<IBinder>* out) override {
+        usleep(ms * 1000);
+        *out = sp<BBinder>::make();
+        return Status::ok();
+    }
     Status openSession(const std::string& name, sp<IBinderRpcSession>* out) override {
         *out = new MyBinderRpcSession(name);
         return Status::ok();
@@ -254,11 +280,35 @@ public:
         return Status::ok();
     }
 
+    std::mutex recordedMutex;
+    std::vector<int32_t> recordedOneways;
+    Status recordOneway(int32_t value) override {
+        std::lock_guard<std::mutex> _l(recordedMutex);
+        recordedOneways.push_back(value);
+        return Status::ok();
+    }
+    Status takeRecordedOneways(std::vector<int32_t>* values) override {
+        std::lock_guard<std::mutex> _l(recordedMutex);
+        values->swap(recordedOneways);
+        recordedOneways.clear();
+        return Status::ok();
+    }
+
     Status sleepMs(int32_t ms) override {
         usleep(ms * 1000);
         return Status::ok();
     }
 
+    Status getThreadPriority(std::vector<int32_t>* out) override {
+        sched_param param{};
+        int policy = sched_getscheduler(0);
+        sched_getparam(0, &param);
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, 0);
+        *out = {policy, param.sched_priority, errno == 0 ? nice : 0};
+        return Status::ok();
+    }
+
     Status sleepMsAsync(int32_t ms) override {
         // In-process binder calls are asynchronous, but the call to this method
         // is synchronous wrt its client. This in/out-process threading model
@@ -487,6 +537,14 @@ public:
         size_t numSessions = 1;
         size_t numIncomingConnections = 0;
         size_t numOutgoingConnections = SIZE_MAX;
+        // called for each client session before it is set up
+        std::function<void(const sp<RpcSession>&)> configureSession;
+        // the last this many sessions don't get their root objects
+        size_t numSessionsWithoutRoot = 0;
+        // called for the server before it starts serving
+        std::function<void(const sp<RpcServer>&)> configureServer;
+        // counts the TLS handshakes of the client sessions
+        std::shared_ptr<RpcTransportCtxFactoryTls::HandshakeCounter> tlsHandshakeCounter;
     };
 
     static inline std::string PrintParamInfo(const testing::TestParamInfo<ParamType>& info) {
@@ -544,6 +602,7 @@ public:
                     sp<RpcServer> server = RpcServer::make(newFactory(rpcSecurity, certVerifier));
 
                     server->setMaxThreads(options.numThreads);
+                    if (options.configureServer) options.configureServer(server);
 
                     unsigned int outPort = 0;
 
@@ -592,7 +651,8 @@ public:
         std::vector<sp<RpcSession>> sessions;
         auto certVerifier = std::make_shared<RpcCertificateVerifierSimple>();
         for (size_t i = 0; i < options.numSessions; i++) {
-            sessions.emplace_back(RpcSession::make(newFactory(rpcSecurity, certVerifier)));
+            sessions.emplace_back(RpcSession::make(newFactory(rpcSecurity, certVerifier, nullptr,
+                                                              options.tlsHandshakeCounter)));
         }
 
         auto serverInfo = readFromFd<BinderRpcTestServerInfo>(ret.host.readEnd());
@@ -620,6 +680,7 @@ public:
         for (const auto& session : sessions) {
             session->setMaxIncomingThreads(options.numIncomingConnections);
             session->setMaxOutgoingThreads(options.numOutgoingConnections);
+            if (options.configureSession) options.configureSession(session);
 
             switch (socketType) {
                 case SocketType::PRECONNECTED:
@@ -640,7 +701,8 @@ public:
                     LOG_ALWAYS_FATAL("Unknown socket type");
             }
             CHECK_EQ(status, OK) << "Could not connect: " << statusToString(status);
-            ret.sessions.push_back({session, session->getRootObject()});
+            bool getRoot = ret.sessions.size() + options.numSessionsWithoutRoot < sessions.size();
+            ret.sessions.push_back({session, getRoot ? session->getRootObject() : nullptr});
         }
         return ret;
     }
@@ -791,6 +853,89 @@ TEST_P(BinderRpc, SendAndGetResultBackBig) {
     EXPECT_EQ(single + single, doubled);
 }
 
+TEST_P(BinderRpc, SendAndGetResultBackAroundRecordSize) {
+    auto proc = createRpcTestSocketServerProcess({});
+    // messages which are gathered into one TLS record, and ones which are
+    // cut into several (a record holds at most 16 KiB)
+    for (size_t size : {8 * 1024 - 1, 8 * 1024, 16 * 1024 - 1, 16 * 1024, 32 * 1024, 40 * 1024}) {
+        std::string single = std::string(size, 'a');
+        std::string doubled;
+        EXPECT_OK(proc.rootIface->doubleString(single, &doubled));
+        EXPECT_EQ(single + single, doubled) << size;
+    }
+}
+
+TEST_P(BinderRpc, ReceiveBuffersAreReused) {
+#if defined(CONFIG_ANDROID_BINDER_RPC_BUFFER_POOL_SIZE) && CONFIG_ANDROID_BINDER_RPC_BUFFER_POOL_SIZE == 0
+    GTEST_SKIP() << "Receive buffers aren't cached";
+#endif
+    auto proc = createRpcTestSocketServerProcess({});
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    constexpr size_t kNumCalls = 10;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        std::string doubled;
+        EXPECT_OK(proc.rootIface->doubleString("cool ", &doubled));
+        EXPECT_EQ("cool cool ", doubled);
+    }
+
+    // every reply after the first one fits in a buffer an earlier one gave back
+    RpcSession::BufferPoolStats stats = session->getBufferPoolStats();
+    EXPECT_GT(stats.misses, 0u);
+    EXPECT_GE(stats.hits, kNumCalls - 1);
+    EXPECT_EQ(0u, stats.dropped);
+    EXPECT_GT(stats.cachedBytes, 0u);
+    EXPECT_EQ(0u, stats.outstanding);
+
+    // too large to be cached, but still handed back
+    std::string single = std::string(40 * 1024, 'a');
+    std::string doubled;
+    EXPECT_OK(proc.rootIface->doubleString(single, &doubled));
+    EXPECT_EQ(single + single, doubled);
+    stats = session->getBufferPoolStats();
+    EXPECT_GT(stats.oversized, 0u);
+    EXPECT_EQ(0u, stats.outstanding);
+}
+
+TEST_P(BinderRpc, TransactionStats) {
+    auto proc = createRpcTestSocketServerProcess({});
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    constexpr size_t kNumCalls = 10;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        std::string doubled;
+        EXPECT_OK(proc.rootIface->doubleString("cool ", &doubled));
+    }
+    EXPECT_OK(proc.rootIface->sendString("a"));
+
+    RpcSession::TransactionStats stats = session->getTransactionStats();
+    auto codeStats = [&](uint32_t code) {
+        for (const auto& codeStats : stats.codes) {
+            if (codeStats.code == code) return codeStats;
+        }
+        ADD_FAILURE() << "No stats for code " << code;
+        return RpcSession::TransactionStats::CodeStats{};
+    };
+    auto total = [](const RpcSession::TransactionStats::Histogram& histogram) {
+        return std::accumulate(histogram.begin(), histogram.end(), uint64_t{0});
+    };
+
+    RpcSession::TransactionStats::CodeStats doubleString =
+            codeStats(BnBinderRpcTest::TRANSACTION_doubleString);
+    EXPECT_EQ(kNumCalls, doubleString.sent);
+    EXPECT_EQ(0u, doubleString.received);
+    EXPECT_EQ(1u, codeStats(BnBinderRpcTest::TRANSACTION_sendString).sent);
+
+    // every call is in the request histograms, but only synchronous ones
+    // wait for a reply
+    EXPECT_GE(total(stats.requestBytes), kNumCalls + 1);
+    EXPECT_GE(total(stats.sendUs), kNumCalls + 1);
+    EXPECT_GE(total(stats.replyBytes), kNumCalls);
+    EXPECT_GE(total(stats.waitUs), kNumCalls);
+    EXPECT_EQ(0u, total(stats.receivedBytes));
+    EXPECT_EQ(0u, total(stats.dispatchUs));
+}
+
 TEST_P(BinderRpc, CallMeBack) {
     auto proc = createRpcTestSocketServerProcess({});
 
@@ -855,6 +1000,59 @@ TEST_P(BinderRpc, RepeatBinderNull) {
     EXPECT_EQ(nullptr, outBinder);
 }
 
+TEST_P(BinderRpc, StaleReplyReleasesBinders) {
+    auto proc = createRpcTestSocketServerProcess({});
+
+    std::vector<int32_t> baseline;
+    EXPECT_OK(proc.rootIface->countBinders(&baseline));
+
+    {
+        RpcSession::ScopedCallTimeout timeout(100ms);
+        sp<IBinder> binder;
+        Status status = proc.rootIface->sleepMsThenGiveMeABinder(500, &binder);
+        EXPECT_EQ(TIMED_OUT, status.transactionError()) << status;
+        EXPECT_EQ(nullptr, binder);
+    }
+
+    // the late reply is read on another thread, and its binder is released
+    std::vector<int32_t> counts;
+    for (size_t tries = 0; tries < 100; tries++) {
+        EXPECT_OK(proc.rootIface->countBinders(&counts));
+        if (counts == baseline) break;
+        usleep(10000);
+    }
+    EXPECT_EQ(baseline, counts);
+}
+
+TEST_P(BinderRpc, CallNestedInTimedOutCallIsRefused) {
+    constexpr int32_t kBusyMs = 300;
+
+    // a single connection, so the call below waits behind the oneway call,
+    // and the server's deadline for it starts only once it is read
+    auto proc = createRpcTestSocketServerProcess({});
+    sp<MyBinderRpcCallback> callback = sp<MyBinderRpcCallback>::make();
+
+    EXPECT_OK(proc.rootIface->sleepMsAsync(kBusyMs));
+    {
+        RpcSession::ScopedCallTimeout timeout(100ms);
+        Status status = proc.rootIface->doCallback(callback, false /*oneway*/,
+                                                   false /*delayed*/, "late");
+        EXPECT_EQ(TIMED_OUT, status.transactionError()) << status;
+    }
+
+    // the callback arrives after the deadline, and nothing runs it
+    usleep(kBusyMs * 2 * 1000);
+    {
+        std::lock_guard<std::mutex> _l(callback->mMutex);
+        EXPECT_EQ(std::vector<std::string>{}, callback->mValues);
+    }
+
+    // the connection is used again once the late reply was read
+    EXPECT_OK(proc.rootIface->doCallback(callback, false /*oneway*/, false /*delayed*/, "again"));
+    std::lock_guard<std::mutex> _l(callback->mMutex);
+    EXPECT_EQ(std::vector<std::string>{"again"}, callback->mValues);
+}
+
 TEST_P(BinderRpc, HoldBinder) {
     auto proc = createRpcTestSocketServerProcess({});
 
@@ -1022,6 +1220,111 @@ TEST_P(BinderRpc, ManySessions) {
     expectSessions(0, proc.rootIface);
 }
 
+TEST_P(BinderRpc, DecStrongBatchSentWithNextCall) {
+    auto proc = createRpcTestSocketServerProcess({
+            .numSessions = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setMaxPendingDecStrongs(1000, 1h);
+                    },
+    });
+    sp<IBinderRpcTest> otherIface =
+            interface_cast<IBinderRpcTest>(proc.proc.sessions.at(1).root);
+
+    constexpr size_t kNumBinders = 100;
+    std::vector<sp<IBinderRpcSession>> sessions;
+    for (size_t i = 0; i < kNumBinders; i++) {
+        sp<IBinderRpcSession> session;
+        EXPECT_OK(proc.rootIface->openSession(std::to_string(i), &session));
+        sessions.push_back(session);
+    }
+    sessions.clear();
+
+    // the dec strongs are held back, so the server still has all of them
+    expectSessions(kNumBinders, otherIface);
+    std::vector<int32_t> remoteCounts;
+    EXPECT_OK(otherIface->countBinders(&remoteCounts));
+    std::sort(remoteCounts.begin(), remoteCounts.end());
+    EXPECT_EQ(remoteCounts, (std::vector<int32_t>{1, kNumBinders + 1}));
+
+    // and sent in the same write as the next call on the session
+    expectSessions(0, proc.rootIface);
+    EXPECT_OK(otherIface->countBinders(&remoteCounts));
+    EXPECT_EQ(remoteCounts, (std::vector<int32_t>{1, 1}));
+}
+
+TEST_P(BinderRpc, DecStrongBatchSentAfterDelay) {
+    auto proc = createRpcTestSocketServerProcess({
+            .numSessions = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setMaxPendingDecStrongs(1000, 10ms);
+                    },
+    });
+    sp<IBinderRpcTest> otherIface =
+            interface_cast<IBinderRpcTest>(proc.proc.sessions.at(1).root);
+
+    for (size_t i = 0; i < 100; i++) {
+        sp<IBinderRpcSession> session;
+        EXPECT_OK(proc.rootIface->openSession(std::to_string(i), &session));
+    }
+
+    // nothing else is sent on the first session, so the worker flushes them
+    int32_t numSessions = -1;
+    for (size_t tries = 0; tries < 100 && numSessions != 0; tries++) {
+        usleep(10000);
+        EXPECT_OK(otherIface->getNumOpenSessions(&numSessions));
+    }
+    EXPECT_EQ(0, numSessions);
+}
+
+TEST_P(BinderRpc, OnewayBatchSentWithNextCall) {
+    auto proc = createRpcTestSocketServerProcess({
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setMaxPendingOnewayBytes(64 * 1024, 1h);
+                    },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    constexpr size_t kNumCalls = 100;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        EXPECT_OK(proc.rootIface->sendString("a"));
+    }
+    RpcSession::OnewayBatchStats stats = session->getOnewayBatchStats();
+    EXPECT_EQ(kNumCalls, stats.queuedCalls);
+    EXPECT_EQ(0u, stats.flushes);
+
+    // all of them are written along with the next call
+    std::string doubled;
+    EXPECT_OK(proc.rootIface->doubleString("a", &doubled));
+    EXPECT_EQ("aa", doubled);
+    stats = session->getOnewayBatchStats();
+    EXPECT_EQ(kNumCalls, stats.queuedCalls);
+    EXPECT_EQ(1u, stats.flushes);
+}
+
+TEST_P(BinderRpc, OnewayBatchSentAfterDelay) {
+    auto proc = createRpcTestSocketServerProcess({
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setMaxPendingOnewayBytes(64 * 1024, 10ms);
+                    },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    EXPECT_OK(proc.rootIface->sendString("a"));
+
+    // nothing else is sent on the session, so the worker flushes it
+    RpcSession::OnewayBatchStats stats;
+    for (size_t tries = 0; tries < 100 && stats.flushes == 0; tries++) {
+        usleep(10000);
+        stats = session->getOnewayBatchStats();
+    }
+    EXPECT_EQ(1u, stats.queuedCalls);
+    EXPECT_EQ(1u, stats.flushes);
+}
+
 size_t epochMillis() {
     using std::chrono::duration_cast;
     using std::chrono::milliseconds;
@@ -1118,6 +1421,37 @@ TEST_P(BinderRpc, ThreadingStressTest) {
     for (auto& t : threads) t.join();
 }
 
+TEST_P(BinderRpc, ManyBindersFromManyThreads) {
+    constexpr size_t kNumClientThreads = 10;
+    constexpr size_t kNumBinders = 50;
+
+    auto proc = createRpcTestSocketServerProcess({.numThreads = kNumClientThreads});
+
+    // each binder is looked up by address and by pointer, from many threads
+    // at once, so they spread over the node table
+    std::vector<std::vector<sp<IBinder>>> binders(kNumClientThreads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumClientThreads; i++) {
+        threads.push_back(std::thread([&, i] {
+            for (size_t j = 0; j < kNumBinders; j++) {
+                sp<IBinder> in = sp<BBinder>::make();
+                sp<IBinder> out;
+                EXPECT_OK(proc.rootIface->repeatBinder(in, &out));
+                EXPECT_EQ(in, out);
+                // and again, once it has an address
+                EXPECT_OK(proc.rootIface->repeatBinder(in, &out));
+                EXPECT_EQ(in, out);
+                binders[i].push_back(in);
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+
+    // and the nodes are all gone again once the process shuts down, see
+    // ~ProcessSession
+    EXPECT_EQ(OK, proc.rootBinder->pingBinder());
+}
+
 static void saturateThreadPool(size_t threadCount, const sp<IBinderRpcTest>& iface) {
     std::vector<std::thread> threads;
     for (size_t i = 0; i < threadCount; i++) {
@@ -1126,6 +1460,405 @@ static void saturateThreadPool(size_t threadCount, const sp<IBinderRpcTest>& ifa
     for (auto& t : threads) t.join();
 }
 
+TEST_P(BinderRpc, MultiplexedInterleavedReplies) {
+    if (std::get<1>(GetParam()) == RpcSecurity::TLS) {
+        GTEST_SKIP() << "Multiplexing needs a transport which can read and write at once";
+    }
+
+    constexpr size_t kNumFastThreads = 5;
+    constexpr size_t kNumCalls = 20;
+    constexpr size_t kSleepMs = 500;
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = kNumFastThreads + 1,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+    });
+
+    size_t epochMsBefore = epochMillis();
+    std::thread sleeper([&] { EXPECT_OK(proc.rootIface->sleepMs(kSleepMs)); });
+
+    // replies for these come back on the same connection while the sleep is
+    // still outstanding, rather than after it
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumFastThreads; i++) {
+        threads.push_back(std::thread([&, i] {
+            for (size_t j = 0; j < kNumCalls; j++) {
+                std::string single = std::to_string(i) + ":" + std::to_string(j);
+                std::string doubled;
+                EXPECT_OK(proc.rootIface->doubleString(single, &doubled));
+                EXPECT_EQ(single + single, doubled);
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+    EXPECT_LT(epochMillis(), epochMsBefore + kSleepMs);
+
+    sleeper.join();
+    EXPECT_GE(epochMillis(), epochMsBefore + kSleepMs);
+}
+
+TEST_P(BinderRpc, MultiplexedNestedCallWhileSendBlocked) {
+    if (std::get<1>(GetParam()) == RpcSecurity::TLS) {
+        GTEST_SKIP() << "Multiplexing needs a transport which can read and write at once";
+    }
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 1,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+    });
+
+    // makes a call on the session from its destructor, which runs when the
+    // server's DEC_STRONG for it is read
+    class CallingBinder : public BBinder {
+    public:
+        CallingBinder(const sp<IBinderRpcTest>& iface, std::atomic<bool>* destroyed)
+              : mIface(iface), mDestroyed(destroyed) {}
+        ~CallingBinder() {
+            std::string doubled;
+            EXPECT_OK(mIface->doubleString("a", &doubled));
+            EXPECT_EQ("aa", doubled);
+            *mDestroyed = true;
+        }
+
+    private:
+        sp<IBinderRpcTest> mIface;
+        std::atomic<bool>* mDestroyed;
+    };
+
+    std::atomic<bool> destroyed = false;
+    EXPECT_OK(proc.rootIface->holdBinder(sp<CallingBinder>::make(proc.rootIface, &destroyed)));
+    EXPECT_OK(proc.rootIface->releaseHeldBinderInMs(100));
+
+    // the server handles oneway calls in order, so while it sleeps these fill
+    // the socket and the sends block, reading the DEC_STRONG in the meantime
+    EXPECT_OK(proc.rootIface->sleepMsAsync(500));
+    std::string big(90 * 1024, 'a');
+    for (size_t i = 0; i < 50; i++) {
+        EXPECT_OK(proc.rootIface->sendString(big));
+    }
+
+    for (size_t tries = 0; tries < 100 && !destroyed; tries++) usleep(10000);
+    EXPECT_TRUE(destroyed);
+
+    saturateThreadPool(1, proc.rootIface);
+}
+
+static Parcel makeDoubleStringRequest(const sp<IBinder>& binder, const std::string& str) {
+    Parcel data;
+    data.markForBinder(binder);
+    CHECK_EQ(OK, data.writeInterfaceToken(binder->getInterfaceDescriptor()));
+    CHECK_EQ(OK, data.writeUtf8AsUtf16(str));
+    return data;
+}
+
+static std::string readDoubleStringReply(const RpcSession::AsyncReply& reply) {
+    EXPECT_EQ(OK, reply.status) << statusToString(reply.status);
+    if (reply.status != OK) return "";
+    EXPECT_EQ(OK, reply.parcel->readExceptionCode());
+    std::string out;
+    EXPECT_EQ(OK, reply.parcel->readUtf8FromUtf16(&out));
+    return out;
+}
+
+TEST_P(BinderRpc, TransactFutureManyInFlight) {
+    if (std::get<1>(GetParam()) == RpcSecurity::TLS) {
+        GTEST_SKIP() << "Multiplexing needs a transport which can read and write at once";
+    }
+
+    constexpr size_t kNumCalls = 50;
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    // all sent from this thread before any reply is read
+    std::vector<std::future<RpcSession::AsyncReply>> futures;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        futures.push_back(
+                session->transactFuture(proc.rootBinder, BnBinderRpcTest::TRANSACTION_doubleString,
+                                        makeDoubleStringRequest(proc.rootBinder,
+                                                                std::to_string(i))));
+    }
+    for (size_t i = 0; i < kNumCalls; i++) {
+        std::string single = std::to_string(i);
+        EXPECT_EQ(single + single, readDoubleStringReply(futures[i].get()));
+    }
+}
+
+TEST_P(BinderRpc, TransactAsyncCallbacksAndShutdown) {
+    if (std::get<1>(GetParam()) == RpcSecurity::TLS) {
+        GTEST_SKIP() << "Multiplexing needs a transport which can read and write at once";
+    }
+
+    constexpr size_t kNumCalls = 10;
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> replies;
+    for (size_t i = 0; i < kNumCalls; i++) {
+        EXPECT_EQ(OK,
+                  session->transactAsync(proc.rootBinder, BnBinderRpcTest::TRANSACTION_doubleString,
+                                         makeDoubleStringRequest(proc.rootBinder, "a"),
+                                         [&](RpcSession::AsyncReply reply) {
+                                             std::string out = readDoubleStringReply(reply);
+                                             std::lock_guard<std::mutex> _l(mutex);
+                                             replies.push_back(out);
+                                             cv.notify_all();
+                                         }));
+    }
+    {
+        std::unique_lock<std::mutex> _l(mutex);
+        EXPECT_TRUE(cv.wait_for(_l, 5s, [&] { return replies.size() == kNumCalls; }));
+        EXPECT_EQ(std::vector<std::string>(kNumCalls, "aa"), replies);
+    }
+
+    // still in flight when the session is shut down
+    Parcel sleepData;
+    sleepData.markForBinder(proc.rootBinder);
+    EXPECT_EQ(OK, sleepData.writeInterfaceToken(proc.rootBinder->getInterfaceDescriptor()));
+    EXPECT_EQ(OK, sleepData.writeInt32(1000));
+    std::future<RpcSession::AsyncReply> sleeping =
+            session->transactFuture(proc.rootBinder, BnBinderRpcTest::TRANSACTION_sleepMs,
+                                    sleepData);
+    EXPECT_TRUE(session->shutdownAndWait(true));
+    // the reader was joined, so the callback already ran
+    ASSERT_EQ(std::future_status::ready, sleeping.wait_for(0s));
+    EXPECT_EQ(DEAD_OBJECT, sleeping.get().status);
+    proc.expectAlreadyShutdown = true;
+}
+
+TEST_P(BinderRpc, TransactAsyncNeedsMultiplexing) {
+    auto proc = createRpcTestSocketServerProcess({});
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    bool called = false;
+    EXPECT_EQ(INVALID_OPERATION,
+              session->transactAsync(proc.rootBinder, BnBinderRpcTest::TRANSACTION_doubleString,
+                                     makeDoubleStringRequest(proc.rootBinder, "a"),
+                                     [&](RpcSession::AsyncReply) { called = true; }));
+    EXPECT_FALSE(called);
+
+    std::future<RpcSession::AsyncReply> future =
+            session->transactFuture(proc.rootBinder, BnBinderRpcTest::TRANSACTION_doubleString,
+                                    makeDoubleStringRequest(proc.rootBinder, "a"));
+    ASSERT_EQ(std::future_status::ready, future.wait_for(0s));
+    EXPECT_EQ(INVALID_OPERATION, future.get().status);
+}
+
+TEST_P(BinderRpc, MultiplexingIgnoredWithoutConcurrentTransport) {
+    if (std::get<1>(GetParam()) != RpcSecurity::TLS) {
+        GTEST_SKIP() << "Only TLS can't read and write at once";
+    }
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    // falls back to one connection per call
+    std::string out;
+    EXPECT_OK(proc.rootIface->doubleString("a", &out));
+    EXPECT_EQ("aa", out);
+    EXPECT_EQ(INVALID_OPERATION,
+              session->transactAsync(proc.rootBinder, BnBinderRpcTest::TRANSACTION_doubleString,
+                                     makeDoubleStringRequest(proc.rootBinder, "a"),
+                                     [](RpcSession::AsyncReply) {}));
+}
+
+TEST_P(BinderRpc, MaxQueuedOnewayBytesTerminatesSession) {
+    if (std::get<1>(GetParam()) == RpcSecurity::TLS) {
+        GTEST_SKIP() << "Multiplexing needs a transport which can read and write at once";
+    }
+
+    constexpr int32_t kSleepMs = 300;
+
+    // calls which arrive while an earlier one is still running are queued
+    // by the worker they are handed to, and each is more than a byte
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 4,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setMultiplexed(true); },
+            .configureServer =
+                    [](const sp<RpcServer>& server) {
+                        server->setMaxQueuedOnewayBytesPerSession(1);
+                    },
+    });
+
+    EXPECT_OK(proc.rootIface->sleepMsAsync(kSleepMs));
+    EXPECT_OK(proc.rootIface->recordOneway(1));
+
+    // the server terminated the session rather than drop the call
+    EXPECT_EQ(DEAD_OBJECT, proc.rootIface->sleepMs(kSleepMs * 2).transactionError());
+    proc.expectAlreadyShutdown = true;
+}
+
+TEST_P(BinderRpc, TlsResumesLaterConnections) {
+    if (std::get<1>(GetParam()) != RpcSecurity::TLS) {
+        GTEST_SKIP() << "Only TLS connections have handshakes";
+    }
+
+    constexpr size_t kNumConnections = 3;
+
+    // only counts the client side, since the server is another process
+    auto counter = std::make_shared<RpcTransportCtxFactoryTls::HandshakeCounter>();
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = kNumConnections,
+            .tlsHandshakeCounter = counter,
+    });
+    auto stats = counter->get();
+
+    // the first connection gets a ticket, which all others resume from
+    EXPECT_EQ(kNumConnections, stats.handshakes);
+    EXPECT_EQ(kNumConnections - 1, stats.resumed);
+    EXPECT_GT(stats.handshakeUs, 0u);
+
+    EXPECT_OK(proc.rootIface->sendString("hello"));
+}
+
+TEST_P(BinderRpc, FastConnect) {
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = 3,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setFastConnect(true); },
+    });
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 3; i++) {
+        threads.push_back(std::thread([&] { EXPECT_OK(proc.rootIface->sleepMs(100)); }));
+    }
+    for (auto& t : threads) t.join();
+}
+
+TEST_P(BinderRpc, FastConnectReleasesUnusedRootObject) {
+    auto proc = createRpcTestSocketServerProcess({
+            .numSessions = 2,
+            .configureSession =
+                    [](const sp<RpcSession>& session) { session->setFastConnect(true); },
+            .numSessionsWithoutRoot = 1,
+    });
+
+    // the server sent the root object to both sessions, but only the first
+    // took it
+    std::vector<int32_t> remoteCounts;
+    EXPECT_OK(proc.rootIface->countBinders(&remoteCounts));
+    EXPECT_EQ(std::vector<int32_t>({1, 1}), remoteCounts);
+
+    sp<RpcSession> unused = proc.proc.sessions.at(1).session;
+    EXPECT_EQ(0, unused->state()->countBinders());
+    EXPECT_TRUE(unused->shutdownAndWait(true));
+    EXPECT_EQ(0, unused->state()->countBinders());
+    unused = nullptr;
+    proc.proc.sessions.pop_back();
+
+    for (size_t tries = 0; tries < 100; tries++) {
+        EXPECT_OK(proc.rootIface->countBinders(&remoteCounts));
+        if (remoteCounts.size() == 1) break;
+        usleep(10000);
+    }
+    EXPECT_EQ(std::vector<int32_t>({1}), remoteCounts);
+}
+
+// runs 'fn' on a new thread with the given scheduling policy and priority, or
+// returns false if this process isn't allowed to use them
+static bool runAtPriority(int policy, int priority, const std::function<void()>& fn) {
+    bool allowed = false;
+    std::thread([&] {
+        if (policy == SCHED_OTHER) {
+            allowed = setpriority(PRIO_PROCESS, 0, priority) == 0;
+        } else {
+            sched_param param{.sched_priority = priority};
+            allowed = sched_setscheduler(0, policy, &param) == 0;
+        }
+        if (allowed) fn();
+    }).join();
+    return allowed;
+}
+
+TEST_P(BinderRpc, PriorityInheritanceNeedsServerOptIn) {
+    auto proc = createRpcTestSocketServerProcess({
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setPriorityInheritance(true);
+                    },
+    });
+
+    std::vector<int32_t> priority;
+    EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    ASSERT_EQ(3u, priority.size());
+    int32_t serverNice = priority[2];
+
+    bool allowed = runAtPriority(SCHED_OTHER, serverNice - 5, [&] {
+        EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    });
+    if (!allowed) GTEST_SKIP() << "Not allowed to raise the priority of a thread";
+    EXPECT_EQ(SCHED_OTHER, priority[0]);
+    EXPECT_EQ(serverNice, priority[2]);
+}
+
+TEST_P(BinderRpc, PriorityInheritance) {
+    auto proc = createRpcTestSocketServerProcess({
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setPriorityInheritance(true);
+                    },
+            .configureServer =
+                    [](const sp<RpcServer>& server) { server->setPriorityInheritance(true); },
+    });
+
+    std::vector<int32_t> priority;
+    EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    ASSERT_EQ(3u, priority.size());
+    int32_t serverNice = priority[2];
+
+    bool allowed = runAtPriority(SCHED_OTHER, serverNice - 5, [&] {
+        EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    });
+    if (!allowed) GTEST_SKIP() << "Not allowed to raise the priority of a thread";
+    EXPECT_EQ(SCHED_OTHER, priority[0]);
+    EXPECT_EQ(serverNice - 5, priority[2]);
+
+    // the thread is back at its own priority for the next call
+    EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    EXPECT_EQ(serverNice, priority[2]);
+}
+
+TEST_P(BinderRpc, PriorityInheritanceClampsRealtimePriority) {
+    constexpr int kMaxRealtimePriority = 10;
+    auto proc = createRpcTestSocketServerProcess({
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setPriorityInheritance(true);
+                    },
+            .configureServer =
+                    [](const sp<RpcServer>& server) {
+                        server->setPriorityInheritance(true, kMaxRealtimePriority);
+                    },
+    });
+
+    std::vector<int32_t> priority;
+    bool allowed = runAtPriority(SCHED_FIFO, kMaxRealtimePriority + 40, [&] {
+        EXPECT_OK(proc.rootIface->getThreadPriority(&priority));
+    });
+    if (!allowed) GTEST_SKIP() << "Not allowed to use real-time priorities";
+    ASSERT_EQ(3u, priority.size());
+    EXPECT_EQ(SCHED_FIFO, priority[0]);
+    EXPECT_EQ(kMaxRealtimePriority, priority[1]);
+}
+
 TEST_P(BinderRpc, OnewayStressTest) {
     constexpr size_t kNumClientThreads = 10;
     constexpr size_t kNumServerThreads = 10;
@@ -1190,6 +1923,40 @@ TEST_P(BinderRpc, OnewayCallQueueing) {
     saturateThreadPool(1 + kNumExtraServerThreads, proc.rootIface);
 }
 
+TEST_P(BinderRpc, OnewayCallsFromManyConnectionsStayInOrder) {
+    constexpr size_t kNumClientThreads = 10;
+    constexpr size_t kNumServerThreads = 10;
+    constexpr size_t kNumCalls = 500;
+
+    auto proc = createRpcTestSocketServerProcess({.numThreads = kNumServerThreads});
+
+    // calls race each other on different connections, so the server often
+    // reads them out of order, some of them far ahead of the expected one
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumClientThreads; i++) {
+        threads.push_back(std::thread([&, i] {
+            for (size_t j = 0; j < kNumCalls; j++) {
+                EXPECT_OK(proc.rootIface->recordOneway(i * kNumCalls + j));
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+
+    saturateThreadPool(kNumServerThreads, proc.rootIface);
+
+    std::vector<int32_t> values;
+    EXPECT_OK(proc.rootIface->takeRecordedOneways(&values));
+    ASSERT_EQ(kNumClientThreads * kNumCalls, values.size());
+
+    // each thread's calls were sent in order, so they ran in that order
+    std::vector<int32_t> lastSeen(kNumClientThreads, -1);
+    for (int32_t value : values) {
+        size_t thread = value / kNumCalls;
+        EXPECT_LT(lastSeen[thread], value);
+        lastSeen[thread] = value;
+    }
+}
+
 TEST_P(BinderRpc, OnewayCallExhaustion) {
     constexpr size_t kNumClients = 2;
     constexpr size_t kTooLongMs = 1000;
@@ -1276,6 +2043,115 @@ TEST_P(BinderRpc, Callbacks) {
     }
 }
 
+// a callback which stays busy for a while, or which makes nested calls
+class BusyBinderRpcCallback : public MyBinderRpcCallback {
+public:
+    BusyBinderRpcCallback(std::chrono::milliseconds busyTime, sp<IBinderRpcTest> nestIface)
+          : mBusyTime(busyTime), mNestIface(std::move(nestIface)) {}
+    Status sendCallback(const std::string& value) override {
+        std::this_thread::sleep_for(mBusyTime);
+        if (mNestIface != nullptr) {
+            // the server calls back on the connection this call came in on
+            Status status = mNestIface->nestMe(sp<MyBinderRpcTest>::make(), 4);
+            if (!status.isOk()) return status;
+        }
+        return MyBinderRpcCallback::sendCallback(value);
+    }
+
+private:
+    std::chrono::milliseconds mBusyTime;
+    sp<IBinderRpcTest> mNestIface;
+};
+
+TEST_P(BinderRpc, IncomingThreadsOnDemand) {
+    if (std::get<0>(GetParam()) == SocketType::PRECONNECTED) {
+        GTEST_SKIP() << "Starting threads on demand needs an address to connect to";
+    }
+    constexpr size_t kMaxIncoming = 3;
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = kMaxIncoming,
+            .numIncomingConnections = kMaxIncoming,
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setIncomingThreadsOnDemand(1, 100ms);
+                    },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+    EXPECT_EQ(1u, session->getIncomingThreadStats().threads);
+
+    // each delayed callback comes from its own server thread, and keeps an
+    // incoming thread busy, so more are started
+    auto cb = sp<BusyBinderRpcCallback>::make(200ms, nullptr);
+    for (size_t i = 0; i < kMaxIncoming; i++) {
+        EXPECT_OK(proc.rootIface->doCallback(cb, false /*oneway*/, true /*delayed*/, "a"));
+    }
+    {
+        std::unique_lock<std::mutex> _l(cb->mMutex);
+        cb->mCv.wait_for(_l, 5s, [&] { return cb->mValues.size() == kMaxIncoming; });
+        EXPECT_EQ(kMaxIncoming, cb->mValues.size());
+    }
+    RpcSession::IncomingThreadStats stats = session->getIncomingThreadStats();
+    EXPECT_GE(stats.maxThreads, 2u);
+    EXPECT_LE(stats.maxThreads, kMaxIncoming);
+    EXPECT_GT(stats.started, 0u);
+
+    // and the server closes them again once they are idle
+    for (size_t tries = 0; tries < 100; tries++) {
+        stats = session->getIncomingThreadStats();
+        if (stats.threads == 1) break;
+        usleep(20000);
+    }
+    EXPECT_EQ(1u, stats.threads);
+    EXPECT_EQ(stats.started, stats.stopped);
+
+    // since this session has an incoming connection w/ a threadpool, we need
+    // to manually shut it down
+    if (auto status = proc.rootIface->scheduleShutdown(); !status.isOk()) {
+        EXPECT_EQ(DEAD_OBJECT, status.transactionError()) << status;
+    }
+    EXPECT_TRUE(session->shutdownAndWait(true));
+    proc.expectAlreadyShutdown = true;
+}
+
+TEST_P(BinderRpc, IncomingThreadsOnDemandCountNestedCallsOnce) {
+    if (std::get<0>(GetParam()) == SocketType::PRECONNECTED) {
+        GTEST_SKIP() << "Starting threads on demand needs an address to connect to";
+    }
+    constexpr size_t kMaxIncoming = 3;
+
+    auto proc = createRpcTestSocketServerProcess({
+            .numThreads = kMaxIncoming,
+            .numIncomingConnections = kMaxIncoming,
+            .configureSession =
+                    [](const sp<RpcSession>& session) {
+                        session->setIncomingThreadsOnDemand(1, 1h);
+                    },
+    });
+    const sp<RpcSession>& session = proc.proc.sessions.at(0).session;
+
+    // the delayed callback comes in on an incoming connection, and the nested
+    // calls from the server come in on the same one, which is only busy once,
+    // so no other thread is needed
+    auto cb = sp<BusyBinderRpcCallback>::make(0ms, proc.rootIface);
+    EXPECT_OK(proc.rootIface->doCallback(cb, false /*oneway*/, true /*delayed*/, "a"));
+    {
+        std::unique_lock<std::mutex> _l(cb->mMutex);
+        cb->mCv.wait_for(_l, 5s, [&] { return !cb->mValues.empty(); });
+        EXPECT_EQ(1u, cb->mValues.size());
+    }
+    RpcSession::IncomingThreadStats stats = session->getIncomingThreadStats();
+    EXPECT_EQ(1u, stats.maxBusy);
+    EXPECT_EQ(0u, stats.started);
+    EXPECT_EQ(1u, stats.threads);
+
+    if (auto status = proc.rootIface->scheduleShutdown(); !status.isOk()) {
+        EXPECT_EQ(DEAD_OBJECT, status.transactionError()) << status;
+    }
+    EXPECT_TRUE(session->shutdownAndWait(true));
+    proc.expectAlreadyShutdown = true;
+}
+
 TEST_P(BinderRpc, OnewayCallbackWithNoThread) {
     auto proc = createRpcTestSocketServerProcess({});
     auto cb = sp<MyBinderRpcCallback>::make();
@@ -1417,6 +2293,23 @@ INSTANTIATE_TEST_CASE_P(PerSocket, BinderRpc,
                                            ::testing::ValuesIn(RpcSecurityValues())),
                         BinderRpc::PrintParamInfo);
 
+INSTANTIATE_TEST_CASE_P(SharedMemory, BinderRpc,
+                        ::testing::Combine(::testing::Values(SocketType::PRECONNECTED,
+                                                             SocketType::UNIX),
+                                           ::testing::Values(RpcSecurity::SHM)),
+                        BinderRpc::PrintParamInfo);
+
+static std::vector<RpcSecurity> ioUringValues() {
+    // e.g. not Linux, or disabled in the kernel
+    if (RpcTransportCtxFactoryIoUring::make() == nullptr) return {};
+    return {RpcSecurity::IO_URING};
+}
+
+INSTANTIATE_TEST_CASE_P(IoUring, BinderRpc,
+                        ::testing::Combine(::testing::ValuesIn(testSocketTypes()),
+                                           ::testing::ValuesIn(ioUringValues())),
+                        BinderRpc::PrintParamInfo);
+
 class BinderRpcServerRootObject
       : public ::testing::TestWithParam<std::tuple<bool, bool, RpcSecurity>> {};
 
@@ -1493,6 +2386,77 @@ TEST_P(BinderRpcSimple, Shutdown) {
             << "After server->shutdown() returns true, join() did not stop after 2s";
 }
 
+TEST(BinderRpc, MaxSessionsPerPeer) {
+    auto addr = allocateSocketAddress();
+    auto server = RpcServer::make(RpcTransportCtxFactoryRaw::make());
+    server->setRootObject(sp<BBinder>::make());
+    server->setMaxSessionsPerPeer(1);
+    ASSERT_EQ(OK, server->setupUnixDomainServer(addr.c_str()));
+    server->start();
+
+    auto first = RpcSession::make(RpcTransportCtxFactoryRaw::make());
+    ASSERT_EQ(OK, first->setupUnixDomainClient(addr.c_str()));
+
+    auto second = RpcSession::make(RpcTransportCtxFactoryRaw::make());
+    status_t status = second->setupUnixDomainClient(addr.c_str());
+#ifdef SO_PEERCRED
+    EXPECT_EQ(WOULD_BLOCK, status) << statusToString(status);
+    EXPECT_EQ(1u, server->getAdmissionStats().rejectedSessions);
+
+    // the peer gets its session back once the server drops the first one
+    EXPECT_TRUE(first->shutdownAndWait(true));
+    for (size_t tries = 0; tries < 100 && !server->listSessions().empty(); tries++) {
+        usleep(10000);
+    }
+    second = RpcSession::make(RpcTransportCtxFactoryRaw::make());
+    status = second->setupUnixDomainClient(addr.c_str());
+#else
+    // the peers of unix domain sockets can't be told apart, so their sessions
+    // aren't limited together
+    EXPECT_EQ(0u, server->getAdmissionStats().rejectedSessions);
+#endif
+    EXPECT_EQ(OK, status) << statusToString(status);
+
+    EXPECT_TRUE(second->shutdownAndWait(true));
+    EXPECT_TRUE(first->shutdownAndWait(true));
+    while (!server->shutdown()) usleep(10000);
+}
+
+TEST(BinderRpc, MaxConnectionsPerSession) {
+    auto addr = allocateSocketAddress();
+    auto server = RpcServer::make(RpcTransportCtxFactoryRaw::make());
+    server->setRootObject(sp<BBinder>::make());
+    server->setMaxThreads(3);
+    server->setMaxConnectionsPerSession(2);
+    ASSERT_EQ(OK, server->setupUnixDomainServer(addr.c_str()));
+    server->start();
+
+    // the server closes the third connection, which may or may not fail the
+    // setup, depending on when the client notices
+    auto session = RpcSession::make(RpcTransportCtxFactoryRaw::make());
+    session->setMaxOutgoingThreads(3);
+    (void)session->setupUnixDomainClient(addr.c_str());
+
+    for (size_t tries = 0; tries < 100 && server->getAdmissionStats().rejectedConnections == 0;
+         tries++) {
+        usleep(10000);
+    }
+    EXPECT_EQ(1u, server->getAdmissionStats().rejectedConnections);
+
+    // the second connection may be set up after the third was refused
+    std::vector<sp<RpcSession>> sessions = server->listSessions();
+    ASSERT_EQ(1u, sessions.size());
+    for (size_t tries = 0; tries < 100 && sessions[0]->getIncomingThreadStats().maxThreads < 2;
+         tries++) {
+        usleep(10000);
+    }
+    EXPECT_EQ(2u, sessions[0]->getIncomingThreadStats().maxThreads);
+
+    EXPECT_TRUE(session->shutdownAndWait(true));
+    sessions.clear();
+    while (!server->shutdown()) usleep(10000);
+}
+
 TEST(BinderRpc, Java) {
 #if !defined(__ANDROID__)
     GTEST_SKIP() << "This test is only run on Android. Though it can technically run on host on"
@@ -1774,6 +2738,9 @@ public:
                         ret.emplace_back(socketType, rpcSecurity, RpcCertificateFormat::PEM);
                         ret.emplace_back(socketType, rpcSecurity, RpcCertificateFormat::DER);
                     } break;
+                    case RpcSecurity::SHM:
+                    case RpcSecurity::IO_URING:
+                        break;
                 }
             }
         }